@@ -1,16 +1,23 @@
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 #include <esp_mac.h>
 #include "include/ds3.h"
 #include "include/ds3_int.h"
+#include "esp_timer.h"
 
 
 /********************************************************************************/
 /*                              C O N S T A N T S                               */
 /********************************************************************************/
 
-static const uint8_t hid_cmd_payload_report_enable[] = { 0x42, 0x03, 0x00, 0x00 };
+/* Complete enable report, sent straight from flash */
+static const uint8_t hid_cmd_report_enable[] = {
+    hid_cmd_code_set_report | hid_cmd_code_type_feature,
+    hid_cmd_identifier_ds3_enable,
+    0x42, 0x03, 0x00, 0x00
+};
 // static const uint8_t hid_cmd_payload_led_arguments[] = { 0xFF, 0x27, 0x10, 0x00, 0x32 };
 
 
@@ -24,14 +31,46 @@ static ds3_connection_callback_t ds3_connection_cb = NULL;
 /* Event callbacks */
 static ds3_event_callback_t ds3_event_cb = NULL;
 
+/* Status callbacks */
+static ds3_status_callback_t ds3_status_cb = NULL;
+
 /* Status flags */
 static bool ds3_is_connected = false;
 static bool ds3_is_active = false;
+static atomic_bool ds3_is_suspended = false;
+
+/* Connection of both L2CAP channels, as last seen by the Bluetooth task */
+static bool ds3_link_is_connected = false;
+
+/* Suspend and resume statistics */
+static ds3_suspend_stats_t ds3_suspend_stats;
 
 /* Input and output data */
+static ds3_controller_t ds3_controller = ds3_controller_dualshock;
 static ds3_input_data_t ds3_input_data;
 static ds3_output_data_t ds3_output_data;
 
+/* Raw input report, only valid while the input report is being processed */
+static uint8_t *ds3_raw_report = NULL;
+static uint16_t ds3_raw_len = sizeof(hid_cmd_t);
+
+/* Arrival of the input report being processed, 0 when unknown */
+static int64_t ds3_raw_time = 0;
+
+/* Arrival stamp of this component's link, the merged links keep their own */
+static ds3_stamp_t ds3_report_stamp;
+
+/* Status monitor */
+static ds3_status_monitor_t ds3_status_monitor;
+
+/* Persistent output report, patched in place by ds3_parse_output */
+static hid_cmd_t ds3_output_cmd = {
+    .code = hid_cmd_code_set_report | hid_cmd_code_type_output,
+    .identifier = hid_cmd_identifier_ds3_control,
+};
+static bool ds3_output_sent = false;
+static bool ds3_output_pending = false; /* Output changed while the link was down, or the control transactions were full */
+
 
 /********************************************************************************/
 /*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
@@ -39,6 +78,14 @@ static ds3_output_data_t ds3_output_data;
 
 static void ds3_handle_connect_event(uint8_t is_connected);
 static void ds3_handle_data_event(ds3_input_data_t *const p_data, ds3_event_t *const p_event);
+static void ds3_handle_status_event(ds3_status_t *const p_status);
+static void ds3_handle_commands();
+static void ds3_send_output();
+static bool ds3_rumble_is_active(ds3_rumble_t *const p_rumble);
+static bool ds3_start_services();
+static bool ds3_stop_services();
+static bool ds3_suspend_services();
+static bool ds3_resume_services();
 
 
 /********************************************************************************/
@@ -58,19 +105,57 @@ static void ds3_handle_data_event(ds3_input_data_t *const p_data, ds3_event_t *c
 *******************************************************************************/
 bool ds3Init()
 {
+    int64_t start = esp_timer_get_time();
     bool ok;
 
+    atomic_store(&ds3_is_suspended, false);
+    ds3_link_is_connected = false;
+
+    ok = ds3_conn_init();
+    if (ok != true)
+    {
+        return false;
+    }
+    ok = ds3_worker_init();
+    if (ok != true)
+    {
+        return false;
+    }
+    ok = ds3_pm_init();
+    if (ok != true)
+    {
+        return false;
+    }
+    ok = ds3_scan_init();
+    if (ok != true)
+    {
+        return false;
+    }
+    ok = ds3_batch_init();
+    if (ok != true)
+    {
+        return false;
+    }
+
+    /* Prepare the persistent output report */
+    ds3_parse_output_init(ds3_output_cmd.data);
+    ds3_output_sent = false;
+    ds3_output_pending = false;
+
     ok = ds3_bt_init();
     if (ok != true)
     {
         return false;
     }
-    ok = ds3_l2cap_init_services();
+    /* Register the services and page scan, from the Bluetooth task */
+    ok = ds3_bt_call(ds3_start_services);
     if (ok != true)
     {
         return false;
     }
 
+    ds3_suspend_stats.init_us = (uint32_t)(esp_timer_get_time() - start);
+
     return true;
 }
 
@@ -89,7 +174,16 @@ bool ds3Deinit()
 {
     bool ok;
 
-    ds3_l2cap_deinit_services();
+    /* The services are already deregistered while suspended */
+    if (!atomic_load(&ds3_is_suspended)) {
+        ds3_bt_call(ds3_stop_services);
+    }
+    atomic_store(&ds3_is_suspended, false);
+    ds3_scan_deinit();
+    ds3_worker_deinit();
+    ds3_batch_deinit();
+    ds3_conn_deinit();
+    ds3_pm_deinit();
     ok = ds3_bt_deinit();
     if (ok != true)
     {
@@ -99,6 +193,98 @@ bool ds3Deinit()
     return true;
 }
 
+/*******************************************************************************
+**
+** Function         ds3Suspend
+**
+** Description      This stops listening for incoming connections, leaving the
+**                  Bluetooth controller and the Bluedroid stack running. The
+**                  host stops page scanning, the HID services are
+**                  deregistered and a connected DS3 controller is
+**                  disconnected. ds3Resume listens again, much faster than
+**                  ds3Deinit followed by ds3Init. The work runs on the
+**                  Bluetooth task, the caller waits for it.
+**
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3Suspend()
+{
+    int64_t start = esp_timer_get_time();
+
+    if (atomic_load(&ds3_is_suspended)) {
+        return true;
+    }
+    if (!ds3_bt_call(ds3_suspend_services)) {
+        return false;
+    }
+
+    ds3_suspend_stats.suspends++;
+    ds3_suspend_stats.suspend_us = (uint32_t)(esp_timer_get_time() - start);
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3Resume
+**
+** Description      This listens for incoming connections again after
+**                  ds3Suspend. The work runs on the Bluetooth task, the
+**                  caller waits for it.
+**
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3Resume()
+{
+    int64_t start = esp_timer_get_time();
+
+    if (!atomic_load(&ds3_is_suspended)) {
+        return true;
+    }
+    if (!ds3_bt_call(ds3_resume_services)) {
+        return false;
+    }
+
+    ds3_suspend_stats.resume_us = (uint32_t)(esp_timer_get_time() - start);
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3IsSuspended
+**
+** Description      This returns whether incoming connections are suspended.
+**
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3IsSuspended()
+{
+    return atomic_load(&ds3_is_suspended);
+}
+
+/*******************************************************************************
+**
+** Function         ds3GetSuspendStats
+**
+** Description      Copies the suspend count and the durations of the last
+**                  ds3Init, ds3Suspend and ds3Resume.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3GetSuspendStats(ds3_suspend_stats_t *const p_stats)
+{
+    *p_stats = ds3_suspend_stats;
+}
+
 /*******************************************************************************
 **
 ** Function         ds3IsConnected
@@ -138,49 +324,40 @@ void ds3HandleConnection(bool is_connected)
 ** Function         ds3EnableReport
 **
 ** Description      This triggers the DS3 controller to start continually
-**                  sending its data.
+**                  sending its data. Sent in place on the Bluetooth task,
+**                  posted to it from any other task.
 **
 **
-** Returns          void
+** Returns          bool, whether the report was sent, or posted
 **
 *******************************************************************************/
-void ds3EnableReport()
+bool ds3EnableReport()
 {
-    hid_cmd_t hid_cmd = {
-        .code = hid_cmd_code_set_report | hid_cmd_code_type_feature,
-        .identifier = hid_cmd_identifier_ds3_enable,
-    };
-    uint16_t len = sizeof(hid_cmd_payload_report_enable);
+    ds3_cmd_t cmd = { .type = ds3_cmd_type_enable };
 
-    memcpy(hid_cmd.data, hid_cmd_payload_report_enable, len);
+    if (ds3_bt_is_task()) {
+        return ds3_l2cap_send_data(hid_cmd_report_enable, sizeof(hid_cmd_report_enable));
+    }
 
-    ds3_l2cap_send_data((uint8_t *)&hid_cmd, len + 2U);
+    return ds3_post_command(&cmd);
 }
 
 /*******************************************************************************
 **
 ** Function         ds3SendCommand
 **
-** Description      Send a command to the DS3 controller.
+** Description      Send the output report to the DS3 controller. Safe to call
+**                  from any task, the report is sent from the Bluetooth task.
 **
 **
-** Returns          void
+** Returns          bool, false when the command queue is full
 **
 *******************************************************************************/
-void ds3SendCommand()
+bool ds3SendCommand()
 {
-    hid_cmd_t hid_cmd = {
-        .code = hid_cmd_code_set_report | hid_cmd_code_type_output,
-        .identifier = hid_cmd_identifier_ds3_control,
-        .data = {0},
-    };
-    uint16_t len = sizeof(hid_cmd.data);
-
-    /* Parse the output data */
-    ds3_parse_output(&ds3_output_data, hid_cmd.data);
+    ds3_cmd_t cmd = { .type = ds3_cmd_type_send };
 
-    /* Send the hid command */
-    ds3_l2cap_send_data((uint8_t *)&hid_cmd, len + 2U);
+    return ds3_post_command(&cmd);
 }
 
 /*******************************************************************************
@@ -201,75 +378,201 @@ void ds3ReceiveData(uint8_t p_data[const])
         // if (hid_cmd->identifier == hid_cmd_identifier_ds3_control)
         static ds3_event_t ds3_event;
 
+        /* Run at full speed while processing */
+        ds3_pm_acquire(ds3_pm_holder_report);
+
+        /* Expose the raw report for the duration of the callbacks */
+        ds3_raw_report = p_data;
+
         /* Save the previous data */
         ds3_input_data_t prev_data = ds3_input_data;
 
         /* Parse the input data */
-        ds3_parse_input(p_hid_cmd->data, &ds3_input_data);
+        if (ds3_controller == ds3_controller_navigation) {
+            ds3_parse_nav_input(p_hid_cmd->data, &ds3_input_data);
+        }
+        else {
+            ds3_parse_input(p_hid_cmd->data, &ds3_input_data);
+        }
+
+        /* Remap the input, the events and every consumer see the remapped data */
+        ds3_remap_apply(&ds3_input_data);
+
+        /* Tag the arrival */
+        uint16_t missed = ds3_stamp_report(&ds3_report_stamp, &ds3_input_data,
+                                           (ds3_raw_time != 0) ? ds3_raw_time : esp_timer_get_time());
+        if (missed != 0) {
+            ds3_telemetry_missed(missed);
+        }
 
         /* Parse the event */
         ds3_parse_event(&prev_data, &ds3_input_data, &ds3_event);
 
+        /* Update the merged device */
+        ds3_merge_report(&ds3_input_data, &ds3_event);
+
+        /* Record the data */
+        ds3_record_report(&ds3_input_data, &ds3_event);
+
+        /* Stream the changes, after the connection frame as the subscribers */
+        if (ds3_is_active) {
+            ds3_bridge_report(&ds3_input_data, &ds3_event);
+        }
+
         /* Process the data event */
         ds3_handle_data_event(&ds3_input_data, &ds3_event);
+
+        /* Process the status event, only when the status has changed */
+        if (ds3_parse_status(&ds3_status_monitor, &ds3_input_data.status)) {
+            ds3_handle_status_event(&ds3_status_monitor.status);
+        }
+
+        ds3_raw_report = NULL;
+
+        /* Let the system sleep until the next report once the input is idle */
+        if (ds3_parse_event_is_empty(&ds3_event)) {
+            ds3_pm_release(ds3_pm_holder_report);
+        }
     }
 }
 
 /*******************************************************************************
 **
-** Function         ds3SetLed
+** Function         ds3GetRawReport
+**
+** Description      Returns the raw HID input report currently being processed,
+**                  pointing directly into the L2CAP buffer. Only valid from
+**                  within the callbacks.
 **
-** Description      Sets the LEDs on the DS3 controller
+** Returns          const uint8_t *, or NULL outside of the callbacks
+**
+*******************************************************************************/
+const uint8_t *ds3GetRawReport(uint16_t *const p_len)
+{
+    if ((ds3_raw_report != NULL) && (p_len != NULL)) {
+        *p_len = ds3_raw_len;
+    }
+    return ds3_raw_report;
+}
+
+/*******************************************************************************
+**
+** Function         ds3ParseExtended
+**
+** Description      Copies the reserved and unknown bytes of the input report
+**                  currently being processed, which ds3_input_data_t leaves
+**                  out. They are not decoded. Only valid from within the
+**                  callbacks.
+**
+** Returns          bool, false outside of the callbacks
+**
+*******************************************************************************/
+bool ds3ParseExtended(ds3_extended_t *const p_ext)
+{
+    if ((ds3_raw_report == NULL) || (ds3_raw_len < sizeof(hid_cmd_t))) {
+        return false;
+    }
+
+    ds3_parse_extended(((hid_cmd_t *)ds3_raw_report)->data, p_ext);
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_receive_data
+**
+** Description      Process the incoming data from the DS3 controller, with
+**                  the length of the L2CAP packet and its arrival time.
 **
 **
 ** Returns          void
 **
 *******************************************************************************/
-void ds3SetLed(uint8_t num, bool val)
+void ds3_receive_data(uint8_t p_data[const], uint16_t len, int64_t time)
 {
-    switch (num)
-    {
-    case 0:
-        ds3SetLeds(val, val, val, val);
-        break;
-    case 1:
-        ds3_output_data.led.led1 = val;
-        break;
-    case 2:
-        ds3_output_data.led.led2 = val;
-        break;
-    case 3:
-        ds3_output_data.led.led3 = val;
-        break;
-    case 4:
-        ds3_output_data.led.led4 = val;
-        break;
-    
-    default:
-        break;
-    }
-    ds3SendCommand();
-}
-void ds3SetLeds(bool led1, bool led2, bool led3, bool led4)
-{
-    ds3_output_data.led = (ds3_led_t){led1, led2, led3, led4};
-    ds3SendCommand();
+    ds3_telemetry_report(time);
+
+    ds3_raw_len = len;
+    ds3_raw_time = time;
+    ds3ReceiveData(p_data);
+    ds3_raw_len = sizeof(hid_cmd_t);
+    ds3_raw_time = 0;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_stamp_report
+**
+** Description      Tag an input report of a link with its arrival, its
+**                  sequence number and the reports estimated lost since the
+**                  previous one, rounded to the expected report period.
+**
+** Returns          uint16_t, the reports estimated lost
+**
+*******************************************************************************/
+uint16_t ds3_stamp_report(ds3_stamp_t *const p_stamp, ds3_input_data_t *const p_data, int64_t now)
+{
+    int64_t periods;
+
+    p_data->time = now;
+    p_data->seq = p_stamp->seq++;
+    p_data->missed = 0;
+
+    if (p_stamp->last_us != 0) {
+        periods = (now - p_stamp->last_us + DS3_TELEMETRY_REPORT_PERIOD_US / 2) / DS3_TELEMETRY_REPORT_PERIOD_US;
+        if (periods > 1) {
+            p_data->missed = (periods > UINT16_MAX) ? UINT16_MAX : (uint16_t)(periods - 1);
+        }
+    }
+    p_stamp->last_us = now;
+
+    return p_data->missed;
+}
+
+/*******************************************************************************
+**
+** Function         ds3SetLed
+**
+** Description      Sets the LEDs on the DS3 controller. Safe to call from any
+**                  task, the report is sent from the Bluetooth task.
+**
+**
+** Returns          bool, false when the command queue is full
+**
+*******************************************************************************/
+bool ds3SetLed(uint8_t num, bool val)
+{
+    ds3_cmd_t cmd = { .type = ds3_cmd_type_led, .arg = {num, val} };
+
+    return ds3_post_command(&cmd);
+}
+bool ds3SetLeds(bool led1, bool led2, bool led3, bool led4)
+{
+    ds3_cmd_t cmd = { .type = ds3_cmd_type_leds, .arg = {led1, led2, led3, led4} };
+
+    return ds3_post_command(&cmd);
 }
 
 /*******************************************************************************
 **
 ** Function         ds3SetRumble
 **
-** Description      Sets the Rumble on the DS3 controller
+** Description      Sets the Rumble on the DS3 controller. Safe to call from
+**                  any task, the report is sent from the Bluetooth task.
 **
 **
-** Returns          void
+** Returns          bool, false when the command queue is full
 **
 *******************************************************************************/
-void ds3SetRumble(uint8_t right_duration, uint8_t right_intensity, uint8_t left_duration, uint8_t left_intensity)
+bool ds3SetRumble(uint8_t right_duration, uint8_t right_intensity, uint8_t left_duration, uint8_t left_intensity)
 {
-    ds3_output_data.rumble = (ds3_rumble_t){right_duration, right_intensity, left_duration, left_intensity};
-    ds3SendCommand();
+    ds3_cmd_t cmd = {
+        .type = ds3_cmd_type_rumble,
+        .arg = {right_duration, right_intensity, left_duration, left_intensity},
+    };
+
+    return ds3_post_command(&cmd);
 }
 
 /*******************************************************************************
@@ -303,6 +606,38 @@ void ds3SetEventCallback(ds3_event_callback_t cb)
     ds3_event_cb = cb;
 }
 
+/*******************************************************************************
+**
+** Function         ds3SetStatusCallback
+**
+** Description      Registers a callback for receiving DS3 controller status
+**                  changes (cable, battery, connection and rumble)
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3SetStatusCallback(ds3_status_callback_t cb)
+{
+    ds3_status_cb = cb;
+}
+
+/*******************************************************************************
+**
+** Function         ds3SetController
+**
+** Description      Selects the controller type on the link, the reports of
+**                  a Navigation controller only carry its own inputs
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3SetController(ds3_controller_t controller)
+{
+    ds3_controller = controller;
+}
+
 /*******************************************************************************
 **
 ** Function         ds3SetBluetoothMacAddress
@@ -323,19 +658,117 @@ void ds3SetBluetoothMacAddress(const uint8_t *mac)
     esp_base_mac_addr_set(base_mac);
 }
 
+/*******************************************************************************
+**
+** Function         ds3_link_connection
+**
+** Description      Follow the L2CAP connection on the Bluetooth task, then
+**                  hand it over to the input task. Both channels report their
+**                  disconnection, only changes are passed on.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_link_connection(bool is_connected)
+{
+    if (is_connected == ds3_link_is_connected) {
+        return;
+    }
+    ds3_link_is_connected = is_connected;
+
+    /* The state machine sends the enable report, and resends it on timeouts */
+    ds3_conn_event(is_connected ? ds3_conn_event_connected : ds3_conn_event_disconnected);
+    /* Page scanning is not needed while connected, and fast for a quick reconnection */
+    ds3_scan_connection(is_connected);
+
+    if (is_connected) {
+        /* Apply the output commands posted while connecting */
+        ds3_handle_commands();
+    }
+    else {
+        /* The controller stops rumbling on its own, a new connection must
+           not restart what is left of it */
+        ds3_rumble_cancel();
+        memset(&ds3_output_data.rumble, 0, sizeof(ds3_output_data.rumble));
+        ds3_request_reset();
+        /* A new connection always gets a full output report */
+        ds3_output_sent = false;
+    }
+
+    ds3_worker_connection(is_connected);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_post_command
+**
+** Description      Post an output command and kick the Bluetooth task, which
+**                  applies it.
+**
+**
+** Returns          bool, false when the command queue is full
+**
+*******************************************************************************/
+bool ds3_post_command(const ds3_cmd_t *p_cmd)
+{
+    if (!ds3_cmd_post(p_cmd)) {
+        return false;
+    }
+    ds3_bt_kick();
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_service
+**
+** Description      Bluetooth task service, run by ds3_bt_kick and for every
+**                  input report. Times out the connection states and the
+**                  control requests, applies the page scan changes and the
+**                  output commands and refreshes the scheduled rumble. Also
+**                  flushes the batch by age when the Bluetooth task is the
+**                  input task.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_service()
+{
+    int64_t now = esp_timer_get_time();
+
+    ds3_conn_service(now);
+    ds3_scan_service();
+    ds3_request_tick(now);
+    ds3_handle_commands();
+#ifndef DS3_WORKER_ENABLE
+    ds3_batch_service();
+#endif
+}
+
 /********************************************************************************/
 /*                      L O C A L    F U N C T I O N S                          */
 /********************************************************************************/
 
 static void ds3_handle_connect_event(uint8_t is_connected)
 {
-    if (is_connected) {
-        if (!ds3_is_active) {
-            ds3EnableReport();
+    /* The connection is reported with the first input report */
+    if (!is_connected) {
+        /* Notify the subscribers, if the connection was reported */
+        if (ds3_is_active) {
+            ds3FlushBatch();
+            ds3_events_connection(false);
+            ds3_bridge_connection(false);
         }
-    }
-    else {
+        ds3_pm_release(ds3_pm_holder_report);
+        ds3_merge_disconnect();
         ds3_is_active = false;
+        /* A new connection restarts the sequence */
+        memset(&ds3_report_stamp, 0, sizeof(ds3_report_stamp));
+        /* A new connection always reports its first status */
+        ds3_status_monitor.valid = false;
     }
 }
 
@@ -347,6 +780,10 @@ static void ds3_handle_data_event(ds3_input_data_t *const p_data, ds3_event_t *c
         if (ds3_event_cb != NULL) {
             ds3_event_cb(p_data, p_event);
         }
+        /* Notify the subscribers */
+        ds3_events_report(p_data, p_event);
+        /* Append to the batch */
+        ds3_batch_report(p_data, p_event);
     }
     else {
         ds3_is_active = true;
@@ -354,5 +791,171 @@ static void ds3_handle_data_event(ds3_input_data_t *const p_data, ds3_event_t *c
         if (ds3_connection_cb != NULL) {
             ds3_connection_cb(ds3_is_active);
         }
+        /* Notify the subscribers */
+        ds3_events_connection(ds3_is_active);
+        ds3_bridge_connection(ds3_is_active);
+    }
+}
+
+static void ds3_handle_status_event(ds3_status_t *const p_status)
+{
+    /* Call the provided status callback */
+    if (ds3_status_cb != NULL) {
+        ds3_status_cb(p_status);
+    }
+    /* Notify the subscribers */
+    ds3_events_status(p_status);
+}
+
+static void ds3_handle_commands()
+{
+    ds3_cmd_t cmd;
+    bool send = false;
+
+    /* Apply all pending commands, and send a single report for them */
+    while (ds3_cmd_pop(&cmd)) {
+        switch (cmd.type)
+        {
+        case ds3_cmd_type_led:
+            switch (cmd.arg[0])
+            {
+            case 0:
+                ds3_output_data.led = (ds3_led_t){cmd.arg[1], cmd.arg[1], cmd.arg[1], cmd.arg[1]};
+                break;
+            case 1:
+                ds3_output_data.led.led1 = cmd.arg[1];
+                break;
+            case 2:
+                ds3_output_data.led.led2 = cmd.arg[1];
+                break;
+            case 3:
+                ds3_output_data.led.led3 = cmd.arg[1];
+                break;
+            case 4:
+                ds3_output_data.led.led4 = cmd.arg[1];
+                break;
+            default:
+                break;
+            }
+            break;
+        case ds3_cmd_type_leds:
+            ds3_output_data.led = (ds3_led_t){cmd.arg[0], cmd.arg[1], cmd.arg[2], cmd.arg[3]};
+            break;
+        case ds3_cmd_type_rumble:
+            /* A direct rumble replaces the scheduled one */
+            ds3_rumble_cancel();
+            ds3_output_data.rumble = (ds3_rumble_t){cmd.arg[0], cmd.arg[1], cmd.arg[2], cmd.arg[3]};
+            break;
+        case ds3_cmd_type_rumble_ms:
+            /* Written into the output data by ds3_rumble_update below */
+            ds3_rumble_schedule(cmd.arg[0], cmd.ms[0], cmd.arg[1], cmd.ms[1]);
+            continue;
+        case ds3_cmd_type_enable:
+            if (ds3_link_is_connected) {
+                ds3EnableReport();
+            }
+            continue;
+        case ds3_cmd_type_request:
+            /* Sent right away, so the wire keeps the order of the posts */
+            ds3_request_send(cmd.arg[0], ds3_link_is_connected);
+            continue;
+        default:
+            break;
+        }
+        send = true;
     }
+
+    /* Refresh the scheduled rumble in the same report */
+    if (ds3_rumble_update(&ds3_output_data.rumble)) {
+        send = true;
+    }
+
+    /* Output changed while disconnected goes out once connected, and while
+       the control transactions fill up once a response freed one */
+    if (send || ds3_output_pending) {
+        ds3_output_pending = !ds3_link_is_connected || !ds3_request_has_room();
+        if (!ds3_output_pending) {
+            ds3_send_output();
+        }
+    }
+}
+
+static void ds3_send_output()
+{
+    uint16_t len = sizeof(ds3_output_cmd.data);
+    bool changed;
+
+    /* Patch the output data into the persistent report */
+    changed = ds3_parse_output(&ds3_output_data, ds3_output_cmd.data);
+
+    /* Skip identical reports, unless they carry a rumble, which restarts on every report */
+    if (!changed && ds3_output_sent && !ds3_rumble_is_active(&ds3_output_data.rumble)) {
+        return;
+    }
+
+    /* Send the hid command */
+    ds3_output_sent = ds3_l2cap_send_data((uint8_t *)&ds3_output_cmd, len + 2U);
+}
+
+/* Register the services, then page scan. Runs on the Bluetooth task. */
+static bool ds3_start_services()
+{
+    if (!ds3_l2cap_init_services()) {
+        return false;
+    }
+    if (!ds3_scan_enable(true)) {
+        ds3_scan_enable(false);
+        ds3_l2cap_deinit_services();
+        return false;
+    }
+
+    return true;
+}
+
+/* Stop listening and drop the connection. Runs on the Bluetooth task. */
+static bool ds3_stop_services()
+{
+    /* Stop page scanning first, so that no new connection comes in */
+    if (!ds3_scan_enable(false)) {
+        return false;
+    }
+    ds3_l2cap_disconnect();
+    /* The disconnect confirmations are not delivered once deregistered */
+    ds3_l2cap_deinit_services();
+    ds3_link_connection(false);
+
+    return true;
+}
+
+/* Suspended tells the application task the outcome, so it only changes here */
+static bool ds3_suspend_services()
+{
+    if (atomic_load(&ds3_is_suspended)) {
+        return true;
+    }
+    if (!ds3_stop_services()) {
+        return false;
+    }
+    atomic_store(&ds3_is_suspended, true);
+
+    return true;
+}
+
+static bool ds3_resume_services()
+{
+    if (!atomic_load(&ds3_is_suspended)) {
+        return true;
+    }
+    if (!ds3_start_services()) {
+        return false;
+    }
+    atomic_store(&ds3_is_suspended, false);
+
+    return true;
+}
+
+static bool ds3_rumble_is_active(ds3_rumble_t *const p_rumble)
+{
+    return (p_rumble->right_duration && p_rumble->right_intensity)
+        || (p_rumble->left_duration && p_rumble->left_intensity);
 }
@@ -0,0 +1,285 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#define DS3_TAG "DS3_BATCH"
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+typedef struct {
+    ds3_batch_callback_t cb;
+    void *p_ctx;
+    uint16_t reports;
+    int64_t period_us;
+} ds3_batch_config_t;
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+#ifndef DS3_SKIP_BATCH
+static void ds3_batch_apply();
+static void ds3_batch_age_cb(void *arg);
+#endif
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+#ifndef DS3_SKIP_BATCH
+/* Settings of ds3SetBatchCallback, applied by the input task */
+static portMUX_TYPE ds3_batch_mux = portMUX_INITIALIZER_UNLOCKED;
+static ds3_batch_config_t ds3_batch_pending = { NULL, NULL, DS3_BATCH_MAX, 0 };
+static atomic_bool ds3_batch_changed;
+
+/* Input task only */
+static ds3_batch_config_t ds3_batch_config = { NULL, NULL, DS3_BATCH_MAX, 0 };
+static ds3_batch_t ds3_batch;
+static int64_t ds3_batch_start_us = 0;
+
+/* Age of the oldest report, set by the timer and checked by the input task */
+static esp_timer_handle_t ds3_batch_timer = NULL;
+static atomic_bool ds3_batch_due;
+#endif
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3SetBatchCallback
+**
+** Description      Registers a callback receiving the input reports in
+**                  batches, flushed every `reports` reports (at most
+**                  DS3_BATCH_MAX) or once the oldest report in the batch is
+**                  `period_ms` old, whichever comes first. A period of 0
+**                  only flushes on count. Pass NULL to disable batching.
+**                  Safe to call from any task, the input task applies the
+**                  settings before its next report, discarding the pending
+**                  reports. Does nothing when DS3_SKIP_BATCH is defined.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3SetBatchCallback(ds3_batch_callback_t cb, void *p_ctx, uint16_t reports, uint32_t period_ms)
+{
+#ifndef DS3_SKIP_BATCH
+    if ((reports == 0) || (reports > DS3_BATCH_MAX)) {
+        reports = DS3_BATCH_MAX;
+    }
+
+    portENTER_CRITICAL(&ds3_batch_mux);
+    ds3_batch_pending.cb = cb;
+    ds3_batch_pending.p_ctx = p_ctx;
+    ds3_batch_pending.reports = reports;
+    ds3_batch_pending.period_us = (int64_t)period_ms * 1000;
+    atomic_store(&ds3_batch_changed, true);
+    portEXIT_CRITICAL(&ds3_batch_mux);
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3FlushBatch
+**
+** Description      Delivers the pending input reports, if any, to the batch
+**                  callback. Must be called from the input task context,
+**                  e.g. from within a handler.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3FlushBatch()
+{
+#ifndef DS3_SKIP_BATCH
+    ds3_batch_apply();
+    if ((ds3_batch.count == 0) || (ds3_batch_config.cb == NULL)) {
+        return;
+    }
+
+    if (ds3_batch_timer != NULL) {
+        esp_timer_stop(ds3_batch_timer);
+    }
+    ds3_batch_config.cb(ds3_batch_config.p_ctx, &ds3_batch);
+    ds3_batch.count = 0;
+#endif
+}
+
+#ifndef DS3_SKIP_BATCH
+/*******************************************************************************
+**
+** Function         ds3_batch_init
+**
+** Description      Create the timer flushing the batches by age
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3_batch_init()
+{
+    esp_timer_create_args_t args = {
+        .callback = ds3_batch_age_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "ds3_batch",
+    };
+    esp_err_t ret;
+
+    atomic_store(&ds3_batch_due, false);
+
+    ret = esp_timer_create(&args, &ds3_batch_timer);
+    if (ret != ESP_OK) {
+        ESP_LOGE(DS3_TAG, "%s create timer failed: %s", __func__, esp_err_to_name(ret));
+        return false;
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_batch_deinit
+**
+** Description      Delete the batch timer
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_batch_deinit()
+{
+    if (ds3_batch_timer != NULL) {
+        esp_timer_stop(ds3_batch_timer);
+        esp_timer_delete(ds3_batch_timer);
+        ds3_batch_timer = NULL;
+    }
+}
+
+/*******************************************************************************
+**
+** Function         ds3_batch_service
+**
+** Description      Flush the batch once its oldest report is old enough,
+**                  called on the input task when the batch timer kicks it.
+**                  The age is checked again, as the batch may have been
+**                  flushed on count since the timer fired.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_batch_service()
+{
+    if (!atomic_exchange(&ds3_batch_due, false)) {
+        return;
+    }
+
+    ds3_batch_apply();
+    if ((ds3_batch.count != 0) && (ds3_batch_config.period_us != 0)
+        && (esp_timer_get_time() - ds3_batch_start_us >= ds3_batch_config.period_us)) {
+        ds3FlushBatch();
+    }
+}
+
+/*******************************************************************************
+**
+** Function         ds3_batch_report
+**
+** Description      Append an input report to the batch, and flush it when
+**                  full or old enough. The age is checked on arrival, and by
+**                  a timer started with the batch, for when the reports stop
+**                  or are dropped.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_batch_report(ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    int64_t now;
+    uint16_t i;
+
+    ds3_batch_apply();
+    if (ds3_batch_config.cb == NULL) {
+        return;
+    }
+
+    now = esp_timer_get_time();
+    i = ds3_batch.count;
+    if (i == 0) {
+        ds3_batch_start_us = now;
+        if ((ds3_batch_config.period_us != 0) && (ds3_batch_timer != NULL)) {
+            esp_timer_stop(ds3_batch_timer);
+            esp_timer_start_once(ds3_batch_timer, (uint64_t)ds3_batch_config.period_us);
+        }
+    }
+
+    /* Append the report to the columns, with its arrival stamp: the age
+       above is on the batching clock, later with the worker handoff */
+    ds3_batch.time[i]        = (uint32_t)p_data->time;
+    ds3_batch.button[i]      = p_data->button;
+    ds3_batch.button_down[i] = p_event->button_down;
+    ds3_batch.button_up[i]   = p_event->button_up;
+    ds3_batch.lx[i]          = p_data->stick.lx;
+    ds3_batch.ly[i]          = p_data->stick.ly;
+    ds3_batch.rx[i]          = p_data->stick.rx;
+    ds3_batch.ry[i]          = p_data->stick.ry;
+#ifndef DS3_PARSE_SKIP_ANALOG
+    ds3_batch.analog[i]      = p_data->analog;
+#endif
+#ifndef DS3_PARSE_SKIP_SENSOR
+    ds3_batch.ax[i]          = p_data->sensor.ax;
+    ds3_batch.ay[i]          = p_data->sensor.ay;
+    ds3_batch.az[i]          = p_data->sensor.az;
+    ds3_batch.gz[i]          = p_data->sensor.gz;
+#endif
+    ds3_batch.count = i + 1;
+
+    /* Flush on count or on age */
+    if ((ds3_batch.count >= ds3_batch_config.reports)
+        || ((ds3_batch_config.period_us != 0) && (now - ds3_batch_start_us >= ds3_batch_config.period_us))) {
+        ds3FlushBatch();
+    }
+}
+#endif
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+#ifndef DS3_SKIP_BATCH
+static void ds3_batch_apply()
+{
+    if (!atomic_load(&ds3_batch_changed)) {
+        return;
+    }
+
+    portENTER_CRITICAL(&ds3_batch_mux);
+    ds3_batch_config = ds3_batch_pending;
+    atomic_store(&ds3_batch_changed, false);
+    portEXIT_CRITICAL(&ds3_batch_mux);
+
+    /* The pending reports belong to the previous settings */
+    ds3_batch.count = 0;
+    if (ds3_batch_timer != NULL) {
+        esp_timer_stop(ds3_batch_timer);
+    }
+}
+
+static void ds3_batch_age_cb(void *arg)
+{
+    /* The batch belongs to the input task, wake it up to flush */
+    atomic_store(&ds3_batch_due, true);
+    ds3_worker_kick();
+}
+#endif
@@ -0,0 +1,437 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#ifdef DS3_BRIDGE_ENABLE
+#include "freertos/task.h"
+#include "driver/uart.h"
+#endif
+
+#define DS3_TAG "DS3_BRIDGE"
+
+/* Frame layout, see tools/ds3_bridge.py for the decoder:
+ *   sync, length, type, sequence, time (4, little endian), payload, crc8
+ * The length counts type to payload, the crc8 covers length to payload.
+ * A report payload is a group mask followed by the absolute values of the
+ * groups in bit order, so every frame decodes on its own. */
+#define DS3_BRIDGE_SYNC   0xA5
+#define DS3_BRIDGE_HEADER 8
+
+/* Frame types */
+#define DS3_BRIDGE_TYPE_REPORT     0x01
+#define DS3_BRIDGE_TYPE_CONNECTION 0x02
+
+/** Largest frame: header, mask, buttons, sticks, analog, sensors, status, crc8 */
+#define DS3_BRIDGE_MAX_SIZE (DS3_BRIDGE_HEADER + 1 + 3 + 4 + 12 + 8 + 3 + 1)
+
+#if defined(DS3_BRIDGE_ENABLE) && (DS3_BRIDGE_TX_BUFFER_SIZE < (2 * DS3_BRIDGE_MAX_SIZE))
+#error "DS3_BRIDGE_TX_BUFFER_SIZE is too small"
+#endif
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+#ifdef DS3_BRIDGE_ENABLE
+static portMUX_TYPE ds3_bridge_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* The UART is owned by the caller of ds3BridgeStart and ds3BridgeStop, the
+   input task only frames while it holds busy and the bridge is active */
+static atomic_bool ds3_bridge_active = false;
+static atomic_bool ds3_bridge_busy = false;
+static int ds3_bridge_uart = -1;
+static uint32_t ds3_bridge_baud = 0;
+static uint8_t ds3_bridge_groups = 0;
+static uint8_t ds3_bridge_seq = 0;
+static uint16_t ds3_bridge_sync_count = 0;
+static ds3_status_t ds3_bridge_status;
+
+/* Estimate of the bytes still in the transmit buffer */
+static uint32_t ds3_bridge_pending = 0;
+static int64_t ds3_bridge_pending_us = 0;
+
+static ds3_bridge_stats_t ds3_bridge_stats;
+#endif
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+#ifdef DS3_BRIDGE_ENABLE
+static bool ds3_bridge_enter(void);
+static void ds3_bridge_send(uint8_t p_frame[const], uint8_t len, int64_t now);
+static uint8_t ds3_bridge_crc8(const uint8_t *p_data, uint8_t len);
+#endif
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3BridgeStart
+**
+** Description      Streams the input as framed binary change records over a
+**                  UART, e.g. to a main MCU. `groups` is a ds3_bridge_group
+**                  mask of the inputs to stream. The frames are queued in
+**                  the driver's transmit buffer while the previous ones are
+**                  sent, and dropped instead of blocking the input task when
+**                  the baud rate cannot keep up. Start and stop the bridge
+**                  from the same task. Fails when DS3_BRIDGE_ENABLE is not
+**                  defined.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3BridgeStart(int uart_num, int tx_pin, uint32_t baud, uint8_t groups)
+{
+#ifdef DS3_BRIDGE_ENABLE
+    uart_config_t config = {
+        .baud_rate = baud,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+    };
+    esp_err_t ret;
+
+    if ((ds3_bridge_uart >= 0) || (baud == 0)) {
+        return false;
+    }
+
+    ret = uart_driver_install(uart_num, UART_FIFO_LEN * 2, DS3_BRIDGE_TX_BUFFER_SIZE, 0, NULL, 0);
+    if (ret == ESP_OK) {
+        ret = uart_param_config(uart_num, &config);
+    }
+    if (ret == ESP_OK) {
+        ret = uart_set_pin(uart_num, tx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(DS3_TAG, "%s uart %d failed: %s", __func__, uart_num, esp_err_to_name(ret));
+        uart_driver_delete(uart_num);
+        return false;
+    }
+
+    portENTER_CRITICAL(&ds3_bridge_mux);
+    memset(&ds3_bridge_stats, 0, sizeof(ds3_bridge_stats));
+    portEXIT_CRITICAL(&ds3_bridge_mux);
+    ds3_bridge_baud = baud;
+    ds3_bridge_groups = groups;
+    ds3_bridge_seq = 0;
+    ds3_bridge_sync_count = 0;
+    ds3_bridge_pending = 0;
+    ds3_bridge_pending_us = esp_timer_get_time();
+    ds3_bridge_uart = uart_num;
+    atomic_store(&ds3_bridge_active, true);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3BridgeStop
+**
+** Description      Stops streaming and releases the UART, once the input
+**                  task is done with the frame it may be writing
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3BridgeStop()
+{
+#ifdef DS3_BRIDGE_ENABLE
+    int uart_num = ds3_bridge_uart;
+
+    if ((uart_num < 0) || !atomic_exchange(&ds3_bridge_active, false)) {
+        return false;
+    }
+
+    /* The input task checks active after setting busy, so it either sees the
+       bridge stopped or is waited for here */
+    while (atomic_load(&ds3_bridge_busy)) {
+        vTaskDelay(1);
+    }
+
+    uart_wait_tx_done(uart_num, pdMS_TO_TICKS(100));
+    uart_driver_delete(uart_num);
+    ds3_bridge_uart = -1;
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3GetBridgeStats
+**
+** Description      Copies the bridge statistics, the bytes per report is
+**                  bytes / reports
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3GetBridgeStats(ds3_bridge_stats_t *const p_stats)
+{
+#ifdef DS3_BRIDGE_ENABLE
+    portENTER_CRITICAL(&ds3_bridge_mux);
+    *p_stats = ds3_bridge_stats;
+    portEXIT_CRITICAL(&ds3_bridge_mux);
+#else
+    memset(p_stats, 0, sizeof(ds3_bridge_stats_t));
+#endif
+}
+
+#ifdef DS3_BRIDGE_ENABLE
+/*******************************************************************************
+**
+** Function         ds3_bridge_report
+**
+** Description      Frame the groups changed by the event. Idle reports are
+**                  not sent, every DS3_BRIDGE_SYNC_REPORTS reports and after
+**                  a dropped frame all groups are sent.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_bridge_report(ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    uint8_t frame[DS3_BRIDGE_MAX_SIZE];
+    uint8_t *p_down = (uint8_t *)&p_event->button_down;
+    uint8_t *p_up = (uint8_t *)&p_event->button_up;
+    uint32_t stick;
+    uint8_t mask = 0;
+    uint8_t len = DS3_BRIDGE_HEADER + 1;
+    int64_t now;
+
+    if (!ds3_bridge_enter()) {
+        return;
+    }
+    portENTER_CRITICAL(&ds3_bridge_mux);
+    ds3_bridge_stats.reports++;
+    portEXIT_CRITICAL(&ds3_bridge_mux);
+
+    if (ds3_bridge_sync_count == 0) {
+        mask = ds3_bridge_group_button | ds3_bridge_group_stick | ds3_bridge_group_analog
+             | ds3_bridge_group_sensor | ds3_bridge_group_status;
+        ds3_bridge_sync_count = DS3_BRIDGE_SYNC_REPORTS;
+    }
+    else {
+        ds3_bridge_sync_count--;
+
+        memcpy(&stick, &p_event->stick_changed, sizeof(stick));
+        if ((p_down[0] | p_down[1] | p_down[2] | p_up[0] | p_up[1] | p_up[2]) != 0) {
+            mask |= ds3_bridge_group_button;
+        }
+        if (stick != 0) {
+            mask |= ds3_bridge_group_stick;
+        }
+#if !defined(DS3_PARSE_SKIP_ANALOG) && !defined(DS3_PARSE_SKIP_ANALOG_CHANGED)
+        {
+            const uint8_t zero[sizeof(ds3_analog_t)] = {0};
+            if (memcmp(&p_event->analog_changed, zero, sizeof(zero)) != 0) {
+                mask |= ds3_bridge_group_analog;
+            }
+        }
+#else
+        /* Without the changed events the analog buttons follow the buttons */
+        if (mask & ds3_bridge_group_button) {
+            mask |= ds3_bridge_group_analog;
+        }
+#endif
+        /* The sensors are noisy, they change with every report */
+        mask |= ds3_bridge_group_sensor;
+        if (memcmp(&ds3_bridge_status, &p_data->status, sizeof(ds3_status_t)) != 0) {
+            mask |= ds3_bridge_group_status;
+        }
+    }
+
+#ifdef DS3_PARSE_SKIP_ANALOG
+    mask &= ~ds3_bridge_group_analog;
+#endif
+#ifdef DS3_PARSE_SKIP_SENSOR
+    mask &= ~ds3_bridge_group_sensor;
+#endif
+    mask &= ds3_bridge_groups;
+    if (mask == 0) {
+        atomic_store(&ds3_bridge_busy, false);
+        return;
+    }
+
+    frame[len - 1] = mask;
+    if (mask & ds3_bridge_group_button) {
+        memcpy(&frame[len], &p_data->button, 3);
+        len += 3;
+    }
+    if (mask & ds3_bridge_group_stick) {
+        memcpy(&frame[len], &p_data->stick, sizeof(ds3_stick_t));
+        len += sizeof(ds3_stick_t);
+    }
+#ifndef DS3_PARSE_SKIP_ANALOG
+    if (mask & ds3_bridge_group_analog) {
+        memcpy(&frame[len], &p_data->analog, sizeof(ds3_analog_t));
+        len += sizeof(ds3_analog_t);
+    }
+#endif
+#ifndef DS3_PARSE_SKIP_SENSOR
+    if (mask & ds3_bridge_group_sensor) {
+        /* Little endian, as the target */
+        memcpy(&frame[len], &p_data->sensor, sizeof(ds3_sensor_t));
+        len += sizeof(ds3_sensor_t);
+    }
+#endif
+    if (mask & ds3_bridge_group_status) {
+        memcpy(&frame[len], &p_data->status, sizeof(ds3_status_t));
+        len += sizeof(ds3_status_t);
+        ds3_bridge_status = p_data->status;
+    }
+
+    now = esp_timer_get_time();
+    frame[2] = DS3_BRIDGE_TYPE_REPORT;
+    ds3_bridge_send(frame, len, now);
+    atomic_store(&ds3_bridge_busy, false);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_bridge_connection
+**
+** Description      Frame a connection change, the first report of the next
+**                  connection is sent whole
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_bridge_connection(uint8_t is_connected)
+{
+    uint8_t frame[DS3_BRIDGE_HEADER + 2];
+
+    if (!ds3_bridge_enter()) {
+        return;
+    }
+
+    frame[2] = DS3_BRIDGE_TYPE_CONNECTION;
+    frame[DS3_BRIDGE_HEADER] = is_connected;
+    ds3_bridge_send(frame, DS3_BRIDGE_HEADER + 1, esp_timer_get_time());
+    if (!is_connected) {
+        ds3_bridge_sync_count = 0;
+    }
+    atomic_store(&ds3_bridge_busy, false);
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3_bridge_enter
+**
+** Description      Mark the input task busy with the UART, clear busy again
+**                  when done. Fails when the bridge is stopped or stopping.
+**
+** Returns          bool
+**
+*******************************************************************************/
+static bool ds3_bridge_enter(void)
+{
+    /* Sequentially consistent, against the clear then check of ds3BridgeStop */
+    atomic_store(&ds3_bridge_busy, true);
+    if (!atomic_load(&ds3_bridge_active)) {
+        atomic_store(&ds3_bridge_busy, false);
+        return false;
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_bridge_send
+**
+** Description      Complete the frame header and crc and queue the frame.
+**                  The fill of the transmit buffer is estimated from the
+**                  baud rate, so a frame that does not fit is dropped
+**                  without asking the driver.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_bridge_send(uint8_t p_frame[const], uint8_t len, int64_t now)
+{
+    uint32_t drained = (uint32_t)(((now - ds3_bridge_pending_us) * ds3_bridge_baud) / 10000000);
+    uint32_t latency_us;
+
+    ds3_bridge_pending = (drained >= ds3_bridge_pending) ? 0 : (ds3_bridge_pending - drained);
+    ds3_bridge_pending_us = now;
+
+    if (ds3_bridge_pending + len + 1 > DS3_BRIDGE_TX_BUFFER_SIZE) {
+        portENTER_CRITICAL(&ds3_bridge_mux);
+        ds3_bridge_stats.dropped++;
+        portEXIT_CRITICAL(&ds3_bridge_mux);
+        /* Resynchronise the receiver with the next frame */
+        ds3_bridge_sync_count = 0;
+        return;
+    }
+
+    p_frame[0] = DS3_BRIDGE_SYNC;
+    p_frame[1] = len - 2;
+    p_frame[3] = ds3_bridge_seq++;
+    p_frame[4] = (uint8_t)now;
+    p_frame[5] = (uint8_t)(now >> 8);
+    p_frame[6] = (uint8_t)(now >> 16);
+    p_frame[7] = (uint8_t)(now >> 24);
+    p_frame[len] = ds3_bridge_crc8(&p_frame[1], len - 1);
+    len++;
+
+    uart_write_bytes(ds3_bridge_uart, (const char *)p_frame, len);
+    ds3_bridge_pending += len;
+
+    /* Time until the last byte of this frame is on the wire */
+    latency_us = (uint32_t)(((uint64_t)ds3_bridge_pending * 10000000) / ds3_bridge_baud);
+    portENTER_CRITICAL(&ds3_bridge_mux);
+    ds3_bridge_stats.latency_us = latency_us;
+    if (latency_us > ds3_bridge_stats.latency_max_us) {
+        ds3_bridge_stats.latency_max_us = latency_us;
+    }
+    ds3_bridge_stats.frames++;
+    ds3_bridge_stats.bytes += len;
+    portEXIT_CRITICAL(&ds3_bridge_mux);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_bridge_crc8
+**
+** Description      CRC-8 with polynomial 0x07
+**
+** Returns          uint8_t
+**
+*******************************************************************************/
+static uint8_t ds3_bridge_crc8(const uint8_t *p_data, uint8_t len)
+{
+    uint8_t crc = 0;
+
+    while (len--) {
+        crc ^= *p_data++;
+        for (uint8_t i = 0; i < 8; i++) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+
+    return crc;
+}
+#endif
@@ -1,15 +1,21 @@
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include "include/ds3.h"
 #include "include/ds3_int.h"
-#include "nvs.h"
-#include "nvs_flash.h"
 #include "esp_log.h"
 #include "esp_bt.h"
 #include "esp_bt_main.h"
 #include "esp_bt_device.h"
 #include "esp_gap_bt_api.h"
+#include "stack/bt_types.h"
+#include "stack/btm_api.h"
+#include "stack/btu.h"
+#include "osi/thread.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 
 #define DS3_TAG "DS3_BT"
 #define DS3_DEVICE_NAME "DS3 Host"
@@ -19,11 +25,66 @@
 /*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
 /********************************************************************************/
 
+static void ds3_bt_service_cb(TIMER_LIST_ENT *p_tle);
+static void ds3_bt_call_cb(TIMER_LIST_ENT *p_tle);
+#ifdef DS3_TELEMETRY_RSSI_ENABLE
+static void ds3_bt_gap_cb(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *param);
+#endif
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+/* Service request, posted to the BTU task as a user function timer */
+static TIMER_LIST_ENT ds3_bt_service_tle = {
+    .event = BTU_TTYPE_USER_FUNC,
+    .param = (TIMER_PARAM_TYPE)ds3_bt_service_cb,
+};
+static atomic_bool ds3_bt_service_pending = false; /* Kicks coalesce until the service runs */
+
+#ifdef DS3_TELEMETRY_RSSI_ENABLE
+/* GAP callback of the application, chained from ds3_bt_gap_cb */
+static _Atomic(esp_bt_gap_cb_t) ds3_bt_app_gap_cb = NULL;
+#endif
+static _Atomic(TaskHandle_t) ds3_bt_task = NULL;  /* Known once the service or a call has run */
+
+/* Synchronous call, posted to the BTU task the same way */
+static TIMER_LIST_ENT ds3_bt_call_tle = {
+    .event = BTU_TTYPE_USER_FUNC,
+    .param = (TIMER_PARAM_TYPE)ds3_bt_call_cb,
+};
+static SemaphoreHandle_t ds3_bt_call_lock = NULL; /* One call in flight */
+static SemaphoreHandle_t ds3_bt_call_done = NULL;
+static bool (*ds3_bt_call_fn)(void) = NULL;
+static bool ds3_bt_call_result = false;
+
 
 /********************************************************************************/
 /*                      P U B L I C    F U N C T I O N S                        */
 /********************************************************************************/
 
+#ifdef DS3_TELEMETRY_RSSI_ENABLE
+/*******************************************************************************
+**
+** Function         ds3SetGapCallback
+**
+** Description      Registers the application's GAP callback. With
+**                  DS3_TELEMETRY_RSSI_ENABLE the component registers its own
+**                  GAP callback with esp_bt_gap_register_callback, which
+**                  replaces any other, so the application registers its
+**                  callback here instead, and receives every GAP event after
+**                  the component. Pass NULL to stop receiving them.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3SetGapCallback(esp_bt_gap_cb_t cb)
+{
+    atomic_store(&ds3_bt_app_gap_cb, cb);
+}
+#endif
+
 /*******************************************************************************
 **
 ** Function         ds3_bt_init
@@ -37,16 +98,25 @@ bool ds3_bt_init()
 {
     esp_err_t ret;
 
-    /* Initialize the nvs flash */
-    ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
-    {
-        ret = nvs_flash_erase();
-        ESP_ERROR_CHECK(ret);
-        ret = nvs_flash_init();
+    /* Calls to the Bluetooth task, see ds3_bt_call */
+    if (ds3_bt_call_lock == NULL) {
+        ds3_bt_call_lock = xSemaphoreCreateMutex();
+        ds3_bt_call_done = xSemaphoreCreateBinary();
+        if ((ds3_bt_call_lock == NULL) || (ds3_bt_call_done == NULL)) {
+            ESP_LOGE(DS3_TAG, "%s create semaphores failed\n", __func__);
+            return false;
+        }
     }
+
+    /* Initialize the nvs flash */
+    ret = ds3_pairing_nvs_init();
     ESP_ERROR_CHECK(ret);
 
+    /* Load the pairing data, this may set the Bluetooth MAC address */
+    ds3_pairing_init();
+    /* Load the input mapping */
+    ds3_remap_init();
+
 #ifdef CONFIG_BTDM_CONTROLLER_MODE_BR_EDR_ONLY
     /* Release memory used by the BLE stack */
     ret = esp_bt_mem_release(ESP_BT_MODE_BLE);
@@ -94,14 +164,19 @@ bool ds3_bt_init()
         return false;
     }
 
-    /* Set the Bluetooth scan mode */
-    ret = esp_bt_gap_set_scan_mode(ESP_BT_CONNECTABLE, ESP_BT_NON_DISCOVERABLE);
+#ifdef DS3_TELEMETRY_RSSI_ENABLE
+    /* Register the GAP callback for the telemetry RSSI samples, the
+       application's callback is chained from it */
+    ret = esp_bt_gap_register_callback(ds3_bt_gap_cb);
     if (ret != ESP_OK)
     {
-        ESP_LOGE(DS3_TAG, "%s set scan mode failed: %s\n", __func__, esp_err_to_name(ret));
+        ESP_LOGE(DS3_TAG, "%s register gap callback failed: %s\n", __func__, esp_err_to_name(ret));
         return false;
     }
+#endif
 
+    /* The host stays non-connectable and non-discoverable, page scanning is
+       started by the scan policy once the services are registered */
     return true;
 }
 
@@ -150,5 +225,210 @@ bool ds3_bt_deinit()
         return false;
     }
 
+    /* The next stack gets a new task */
+    ds3_bt_task = NULL;
+    atomic_store(&ds3_bt_service_pending, false);
+    vSemaphoreDelete(ds3_bt_call_lock);
+    vSemaphoreDelete(ds3_bt_call_done);
+    ds3_bt_call_lock = NULL;
+    ds3_bt_call_done = NULL;
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_bt_set_page_scan
+**
+** Description      Set the page scan window and interval, in 0.625 ms slots,
+**                  or stop page scanning with a zero window. This goes to
+**                  BTM directly, esp_bt_gap_set_scan_mode would apply the
+**                  default window and interval, later, from the BTC task.
+**                  The host is never discoverable.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3_bt_set_page_scan(uint16_t window, uint16_t interval, bool interlaced)
+{
+    tBTM_STATUS status;
+
+    if (window == 0) {
+        status = BTM_SetConnectability(BTM_NON_CONNECTABLE, BTM_DEFAULT_CONN_WINDOW, BTM_DEFAULT_CONN_INTERVAL);
+    }
+    else {
+        /* Interlaced scanning listens on both page trains in one interval */
+        status = BTM_SetPageScanType(interlaced ? BTM_SCAN_TYPE_INTERLACED : BTM_SCAN_TYPE_STANDARD);
+        if (status != BTM_SUCCESS && status != BTM_CMD_STARTED)
+        {
+            ESP_LOGE(DS3_TAG, "%s set page scan type failed: %d\n", __func__, status);
+            return false;
+        }
+        status = BTM_SetConnectability(BTM_CONNECTABLE, window, interval);
+    }
+    if (status != BTM_SUCCESS)
+    {
+        ESP_LOGE(DS3_TAG, "%s set connectability failed: %d\n", __func__, status);
+        return false;
+    }
+
     return true;
 }
+
+/*******************************************************************************
+**
+** Function         ds3_bt_kick
+**
+** Description      Schedule ds3_service on the Bluetooth task, which owns the
+**                  L2CAP channels, the connection state machine and the page
+**                  scan settings. Kicks coalesce until the service runs.
+**                  Safe to call from any task, it never waits.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_bt_kick()
+{
+    if (atomic_exchange(&ds3_bt_service_pending, true)) {
+        return;
+    }
+
+    /* Never wait for room in the Bluetooth task queue. When it is full, the
+       service runs anyway with the next input report or connection tick,
+       and the next kick posts again */
+    if (!btu_task_post(SIG_BTU_GENERAL_ALARM, &ds3_bt_service_tle, 0)) {
+        atomic_store(&ds3_bt_service_pending, false);
+        ESP_LOGD(DS3_TAG, "%s queue full", __func__);
+    }
+}
+
+/*******************************************************************************
+**
+** Function         ds3_bt_is_task
+**
+** Description      Whether the caller runs on the Bluetooth task. The L2CAP
+**                  callbacks can only arrive once ds3Init registered the
+**                  services through ds3_bt_call, so the task is always known
+**                  by then.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3_bt_is_task()
+{
+    return (ds3_bt_task != NULL) && (ds3_bt_task == xTaskGetCurrentTaskHandle());
+}
+
+/*******************************************************************************
+**
+** Function         ds3_bt_call
+**
+** Description      Run a function on the Bluetooth task and wait for its
+**                  result, or run it in place when already on it. For the
+**                  calls from the application that touch L2CAP and BTM,
+**                  between ds3_bt_init and ds3_bt_deinit.
+**
+** Returns          bool, the result of the function, false if not posted
+**
+*******************************************************************************/
+bool ds3_bt_call(bool (*p_call)(void))
+{
+    bool result = false;
+
+    if (ds3_bt_is_task()) {
+        return p_call();
+    }
+    if (ds3_bt_call_lock == NULL) {
+        return false;
+    }
+
+    xSemaphoreTake(ds3_bt_call_lock, portMAX_DELAY);
+    ds3_bt_call_fn = p_call;
+    if (btu_task_post(SIG_BTU_GENERAL_ALARM, &ds3_bt_call_tle, OSI_THREAD_MAX_TIMEOUT)) {
+        xSemaphoreTake(ds3_bt_call_done, portMAX_DELAY);
+        result = ds3_bt_call_result;
+    }
+    else {
+        ESP_LOGW(DS3_TAG, "%s post failed", __func__);
+    }
+    xSemaphoreGive(ds3_bt_call_lock);
+
+    return result;
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3_bt_service_cb
+**
+** Description      Runs the service on the Bluetooth task, called by the BTU
+**                  general alarm handler for the posted user function timer.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_bt_service_cb(TIMER_LIST_ENT *p_tle)
+{
+    (void)p_tle;
+
+    ds3_bt_task = xTaskGetCurrentTaskHandle();
+    /* Clear first, so a kick during the service runs it again */
+    atomic_store(&ds3_bt_service_pending, false);
+    ds3_service();
+}
+
+/*******************************************************************************
+**
+** Function         ds3_bt_call_cb
+**
+** Description      Runs the function of ds3_bt_call on the Bluetooth task and
+**                  wakes up the caller. The semaphores order the accesses to
+**                  the function and its result.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_bt_call_cb(TIMER_LIST_ENT *p_tle)
+{
+    (void)p_tle;
+
+    ds3_bt_task = xTaskGetCurrentTaskHandle();
+    ds3_bt_call_result = ds3_bt_call_fn();
+    xSemaphoreGive(ds3_bt_call_done);
+}
+
+#ifdef DS3_TELEMETRY_RSSI_ENABLE
+/*******************************************************************************
+**
+** Function         ds3_bt_gap_cb
+**
+** Description      This is the GAP event callback function. Every event is
+**                  passed on to the callback of ds3SetGapCallback.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_bt_gap_cb(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *param)
+{
+    esp_bt_gap_cb_t app_cb = atomic_load(&ds3_bt_app_gap_cb);
+
+    switch (event)
+    {
+    case ESP_BT_GAP_READ_RSSI_DELTA_EVT:
+        if (param->read_rssi_delta.stat == ESP_BT_STATUS_SUCCESS) {
+            ds3_telemetry_rssi(param->read_rssi_delta.rssi_delta);
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (app_cb != NULL) {
+        app_cb(event, param);
+    }
+}
+#endif
@@ -0,0 +1,107 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+
+#if (DS3_CMD_QUEUE_SIZE & (DS3_CMD_QUEUE_SIZE - 1)) != 0
+#error "DS3_CMD_QUEUE_SIZE must be a power of two"
+#endif
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+/* Queue cell, the sequence is stored relative to the cell index so that the
+   zero initialized queue is valid before ds3Init */
+typedef struct {
+    atomic_uint seq;
+    ds3_cmd_t cmd;
+} ds3_cmd_cell_t;
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static ds3_cmd_cell_t ds3_cmd_cells[DS3_CMD_QUEUE_SIZE];
+static atomic_uint ds3_cmd_enqueue_pos;
+static unsigned int ds3_cmd_dequeue_pos = 0;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3_cmd_post
+**
+** Description      Post a command into the queue. Lock-free, safe to call
+**                  from any task on either core.
+**
+** Returns          bool, false when the queue is full
+**
+*******************************************************************************/
+bool ds3_cmd_post(const ds3_cmd_t *p_cmd)
+{
+    unsigned int pos = atomic_load_explicit(&ds3_cmd_enqueue_pos, memory_order_relaxed);
+    unsigned int index;
+    ds3_cmd_cell_t *p_cell;
+
+    for (;;) {
+        index = pos & (DS3_CMD_QUEUE_SIZE - 1);
+        p_cell = &ds3_cmd_cells[index];
+        int diff = (int)(atomic_load_explicit(&p_cell->seq, memory_order_acquire) + index - pos);
+
+        if (diff == 0) {
+            /* The cell is free, try to claim it */
+            if (atomic_compare_exchange_weak_explicit(&ds3_cmd_enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            /* The cell still holds a command from the previous lap */
+            return false;
+        }
+        else {
+            pos = atomic_load_explicit(&ds3_cmd_enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    p_cell->cmd = *p_cmd;
+    atomic_store_explicit(&p_cell->seq, pos + 1 - index, memory_order_release);
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_cmd_pop
+**
+** Description      Pop the oldest command from the queue. Must only be called
+**                  from the Bluetooth task.
+**
+** Returns          bool, false when the queue is empty
+**
+*******************************************************************************/
+bool ds3_cmd_pop(ds3_cmd_t *const p_cmd)
+{
+    unsigned int pos = ds3_cmd_dequeue_pos;
+    unsigned int index = pos & (DS3_CMD_QUEUE_SIZE - 1);
+    ds3_cmd_cell_t *p_cell = &ds3_cmd_cells[index];
+    int diff = (int)(atomic_load_explicit(&p_cell->seq, memory_order_acquire) + index - (pos + 1));
+
+    if (diff < 0) {
+        return false;
+    }
+
+    *p_cmd = p_cell->cmd;
+    ds3_cmd_dequeue_pos = pos + 1;
+    atomic_store_explicit(&p_cell->seq, pos + DS3_CMD_QUEUE_SIZE - index, memory_order_release);
+
+    return true;
+}
@@ -0,0 +1,311 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#define DS3_TAG "DS3_CONN"
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+/* Transition action, returning the state to enter */
+typedef ds3_state_t (*ds3_conn_action_t)(ds3_state_t next);
+
+typedef struct {
+    ds3_state_t state;
+    ds3_conn_event_t event;
+    ds3_state_t next;
+    ds3_conn_action_t action;
+} ds3_conn_transition_t;
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static ds3_state_t ds3_conn_action_enable(ds3_state_t next);
+static ds3_state_t ds3_conn_action_retry(ds3_state_t next);
+static ds3_state_t ds3_conn_action_reconnect(ds3_state_t next);
+static void ds3_conn_enter(ds3_state_t state, int64_t now);
+static void ds3_conn_tick_cb(void *arg);
+
+
+/********************************************************************************/
+/*                              C O N S T A N T S                               */
+/********************************************************************************/
+
+/* Transition table, events without a matching row are ignored */
+static const ds3_conn_transition_t ds3_conn_transitions[] = {
+    /* State               Event                          Next                 Action */
+    { ds3_state_idle,      ds3_conn_event_connected,      ds3_state_enabling,  ds3_conn_action_enable    },
+    { ds3_state_l2cap_up,  ds3_conn_event_timeout,        ds3_state_enabling,  ds3_conn_action_enable    },
+    { ds3_state_l2cap_up,  ds3_conn_event_disconnected,   ds3_state_idle,      NULL                      },
+    { ds3_state_enabling,  ds3_conn_event_report,         ds3_state_streaming, NULL                      },
+    { ds3_state_enabling,  ds3_conn_event_timeout,        ds3_state_enabling,  ds3_conn_action_retry     },
+    { ds3_state_enabling,  ds3_conn_event_disconnected,   ds3_state_idle,      NULL                      },
+    { ds3_state_streaming, ds3_conn_event_timeout,        ds3_state_stalled,   ds3_conn_action_enable    },
+    { ds3_state_streaming, ds3_conn_event_disconnected,   ds3_state_idle,      NULL                      },
+    { ds3_state_stalled,   ds3_conn_event_report,         ds3_state_streaming, NULL                      },
+    { ds3_state_stalled,   ds3_conn_event_timeout,        ds3_state_idle,      ds3_conn_action_reconnect },
+    { ds3_state_stalled,   ds3_conn_event_disconnected,   ds3_state_idle,      NULL                      },
+};
+
+/* Time without progress after which a state times out, 0 for never */
+static const uint32_t ds3_conn_timeouts_ms[ds3_state_count] = {
+    [ds3_state_idle]      = 0,
+    [ds3_state_l2cap_up]  = DS3_CONN_TICK_MS,
+    [ds3_state_enabling]  = DS3_CONN_ENABLE_TIMEOUT_MS,
+    [ds3_state_streaming] = DS3_CONN_STALL_TIMEOUT_MS,
+    [ds3_state_stalled]   = DS3_CONN_RECOVER_TIMEOUT_MS,
+};
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static portMUX_TYPE ds3_conn_mux = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t ds3_conn_timer = NULL;
+
+static ds3_conn_stats_t ds3_conn_stats;
+static int64_t ds3_conn_entered_us = 0;  /* Time the current state was entered */
+static int64_t ds3_conn_progress_us = 0; /* Time of the last progress in the current state */
+static uint8_t ds3_conn_retries = 0;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3GetConnectionStats
+**
+** Description      Copies the connection state and its transition statistics.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3GetConnectionStats(ds3_conn_stats_t *const p_stats)
+{
+    portENTER_CRITICAL(&ds3_conn_mux);
+    *p_stats = ds3_conn_stats;
+    portEXIT_CRITICAL(&ds3_conn_mux);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_conn_init
+**
+** Description      Create the connection state machine timer
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3_conn_init()
+{
+    esp_timer_create_args_t args = {
+        .callback = ds3_conn_tick_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "ds3_conn",
+    };
+    esp_err_t ret;
+
+    memset(&ds3_conn_stats, 0, sizeof(ds3_conn_stats));
+    ds3_conn_stats.state = ds3_state_idle;
+    ds3_conn_entered_us = esp_timer_get_time();
+
+    ret = esp_timer_create(&args, &ds3_conn_timer);
+    if (ret != ESP_OK) {
+        ESP_LOGE(DS3_TAG, "%s create timer failed: %s", __func__, esp_err_to_name(ret));
+        return false;
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_conn_deinit
+**
+** Description      Delete the connection state machine timer
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_conn_deinit()
+{
+    if (ds3_conn_timer != NULL) {
+        esp_timer_stop(ds3_conn_timer);
+        esp_timer_delete(ds3_conn_timer);
+        ds3_conn_timer = NULL;
+    }
+    ds3_conn_stats.state = ds3_state_idle;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_conn_event
+**
+** Description      Feed an event into the connection state machine. Only
+**                  called from the Bluetooth task, which serializes the
+**                  transitions with the L2CAP callbacks that feed them.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_conn_event(ds3_conn_event_t event)
+{
+    const ds3_conn_transition_t *p_transition = NULL;
+    int64_t now = esp_timer_get_time();
+    ds3_state_t state;
+
+    portENTER_CRITICAL(&ds3_conn_mux);
+    state = ds3_conn_stats.state;
+
+    /* Fast path: a report while streaming only marks progress */
+    if ((event == ds3_conn_event_report) && (state == ds3_state_streaming)) {
+        ds3_conn_progress_us = now;
+        portEXIT_CRITICAL(&ds3_conn_mux);
+        return;
+    }
+
+    for (uint8_t i = 0; i < sizeof(ds3_conn_transitions) / sizeof(ds3_conn_transitions[0]); i++) {
+        if ((ds3_conn_transitions[i].state == state) && (ds3_conn_transitions[i].event == event)) {
+            p_transition = &ds3_conn_transitions[i];
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&ds3_conn_mux);
+
+    if (p_transition == NULL) {
+        return;
+    }
+
+    /* Actions talk to L2CAP, so they run outside of the critical section,
+       the mux only guards the statistics read by other tasks */
+    if (p_transition->action != NULL) {
+        ds3_conn_enter(p_transition->action(p_transition->next), now);
+    }
+    else {
+        ds3_conn_enter(p_transition->next, now);
+    }
+}
+
+/*******************************************************************************
+**
+** Function         ds3_conn_service
+**
+** Description      Time out the current state, called from the Bluetooth task
+**                  when the tick wakes it.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_conn_service(int64_t now)
+{
+    uint32_t timeout_ms;
+    bool expired;
+
+    portENTER_CRITICAL(&ds3_conn_mux);
+    timeout_ms = ds3_conn_timeouts_ms[ds3_conn_stats.state];
+    expired = (timeout_ms != 0) && ((now - ds3_conn_progress_us) >= ((int64_t)timeout_ms * 1000));
+    portEXIT_CRITICAL(&ds3_conn_mux);
+
+    if (expired) {
+        ds3_conn_event(ds3_conn_event_timeout);
+    }
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+static ds3_state_t ds3_conn_action_enable(ds3_state_t next)
+{
+    ds3_conn_retries = 0;
+
+    /* Stay in l2cap_up and try again on the next tick if sending failed */
+    if (!ds3EnableReport()) {
+        return ds3_state_l2cap_up;
+    }
+
+    return next;
+}
+
+static ds3_state_t ds3_conn_action_retry(ds3_state_t next)
+{
+    if (ds3_conn_retries >= DS3_CONN_ENABLE_RETRIES) {
+        return ds3_conn_action_reconnect(ds3_state_idle);
+    }
+
+    ds3_conn_retries++;
+    portENTER_CRITICAL(&ds3_conn_mux);
+    ds3_conn_stats.enable_retries++;
+    portEXIT_CRITICAL(&ds3_conn_mux);
+    ds3EnableReport();
+
+    return next;
+}
+
+static ds3_state_t ds3_conn_action_reconnect(ds3_state_t next)
+{
+    ESP_LOGW(DS3_TAG, "[%s] no input reports, disconnecting", __func__);
+
+    portENTER_CRITICAL(&ds3_conn_mux);
+    ds3_conn_stats.reconnects++;
+    portEXIT_CRITICAL(&ds3_conn_mux);
+
+    /* Drop the link now rather than on the disconnect confirmations, a
+       link left up without them would ignore the next connection. The
+       confirmations that do arrive find it down already. */
+    ds3_l2cap_disconnect();
+    ds3_link_connection(false);
+
+    return next;
+}
+
+static void ds3_conn_enter(ds3_state_t state, int64_t now)
+{
+    ds3_state_t prev;
+
+    portENTER_CRITICAL(&ds3_conn_mux);
+    prev = ds3_conn_stats.state;
+    if (state != prev) {
+        ds3_conn_stats.state = state;
+        ds3_conn_stats.latency_us[state] = (uint32_t)(now - ds3_conn_entered_us);
+        ds3_conn_stats.transitions++;
+        ds3_conn_entered_us = now;
+    }
+    ds3_conn_progress_us = now;
+    portEXIT_CRITICAL(&ds3_conn_mux);
+
+    if (state == prev) {
+        return;
+    }
+    DS3_TRACE(ds3_trace_event_state, state, prev);
+
+    /* Only tick while connected */
+    if (ds3_conn_timer != NULL) {
+        if (prev == ds3_state_idle) {
+            esp_timer_start_periodic(ds3_conn_timer, DS3_CONN_TICK_MS * 1000);
+        }
+        else if (state == ds3_state_idle) {
+            esp_timer_stop(ds3_conn_timer);
+        }
+    }
+}
+
+static void ds3_conn_tick_cb(void *arg)
+{
+    /* The timeouts are evaluated on the Bluetooth task, so a tick can never
+       interleave with the L2CAP events of the same link */
+    ds3_bt_kick();
+}
@@ -0,0 +1,344 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define DS3_TAG "DS3_EVENTS"
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+typedef struct {
+    ds3_handlers_t handlers;
+    void *p_ctx;
+    int id;
+    uint8_t mask;     /* Interest mask, 0 once unsubscribed */
+    uint8_t priority;
+} ds3_subscriber_t;
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static uint8_t ds3_events_begin();
+static void ds3_events_end();
+static uint8_t ds3_events_mask(uint8_t index);
+static void ds3_events_compact();
+static int ds3_events_next_id();
+static uint8_t ds3_events_report_mask(ds3_event_t *const p_event);
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static portMUX_TYPE ds3_events_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* Subscribers, sorted by descending priority. Entries are only inserted or
+   moved while no dispatch runs, a dispatch reads their masks under the mux */
+static ds3_subscriber_t ds3_subscribers[DS3_SUBSCRIBER_MAX];
+static uint8_t ds3_subscriber_count = 0;
+static int ds3_subscriber_next_id = 1;
+
+/* Unsubscribing while dispatching only clears the mask, compacting is deferred */
+static uint8_t ds3_dispatch_depth = 0;
+static TaskHandle_t ds3_dispatch_task = NULL; /* Task dispatching, the input task */
+static uint32_t ds3_dispatch_done = 0;        /* Dispatches completed */
+static bool ds3_dispatch_compact = false;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3Subscribe
+**
+** Description      Registers a set of handlers with a user context. Handlers
+**                  are called in descending priority for the notifications
+**                  selected by the interest mask (see ds3_interest), from
+**                  the input task. Waits for a dispatch in progress on the
+**                  input task. Must not be called from within a handler.
+**
+** Returns          int, the subscription id, or -1 on failure
+**
+*******************************************************************************/
+int ds3Subscribe(const ds3_handlers_t *p_handlers, void *p_ctx, uint8_t mask, uint8_t priority)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    uint8_t index;
+    int id;
+
+    if (mask == 0) {
+        return -1;
+    }
+
+    /* Inserting moves the entries, so it waits for the dispatch to end */
+    portENTER_CRITICAL(&ds3_events_mux);
+    while (ds3_dispatch_depth != 0) {
+        bool in_handler = (ds3_dispatch_task == task);
+        portEXIT_CRITICAL(&ds3_events_mux);
+        if (in_handler) {
+            return -1;
+        }
+        vTaskDelay(1);
+        portENTER_CRITICAL(&ds3_events_mux);
+    }
+    if (ds3_subscriber_count >= DS3_SUBSCRIBER_MAX) {
+        portEXIT_CRITICAL(&ds3_events_mux);
+        ESP_LOGE(DS3_TAG, "[%s] subscriber table is full", __func__);
+        return -1;
+    }
+
+    /* Insert after the subscribers of the same or higher priority */
+    for (index = ds3_subscriber_count; index > 0; index--) {
+        if (ds3_subscribers[index - 1].priority >= priority) {
+            break;
+        }
+        ds3_subscribers[index] = ds3_subscribers[index - 1];
+    }
+    id = ds3_events_next_id();
+    ds3_subscribers[index] = (ds3_subscriber_t){
+        .handlers = *p_handlers,
+        .p_ctx = p_ctx,
+        .id = id,
+        .mask = mask,
+        .priority = priority,
+    };
+    ds3_subscriber_count++;
+    portEXIT_CRITICAL(&ds3_events_mux);
+
+    return id;
+}
+
+/*******************************************************************************
+**
+** Function         ds3Unsubscribe
+**
+** Description      Removes a subscription. Safe to call from within a
+**                  handler; the subscriber receives no further notification.
+**                  From another task it waits for the dispatch in progress,
+**                  so the handlers are not running once it returns.
+**
+** Returns          bool, whether the subscription was found
+**
+*******************************************************************************/
+bool ds3Unsubscribe(int id)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    bool found = false;
+    bool wait;
+    uint32_t done;
+
+    portENTER_CRITICAL(&ds3_events_mux);
+    for (uint8_t i = 0; i < ds3_subscriber_count; i++) {
+        if ((ds3_subscribers[i].id == id) && (ds3_subscribers[i].mask != 0)) {
+            ds3_subscribers[i].mask = 0;
+            ds3_dispatch_compact = true;
+            found = true;
+            break;
+        }
+    }
+    if (found && (ds3_dispatch_depth == 0)) {
+        ds3_events_compact();
+    }
+    wait = found && (ds3_dispatch_depth != 0) && (ds3_dispatch_task != task);
+    done = ds3_dispatch_done;
+    portEXIT_CRITICAL(&ds3_events_mux);
+
+    while (wait) {
+        vTaskDelay(1);
+        portENTER_CRITICAL(&ds3_events_mux);
+        wait = (ds3_dispatch_depth != 0) && (ds3_dispatch_done == done);
+        portEXIT_CRITICAL(&ds3_events_mux);
+    }
+
+    return found;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_events_connection
+**
+** Description      Dispatch a connection change to the subscribers
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_events_connection(uint8_t is_connected)
+{
+    uint8_t count = ds3_events_begin();
+
+    for (uint8_t i = 0; i < count; i++) {
+        ds3_subscriber_t *p_sub = &ds3_subscribers[i];
+        if ((ds3_events_mask(i) & ds3_interest_connection) && (p_sub->handlers.connection != NULL)) {
+            p_sub->handlers.connection(p_sub->p_ctx, is_connected);
+        }
+    }
+    ds3_events_end();
+}
+
+/*******************************************************************************
+**
+** Function         ds3_events_report
+**
+** Description      Dispatch an input report to the subscribers interested
+**                  in what it changed
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_events_report(ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    uint8_t count = ds3_events_begin();
+    uint8_t mask = (count != 0) ? ds3_events_report_mask(p_event) : 0;
+
+    for (uint8_t i = 0; i < count; i++) {
+        ds3_subscriber_t *p_sub = &ds3_subscribers[i];
+        if ((ds3_events_mask(i) & mask) && (p_sub->handlers.event != NULL)) {
+            p_sub->handlers.event(p_sub->p_ctx, p_data, p_event);
+        }
+    }
+    ds3_events_end();
+}
+
+/*******************************************************************************
+**
+** Function         ds3_events_status
+**
+** Description      Dispatch a status change to the subscribers
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_events_status(ds3_status_t *const p_status)
+{
+    uint8_t count = ds3_events_begin();
+
+    for (uint8_t i = 0; i < count; i++) {
+        ds3_subscriber_t *p_sub = &ds3_subscribers[i];
+        if ((ds3_events_mask(i) & ds3_interest_status) && (p_sub->handlers.status != NULL)) {
+            p_sub->handlers.status(p_sub->p_ctx, p_status);
+        }
+    }
+    ds3_events_end();
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/* Enter a dispatch, the entries stay in place until it ends */
+static uint8_t ds3_events_begin()
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    uint8_t count;
+
+    portENTER_CRITICAL(&ds3_events_mux);
+    if (ds3_dispatch_depth++ == 0) {
+        ds3_dispatch_task = task;
+    }
+    count = ds3_subscriber_count;
+    portEXIT_CRITICAL(&ds3_events_mux);
+
+    return count;
+}
+
+static void ds3_events_end()
+{
+    portENTER_CRITICAL(&ds3_events_mux);
+    if (--ds3_dispatch_depth == 0) {
+        ds3_dispatch_task = NULL;
+        ds3_dispatch_done++;
+        if (ds3_dispatch_compact) {
+            ds3_events_compact();
+        }
+    }
+    portEXIT_CRITICAL(&ds3_events_mux);
+}
+
+/* Interest mask of an entry, cleared by ds3Unsubscribe from any task */
+static uint8_t ds3_events_mask(uint8_t index)
+{
+    uint8_t mask;
+
+    portENTER_CRITICAL(&ds3_events_mux);
+    mask = ds3_subscribers[index].mask;
+    portEXIT_CRITICAL(&ds3_events_mux);
+
+    return mask;
+}
+
+/* Called under the mux, outside of a dispatch */
+static void ds3_events_compact()
+{
+    uint8_t count = 0;
+
+    /* Drop the unsubscribed entries, keeping the priority order */
+    for (uint8_t i = 0; i < ds3_subscriber_count; i++) {
+        if (ds3_subscribers[i].mask != 0) {
+            ds3_subscribers[count++] = ds3_subscribers[i];
+        }
+    }
+    ds3_subscriber_count = count;
+    ds3_dispatch_compact = false;
+}
+
+/* Called under the mux, ids are positive and skip the ones in use when
+   the counter wraps */
+static int ds3_events_next_id()
+{
+    bool used;
+    int id;
+
+    do {
+        id = ds3_subscriber_next_id;
+        ds3_subscriber_next_id = (id == INT_MAX) ? 1 : (id + 1);
+        used = false;
+        for (uint8_t i = 0; i < ds3_subscriber_count; i++) {
+            used |= (ds3_subscribers[i].id == id);
+        }
+    } while (used);
+
+    return id;
+}
+
+static uint8_t ds3_events_report_mask(ds3_event_t *const p_event)
+{
+    uint8_t *p_down = (uint8_t *)&p_event->button_down;
+    uint8_t *p_up = (uint8_t *)&p_event->button_up;
+    uint8_t mask = ds3_interest_report;
+
+    if (p_down[0] | p_down[1] | p_down[2] | p_up[0] | p_up[1] | p_up[2]) {
+        mask |= ds3_interest_button;
+    }
+    if (p_event->stick_changed.lx | p_event->stick_changed.ly | p_event->stick_changed.rx | p_event->stick_changed.ry) {
+        mask |= ds3_interest_stick;
+    }
+#ifndef DS3_PARSE_SKIP_ANALOG
+#ifndef DS3_PARSE_SKIP_ANALOG_CHANGED
+    {
+        uint8_t *p_analog = (uint8_t *)&p_event->analog_changed;
+        uint8_t changed = 0;
+        for (uint8_t i = 0; i < sizeof(ds3_analog_t); i++) {
+            changed |= p_analog[i];
+        }
+        if (changed) {
+            mask |= ds3_interest_analog;
+        }
+    }
+#endif
+#endif
+
+    return mask;
+}
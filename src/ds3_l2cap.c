@@ -107,6 +107,29 @@ void ds3_l2cap_deinit_services()
     ds3_l2cap_hidi_connected = false;
 }
 
+/*******************************************************************************
+**
+** Function         ds3_l2cap_disconnect
+**
+** Description      This function disconnects the connected L2CAP channels.
+**                  They are closed from here on, without waiting for the
+**                  disconnect confirmations, which may never come.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_l2cap_disconnect()
+{
+    if (ds3_l2cap_hidi_connected) {
+        L2CA_DisconnectReq(DS3_L2CAP_ID_HIDI);
+    }
+    if (ds3_l2cap_hidc_connected) {
+        L2CA_DisconnectReq(DS3_L2CAP_ID_HIDC);
+    }
+    ds3_l2cap_hidc_connected = false;
+    ds3_l2cap_hidi_connected = false;
+}
+
 /*******************************************************************************
 **
 ** Function         ds3_l2cap_send_data
@@ -116,15 +139,26 @@ void ds3_l2cap_deinit_services()
 ** Returns          bool
 **
 *******************************************************************************/
-bool ds3_l2cap_send_data(uint8_t p_data[const], uint16_t len)
+bool ds3_l2cap_send_data(const uint8_t p_data[const], uint16_t len)
 {
     uint8_t result;
     BT_HDR *p_buf;
 
     p_buf = (BT_HDR *)osi_malloc(BT_SMALL_BUFFER_SIZE);
 
-    if (!p_buf)
+    if (!p_buf) {
         ESP_LOGE(DS3_TAG, "[%s] allocating buffer for sending the command failed", __func__);
+        return false;
+    }
+
+    /* Control transactions are matched with their responses in order, the
+       packet waits when too many are in flight */
+    if (!ds3_request_reserve(p_data[0])) {
+        osi_free(p_buf);
+        return false;
+    }
+
+    ds3_pm_acquire(ds3_pm_holder_send);
 
     p_buf->len = len;
     p_buf->offset = L2CAP_MIN_OFFSET;
@@ -132,22 +166,16 @@ bool ds3_l2cap_send_data(uint8_t p_data[const], uint16_t len)
     memcpy(&p_buf->data[p_buf->offset], p_data, len);
 
     result = L2CA_DataWrite(DS3_L2CAP_ID_HIDC, p_buf);
+    ds3_pm_release(ds3_pm_holder_send);
+    ds3_telemetry_send(result == L2CAP_DW_SUCCESS, result == L2CAP_DW_CONGESTED);
+    ds3_request_sent(p_data[0], result != L2CAP_DW_FAILED);
 
-    switch (result)
-    {
-    case L2CAP_DW_SUCCESS:
-        ESP_LOGI(DS3_TAG, "[%s] sending command: success", __func__);
-        break;
-    case L2CAP_DW_CONGESTED:
-        ESP_LOGW(DS3_TAG, "[%s] sending command: congested", __func__);
-        break;
-    case L2CAP_DW_FAILED:
+    /* This is the output hot path, only failures are logged as text */
+    DS3_TRACE(ds3_trace_event_send, result, len);
+    if (result == L2CAP_DW_FAILED) {
         ESP_LOGE(DS3_TAG, "[%s] sending command: failed", __func__);
-        break;
-    default:
-        break;
     }
-    
+
     return (result == L2CAP_DW_SUCCESS);
 }
 
@@ -212,7 +240,22 @@ static void ds3_l2cap_deinit_service(const char *name, uint16_t psm)
 *******************************************************************************/
 static void ds3_l2cap_connect_ind_cb(BD_ADDR bd_addr, uint16_t l2cap_cid, uint16_t psm, uint8_t l2cap_id)
 {
-    ESP_LOGI(DS3_TAG, "[%s] bd_addr: %s\n  l2cap_cid: 0x%02x\n  psm: %d\n  id: %d", __func__, bd_addr, l2cap_cid, psm, l2cap_id);
+    ESP_LOGI(DS3_TAG, "[%s] bd_addr: %02x:%02x:%02x:%02x:%02x:%02x, l2cap_cid: 0x%02x, psm: %d, id: %d", __func__,
+             bd_addr[0], bd_addr[1], bd_addr[2], bd_addr[3], bd_addr[4], bd_addr[5], l2cap_cid, psm, l2cap_id);
+    DS3_TRACE(ds3_trace_event_connect_ind, l2cap_id, psm);
+
+    /* Reject unknown controllers before spending any configuration on them */
+    if (!ds3_pairing_is_allowed(bd_addr)) {
+        DS3_TRACE(ds3_trace_event_reject, l2cap_id, psm);
+        L2CA_ConnectRsp(bd_addr, l2cap_id, l2cap_cid, L2CAP_CONN_SECURITY_BLOCK, L2CAP_CONN_OK);
+        return;
+    }
+
+    /* The HID control channel is the first one to be opened */
+    if (psm == BT_PSM_HIDC) {
+        ds3_telemetry_connect(bd_addr);
+        ds3_scan_paged();
+    }
 
     /* Send a Connection pending response to the L2CAP layer. */
     L2CA_ConnectRsp(bd_addr, l2cap_id, l2cap_cid, L2CAP_CONN_PENDING, L2CAP_CONN_PENDING);
@@ -236,7 +279,7 @@ static void ds3_l2cap_connect_ind_cb(BD_ADDR bd_addr, uint16_t l2cap_cid, uint16
 *******************************************************************************/
 static void ds3_l2cap_connect_cfm_cb(uint16_t l2cap_cid, uint16_t result)
 {
-    ESP_LOGI(DS3_TAG, "[%s] l2cap_cid: 0x%02x\n  result: %d", __func__, l2cap_cid, result);
+    ESP_LOGI(DS3_TAG, "[%s] l2cap_cid: 0x%02x, result: %d", __func__, l2cap_cid, result);
 }
 
 /*******************************************************************************
@@ -251,7 +294,7 @@ static void ds3_l2cap_connect_cfm_cb(uint16_t l2cap_cid, uint16_t result)
 *******************************************************************************/
 static void ds3_l2cap_config_ind_cb(uint16_t l2cap_cid, tL2CAP_CFG_INFO *p_cfg)
 {
-    ESP_LOGI(DS3_TAG, "[%s] l2cap_cid: 0x%02x\n  p_cfg->result: %d\n  p_cfg->mtu_present: %d\n  p_cfg->mtu: %d", __func__, l2cap_cid, p_cfg->result, p_cfg->mtu_present, p_cfg->mtu);
+    ESP_LOGI(DS3_TAG, "[%s] l2cap_cid: 0x%02x, result: %d, mtu_present: %d, mtu: %d", __func__, l2cap_cid, p_cfg->result, p_cfg->mtu_present, p_cfg->mtu);
 
     p_cfg->result = L2CAP_CFG_OK;
 
@@ -271,7 +314,8 @@ static void ds3_l2cap_config_ind_cb(uint16_t l2cap_cid, tL2CAP_CFG_INFO *p_cfg)
 *******************************************************************************/
 static void ds3_l2cap_config_cfm_cb(uint16_t l2cap_cid, tL2CAP_CFG_INFO *p_cfg)
 {
-    ESP_LOGI(DS3_TAG, "[%s] l2cap_cid: 0x%02x\n  p_cfg->result: %d", __func__, l2cap_cid, p_cfg->result);
+    ESP_LOGI(DS3_TAG, "[%s] l2cap_cid: 0x%02x, result: %d", __func__, l2cap_cid, p_cfg->result);
+    DS3_TRACE(ds3_trace_event_config_cfm, p_cfg->result, l2cap_cid);
 
     if (p_cfg->result == L2CAP_CFG_OK) {
         if (l2cap_cid == DS3_L2CAP_ID_HIDC) {
@@ -282,7 +326,7 @@ static void ds3_l2cap_config_cfm_cb(uint16_t l2cap_cid, tL2CAP_CFG_INFO *p_cfg)
         }
         /* The DS3 controller is connected after receiving both config confirmation */
         if (ds3_l2cap_hidc_connected && ds3_l2cap_hidi_connected) {
-            ds3HandleConnection(true);
+            ds3_link_connection(true);
         }
     }
 }
@@ -299,7 +343,8 @@ static void ds3_l2cap_config_cfm_cb(uint16_t l2cap_cid, tL2CAP_CFG_INFO *p_cfg)
 *******************************************************************************/
 static void ds3_l2cap_disconnect_ind_cb(uint16_t l2cap_cid, bool ack_needed)
 {
-    ESP_LOGI(DS3_TAG, "[%s] l2cap_cid: 0x%02x\n  ack_needed: %d", __func__, l2cap_cid, ack_needed);
+    ESP_LOGI(DS3_TAG, "[%s] l2cap_cid: 0x%02x, ack_needed: %d", __func__, l2cap_cid, ack_needed);
+    DS3_TRACE(ds3_trace_event_disconnect_ind, ack_needed, l2cap_cid);
 
     if (ack_needed) {
         /* Send a Disconnect response */
@@ -313,7 +358,7 @@ static void ds3_l2cap_disconnect_ind_cb(uint16_t l2cap_cid, bool ack_needed)
     }
     /* The device requests disconnect */
     if (!ds3_l2cap_hidc_connected || !ds3_l2cap_hidi_connected) {
-        ds3HandleConnection(false);
+        ds3_link_connection(false);
     }
 }
 
@@ -329,7 +374,8 @@ static void ds3_l2cap_disconnect_ind_cb(uint16_t l2cap_cid, bool ack_needed)
 *******************************************************************************/
 static void ds3_l2cap_disconnect_cfm_cb(uint16_t l2cap_cid, uint16_t result)
 {
-    ESP_LOGI(DS3_TAG, "[%s] l2cap_cid: 0x%02x\n  result: %d", __func__, l2cap_cid, result);
+    ESP_LOGI(DS3_TAG, "[%s] l2cap_cid: 0x%02x, result: %d", __func__, l2cap_cid, result);
+    DS3_TRACE(ds3_trace_event_disconnect_cfm, result, l2cap_cid);
 
     if (result == L2CAP_CONN_OK) {
         if (l2cap_cid == DS3_L2CAP_ID_HIDC) {
@@ -340,7 +386,7 @@ static void ds3_l2cap_disconnect_cfm_cb(uint16_t l2cap_cid, uint16_t result)
         }
         /* The device acknowledges disconnect */
         if (!ds3_l2cap_hidc_connected || !ds3_l2cap_hidi_connected) {
-            ds3HandleConnection(false);
+            ds3_link_connection(false);
         }
     };
 }
@@ -360,9 +406,21 @@ static void ds3_l2cap_data_ind_cb(uint16_t l2cap_cid, BT_HDR *p_buf)
     /* Check if data is received via the HID interrupt channel */
     if (l2cap_cid == DS3_L2CAP_ID_HIDI) {
         if (p_buf->len > 2) {
-            ds3ReceiveData(&p_buf->data[p_buf->offset]);
+            /* Only the link upkeep runs here: keep the connection state
+               machine streaming, and refresh the output on the report cadence */
+            if (p_buf->data[p_buf->offset] == (hid_cmd_code_data | hid_cmd_code_type_input)) {
+                ds3_conn_event(ds3_conn_event_report);
+            }
+            ds3_service();
+            /* The worker takes ownership of the buffer */
+            ds3_worker_data(p_buf, &p_buf->data[p_buf->offset], p_buf->len);
+            return;
         }
     }
+    /* Responses to the control requests */
+    else if ((l2cap_cid == DS3_L2CAP_ID_HIDC) && (p_buf->len > 0)) {
+        ds3_request_response(&p_buf->data[p_buf->offset], p_buf->len);
+    }
 
     osi_free(p_buf);
 }
@@ -378,5 +436,8 @@ static void ds3_l2cap_data_ind_cb(uint16_t l2cap_cid, BT_HDR *p_buf)
 *******************************************************************************/
 static void ds3_l2cap_congest_cb(uint16_t l2cap_cid, bool congested)
 {
-    ESP_LOGI(DS3_TAG, "[%s] l2cap_cid: 0x%02x\n  congested: %d", __func__, l2cap_cid, congested);
+    ESP_LOGW(DS3_TAG, "[%s] l2cap_cid: 0x%02x, congested: %d", __func__, l2cap_cid, congested);
+    DS3_TRACE(ds3_trace_event_congestion, congested, l2cap_cid);
+
+    ds3_telemetry_congestion(congested);
 }
@@ -0,0 +1,407 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+#ifndef DS3_SKIP_MERGE
+/* Buttons in ds3_button_t, one bit each */
+#define DS3_MERGE_BUTTON_COUNT 17
+/* Button bits of ds3_button_t, the bits after them are padding */
+#define DS3_MERGE_BUTTON_MASK ((1u << DS3_MERGE_BUTTON_COUNT) - 1)
+/* Target of an input that is not merged */
+#define DS3_MERGE_DROP 0xFF
+
+/* Bits of ds3_button_t */
+enum ds3_merge_bit {
+    ds3_merge_bit_select, ds3_merge_bit_l3, ds3_merge_bit_r3, ds3_merge_bit_start,
+    ds3_merge_bit_up, ds3_merge_bit_right, ds3_merge_bit_down, ds3_merge_bit_left,
+    ds3_merge_bit_l2, ds3_merge_bit_r2, ds3_merge_bit_l1, ds3_merge_bit_r1,
+    ds3_merge_bit_triangle, ds3_merge_bit_circle, ds3_merge_bit_cross, ds3_merge_bit_square,
+    ds3_merge_bit_ps,
+};
+
+/* Role of a link in the merged device, as dense lookup tables */
+typedef struct {
+    uint8_t button[DS3_MERGE_BUTTON_COUNT]; /* Target bit of each button bit */
+    uint8_t analog[12];                     /* Target byte of each ds3_analog_t byte */
+    uint8_t stick_left;                     /* Target of the left stick, offset in ds3_stick_t */
+    uint8_t stick_right;                    /* Target of the right stick, offset in ds3_stick_t */
+    bool primary;                           /* Owns the status and the sensors */
+} ds3_merge_role_t;
+
+#define DS3_MERGE_BUTTON_IDENTITY {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16}
+#define DS3_MERGE_ANALOG_IDENTITY {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}
+#define D DS3_MERGE_DROP
+
+/* Roles per merge mode and link */
+static const ds3_merge_role_t ds3_merge_roles[ds3_merge_count][DS3_MERGE_LINKS] = {
+    [ds3_merge_ds3_nav] = {
+        /* Dualshock, complete */
+        {DS3_MERGE_BUTTON_IDENTITY, DS3_MERGE_ANALOG_IDENTITY, 0, 2, true},
+        /* Navigation, a second left hand */
+        {DS3_MERGE_BUTTON_IDENTITY, DS3_MERGE_ANALOG_IDENTITY, 0, D, false},
+    },
+    [ds3_merge_nav_nav] = {
+        /* Left navigation, as is */
+        {DS3_MERGE_BUTTON_IDENTITY, DS3_MERGE_ANALOG_IDENTITY, 0, D, true},
+        /* Right navigation, mirrored onto the right side of a Dualshock */
+        {
+            {
+                [ds3_merge_bit_select] = D, [ds3_merge_bit_l3] = ds3_merge_bit_r3,
+                [ds3_merge_bit_r3] = D, [ds3_merge_bit_start] = D,
+                [ds3_merge_bit_up] = ds3_merge_bit_triangle, [ds3_merge_bit_right] = ds3_merge_bit_circle,
+                [ds3_merge_bit_down] = ds3_merge_bit_cross, [ds3_merge_bit_left] = ds3_merge_bit_square,
+                [ds3_merge_bit_l2] = ds3_merge_bit_r2, [ds3_merge_bit_r2] = D,
+                [ds3_merge_bit_l1] = ds3_merge_bit_r1, [ds3_merge_bit_r1] = D,
+                [ds3_merge_bit_triangle] = D, [ds3_merge_bit_circle] = ds3_merge_bit_select,
+                [ds3_merge_bit_cross] = ds3_merge_bit_start, [ds3_merge_bit_square] = D,
+                [ds3_merge_bit_ps] = ds3_merge_bit_ps,
+            },
+            /* up, right, down, left, l2, r2, l1, r1, triangle, circle, cross, square */
+            {8, 9, 10, 11, 5, D, 7, D, D, D, D, D},
+            2, D, false,
+        },
+    },
+};
+
+#undef D
+#endif
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+#ifndef DS3_SKIP_MERGE
+static portMUX_TYPE ds3_merge_mux = portMUX_INITIALIZER_UNLOCKED;
+static ds3_merge_mode_t ds3_merge_mode = ds3_merge_none;
+static uint8_t ds3_merge_local = 0;
+
+/* Button bits of each link, already mapped to their targets */
+static uint32_t ds3_merge_buttons[DS3_MERGE_LINKS];
+
+/* Arrival stamps of the links fed with ds3MergeUpdate */
+static ds3_stamp_t ds3_merge_stamps[DS3_MERGE_LINKS];
+
+/* Merged device state */
+static ds3_input_data_t ds3_merge_data;
+#endif
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+#ifndef DS3_SKIP_MERGE
+static void ds3_merge_apply(uint8_t link, ds3_input_data_t *const p_data, ds3_event_t *const p_event);
+static void ds3_merge_buttons_update();
+static void ds3_merge_release(uint8_t link);
+#endif
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3SetMergeMode
+**
+** Description      Fuses the input of two controllers into one merged device,
+**                  read with ds3GetMergedInput. The connection of this
+**                  component feeds `local_link`, the other link is fed by
+**                  the application with ds3MergeUpdate. Resets the merged
+**                  state. Does nothing when DS3_SKIP_MERGE is defined.
+**
+** Returns          bool, false for an invalid mode or link
+**
+*******************************************************************************/
+bool ds3SetMergeMode(ds3_merge_mode_t mode, uint8_t local_link)
+{
+#ifndef DS3_SKIP_MERGE
+    if ((mode >= ds3_merge_count) || (local_link >= DS3_MERGE_LINKS)) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&ds3_merge_mux);
+    ds3_merge_mode = mode;
+    ds3_merge_local = local_link;
+    memset(ds3_merge_buttons, 0, sizeof(ds3_merge_buttons));
+    memset(ds3_merge_stamps, 0, sizeof(ds3_merge_stamps));
+    memset(&ds3_merge_data, 0, sizeof(ds3_merge_data));
+    portEXIT_CRITICAL(&ds3_merge_mux);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3MergeUpdate
+**
+** Description      Feeds a report of a link not connected to this component,
+**                  e.g. forwarded from another receiver, into the merged
+**                  device. Only the inputs changed by the event are applied.
+**                  The report is stamped on arrival with the time, sequence
+**                  number and missed count of its own link.
+**
+** Returns          bool, false when merging is off or the link is invalid
+**
+*******************************************************************************/
+bool ds3MergeUpdate(uint8_t link, ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+#ifndef DS3_SKIP_MERGE
+    int64_t now = esp_timer_get_time();
+
+    if ((ds3_merge_mode == ds3_merge_none) || (link >= DS3_MERGE_LINKS) || (link == ds3_merge_local)) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&ds3_merge_mux);
+    ds3_stamp_report(&ds3_merge_stamps[link], p_data, now);
+    ds3_merge_apply(link, p_data, p_event);
+    portEXIT_CRITICAL(&ds3_merge_mux);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3MergeDisconnect
+**
+** Description      Releases the buttons held through a link fed with
+**                  ds3MergeUpdate, when its controller disconnects, and
+**                  restarts its sequence. The link of this component is
+**                  released on its own.
+**
+** Returns          bool, false when merging is off or the link is invalid
+**
+*******************************************************************************/
+bool ds3MergeDisconnect(uint8_t link)
+{
+#ifndef DS3_SKIP_MERGE
+    if ((ds3_merge_mode == ds3_merge_none) || (link >= DS3_MERGE_LINKS) || (link == ds3_merge_local)) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&ds3_merge_mux);
+    ds3_merge_release(link);
+    memset(&ds3_merge_stamps[link], 0, sizeof(ds3_merge_stamps[link]));
+    portEXIT_CRITICAL(&ds3_merge_mux);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3GetMergedInput
+**
+** Description      Copies the state of the merged device. Its arrival time,
+**                  sequence number and missed count are those of the last
+**                  report merged, on the link that sent it.
+**
+** Returns          bool, false when merging is off
+**
+*******************************************************************************/
+bool ds3GetMergedInput(ds3_input_data_t *const p_data)
+{
+#ifndef DS3_SKIP_MERGE
+    if (ds3_merge_mode == ds3_merge_none) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&ds3_merge_mux);
+    *p_data = ds3_merge_data;
+    portEXIT_CRITICAL(&ds3_merge_mux);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifndef DS3_SKIP_MERGE
+/*******************************************************************************
+**
+** Function         ds3_merge_report
+**
+** Description      Feeds an input report of this component's connection into
+**                  the merged device
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_merge_report(ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    if (ds3_merge_mode == ds3_merge_none) {
+        return;
+    }
+
+    portENTER_CRITICAL(&ds3_merge_mux);
+    ds3_merge_apply(ds3_merge_local, p_data, p_event);
+    portEXIT_CRITICAL(&ds3_merge_mux);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_merge_disconnect
+**
+** Description      Releases the buttons held through this component's
+**                  connection
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_merge_disconnect()
+{
+    portENTER_CRITICAL(&ds3_merge_mux);
+    ds3_merge_release(ds3_merge_local);
+    portEXIT_CRITICAL(&ds3_merge_mux);
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3_merge_apply
+**
+** Description      Writes the inputs changed by the event through the role
+**                  tables of the link. Buttons of all links are or'ed, the
+**                  other inputs are taken from the link that changed last.
+**                  The arrival stamp is the one of the report applied.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_merge_apply(uint8_t link, ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    const ds3_merge_role_t *p_role = &ds3_merge_roles[ds3_merge_mode][link];
+    uint32_t down = 0;
+    uint32_t up = 0;
+    uint32_t stick;
+
+    /* Stamped by its own link, see ds3_stamp_report */
+    ds3_merge_data.time = p_data->time;
+    ds3_merge_data.seq = p_data->seq;
+    ds3_merge_data.missed = p_data->missed;
+
+    /* Buttons, remapped only when one of them changed */
+    memcpy(&down, &p_event->button_down, sizeof(ds3_button_t));
+    memcpy(&up, &p_event->button_up, sizeof(ds3_button_t));
+    if (((down | up) & DS3_MERGE_BUTTON_MASK) != 0) {
+        uint32_t bits = 0;
+        uint32_t mapped = 0;
+
+        /* The padding bits would index past the role table */
+        memcpy(&bits, &p_data->button, sizeof(ds3_button_t));
+        bits &= DS3_MERGE_BUTTON_MASK;
+        while (bits != 0) {
+            uint8_t target = p_role->button[__builtin_ctz(bits)];
+            if (target != DS3_MERGE_DROP) {
+                mapped |= 1u << target;
+            }
+            bits &= bits - 1;
+        }
+
+        ds3_merge_buttons[link] = mapped;
+        ds3_merge_buttons_update();
+    }
+
+    /* Sticks */
+    memcpy(&stick, &p_event->stick_changed, sizeof(stick));
+    if (stick != 0) {
+        int8_t *p_stick = (int8_t *)&ds3_merge_data.stick;
+        if (p_role->stick_left != DS3_MERGE_DROP) {
+            p_stick[p_role->stick_left] = p_data->stick.lx;
+            p_stick[p_role->stick_left + 1] = p_data->stick.ly;
+        }
+        if (p_role->stick_right != DS3_MERGE_DROP) {
+            p_stick[p_role->stick_right] = p_data->stick.rx;
+            p_stick[p_role->stick_right + 1] = p_data->stick.ry;
+        }
+    }
+
+#ifndef DS3_PARSE_SKIP_ANALOG
+    /* Analog buttons, without the changed events the bytes are always written */
+    {
+        const uint8_t *p_src = (const uint8_t *)&p_data->analog;
+        uint8_t *p_dst = (uint8_t *)&ds3_merge_data.analog;
+#ifndef DS3_PARSE_SKIP_ANALOG_CHANGED
+        const uint8_t *p_changed = (const uint8_t *)&p_event->analog_changed;
+#endif
+
+        for (uint8_t i = 0; i < sizeof(ds3_analog_t); i++) {
+#ifndef DS3_PARSE_SKIP_ANALOG_CHANGED
+            if (p_changed[i] == 0) {
+                continue;
+            }
+#endif
+            if (p_role->analog[i] != DS3_MERGE_DROP) {
+                p_dst[p_role->analog[i]] = p_src[i];
+            }
+        }
+    }
+#endif
+
+    if (p_role->primary) {
+        ds3_merge_data.status = p_data->status;
+#ifndef DS3_PARSE_SKIP_SENSOR
+        ds3_merge_data.sensor = p_data->sensor;
+#endif
+    }
+}
+
+/*******************************************************************************
+**
+** Function         ds3_merge_buttons_update
+**
+** Description      Or the mapped buttons of all links into the merged state
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_merge_buttons_update()
+{
+    uint32_t merged = 0;
+
+    for (uint8_t i = 0; i < DS3_MERGE_LINKS; i++) {
+        merged |= ds3_merge_buttons[i];
+    }
+    memcpy(&ds3_merge_data.button, &merged, sizeof(ds3_button_t));
+}
+
+/*******************************************************************************
+**
+** Function         ds3_merge_release
+**
+** Description      Release the buttons held through a link, called with the
+**                  mux taken
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_merge_release(uint8_t link)
+{
+    ds3_merge_buttons[link] = 0;
+    ds3_merge_buttons_update();
+}
+#endif
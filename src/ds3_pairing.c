@@ -0,0 +1,437 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+#define DS3_TAG "DS3_PAIRING"
+
+#define DS3_PAIRING_NVS_NAMESPACE "ds3"
+#define DS3_PAIRING_NVS_KEY_ALLOW "allow"
+#define DS3_PAIRING_NVS_KEY_HOST  "host"
+
+/** Number of hash slots, a power of two kept at most half full so lookups stay O(1) */
+#if DS3_PAIRING_MAX <= 4
+#define DS3_PAIRING_SLOTS 8
+#elif DS3_PAIRING_MAX <= 8
+#define DS3_PAIRING_SLOTS 16
+#elif DS3_PAIRING_MAX <= 16
+#define DS3_PAIRING_SLOTS 32
+#elif DS3_PAIRING_MAX <= 32
+#define DS3_PAIRING_SLOTS 64
+#else
+#error "DS3_PAIRING_MAX must not exceed 32"
+#endif
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+/* Allow-list, as persisted in NVS, and its hash slots holding an allow-list
+   index + 1, or 0 when empty */
+typedef struct {
+    uint8_t list[DS3_PAIRING_MAX][6];
+    uint8_t count;
+    uint8_t slots[DS3_PAIRING_SLOTS];
+} ds3_pairing_table_t;
+
+enum ds3_pairing_op {
+    ds3_pairing_op_add,
+    ds3_pairing_op_remove,
+    ds3_pairing_op_clear,
+};
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static bool ds3_pairing_update(uint8_t op, const uint8_t *bd_addr);
+static bool ds3_pairing_load(bool reload);
+static int ds3_pairing_find(const ds3_pairing_table_t *p_table, const uint8_t *bd_addr);
+static uint8_t ds3_pairing_hash(const uint8_t *bd_addr);
+static void ds3_pairing_rebuild(ds3_pairing_table_t *const p_table);
+static bool ds3_pairing_save(const ds3_pairing_table_t *p_table);
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+/* The table in use, looked up by the Bluetooth task. Updates are built and
+   saved aside, then copied in under the mux. */
+static portMUX_TYPE ds3_pairing_mux = portMUX_INITIALIZER_UNLOCKED;
+static ds3_pairing_table_t ds3_pairing;
+static uint32_t ds3_pairing_generation = 0; /* Bumped by every copy */
+static atomic_bool ds3_pairing_loaded;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3PairingAdd
+**
+** Description      Adds a controller address to the allow-list in NVS. While
+**                  the allow-list is empty, every controller is accepted.
+**                  The allow-list in use only changes once saved. Safe to
+**                  call from any task, also before ds3Init, which then loads
+**                  the allow-list and initializes the NVS flash if needed.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3PairingAdd(const uint8_t *bd_addr)
+{
+    return ds3_pairing_update(ds3_pairing_op_add, bd_addr);
+}
+
+/*******************************************************************************
+**
+** Function         ds3PairingRemove
+**
+** Description      Removes a controller address from the allow-list in NVS,
+**                  as ds3PairingAdd.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3PairingRemove(const uint8_t *bd_addr)
+{
+    return ds3_pairing_update(ds3_pairing_op_remove, bd_addr);
+}
+
+/*******************************************************************************
+**
+** Function         ds3PairingClear
+**
+** Description      Clears the allow-list in NVS, accepting every controller,
+**                  as ds3PairingAdd.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3PairingClear()
+{
+    return ds3_pairing_update(ds3_pairing_op_clear, NULL);
+}
+
+/*******************************************************************************
+**
+** Function         ds3PairingSetHostAddress
+**
+** Description      Stores the Bluetooth MAC address this host takes at every
+**                  ds3Init, so that a fleet of hosts can rotate the address
+**                  the controllers are paired with. Takes effect at the next
+**                  ds3Init. Before the first ds3Init, the NVS flash must be
+**                  initialized by the application.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3PairingSetHostAddress(const uint8_t *mac)
+{
+    nvs_handle_t handle;
+    esp_err_t ret;
+
+    ret = nvs_open(DS3_PAIRING_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(DS3_TAG, "[%s] opening nvs failed: %s", __func__, esp_err_to_name(ret));
+        return false;
+    }
+    if (mac != NULL) {
+        ret = nvs_set_blob(handle, DS3_PAIRING_NVS_KEY_HOST, mac, 6);
+    }
+    else {
+        ret = nvs_erase_key(handle, DS3_PAIRING_NVS_KEY_HOST);
+        if (ret == ESP_ERR_NVS_NOT_FOUND) {
+            ret = ESP_OK;
+        }
+    }
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(DS3_TAG, "[%s] writing nvs failed: %s", __func__, esp_err_to_name(ret));
+        return false;
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_pairing_nvs_init
+**
+** Description      Initialize the NVS flash, erasing it when it is full or
+**                  of a newer format. Already initialized is fine.
+**
+** Returns          esp_err_t
+**
+*******************************************************************************/
+esp_err_t ds3_pairing_nvs_init()
+{
+    esp_err_t ret = nvs_flash_init();
+
+    if ((ret == ESP_ERR_NVS_NO_FREE_PAGES) || (ret == ESP_ERR_NVS_NEW_VERSION_FOUND)) {
+        ret = nvs_flash_erase();
+        if (ret == ESP_OK) {
+            ret = nvs_flash_init();
+        }
+    }
+
+    return ret;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_pairing_init
+**
+** Description      Load the allow-list and host address from NVS. Must be
+**                  called after the NVS flash and before the Bluetooth
+**                  controller are initialized.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_pairing_init()
+{
+    nvs_handle_t handle;
+    uint8_t mac[6];
+    size_t len;
+
+    ds3_pairing_load(true);
+
+    /* Host address */
+    if (nvs_open(DS3_PAIRING_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        len = sizeof(mac);
+        if (nvs_get_blob(handle, DS3_PAIRING_NVS_KEY_HOST, mac, &len) == ESP_OK && len == sizeof(mac)) {
+            ds3SetBluetoothMacAddress(mac);
+        }
+        nvs_close(handle);
+    }
+}
+
+/*******************************************************************************
+**
+** Function         ds3_pairing_is_allowed
+**
+** Description      Check whether the controller address may connect
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3_pairing_is_allowed(const uint8_t *bd_addr)
+{
+    bool allowed;
+
+    portENTER_CRITICAL(&ds3_pairing_mux);
+    allowed = (ds3_pairing.count == 0) || (ds3_pairing_find(&ds3_pairing, bd_addr) >= 0);
+    portEXIT_CRITICAL(&ds3_pairing_mux);
+
+    return allowed;
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3_pairing_update
+**
+** Description      Apply a change to a copy of the allow-list, save it, and
+**                  only then put it in use. Started over when another task
+**                  put its own change in use meanwhile, so that the last
+**                  copy saved is always the one in use.
+**
+** Returns          bool
+**
+*******************************************************************************/
+static bool ds3_pairing_update(uint8_t op, const uint8_t *bd_addr)
+{
+    ds3_pairing_table_t candidate;
+    uint32_t generation;
+    bool committed = false;
+    int index;
+
+    /* Never overwrite the allow-list in NVS with one that was not loaded */
+    if (!atomic_load(&ds3_pairing_loaded) && !ds3_pairing_load(false)) {
+        return false;
+    }
+
+    while (!committed) {
+        portENTER_CRITICAL(&ds3_pairing_mux);
+        candidate = ds3_pairing;
+        generation = ds3_pairing_generation;
+        portEXIT_CRITICAL(&ds3_pairing_mux);
+
+        switch (op)
+        {
+        case ds3_pairing_op_add:
+            if (ds3_pairing_find(&candidate, bd_addr) >= 0) {
+                return true;
+            }
+            if (candidate.count >= DS3_PAIRING_MAX) {
+                ESP_LOGE(DS3_TAG, "[%s] allow-list is full", __func__);
+                return false;
+            }
+            memcpy(candidate.list[candidate.count++], bd_addr, 6);
+            break;
+        case ds3_pairing_op_remove:
+            index = ds3_pairing_find(&candidate, bd_addr);
+            if (index < 0) {
+                return true;
+            }
+            /* Move the last entry into the freed place */
+            candidate.count--;
+            memcpy(candidate.list[index], candidate.list[candidate.count], 6);
+            break;
+        default:
+            candidate.count = 0;
+            break;
+        }
+        ds3_pairing_rebuild(&candidate);
+
+        if (!ds3_pairing_save(&candidate)) {
+            return false;
+        }
+
+        portENTER_CRITICAL(&ds3_pairing_mux);
+        if (generation == ds3_pairing_generation) {
+            ds3_pairing = candidate;
+            ds3_pairing_generation++;
+            committed = true;
+        }
+        portEXIT_CRITICAL(&ds3_pairing_mux);
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_pairing_load
+**
+** Description      Load the allow-list from NVS and put it in use. Without
+**                  `reload`, only the first load is put in use, and the NVS
+**                  flash is initialized first, for the changes made before
+**                  ds3Init.
+**
+** Returns          bool
+**
+*******************************************************************************/
+static bool ds3_pairing_load(bool reload)
+{
+    ds3_pairing_table_t table;
+    nvs_handle_t handle;
+    size_t len;
+    esp_err_t ret;
+
+    memset(&table, 0, sizeof(table));
+
+    if (!reload) {
+        ret = ds3_pairing_nvs_init();
+        if (ret != ESP_OK) {
+            ESP_LOGE(DS3_TAG, "[%s] initializing nvs failed: %s", __func__, esp_err_to_name(ret));
+            return false;
+        }
+    }
+
+    if (nvs_open(DS3_PAIRING_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        len = sizeof(table.list);
+        if (nvs_get_blob(handle, DS3_PAIRING_NVS_KEY_ALLOW, table.list, &len) == ESP_OK) {
+            table.count = len / 6;
+        }
+        nvs_close(handle);
+    }
+    ds3_pairing_rebuild(&table);
+
+    portENTER_CRITICAL(&ds3_pairing_mux);
+    if (reload || !atomic_load(&ds3_pairing_loaded)) {
+        ds3_pairing = table;
+        ds3_pairing_generation++;
+        atomic_store(&ds3_pairing_loaded, true);
+    }
+    portEXIT_CRITICAL(&ds3_pairing_mux);
+
+    return true;
+}
+
+static int ds3_pairing_find(const ds3_pairing_table_t *p_table, const uint8_t *bd_addr)
+{
+    uint8_t slot = ds3_pairing_hash(bd_addr);
+
+    /* Linear probing, the table is at most half full */
+    while (p_table->slots[slot] != 0) {
+        int index = p_table->slots[slot] - 1;
+        if (memcmp(p_table->list[index], bd_addr, 6) == 0) {
+            return index;
+        }
+        slot = (slot + 1) & (DS3_PAIRING_SLOTS - 1);
+    }
+
+    return -1;
+}
+
+static uint8_t ds3_pairing_hash(const uint8_t *bd_addr)
+{
+    /* The lower half of the address (NIC specific) is the most random part */
+    return (bd_addr[3] ^ bd_addr[4] ^ (bd_addr[5] * 7)) & (DS3_PAIRING_SLOTS - 1);
+}
+
+static void ds3_pairing_rebuild(ds3_pairing_table_t *const p_table)
+{
+    memset(p_table->slots, 0, sizeof(p_table->slots));
+
+    for (uint8_t i = 0; i < p_table->count; i++) {
+        uint8_t slot = ds3_pairing_hash(p_table->list[i]);
+        while (p_table->slots[slot] != 0) {
+            slot = (slot + 1) & (DS3_PAIRING_SLOTS - 1);
+        }
+        p_table->slots[slot] = i + 1;
+    }
+}
+
+static bool ds3_pairing_save(const ds3_pairing_table_t *p_table)
+{
+    nvs_handle_t handle;
+    esp_err_t ret;
+
+    ret = nvs_open(DS3_PAIRING_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(DS3_TAG, "[%s] opening nvs failed: %s", __func__, esp_err_to_name(ret));
+        return false;
+    }
+    if (p_table->count > 0) {
+        ret = nvs_set_blob(handle, DS3_PAIRING_NVS_KEY_ALLOW, p_table->list, p_table->count * 6);
+    }
+    else {
+        ret = nvs_erase_key(handle, DS3_PAIRING_NVS_KEY_ALLOW);
+        if (ret == ESP_ERR_NVS_NOT_FOUND) {
+            ret = ESP_OK;
+        }
+    }
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(DS3_TAG, "[%s] writing nvs failed: %s", __func__, esp_err_to_name(ret));
+        return false;
+    }
+
+    return true;
+}
@@ -32,10 +32,16 @@ typedef struct __attribute__((__packed__)) {
     ds3_status_t status;
     /* Unknown */
     uint8_t unk4[9];
-    /* Sensor */
+    /* Sensor (the DS3 only has the yaw gyroscope) */
     ds3_sensor_t sensor;
 } ds3_input_report_t;
 
+/* Buttons of the Navigation controller: l3 and the dpad, l2, l1, circle and cross, ps */
+#define DS3_NAV_BUTTON_MASK {0xF2, 0x65, 0x01}
+
+/* Led bitmask of the output report */
+#define DS3_LED_MASK 0x1E
+
 /* Led payload struct */
 #define DS3_LED_PAYLOAD {0xFF, 0x27, 0x10, 0x00, 0x32}
 typedef struct {
@@ -98,24 +104,113 @@ void ds3_parse_input(uint8_t p_packet[const], ds3_input_data_t *const p_data)
 
 /*******************************************************************************
 **
-** Function         ds3_parse_output
+** Function         ds3_parse_nav_input
+**
+** Description      Parse the input packet of a Navigation controller into
+**                  input data. It uses the Dualshock layout, the inputs the
+**                  Navigation controller does not have are cleared.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_parse_nav_input(uint8_t p_packet[const], ds3_input_data_t *const p_data)
+{
+    static const uint8_t nav_mask[] = DS3_NAV_BUTTON_MASK;
+    uint8_t *p_button = (uint8_t *)&p_data->button;
+
+    ds3_parse_input(p_packet, p_data);
+
+    p_button[0] &= nav_mask[0];
+    p_button[1] &= nav_mask[1];
+    p_button[2] &= nav_mask[2];
+    p_data->stick.rx = 0;
+    p_data->stick.ry = 0;
+#ifndef DS3_PARSE_SKIP_ANALOG
+    p_data->analog.r2 = 0;
+    p_data->analog.r1 = 0;
+    p_data->analog.triangle = 0;
+    p_data->analog.square = 0;
+#endif
+#ifndef DS3_PARSE_SKIP_SENSOR
+    memset(&p_data->sensor, 0, sizeof(ds3_sensor_t));
+#endif
+}
+
+/*******************************************************************************
 **
-** Description      Parse the output data into output packet
+** Function         ds3_parse_extended
+**
+** Description      Copy the reserved and unknown input packet bytes, which
+**                  ds3_parse_input skips, into extended data
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_parse_extended(uint8_t p_packet[const], ds3_extended_t *const p_ext)
+{
+    /* Cast input report pointer */
+    ds3_input_report_t *p_report = (ds3_input_report_t *)p_packet;
+
+    /* Parse extended data */
+    p_ext->reserved0 = p_report->unk0[0];
+    p_ext->reserved1 = p_report->unk1[0];
+    memcpy(p_ext->reserved2, p_report->unk2, sizeof(p_ext->reserved2));
+    memcpy(p_ext->reserved3, p_report->unk3, sizeof(p_ext->reserved3));
+    memcpy(p_ext->unknown, p_report->unk4, sizeof(p_ext->unknown));
+}
+
+/*******************************************************************************
+**
+** Function         ds3_parse_output_init
+**
+** Description      Fill the constant part of a persistent output packet
 **
 ** Returns          void
 **
 *******************************************************************************/
-void ds3_parse_output(ds3_output_data_t *const p_data, uint8_t p_packet[const])
+void ds3_parse_output_init(uint8_t p_packet[const])
 {
     /* Cast output report pointer */
     ds3_output_report_t *p_report = (ds3_output_report_t *)p_packet;
 
-    /* Parse output data */
-    p_report->rumble = p_data->rumble;
-    p_report->led = p_data->led;
+    /* The led payload never changes, only fill it once */
     p_report->payload = (ds3_led_payload_t){DS3_LED_PAYLOAD, DS3_LED_PAYLOAD, DS3_LED_PAYLOAD, DS3_LED_PAYLOAD};
 }
 
+/*******************************************************************************
+**
+** Function         ds3_parse_output
+**
+** Description      Patch the output data into a persistent output packet,
+**                  previously filled by ds3_parse_output_init. Only the
+**                  rumble and led bytes are touched.
+**
+** Returns          bool, whether the packet has changed
+**
+*******************************************************************************/
+bool ds3_parse_output(ds3_output_data_t *const p_data, uint8_t p_packet[const])
+{
+    /* Cast output report pointer */
+    ds3_output_report_t *p_report = (ds3_output_report_t *)p_packet;
+    uint8_t *p_led = (uint8_t *)&p_report->led;
+    uint8_t led = *(uint8_t *)&p_data->led & DS3_LED_MASK;
+    bool changed = false;
+
+    /* Patch rumble data */
+    if (memcmp(&p_report->rumble, &p_data->rumble, sizeof(ds3_rumble_t)) != 0) {
+        p_report->rumble = p_data->rumble;
+        changed = true;
+    }
+
+    /* Patch led data */
+    if (*p_led != led) {
+        *p_led = led;
+        changed = true;
+    }
+
+    return changed;
+}
+
 /*******************************************************************************
 **
 ** Function         ds3_parse_event
@@ -170,3 +265,73 @@ void ds3_parse_event(ds3_input_data_t *const p_prev, ds3_input_data_t *const p_d
 #endif
 #endif
 }
+
+/*******************************************************************************
+**
+** Function         ds3_parse_event_is_empty
+**
+** Description      Check whether the event report holds no change at all
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3_parse_event_is_empty(ds3_event_t *const p_event)
+{
+    uint8_t *p_evt = (uint8_t *)p_event;
+    uint8_t changed = 0;
+
+    for (uint8_t i = 0; i < sizeof(ds3_event_t); i++) {
+        changed |= p_evt[i];
+    }
+
+    return (changed == 0);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_parse_status
+**
+** Description      Update the status monitor with the input status. Cable and
+**                  connection changes are taken immediately, battery level
+**                  changes only once stable for DS3_STATUS_BATTERY_HYSTERESIS
+**                  reports.
+**
+** Returns          bool, whether the reported status has changed
+**
+*******************************************************************************/
+bool ds3_parse_status(ds3_status_monitor_t *const p_monitor, ds3_status_t *const p_status)
+{
+    bool changed = false;
+
+    /* The first status after connecting is reported as is */
+    if (!p_monitor->valid) {
+        p_monitor->status = *p_status;
+        p_monitor->battery_pending = p_status->battery;
+        p_monitor->battery_count = 0;
+        p_monitor->valid = true;
+        return true;
+    }
+
+    /* Cable and connection events */
+    if ((p_monitor->status.cable != p_status->cable) || (p_monitor->status.connection != p_status->connection)) {
+        p_monitor->status.cable = p_status->cable;
+        p_monitor->status.connection = p_status->connection;
+        changed = true;
+    }
+
+    /* Battery events */
+    if (p_status->battery == p_monitor->status.battery) {
+        p_monitor->battery_count = 0;
+    }
+    else if (p_status->battery != p_monitor->battery_pending) {
+        p_monitor->battery_pending = p_status->battery;
+        p_monitor->battery_count = 1;
+    }
+    else if (++p_monitor->battery_count >= DS3_STATUS_BATTERY_HYSTERESIS) {
+        p_monitor->status.battery = p_status->battery;
+        p_monitor->battery_count = 0;
+        changed = true;
+    }
+
+    return changed;
+}
@@ -0,0 +1,158 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_pm.h"
+#include "freertos/FreeRTOS.h"
+
+#define DS3_TAG "DS3_PM"
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+#ifdef DS3_PM_ENABLE
+static portMUX_TYPE ds3_pm_mux = portMUX_INITIALIZER_UNLOCKED;
+static esp_pm_lock_handle_t ds3_pm_lock = NULL;
+static uint8_t ds3_pm_holders = 0;
+static int64_t ds3_pm_acquired_us = 0;
+#endif
+static ds3_pm_stats_t ds3_pm_stats;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3GetPmStats
+**
+** Description      Copies the power management lock statistics. All zero
+**                  unless DS3_PM_ENABLE is defined.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3GetPmStats(ds3_pm_stats_t *const p_stats)
+{
+#ifdef DS3_PM_ENABLE
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&ds3_pm_mux);
+    *p_stats = ds3_pm_stats;
+    /* Include the time of the current hold */
+    if (ds3_pm_holders != 0) {
+        p_stats->held_us += now - ds3_pm_acquired_us;
+    }
+    portEXIT_CRITICAL(&ds3_pm_mux);
+#else
+    *p_stats = ds3_pm_stats;
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3_pm_init
+**
+** Description      Create the CPU frequency lock. Without power management
+**                  in the project configuration only the accounting is done.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3_pm_init()
+{
+    memset(&ds3_pm_stats, 0, sizeof(ds3_pm_stats));
+
+#ifdef DS3_PM_ENABLE
+    esp_err_t ret;
+
+    ds3_pm_holders = 0;
+
+    ret = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "ds3", &ds3_pm_lock);
+    if (ret == ESP_ERR_NOT_SUPPORTED) {
+        ds3_pm_lock = NULL;
+    }
+    else if (ret != ESP_OK) {
+        ESP_LOGE(DS3_TAG, "%s create lock failed: %s", __func__, esp_err_to_name(ret));
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_pm_deinit
+**
+** Description      Release and delete the CPU frequency lock
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_pm_deinit()
+{
+#ifdef DS3_PM_ENABLE
+    ds3_pm_release(ds3_pm_holder_report | ds3_pm_holder_send);
+    if (ds3_pm_lock != NULL) {
+        esp_pm_lock_delete(ds3_pm_lock);
+        ds3_pm_lock = NULL;
+    }
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3_pm_acquire
+**
+** Description      Hold the CPU frequency lock on behalf of the holder
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_pm_acquire(uint8_t holder)
+{
+#ifdef DS3_PM_ENABLE
+    portENTER_CRITICAL_SAFE(&ds3_pm_mux);
+    if (ds3_pm_holders == 0) {
+        if (ds3_pm_lock != NULL) {
+            esp_pm_lock_acquire(ds3_pm_lock);
+        }
+        ds3_pm_acquired_us = esp_timer_get_time();
+        ds3_pm_stats.acquisitions++;
+    }
+    ds3_pm_holders |= holder;
+    portEXIT_CRITICAL_SAFE(&ds3_pm_mux);
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3_pm_release
+**
+** Description      Stop holding the CPU frequency lock on behalf of the
+**                  holders, releasing it once nobody holds it
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_pm_release(uint8_t holders)
+{
+#ifdef DS3_PM_ENABLE
+    portENTER_CRITICAL_SAFE(&ds3_pm_mux);
+    if ((ds3_pm_holders != 0) && ((ds3_pm_holders & ~holders) == 0)) {
+        if (ds3_pm_lock != NULL) {
+            esp_pm_lock_release(ds3_pm_lock);
+        }
+        ds3_pm_stats.held_us += esp_timer_get_time() - ds3_pm_acquired_us;
+    }
+    ds3_pm_holders &= ~holders;
+    portEXIT_CRITICAL_SAFE(&ds3_pm_mux);
+#endif
+}
@@ -0,0 +1,332 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define DS3_TAG "DS3_RECORD"
+
+/* File header, see tools/ds3_record.py for the decoder */
+#define DS3_RECORD_MAGIC   "DS3R"
+#define DS3_RECORD_VERSION 1
+
+/* Header flags */
+#define DS3_RECORD_FLAG_ANALOG 0x01
+#define DS3_RECORD_FLAG_SENSOR 0x02
+
+/* Record tag bits, a tag with DS3_RECORD_TAG_IDLE set is followed by a run length */
+#define DS3_RECORD_TAG_BUTTON 0x01
+#define DS3_RECORD_TAG_STICK  0x02
+#define DS3_RECORD_TAG_ANALOG 0x04
+#define DS3_RECORD_TAG_SENSOR 0x08
+#define DS3_RECORD_TAG_STATUS 0x10
+#define DS3_RECORD_TAG_IDLE   0x80
+
+/** Largest encoded record: idle run, tag, buttons, 4 + 12 byte deltas, 4 word deltas, status */
+#define DS3_RECORD_MAX_SIZE ((1 + 5) + 1 + 3 + 2 * 4 + 2 * 12 + 3 * 4 + 3)
+
+#if !defined(DS3_SKIP_RECORD) && (DS3_RECORD_BUFFER_SIZE < (2 * DS3_RECORD_MAX_SIZE))
+#error "DS3_RECORD_BUFFER_SIZE is too small"
+#endif
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+#ifndef DS3_SKIP_RECORD
+static void ds3_record_encode(ds3_input_data_t *const p_data, ds3_event_t *const p_event);
+static void ds3_record_flush_idle();
+static bool ds3_record_write();
+static void ds3_record_varint(uint32_t value);
+static void ds3_record_delta8(int8_t delta);
+#ifndef DS3_PARSE_SKIP_SENSOR
+static void ds3_record_delta16(int16_t delta);
+#endif
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+/* The file and the buffer belong to ds3RecordStart and ds3RecordStop while
+   the recording is inactive, and to the input task while it is busy */
+static atomic_bool ds3_record_active = false;
+static atomic_bool ds3_record_busy = false;
+static FILE *ds3_record_file = NULL;
+static bool ds3_record_first = false;
+static ds3_input_data_t ds3_record_prev;
+static uint32_t ds3_record_idle = 0;
+
+static uint8_t ds3_record_buffer[DS3_RECORD_BUFFER_SIZE];
+static uint16_t ds3_record_len = 0;
+#endif
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3RecordStart
+**
+** Description      Starts recording every input report into the given file,
+**                  opened for binary writing (e.g. on SPIFFS or FAT). The
+**                  file is written from the input task, in blocks of
+**                  DS3_RECORD_BUFFER_SIZE bytes. Start and stop the recording
+**                  from the same task. Fails when DS3_SKIP_RECORD is defined.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3RecordStart(FILE *p_file)
+{
+#ifndef DS3_SKIP_RECORD
+    uint8_t flags = 0;
+
+    if ((p_file == NULL) || (ds3_record_file != NULL)) {
+        return false;
+    }
+
+#ifndef DS3_PARSE_SKIP_ANALOG
+    flags |= DS3_RECORD_FLAG_ANALOG;
+#endif
+#ifndef DS3_PARSE_SKIP_SENSOR
+    flags |= DS3_RECORD_FLAG_SENSOR;
+#endif
+
+    /* Header */
+    memcpy(ds3_record_buffer, DS3_RECORD_MAGIC, 4);
+    ds3_record_buffer[4] = DS3_RECORD_VERSION;
+    ds3_record_buffer[5] = flags;
+    ds3_record_len = 6;
+
+    ds3_record_idle = 0;
+    ds3_record_first = true;
+    ds3_record_file = p_file;
+    atomic_store(&ds3_record_active, true);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3RecordStop
+**
+** Description      Stops recording and writes the pending data, after the
+**                  report the input task may be encoding. The file is left
+**                  open.
+**
+** Returns          bool, whether all data was written
+**
+*******************************************************************************/
+bool ds3RecordStop()
+{
+#ifndef DS3_SKIP_RECORD
+    bool ok;
+
+    if ((ds3_record_file == NULL) || !atomic_exchange(&ds3_record_active, false)) {
+        return false;
+    }
+
+    /* ds3_record_report sets busy before it checks active */
+    while (atomic_load(&ds3_record_busy)) {
+        vTaskDelay(1);
+    }
+
+    ds3_record_flush_idle();
+    ok = ds3_record_write() && (fflush(ds3_record_file) == 0);
+    ds3_record_file = NULL;
+
+    return ok;
+#else
+    return false;
+#endif
+}
+
+#ifndef DS3_SKIP_RECORD
+/*******************************************************************************
+**
+** Function         ds3_record_report
+**
+** Description      Encode an input report while recording, called from the
+**                  input task
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_record_report(ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    atomic_store(&ds3_record_busy, true);
+    if (atomic_load(&ds3_record_active)) {
+        ds3_record_encode(p_data, p_event);
+    }
+    atomic_store(&ds3_record_busy, false);
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3_record_encode
+**
+** Description      Encode an input report. Buttons are stored as the edges
+**                  of the event, the other fields as zig-zag varint deltas,
+**                  and reports without any change as run lengths.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_record_encode(ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    ds3_input_data_t *p_prev = &ds3_record_prev;
+    uint8_t *p_down = (uint8_t *)&p_event->button_down;
+    uint8_t *p_up = (uint8_t *)&p_event->button_up;
+    uint8_t edges[3];
+    uint8_t tag = 0;
+    uint16_t tag_pos;
+
+    /* The first report is a delta against zero, with every field present */
+    if (ds3_record_first) {
+        memset(p_prev, 0, sizeof(ds3_input_data_t));
+        memcpy(edges, &p_data->button, sizeof(edges));
+        tag = DS3_RECORD_TAG_BUTTON | DS3_RECORD_TAG_STICK | DS3_RECORD_TAG_STATUS;
+#ifndef DS3_PARSE_SKIP_ANALOG
+        tag |= DS3_RECORD_TAG_ANALOG;
+#endif
+#ifndef DS3_PARSE_SKIP_SENSOR
+        tag |= DS3_RECORD_TAG_SENSOR;
+#endif
+        ds3_record_first = false;
+    }
+    else {
+        edges[0] = p_down[0] | p_up[0];
+        edges[1] = p_down[1] | p_up[1];
+        edges[2] = p_down[2] | p_up[2];
+        if (edges[0] | edges[1] | edges[2]) {
+            tag |= DS3_RECORD_TAG_BUTTON;
+        }
+        if (memcmp(&p_prev->stick, &p_data->stick, sizeof(ds3_stick_t)) != 0) {
+            tag |= DS3_RECORD_TAG_STICK;
+        }
+#ifndef DS3_PARSE_SKIP_ANALOG
+        if (memcmp(&p_prev->analog, &p_data->analog, sizeof(ds3_analog_t)) != 0) {
+            tag |= DS3_RECORD_TAG_ANALOG;
+        }
+#endif
+#ifndef DS3_PARSE_SKIP_SENSOR
+        if (memcmp(&p_prev->sensor, &p_data->sensor, sizeof(ds3_sensor_t)) != 0) {
+            tag |= DS3_RECORD_TAG_SENSOR;
+        }
+#endif
+        if (memcmp(&p_prev->status, &p_data->status, sizeof(ds3_status_t)) != 0) {
+            tag |= DS3_RECORD_TAG_STATUS;
+        }
+    }
+
+    /* Idle reports are only counted */
+    if (tag == 0) {
+        ds3_record_idle++;
+        return;
+    }
+    ds3_record_flush_idle();
+
+    tag_pos = ds3_record_len++;
+    ds3_record_buffer[tag_pos] = tag;
+
+    if (tag & DS3_RECORD_TAG_BUTTON) {
+        memcpy(&ds3_record_buffer[ds3_record_len], edges, sizeof(edges));
+        ds3_record_len += sizeof(edges);
+    }
+    if (tag & DS3_RECORD_TAG_STICK) {
+        ds3_record_delta8(p_data->stick.lx - p_prev->stick.lx);
+        ds3_record_delta8(p_data->stick.ly - p_prev->stick.ly);
+        ds3_record_delta8(p_data->stick.rx - p_prev->stick.rx);
+        ds3_record_delta8(p_data->stick.ry - p_prev->stick.ry);
+    }
+#ifndef DS3_PARSE_SKIP_ANALOG
+    if (tag & DS3_RECORD_TAG_ANALOG) {
+        uint8_t *p_old = (uint8_t *)&p_prev->analog;
+        uint8_t *p_new = (uint8_t *)&p_data->analog;
+        for (uint8_t i = 0; i < sizeof(ds3_analog_t); i++) {
+            ds3_record_delta8(p_new[i] - p_old[i]);
+        }
+    }
+#endif
+#ifndef DS3_PARSE_SKIP_SENSOR
+    if (tag & DS3_RECORD_TAG_SENSOR) {
+        ds3_record_delta16(p_data->sensor.ax - p_prev->sensor.ax);
+        ds3_record_delta16(p_data->sensor.ay - p_prev->sensor.ay);
+        ds3_record_delta16(p_data->sensor.az - p_prev->sensor.az);
+        ds3_record_delta16(p_data->sensor.gz - p_prev->sensor.gz);
+    }
+#endif
+    if (tag & DS3_RECORD_TAG_STATUS) {
+        memcpy(&ds3_record_buffer[ds3_record_len], &p_data->status, sizeof(ds3_status_t));
+        ds3_record_len += sizeof(ds3_status_t);
+    }
+
+    *p_prev = *p_data;
+
+    /* Keep room for the next record */
+    if (ds3_record_len > (DS3_RECORD_BUFFER_SIZE - DS3_RECORD_MAX_SIZE)) {
+        ds3_record_write();
+    }
+}
+
+static void ds3_record_flush_idle()
+{
+    if (ds3_record_idle == 0) {
+        return;
+    }
+    ds3_record_buffer[ds3_record_len++] = DS3_RECORD_TAG_IDLE;
+    ds3_record_varint(ds3_record_idle);
+    ds3_record_idle = 0;
+}
+
+static bool ds3_record_write()
+{
+    size_t written = fwrite(ds3_record_buffer, 1, ds3_record_len, ds3_record_file);
+    bool ok = (written == ds3_record_len);
+
+    if (!ok) {
+        ESP_LOGE(DS3_TAG, "[%s] writing the recording failed", __func__);
+    }
+    ds3_record_len = 0;
+
+    return ok;
+}
+
+static void ds3_record_varint(uint32_t value)
+{
+    while (value >= 0x80) {
+        ds3_record_buffer[ds3_record_len++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    ds3_record_buffer[ds3_record_len++] = (uint8_t)value;
+}
+
+static void ds3_record_delta8(int8_t delta)
+{
+    ds3_record_varint((uint8_t)((delta << 1) ^ (delta >> 7)));
+}
+
+#ifndef DS3_PARSE_SKIP_SENSOR
+static void ds3_record_delta16(int16_t delta)
+{
+    ds3_record_varint((uint16_t)((delta << 1) ^ (delta >> 15)));
+}
+#endif
+#endif
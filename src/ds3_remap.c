@@ -0,0 +1,288 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "nvs.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+#define DS3_TAG "DS3_REMAP"
+
+#define DS3_REMAP_NVS_NAMESPACE "ds3"
+#define DS3_REMAP_NVS_KEY       "remap"
+
+/* Buttons in ds3_button_t, one bit each, looked up a nibble at a time */
+#define DS3_REMAP_BUTTON_COUNT 17
+#define DS3_REMAP_NIBBLES      ((DS3_REMAP_BUTTON_COUNT + 3) / 4)
+
+/* First button bit with an analog value, the analog values follow the button order */
+#define DS3_REMAP_ANALOG_FIRST 4
+#define DS3_REMAP_ANALOG_COUNT 12
+
+/* Axis table entry flag */
+#define DS3_REMAP_AXIS_INVERT 0x80
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+#ifndef DS3_SKIP_REMAP
+static bool ds3_remap_compile(const ds3_remap_t *p_map, uint8_t count);
+static bool ds3_remap_save(const ds3_remap_t *p_map, uint8_t count);
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static portMUX_TYPE ds3_remap_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool ds3_remap_active = false;
+
+/* Output button bits set by each value of each input nibble */
+static uint32_t ds3_remap_nibble[DS3_REMAP_NIBBLES][16];
+/* Input axis of each output axis, with DS3_REMAP_AXIS_INVERT */
+static uint8_t ds3_remap_axis[4];
+/* Input analog value of each output analog value, or DS3_REMAP_NONE */
+static uint8_t ds3_remap_analog[DS3_REMAP_ANALOG_COUNT];
+#endif
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3SetRemap
+**
+** Description      Remaps the buttons and stick axes of every input report,
+**                  before the events are computed, so all consumers see the
+**                  remapped data. Each entry drives an output from an input,
+**                  the outputs without an entry keep their own input. The
+**                  analog value of a button follows it. A count of 0
+**                  restores the identity. With `persist` the mapping is
+**                  stored in NVS and applied again at ds3Init. Fails when
+**                  DS3_SKIP_REMAP is defined.
+**
+** Returns          bool, false for an invalid mapping or when NVS fails
+**
+*******************************************************************************/
+bool ds3SetRemap(const ds3_remap_t *p_map, uint8_t count, bool persist)
+{
+#ifndef DS3_SKIP_REMAP
+    if ((count > DS3_REMAP_MAX) || ((count > 0) && (p_map == NULL))) {
+        return false;
+    }
+    if (!ds3_remap_compile(p_map, count)) {
+        return false;
+    }
+
+    return !persist || ds3_remap_save(p_map, count);
+#else
+    return false;
+#endif
+}
+
+#ifndef DS3_SKIP_REMAP
+/*******************************************************************************
+**
+** Function         ds3_remap_init
+**
+** Description      Load and compile the mapping stored in NVS. Must be called
+**                  after the NVS flash is initialized.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_remap_init()
+{
+    ds3_remap_t map[DS3_REMAP_MAX];
+    nvs_handle_t handle;
+    size_t len = 0;
+
+    if (nvs_open(DS3_REMAP_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        len = sizeof(map);
+        if (nvs_get_blob(handle, DS3_REMAP_NVS_KEY, map, &len) != ESP_OK) {
+            len = 0;
+        }
+        nvs_close(handle);
+    }
+
+    if (!ds3_remap_compile(map, len / sizeof(ds3_remap_t))) {
+        ESP_LOGW(DS3_TAG, "[%s] ignoring the invalid stored mapping", __func__);
+        ds3_remap_compile(NULL, 0);
+    }
+}
+
+/*******************************************************************************
+**
+** Function         ds3_remap_apply
+**
+** Description      Remap the input data through the compiled tables, a table
+**                  lookup per button nibble and one per axis and analog value
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_remap_apply(ds3_input_data_t *const p_data)
+{
+    uint32_t in = 0;
+    uint32_t out;
+    int8_t stick[4];
+
+    if (!ds3_remap_active) {
+        return;
+    }
+
+    portENTER_CRITICAL(&ds3_remap_mux);
+
+    /* Buttons */
+    memcpy(&in, &p_data->button, sizeof(ds3_button_t));
+    out = ds3_remap_nibble[0][in & 0xF]
+        | ds3_remap_nibble[1][(in >> 4) & 0xF]
+        | ds3_remap_nibble[2][(in >> 8) & 0xF]
+        | ds3_remap_nibble[3][(in >> 12) & 0xF]
+        | ds3_remap_nibble[4][(in >> 16) & 0x1];
+    memcpy(&p_data->button, &out, sizeof(ds3_button_t));
+
+    /* Sticks */
+    memcpy(stick, &p_data->stick, sizeof(stick));
+    for (uint8_t i = 0; i < 4; i++) {
+        int8_t value = stick[ds3_remap_axis[i] & 0x3];
+        if (ds3_remap_axis[i] & DS3_REMAP_AXIS_INVERT) {
+            value = (value == INT8_MIN) ? INT8_MAX : -value;
+        }
+        ((int8_t *)&p_data->stick)[i] = value;
+    }
+
+#ifndef DS3_PARSE_SKIP_ANALOG
+    /* Analog buttons */
+    {
+        uint8_t analog[DS3_REMAP_ANALOG_COUNT];
+        uint8_t *p_analog = (uint8_t *)&p_data->analog;
+
+        memcpy(analog, p_analog, sizeof(analog));
+        for (uint8_t i = 0; i < DS3_REMAP_ANALOG_COUNT; i++) {
+            p_analog[i] = (ds3_remap_analog[i] == DS3_REMAP_NONE) ? 0 : analog[ds3_remap_analog[i]];
+        }
+    }
+#endif
+
+    portEXIT_CRITICAL(&ds3_remap_mux);
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3_remap_compile
+**
+** Description      Compile a mapping into the lookup tables
+**
+** Returns          bool, false for an invalid mapping
+**
+*******************************************************************************/
+static bool ds3_remap_compile(const ds3_remap_t *p_map, uint8_t count)
+{
+    uint8_t button[DS3_REMAP_BUTTON_COUNT];
+    uint8_t axis[4];
+    uint32_t nibble[DS3_REMAP_NIBBLES][16];
+    uint8_t analog[DS3_REMAP_ANALOG_COUNT];
+
+    /* Input of each output, identity by default */
+    for (uint8_t i = 0; i < DS3_REMAP_BUTTON_COUNT; i++) {
+        button[i] = i;
+    }
+    for (uint8_t i = 0; i < 4; i++) {
+        axis[i] = i;
+    }
+
+    for (uint8_t i = 0; i < count; i++) {
+        const ds3_remap_t *p_entry = &p_map[i];
+
+        if (p_entry->kind == ds3_remap_kind_button) {
+            if ((p_entry->to >= DS3_REMAP_BUTTON_COUNT)
+                || ((p_entry->from >= DS3_REMAP_BUTTON_COUNT) && (p_entry->from != DS3_REMAP_NONE))) {
+                return false;
+            }
+            button[p_entry->to] = p_entry->from;
+        }
+        else if (p_entry->kind == ds3_remap_kind_axis) {
+            if ((p_entry->to >= 4) || (p_entry->from >= 4)) {
+                return false;
+            }
+            axis[p_entry->to] = p_entry->from | (p_entry->invert ? DS3_REMAP_AXIS_INVERT : 0);
+        }
+        else {
+            return false;
+        }
+    }
+
+    /* Nibble tables, every output bit set in the values where its input bit is */
+    memset(nibble, 0, sizeof(nibble));
+    for (uint8_t out = 0; out < DS3_REMAP_BUTTON_COUNT; out++) {
+        uint8_t in = button[out];
+        if (in == DS3_REMAP_NONE) {
+            continue;
+        }
+        for (uint8_t value = 0; value < 16; value++) {
+            if (value & (1 << (in & 0x3))) {
+                nibble[in >> 2][value] |= 1u << out;
+            }
+        }
+    }
+
+    /* Analog values follow their buttons, those without one read 0 */
+    for (uint8_t i = 0; i < DS3_REMAP_ANALOG_COUNT; i++) {
+        uint8_t in = button[DS3_REMAP_ANALOG_FIRST + i];
+        bool has_analog = (in >= DS3_REMAP_ANALOG_FIRST) && (in < DS3_REMAP_ANALOG_FIRST + DS3_REMAP_ANALOG_COUNT);
+        analog[i] = has_analog ? (in - DS3_REMAP_ANALOG_FIRST) : DS3_REMAP_NONE;
+    }
+
+    portENTER_CRITICAL(&ds3_remap_mux);
+    memcpy(ds3_remap_nibble, nibble, sizeof(nibble));
+    memcpy(ds3_remap_axis, axis, sizeof(axis));
+    memcpy(ds3_remap_analog, analog, sizeof(analog));
+    ds3_remap_active = (count > 0);
+    portEXIT_CRITICAL(&ds3_remap_mux);
+
+    return true;
+}
+
+static bool ds3_remap_save(const ds3_remap_t *p_map, uint8_t count)
+{
+    nvs_handle_t handle;
+    esp_err_t ret;
+
+    ret = nvs_open(DS3_REMAP_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(DS3_TAG, "[%s] opening nvs failed: %s", __func__, esp_err_to_name(ret));
+        return false;
+    }
+    if (count > 0) {
+        ret = nvs_set_blob(handle, DS3_REMAP_NVS_KEY, p_map, count * sizeof(ds3_remap_t));
+    }
+    else {
+        ret = nvs_erase_key(handle, DS3_REMAP_NVS_KEY);
+        if (ret == ESP_ERR_NVS_NOT_FOUND) {
+            ret = ESP_OK;
+        }
+    }
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(DS3_TAG, "[%s] writing nvs failed: %s", __func__, esp_err_to_name(ret));
+        return false;
+    }
+
+    return true;
+}
+#endif
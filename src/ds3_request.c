@@ -0,0 +1,492 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#define DS3_TAG "DS3_REQUEST"
+
+/* HID control transaction types, in the upper nibble */
+#define DS3_REQUEST_HANDSHAKE 0x00
+#define DS3_REQUEST_TYPE_MASK 0xF0
+
+/* The window is reserved in the FIFO, so a tracked request always fits */
+#if DS3_REQUEST_QUEUE_SIZE <= DS3_REQUEST_WINDOW
+#error "DS3_REQUEST_QUEUE_SIZE must be larger than DS3_REQUEST_WINDOW"
+#endif
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+/* Request posted through ds3Request, waiting for the Bluetooth task to send it */
+typedef struct {
+    bool queued;
+    uint8_t packet[DS3_HID_BUFFER_SIZE];
+    uint16_t len;
+    ds3_request_callback_t cb;
+    void *p_ctx;
+} ds3_request_slot_t;
+
+/* Transaction waiting for its response. Every control request the host sends
+   is one, also the untracked output and enable reports, as the responses
+   carry no identifier and can only be matched in order. Entries are only
+   pushed and popped on the Bluetooth task, in the order of the wire. */
+typedef struct {
+    uint8_t code;                  /* Request code */
+    bool tracked;                  /* Sent through ds3Request */
+    bool sent;                     /* Written to the channel */
+    ds3_request_callback_t cb;
+    void *p_ctx;
+    int64_t deadline_us;
+} ds3_request_pending_t;
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static bool ds3_request_push(uint8_t code, bool tracked, ds3_request_callback_t cb, void *p_ctx, int64_t now);
+static bool ds3_request_pop(ds3_request_pending_t *const p_pending);
+static void ds3_request_complete(ds3_request_pending_t *const p_pending, uint8_t result, const uint8_t *p_data, uint16_t len);
+static bool ds3_request_expects_data(uint8_t code);
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static portMUX_TYPE ds3_request_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* Requests posted and not yet sent, one per window position */
+static ds3_request_slot_t ds3_request_slots[DS3_REQUEST_WINDOW];
+
+/* FIFO of the transactions in flight, in the order they were sent */
+static ds3_request_pending_t ds3_request_fifo[DS3_REQUEST_QUEUE_SIZE];
+static uint8_t ds3_request_head = 0;
+static uint8_t ds3_request_count = 0;
+static uint8_t ds3_request_untracked = 0; /* Entries in the FIFO not sent through ds3Request */
+static uint8_t ds3_request_tracked = 0;   /* Requests queued or in flight, up to the window */
+
+static ds3_request_stats_t ds3_request_stats;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3Request
+**
+** Description      Sends a HID control request (hid_cmd_code_get_report,
+**                  get_protocol, get_idle, set_report, ...) without waiting
+**                  for the response. The request is posted to the Bluetooth
+**                  task, which sends it in order with the output reports.
+**                  Once posted, the callback runs exactly once, on the
+**                  Bluetooth task, with the HANDSHAKE result or the DATA
+**                  payload, or ds3_request_result_timeout / disconnected /
+**                  failed, and must not block. At most DS3_REQUEST_WINDOW
+**                  requests are queued or in flight.
+**
+** Returns          bool, false when the window or the command queue is full
+**
+*******************************************************************************/
+bool ds3Request(uint8_t code, const uint8_t *p_payload, uint16_t len, ds3_request_callback_t cb, void *p_ctx)
+{
+    ds3_request_slot_t *p_slot = NULL;
+    ds3_cmd_t cmd = { .type = ds3_cmd_type_request };
+    uint8_t slot;
+
+    if (len > sizeof(p_slot->packet) - 1) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&ds3_request_mux);
+    if (ds3_request_tracked < DS3_REQUEST_WINDOW) {
+        /* A free slot exists as long as the window is not full */
+        for (slot = 0; slot < DS3_REQUEST_WINDOW; slot++) {
+            if (!ds3_request_slots[slot].queued) {
+                p_slot = &ds3_request_slots[slot];
+                p_slot->queued = true;
+                ds3_request_tracked++;
+                break;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&ds3_request_mux);
+    if (p_slot == NULL) {
+        return false;
+    }
+
+    /* The slot is ours until the Bluetooth task pops the command */
+    p_slot->packet[0] = code;
+    if (len > 0) {
+        memcpy(&p_slot->packet[1], p_payload, len);
+    }
+    p_slot->len = len + 1;
+    p_slot->cb = cb;
+    p_slot->p_ctx = p_ctx;
+
+    cmd.arg[0] = slot;
+    if (!ds3_post_command(&cmd)) {
+        portENTER_CRITICAL(&ds3_request_mux);
+        p_slot->queued = false;
+        ds3_request_tracked--;
+        portEXIT_CRITICAL(&ds3_request_mux);
+        return false;
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3GetReport
+**
+** Description      Reads a report, e.g. a feature report, asynchronously
+**                  with ds3Request
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3GetReport(uint8_t type, uint8_t report_id, ds3_request_callback_t cb, void *p_ctx)
+{
+    return ds3Request(hid_cmd_code_get_report | (type & 0x03), &report_id, 1, cb, p_ctx);
+}
+
+/*******************************************************************************
+**
+** Function         ds3GetRequestStats
+**
+** Description      Copies the control request statistics
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3GetRequestStats(ds3_request_stats_t *const p_stats)
+{
+    portENTER_CRITICAL(&ds3_request_mux);
+    *p_stats = ds3_request_stats;
+    portEXIT_CRITICAL(&ds3_request_mux);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_request_send
+**
+** Description      Send a request posted by ds3Request, on the Bluetooth task.
+**                  It joins the FIFO before it is written, so that nothing
+**                  else can be sent in between.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_request_send(uint8_t slot, bool is_connected)
+{
+    ds3_request_slot_t *p_slot = &ds3_request_slots[slot % DS3_REQUEST_WINDOW];
+    ds3_request_pending_t pending = {
+        .code = p_slot->packet[0],
+        .tracked = true,
+        .cb = p_slot->cb,
+        .p_ctx = p_slot->p_ctx,
+    };
+    uint8_t result = ds3_request_result_disconnected;
+    ds3_request_pending_t *p_last;
+
+    if (is_connected) {
+        portENTER_CRITICAL(&ds3_request_mux);
+        ds3_request_push(pending.code, true, pending.cb, pending.p_ctx, esp_timer_get_time());
+        portEXIT_CRITICAL(&ds3_request_mux);
+
+        /* ds3_request_sent marks it as written, a congested channel still
+           queued it */
+        ds3_l2cap_send_data(p_slot->packet, p_slot->len);
+        result = ds3_request_result_ok;
+    }
+
+    portENTER_CRITICAL(&ds3_request_mux);
+    if (is_connected) {
+        p_last = &ds3_request_fifo[(ds3_request_head + ds3_request_count - 1) % DS3_REQUEST_QUEUE_SIZE];
+        if (!p_last->sent) {
+            /* Not on the wire, no response to wait for */
+            ds3_request_count--;
+            result = ds3_request_result_failed;
+        }
+    }
+    p_slot->queued = false;
+    if (result != ds3_request_result_ok) {
+        ds3_request_tracked--;
+    }
+    portEXIT_CRITICAL(&ds3_request_mux);
+
+    if (result != ds3_request_result_ok) {
+        ds3_request_complete(&pending, result, NULL, 0);
+    }
+}
+
+/*******************************************************************************
+**
+** Function         ds3_request_has_room
+**
+** Description      Whether a packet outside of ds3Request can be sent. The
+**                  FIFO keeps room for the requests, and an entry whose
+**                  response can still arrive is never dropped, so the output
+**                  waits until a response or a timeout frees one.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3_request_has_room()
+{
+    return ds3_request_untracked < (DS3_REQUEST_QUEUE_SIZE - DS3_REQUEST_WINDOW);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_request_reserve
+**
+** Description      Called for every packet about to be written to the HID
+**                  control channel. Packets expecting a response join the
+**                  FIFO, unless ds3_request_send already pushed them.
+**
+** Returns          bool, false when the FIFO has no room for the packet
+**
+*******************************************************************************/
+bool ds3_request_reserve(uint8_t code)
+{
+    uint8_t type = code & DS3_REQUEST_TYPE_MASK;
+    ds3_request_pending_t *p_last;
+    bool ok = true;
+
+    /* DATA and HANDSHAKE from the host get no response */
+    if ((type < hid_cmd_code_get_report) || (type > hid_cmd_code_set_idle)) {
+        return true;
+    }
+
+    portENTER_CRITICAL(&ds3_request_mux);
+    p_last = (ds3_request_count > 0)
+           ? &ds3_request_fifo[(ds3_request_head + ds3_request_count - 1) % DS3_REQUEST_QUEUE_SIZE]
+           : NULL;
+    if ((p_last == NULL) || !p_last->tracked || p_last->sent || (p_last->code != code)) {
+        ok = ds3_request_has_room() && ds3_request_push(code, false, NULL, NULL, esp_timer_get_time());
+    }
+    portEXIT_CRITICAL(&ds3_request_mux);
+
+    return ok;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_request_sent
+**
+** Description      Account for the packet reserved last, once written. An
+**                  output that did not make it to the channel leaves the
+**                  FIFO, ds3_request_send takes care of its own requests.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_request_sent(uint8_t code, bool success)
+{
+    uint8_t type = code & DS3_REQUEST_TYPE_MASK;
+    ds3_request_pending_t *p_last;
+
+    if ((type < hid_cmd_code_get_report) || (type > hid_cmd_code_set_idle)) {
+        return;
+    }
+
+    portENTER_CRITICAL(&ds3_request_mux);
+    p_last = &ds3_request_fifo[(ds3_request_head + ds3_request_count - 1) % DS3_REQUEST_QUEUE_SIZE];
+    if (success) {
+        p_last->sent = true;
+        if (p_last->tracked) {
+            ds3_request_stats.requests++;
+        }
+    }
+    else if (!p_last->tracked) {
+        /* Not on the wire, no response to wait for */
+        ds3_request_count--;
+        ds3_request_untracked--;
+    }
+    portEXIT_CRITICAL(&ds3_request_mux);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_request_response
+**
+** Description      Match a packet received on the HID control channel with
+**                  the oldest transaction in flight. A DATA packet skips the
+**                  transactions that only get a HANDSHAKE, their responses
+**                  were lost.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_request_response(uint8_t p_data[const], uint16_t len)
+{
+    uint8_t type = p_data[0] & DS3_REQUEST_TYPE_MASK;
+    ds3_request_pending_t pending;
+    bool found = false;
+
+    if ((type != DS3_REQUEST_HANDSHAKE) && (type != hid_cmd_code_data)) {
+        return;
+    }
+
+    for (;;) {
+        portENTER_CRITICAL(&ds3_request_mux);
+        if (!ds3_request_pop(&pending)) {
+            portEXIT_CRITICAL(&ds3_request_mux);
+            break;
+        }
+        found = (type == DS3_REQUEST_HANDSHAKE) || ds3_request_expects_data(pending.code);
+        if (!found) {
+            ds3_request_stats.lost++;
+        }
+        else if ((type == DS3_REQUEST_HANDSHAKE) && ((p_data[0] & 0x0F) != ds3_request_result_ok)) {
+            ds3_request_stats.errors++;
+        }
+        portEXIT_CRITICAL(&ds3_request_mux);
+
+        if (found) {
+            if (type == DS3_REQUEST_HANDSHAKE) {
+                ds3_request_complete(&pending, p_data[0] & 0x0F, NULL, 0);
+            }
+            else {
+                ds3_request_complete(&pending, ds3_request_result_ok, &p_data[1], len - 1);
+            }
+            break;
+        }
+        ds3_request_complete(&pending, ds3_request_result_timeout, NULL, 0);
+    }
+
+    if (!found) {
+        ESP_LOGD(DS3_TAG, "[%s] unexpected response 0x%02x", __func__, p_data[0]);
+    }
+}
+
+/*******************************************************************************
+**
+** Function         ds3_request_tick
+**
+** Description      Time out the transactions in flight for longer than
+**                  DS3_REQUEST_TIMEOUT_MS, oldest first
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_request_tick(int64_t now)
+{
+    ds3_request_pending_t pending;
+    bool expired;
+
+    do {
+        portENTER_CRITICAL(&ds3_request_mux);
+        expired = (ds3_request_count > 0) && (now >= ds3_request_fifo[ds3_request_head].deadline_us)
+               && ds3_request_pop(&pending);
+        if (expired) {
+            ds3_request_stats.timeouts++;
+        }
+        portEXIT_CRITICAL(&ds3_request_mux);
+
+        if (expired) {
+            ds3_request_complete(&pending, ds3_request_result_timeout, NULL, 0);
+        }
+    } while (expired);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_request_reset
+**
+** Description      Fail every transaction in flight, on disconnection
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_request_reset()
+{
+    ds3_request_pending_t pending;
+    bool popped;
+
+    do {
+        portENTER_CRITICAL(&ds3_request_mux);
+        popped = ds3_request_pop(&pending);
+        portEXIT_CRITICAL(&ds3_request_mux);
+
+        if (popped) {
+            ds3_request_complete(&pending, ds3_request_result_disconnected, NULL, 0);
+        }
+    } while (popped);
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/* Must be called within the critical section */
+static bool ds3_request_push(uint8_t code, bool tracked, ds3_request_callback_t cb, void *p_ctx, int64_t now)
+{
+    ds3_request_pending_t *p_pending;
+
+    /* Never make room by dropping an entry, its response would be matched
+       with the next transaction */
+    if (ds3_request_count >= DS3_REQUEST_QUEUE_SIZE) {
+        return false;
+    }
+
+    p_pending = &ds3_request_fifo[(ds3_request_head + ds3_request_count) % DS3_REQUEST_QUEUE_SIZE];
+    p_pending->code = code;
+    p_pending->tracked = tracked;
+    p_pending->sent = false;
+    p_pending->cb = cb;
+    p_pending->p_ctx = p_ctx;
+    p_pending->deadline_us = now + (int64_t)DS3_REQUEST_TIMEOUT_MS * 1000;
+    ds3_request_count++;
+    /* Tracked requests were counted by ds3Request */
+    if (!tracked) {
+        ds3_request_untracked++;
+    }
+
+    return true;
+}
+
+/* Must be called within the critical section */
+static bool ds3_request_pop(ds3_request_pending_t *const p_pending)
+{
+    if (ds3_request_count == 0) {
+        return false;
+    }
+
+    *p_pending = ds3_request_fifo[ds3_request_head];
+    ds3_request_head = (ds3_request_head + 1) % DS3_REQUEST_QUEUE_SIZE;
+    ds3_request_count--;
+    if (p_pending->tracked) {
+        ds3_request_tracked--;
+    }
+    else {
+        ds3_request_untracked--;
+    }
+
+    return true;
+}
+
+static void ds3_request_complete(ds3_request_pending_t *const p_pending, uint8_t result, const uint8_t *p_data, uint16_t len)
+{
+    if (p_pending->tracked && (p_pending->cb != NULL)) {
+        p_pending->cb(p_pending->p_ctx, result, p_data, len);
+    }
+}
+
+static bool ds3_request_expects_data(uint8_t code)
+{
+    uint8_t type = code & DS3_REQUEST_TYPE_MASK;
+
+    return (type == hid_cmd_code_get_report) || (type == hid_cmd_code_get_protocol) || (type == hid_cmd_code_get_idle);
+}
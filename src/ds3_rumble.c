@@ -0,0 +1,235 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "esp_timer.h"
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+/* Longest duration written to the controller, 0xFF is avoided as some
+   controllers treat it as endless */
+#define DS3_RUMBLE_DURATION_MAX 0xFE
+
+/* Scheduled motor, only touched on the Bluetooth task */
+typedef struct {
+    uint8_t intensity;
+    int64_t end_us;    /* Time the logical effect ends, 0 when off */
+    int64_t expiry_us; /* Time the duration last written to the controller runs out */
+} ds3_rumble_motor_t;
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static ds3_rumble_motor_t ds3_rumble_right;
+static ds3_rumble_motor_t ds3_rumble_left;
+static bool ds3_rumble_pending = false;
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static void ds3_rumble_motor_set(ds3_rumble_motor_t *const p_motor, uint8_t intensity, uint32_t duration_ms, int64_t now);
+static bool ds3_rumble_motor_due(ds3_rumble_motor_t *const p_motor, int64_t now, uint8_t *p_duration, uint8_t *p_intensity);
+static void ds3_rumble_motor_write(ds3_rumble_motor_t *const p_motor, int64_t now, uint8_t *p_duration, uint8_t *p_intensity);
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3SetRumbleMs
+**
+** Description      Rumbles the motors for the given durations in ms, a
+**                  duration of 0 stops the motor. Longer effects than the
+**                  controller takes in one report are refreshed just before
+**                  they run out, together with any pending led change.
+**                  Safe to call from any task, the schedule travels in the
+**                  command and starts when the Bluetooth task applies it.
+**
+** Returns          bool, false when the command queue is full
+**
+*******************************************************************************/
+bool ds3SetRumbleMs(uint8_t right_intensity, uint32_t right_ms, uint8_t left_intensity, uint32_t left_ms)
+{
+    ds3_cmd_t cmd = {
+        .type = ds3_cmd_type_rumble_ms,
+        .arg = {right_intensity, left_intensity},
+        .ms = {right_ms, left_ms},
+    };
+
+    return ds3_post_command(&cmd);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_rumble_schedule
+**
+** Description      Replaces the schedule with the one of a ds3SetRumbleMs
+**                  command. Called from the Bluetooth task.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_rumble_schedule(uint8_t right_intensity, uint32_t right_ms, uint8_t left_intensity, uint32_t left_ms)
+{
+    int64_t now = esp_timer_get_time();
+
+    ds3_rumble_motor_set(&ds3_rumble_right, right_intensity, right_ms, now);
+    ds3_rumble_motor_set(&ds3_rumble_left, left_intensity, left_ms, now);
+    ds3_rumble_pending = true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_rumble_update
+**
+** Description      Writes the scheduled rumble into the output data when it
+**                  changed or is about to run out on the controller. Called
+**                  from the Bluetooth task by every service run.
+**
+** Returns          bool, whether the output report must be sent
+**
+*******************************************************************************/
+bool ds3_rumble_update(ds3_rumble_t *const p_rumble)
+{
+    bool send = false;
+    int64_t now;
+
+    /* Nothing scheduled, the common case */
+    if (!ds3_rumble_pending && (ds3_rumble_right.end_us == 0) && (ds3_rumble_left.end_us == 0)) {
+        return false;
+    }
+
+    now = esp_timer_get_time();
+
+    if (ds3_rumble_motor_due(&ds3_rumble_right, now, &p_rumble->right_duration, &p_rumble->right_intensity)) {
+        ds3_rumble_pending = true;
+    }
+    if (ds3_rumble_motor_due(&ds3_rumble_left, now, &p_rumble->left_duration, &p_rumble->left_intensity)) {
+        ds3_rumble_pending = true;
+    }
+    if (ds3_rumble_pending) {
+        /* Both motors share the report, refresh them together */
+        ds3_rumble_motor_write(&ds3_rumble_right, now, &p_rumble->right_duration, &p_rumble->right_intensity);
+        ds3_rumble_motor_write(&ds3_rumble_left, now, &p_rumble->left_duration, &p_rumble->left_intensity);
+        ds3_rumble_pending = false;
+        send = true;
+    }
+
+    return send;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_rumble_cancel
+**
+** Description      Drops the schedule without touching the output data, when
+**                  the rumble is set directly or the controller disconnects.
+**                  Called from the Bluetooth task.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_rumble_cancel()
+{
+    memset(&ds3_rumble_right, 0, sizeof(ds3_rumble_motor_t));
+    memset(&ds3_rumble_left, 0, sizeof(ds3_rumble_motor_t));
+    ds3_rumble_pending = false;
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3_rumble_motor_set
+**
+** Description      Schedule a motor for a logical duration
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_rumble_motor_set(ds3_rumble_motor_t *const p_motor, uint8_t intensity, uint32_t duration_ms, int64_t now)
+{
+    if ((duration_ms == 0) || (intensity == 0)) {
+        memset(p_motor, 0, sizeof(ds3_rumble_motor_t));
+        return;
+    }
+
+    p_motor->intensity = intensity;
+    p_motor->end_us = now + (int64_t)duration_ms * 1000;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_rumble_motor_due
+**
+** Description      Check whether the duration on the controller runs out
+**                  before the logical effect ends. Once the effect has run
+**                  out on the controller it is cleared from the output data
+**                  without sending, so a later led change does not restart it.
+**
+** Returns          bool
+**
+*******************************************************************************/
+static bool ds3_rumble_motor_due(ds3_rumble_motor_t *const p_motor, int64_t now, uint8_t *p_duration, uint8_t *p_intensity)
+{
+    if (p_motor->end_us == 0) {
+        return false;
+    }
+    if (p_motor->end_us <= p_motor->expiry_us) {
+        /* The last write covers the rest of the effect */
+        if (now >= p_motor->expiry_us) {
+            memset(p_motor, 0, sizeof(ds3_rumble_motor_t));
+            *p_duration = 0;
+            *p_intensity = 0;
+        }
+        return false;
+    }
+
+    return (now >= p_motor->expiry_us - (int64_t)DS3_RUMBLE_REFRESH_MARGIN_MS * 1000);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_rumble_motor_write
+**
+** Description      Write the remaining duration of a motor, capped to what a
+**                  single report holds, and note when it runs out
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_rumble_motor_write(ds3_rumble_motor_t *const p_motor, int64_t now, uint8_t *p_duration, uint8_t *p_intensity)
+{
+    int64_t remaining_us = p_motor->end_us - now;
+    int64_t units;
+
+    if ((p_motor->end_us == 0) || (remaining_us <= 0)) {
+        memset(p_motor, 0, sizeof(ds3_rumble_motor_t));
+        *p_duration = 0;
+        *p_intensity = 0;
+        return;
+    }
+
+    /* Round up, the effect may end a fraction of a unit late but never early */
+    units = (remaining_us + DS3_RUMBLE_UNIT_MS * 1000 - 1) / (DS3_RUMBLE_UNIT_MS * 1000);
+    if (units > DS3_RUMBLE_DURATION_MAX) {
+        units = DS3_RUMBLE_DURATION_MAX;
+    }
+
+    *p_duration = (uint8_t)units;
+    *p_intensity = p_motor->intensity;
+    p_motor->expiry_us = now + units * DS3_RUMBLE_UNIT_MS * 1000;
+}
@@ -0,0 +1,541 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#define DS3_TAG "DS3_SCAN"
+
+/* Page scan limits, in slots */
+#define DS3_SCAN_WINDOW_MIN   0x0011
+#define DS3_SCAN_INTERVAL_MAX 0x1000
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static portMUX_TYPE ds3_scan_mux = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t ds3_scan_timer = NULL;
+
+static ds3_scan_policy_t ds3_scan_policy = {
+    .window = DS3_SCAN_WINDOW,
+    .fast_interval = DS3_SCAN_FAST_INTERVAL,
+    .slow_interval = DS3_SCAN_SLOW_INTERVAL,
+    .fast_ms = DS3_SCAN_FAST_MS,
+    .step_ms = DS3_SCAN_STEP_MS,
+    .off_when_connected = true,
+};
+/* Scanning state and level are kept in the statistics */
+static ds3_scan_stats_t ds3_scan_stats;
+static uint8_t ds3_scan_last_level = 0;
+
+static bool ds3_scan_enabled = false;   /* Between ds3Init or ds3Resume and ds3Suspend or ds3Deinit */
+static bool ds3_scan_link = false;      /* The controller is connected */
+static bool ds3_scan_counted = false;   /* The connection of the current scan is counted */
+static int64_t ds3_scan_start_us = 0;   /* Start of page scanning */
+static int64_t ds3_scan_level_us = 0;   /* Entry of the current level */
+
+/* Bumped at each change of the scanning state or level, see ds3_scan_update */
+static uint32_t ds3_scan_serial = 0;
+static uint32_t ds3_scan_applied = 0;   /* Serial last applied to the stack */
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static void ds3_scan_levels();
+static void ds3_scan_account(int64_t now);
+static void ds3_scan_begin(int64_t now);
+static void ds3_scan_end(int64_t now);
+static bool ds3_scan_update();
+static bool ds3_scan_changed();
+static bool ds3_scan_apply();
+static void ds3_scan_timer_cb(void *arg);
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3SetScanPolicy
+**
+** Description      Set the page scan policy. Page scanning starts at the fast
+**                  interval, the interval then doubles every step up to the
+**                  slow interval. A scan in progress restarts at the fast
+**                  interval and the level statistics restart.
+**
+** Returns          bool, false if the window and intervals are out of range
+**
+*******************************************************************************/
+bool ds3SetScanPolicy(const ds3_scan_policy_t *p_policy)
+{
+    int64_t now = esp_timer_get_time();
+
+    if (p_policy->window < DS3_SCAN_WINDOW_MIN ||
+        p_policy->fast_interval < p_policy->window ||
+        p_policy->slow_interval < p_policy->fast_interval ||
+        p_policy->slow_interval > DS3_SCAN_INTERVAL_MAX ||
+        p_policy->fast_ms == 0 || p_policy->step_ms == 0) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&ds3_scan_mux);
+    ds3_scan_account(now);
+    ds3_scan_policy = *p_policy;
+    ds3_scan_levels();
+    if (ds3_scan_stats.scanning && ds3_scan_link && ds3_scan_policy.off_when_connected) {
+        ds3_scan_end(now);
+    }
+    else if (ds3_scan_stats.scanning) {
+        /* Keep the start of the scan, for the connect latency */
+        ds3_scan_stats.level = 0;
+        ds3_scan_level_us = now;
+        ds3_scan_serial++;
+    }
+    else if (ds3_scan_enabled && ds3_scan_link && !ds3_scan_policy.off_when_connected) {
+        ds3_scan_begin(now);
+    }
+    portEXIT_CRITICAL(&ds3_scan_mux);
+
+    return ds3_scan_update();
+}
+
+/*******************************************************************************
+**
+** Function         ds3GetScanPolicy
+**
+** Description      Copies the page scan policy.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3GetScanPolicy(ds3_scan_policy_t *const p_policy)
+{
+    portENTER_CRITICAL(&ds3_scan_mux);
+    *p_policy = ds3_scan_policy;
+    portEXIT_CRITICAL(&ds3_scan_mux);
+}
+
+/*******************************************************************************
+**
+** Function         ds3GetScanStats
+**
+** Description      Copies the page scan statistics, the time spent and the
+**                  connections accepted at each level of the backoff.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3GetScanStats(ds3_scan_stats_t *const p_stats)
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&ds3_scan_mux);
+    /* Include the time at the current level */
+    ds3_scan_account(now);
+    *p_stats = ds3_scan_stats;
+    portEXIT_CRITICAL(&ds3_scan_mux);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_scan_init
+**
+** Description      Create the backoff timer. Page scanning is off until
+**                  ds3_scan_enable.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3_scan_init()
+{
+    esp_err_t ret;
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = ds3_scan_timer_cb,
+        .name = "ds3_scan",
+    };
+
+    memset(&ds3_scan_stats, 0, sizeof(ds3_scan_stats));
+    ds3_scan_levels();
+    ds3_scan_enabled = false;
+    ds3_scan_link = false;
+    ds3_scan_applied = ds3_scan_serial;
+
+    ret = esp_timer_create(&timer_args, &ds3_scan_timer);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(DS3_TAG, "%s create timer failed: %s\n", __func__, esp_err_to_name(ret));
+        return false;
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_scan_deinit
+**
+** Description      Delete the backoff timer, ds3Deinit or ds3Suspend already
+**                  stopped page scanning from the Bluetooth task.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_scan_deinit()
+{
+    if (ds3_scan_timer != NULL) {
+        esp_timer_stop(ds3_scan_timer);
+        esp_timer_delete(ds3_scan_timer);
+        ds3_scan_timer = NULL;
+    }
+}
+
+/*******************************************************************************
+**
+** Function         ds3_scan_enable
+**
+** Description      Start page scanning at the fast interval, the services
+**                  being registered, or stop it for good until enabled again.
+**                  Called from the Bluetooth task, which applies it directly.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3_scan_enable(bool enable)
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&ds3_scan_mux);
+    ds3_scan_enabled = enable;
+    ds3_scan_link = false;
+    if (enable) {
+        ds3_scan_begin(now);
+    }
+    else {
+        ds3_scan_end(now);
+    }
+    portEXIT_CRITICAL(&ds3_scan_mux);
+
+    return ds3_scan_update();
+}
+
+/*******************************************************************************
+**
+** Function         ds3_scan_service
+**
+** Description      Apply a change made by another task, the policy or a
+**                  backoff step. Called from the Bluetooth task by every
+**                  service run.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_scan_service()
+{
+    if (ds3_scan_changed()) {
+        ds3_scan_apply();
+    }
+}
+
+/*******************************************************************************
+**
+** Function         ds3_scan_paged
+**
+** Description      Count an incoming connection at the current level, once
+**                  per scan. Called on the HID control channel connection.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_scan_paged()
+{
+    int64_t now = esp_timer_get_time();
+    ds3_scan_level_stats_t *p_level;
+
+    portENTER_CRITICAL(&ds3_scan_mux);
+    if (ds3_scan_stats.scanning && !ds3_scan_counted) {
+        p_level = &ds3_scan_stats.levels[ds3_scan_stats.level];
+        ds3_scan_stats.last_connect_ms = (uint32_t)((now - ds3_scan_start_us) / 1000);
+        p_level->connects++;
+        p_level->connect_ms += ds3_scan_stats.last_connect_ms;
+        ds3_scan_counted = true;
+    }
+    portEXIT_CRITICAL(&ds3_scan_mux);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_scan_connection
+**
+** Description      Follow the connection of the controller, page scanning
+**                  stops while connected if the policy says so and restarts
+**                  at the fast interval on disconnection.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_scan_connection(bool is_connected)
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&ds3_scan_mux);
+    if (!ds3_scan_enabled) {
+        /* Suspended, nothing restarts the scan before ds3Resume */
+    }
+    else if (is_connected) {
+        ds3_scan_link = true;
+        if (ds3_scan_policy.off_when_connected) {
+            ds3_scan_end(now);
+        }
+    }
+    else if (ds3_scan_link) {
+        /* Both channels report their disconnection, the first one restarts */
+        ds3_scan_link = false;
+        ds3_scan_begin(now);
+    }
+    portEXIT_CRITICAL(&ds3_scan_mux);
+
+    ds3_scan_update();
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3_scan_levels
+**
+** Description      Compute the interval of each level from the policy, the
+**                  last level is at the slow interval. Clears the level
+**                  statistics. Called with the lock held.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_scan_levels()
+{
+    uint32_t interval = ds3_scan_policy.fast_interval;
+    uint8_t level;
+
+    ds3_scan_last_level = DS3_SCAN_LEVELS - 1;
+    for (level = 0; level < DS3_SCAN_LEVELS; level++) {
+        if (interval >= ds3_scan_policy.slow_interval || level == DS3_SCAN_LEVELS - 1) {
+            interval = ds3_scan_policy.slow_interval;
+            if (ds3_scan_last_level > level) {
+                ds3_scan_last_level = level;
+            }
+        }
+        memset(&ds3_scan_stats.levels[level], 0, sizeof(ds3_scan_stats.levels[level]));
+        ds3_scan_stats.levels[level].interval = (uint16_t)interval;
+        interval *= 2;
+    }
+    ds3_scan_stats.window = ds3_scan_policy.window;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_scan_account
+**
+** Description      Add the time since the entry of the current level to the
+**                  statistics. Called with the lock held.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_scan_account(int64_t now)
+{
+    uint64_t elapsed;
+    uint32_t window;
+    uint32_t interval;
+
+    if (!ds3_scan_stats.scanning) {
+        return;
+    }
+    elapsed = (uint64_t)(now - ds3_scan_level_us);
+    interval = ds3_scan_stats.levels[ds3_scan_stats.level].interval;
+    window = ds3_scan_stats.window;
+    /* The fast level scans interlaced, a window on each page train */
+    if (ds3_scan_stats.level == 0) {
+        window = (2 * window < interval) ? 2 * window : interval;
+    }
+    ds3_scan_stats.scan_us += elapsed;
+    ds3_scan_stats.levels[ds3_scan_stats.level].scan_us += elapsed;
+    ds3_scan_stats.radio_us += elapsed * window / interval;
+    ds3_scan_level_us = now;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_scan_begin
+**
+** Description      Start a scan at the fast interval. Called with the lock
+**                  held, ds3_scan_update applies it.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_scan_begin(int64_t now)
+{
+    ds3_scan_account(now);
+    ds3_scan_stats.scanning = true;
+    ds3_scan_stats.level = 0;
+    ds3_scan_start_us = now;
+    ds3_scan_level_us = now;
+    ds3_scan_counted = false;
+    ds3_scan_serial++;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_scan_end
+**
+** Description      Stop the scan. Called with the lock held, ds3_scan_update
+**                  applies it.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_scan_end(int64_t now)
+{
+    if (ds3_scan_stats.scanning) {
+        ds3_scan_account(now);
+        ds3_scan_stats.scanning = false;
+        ds3_scan_serial++;
+    }
+}
+
+/*******************************************************************************
+**
+** Function         ds3_scan_update
+**
+** Description      Apply the scanning state and level to the stack, right
+**                  away on the Bluetooth task. BTM is not thread safe, other
+**                  tasks kick the Bluetooth task, where ds3_scan_service
+**                  applies the change.
+**
+** Returns          bool, false if the stack refused the settings
+**
+*******************************************************************************/
+static bool ds3_scan_update()
+{
+    if (ds3_bt_is_task()) {
+        return ds3_scan_apply();
+    }
+
+    if (ds3_scan_changed()) {
+        ds3_bt_kick();
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_scan_changed
+**
+** Description      Whether the scanning state or level changed since it was
+**                  last applied to the stack.
+**
+** Returns          bool
+**
+*******************************************************************************/
+static bool ds3_scan_changed()
+{
+    bool changed;
+
+    portENTER_CRITICAL(&ds3_scan_mux);
+    changed = ds3_scan_serial != ds3_scan_applied;
+    portEXIT_CRITICAL(&ds3_scan_mux);
+
+    return changed;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_scan_apply
+**
+** Description      Apply the scanning state and level to the stack and arm
+**                  the backoff timer. Runs on the Bluetooth task, the stack is
+**                  not called with the lock held. A change made meanwhile by
+**                  another task kicks the service again, so that the last
+**                  change always wins.
+**
+** Returns          bool
+**
+*******************************************************************************/
+static bool ds3_scan_apply()
+{
+    bool scanning;
+    bool ok;
+    uint8_t level;
+    uint16_t window;
+    uint16_t interval;
+    uint32_t serial;
+    uint32_t delay_ms;
+
+    portENTER_CRITICAL(&ds3_scan_mux);
+    scanning = ds3_scan_stats.scanning;
+    level = ds3_scan_stats.level;
+    window = ds3_scan_stats.window;
+    interval = ds3_scan_stats.levels[level].interval;
+    delay_ms = level == 0 ? ds3_scan_policy.fast_ms : ds3_scan_policy.step_ms;
+    serial = ds3_scan_serial;
+    portEXIT_CRITICAL(&ds3_scan_mux);
+
+    /* The fast interval also scans both page trains */
+    ok = ds3_bt_set_page_scan(scanning ? window : 0, interval, scanning && level == 0);
+
+    if (ds3_scan_timer != NULL) {
+        esp_timer_stop(ds3_scan_timer);
+        if (scanning && level < ds3_scan_last_level) {
+            esp_timer_start_once(ds3_scan_timer, (uint64_t)delay_ms * 1000);
+        }
+    }
+
+    /* Applied even on failure, a retry would fail the same way */
+    portENTER_CRITICAL(&ds3_scan_mux);
+    ds3_scan_applied = serial;
+    portEXIT_CRITICAL(&ds3_scan_mux);
+
+    ESP_LOGD(DS3_TAG, "[%s] scanning: %d, level: %d, interval: 0x%04x", __func__, scanning, level, interval);
+
+    return ok;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_scan_timer_cb
+**
+** Description      Back off to the next level, doubling the interval.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ds3_scan_timer_cb(void *arg)
+{
+    int64_t now = esp_timer_get_time();
+    bool changed = false;
+
+    portENTER_CRITICAL(&ds3_scan_mux);
+    if (ds3_scan_stats.scanning && ds3_scan_stats.level < ds3_scan_last_level) {
+        ds3_scan_account(now);
+        ds3_scan_stats.level++;
+        ds3_scan_serial++;
+        changed = true;
+    }
+    portEXIT_CRITICAL(&ds3_scan_mux);
+
+    if (changed) {
+        ds3_scan_update();
+    }
+}
@@ -0,0 +1,225 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_gap_bt_api.h"
+#include "freertos/FreeRTOS.h"
+
+#define DS3_TAG "DS3_TELEMETRY"
+
+/** Window over which the report rate is computed */
+#define DS3_TELEMETRY_RATE_WINDOW_US 1000000
+/** Width of a jitter histogram bucket */
+#define DS3_TELEMETRY_JITTER_BUCKET_US 1000
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static portMUX_TYPE ds3_telemetry_mux = portMUX_INITIALIZER_UNLOCKED;
+static ds3_telemetry_t ds3_telemetry;
+
+static uint8_t ds3_telemetry_bd_addr[6];
+static int64_t ds3_telemetry_last_report_us = 0;
+static int64_t ds3_telemetry_window_start_us = 0;
+static uint32_t ds3_telemetry_window_count = 0;
+static int64_t ds3_telemetry_last_rssi_us = 0;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3GetTelemetry
+**
+** Description      Copies a snapshot of the link telemetry of the connected
+**                  DS3 controller. Cheap enough to be called every frame.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3GetTelemetry(ds3_telemetry_t *const p_telemetry)
+{
+    portENTER_CRITICAL(&ds3_telemetry_mux);
+    *p_telemetry = ds3_telemetry;
+    portEXIT_CRITICAL(&ds3_telemetry_mux);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_telemetry_connect
+**
+** Description      Reset the telemetry for a new connection from bd_addr
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_telemetry_connect(const uint8_t bd_addr[6])
+{
+    portENTER_CRITICAL(&ds3_telemetry_mux);
+    memset(&ds3_telemetry, 0, sizeof(ds3_telemetry));
+    memcpy(ds3_telemetry_bd_addr, bd_addr, sizeof(ds3_telemetry_bd_addr));
+    ds3_telemetry_last_report_us = 0;
+    ds3_telemetry_window_start_us = 0;
+    ds3_telemetry_window_count = 0;
+    ds3_telemetry_last_rssi_us = 0;
+    portEXIT_CRITICAL(&ds3_telemetry_mux);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_telemetry_report
+**
+** Description      Account for an input report received on the HID
+**                  interrupt channel, at its arrival time. Called from the
+**                  input task.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_telemetry_report(int64_t now)
+{
+    int64_t interval;
+    bool first;
+    uint16_t rate;
+    uint32_t bucket;
+#ifdef DS3_TELEMETRY_RSSI_ENABLE
+    uint8_t bd_addr[6];
+    bool sample = false;
+#endif
+
+    /* The connection resets the state from the Bluetooth task */
+    portENTER_CRITICAL(&ds3_telemetry_mux);
+    interval = now - ds3_telemetry_last_report_us;
+    first = (ds3_telemetry_last_report_us == 0);
+    ds3_telemetry_last_report_us = now;
+
+    /* Report rate */
+    if (first) {
+        ds3_telemetry_window_start_us = now;
+    }
+    ds3_telemetry_window_count++;
+    if (now - ds3_telemetry_window_start_us >= DS3_TELEMETRY_RATE_WINDOW_US) {
+        rate = (uint16_t)((ds3_telemetry_window_count * 1000000LL) / (now - ds3_telemetry_window_start_us));
+        if (rate != 0) {
+            ds3_telemetry.report_rate = rate;
+        }
+        ds3_telemetry_window_start_us = now;
+        ds3_telemetry_window_count = 0;
+    }
+
+    /* Inter-arrival jitter bucket */
+    if (interval < DS3_TELEMETRY_REPORT_PERIOD_US) {
+        bucket = (DS3_TELEMETRY_REPORT_PERIOD_US - interval) / DS3_TELEMETRY_JITTER_BUCKET_US;
+    }
+    else {
+        bucket = (interval - DS3_TELEMETRY_REPORT_PERIOD_US) / DS3_TELEMETRY_JITTER_BUCKET_US;
+    }
+    if (bucket >= DS3_TELEMETRY_JITTER_BUCKETS) {
+        bucket = DS3_TELEMETRY_JITTER_BUCKETS - 1;
+    }
+
+    ds3_telemetry.report_count++;
+    if (!first) {
+        ds3_telemetry.jitter[bucket]++;
+        if (interval > DS3_TELEMETRY_GAP_US) {
+            ds3_telemetry.gap_count++;
+        }
+    }
+
+#ifdef DS3_TELEMETRY_RSSI_ENABLE
+    if (now - ds3_telemetry_last_rssi_us >= DS3_TELEMETRY_RSSI_PERIOD_US) {
+        ds3_telemetry_last_rssi_us = now;
+        memcpy(bd_addr, ds3_telemetry_bd_addr, sizeof(bd_addr));
+        sample = true;
+    }
+#endif
+    portEXIT_CRITICAL(&ds3_telemetry_mux);
+
+#ifdef DS3_TELEMETRY_RSSI_ENABLE
+    /* Sample the RSSI, the result arrives in ds3_telemetry_rssi */
+    if (sample) {
+        esp_bt_gap_read_rssi_delta(bd_addr);
+    }
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3_telemetry_missed
+**
+** Description      Account for input reports estimated lost
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_telemetry_missed(uint16_t count)
+{
+    portENTER_CRITICAL(&ds3_telemetry_mux);
+    ds3_telemetry.missed_count += count;
+    portEXIT_CRITICAL(&ds3_telemetry_mux);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_telemetry_send
+**
+** Description      Account for the result of an output report write
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_telemetry_send(bool success, bool congested)
+{
+    portENTER_CRITICAL(&ds3_telemetry_mux);
+    ds3_telemetry.send_count++;
+    if (congested) {
+        ds3_telemetry.send_congested_count++;
+    }
+    else if (!success) {
+        ds3_telemetry.send_fail_count++;
+    }
+    portEXIT_CRITICAL(&ds3_telemetry_mux);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_telemetry_congestion
+**
+** Description      Account for a change of the L2CAP congestion status
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_telemetry_congestion(bool congested)
+{
+    portENTER_CRITICAL(&ds3_telemetry_mux);
+    if (congested && !ds3_telemetry.congested) {
+        ds3_telemetry.congestion_count++;
+    }
+    ds3_telemetry.congested = congested;
+    portEXIT_CRITICAL(&ds3_telemetry_mux);
+}
+
+/*******************************************************************************
+**
+** Function         ds3_telemetry_rssi
+**
+** Description      Store a sampled RSSI delta
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_telemetry_rssi(int8_t rssi_delta)
+{
+    portENTER_CRITICAL(&ds3_telemetry_mux);
+    ds3_telemetry.rssi_delta = rssi_delta;
+    ds3_telemetry.rssi_valid = true;
+    portEXIT_CRITICAL(&ds3_telemetry_mux);
+}
@@ -0,0 +1,97 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+/** Prefix of the dumped lines, matched by tools/ds3_trace.py */
+#define DS3_TRACE_PREFIX "DS3TRACE:"
+
+#if (DS3_TRACE_SIZE & (DS3_TRACE_SIZE - 1)) != 0
+#error "DS3_TRACE_SIZE must be a power of two"
+#endif
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+#ifdef DS3_TRACE_ENABLE
+static portMUX_TYPE ds3_trace_mux = portMUX_INITIALIZER_UNLOCKED;
+static ds3_trace_record_t ds3_trace_ring[DS3_TRACE_SIZE];
+static uint32_t ds3_trace_head = 0;
+#endif
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3DumpTrace
+**
+** Description      Prints the trace ring as hex records, oldest first, to be
+**                  decoded on the host with tools/ds3_trace.py. Prints
+**                  nothing unless DS3_TRACE_ENABLE is defined.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3DumpTrace()
+{
+#ifdef DS3_TRACE_ENABLE
+    static ds3_trace_record_t records[DS3_TRACE_SIZE];
+    uint32_t head;
+    uint32_t count;
+
+    /* Copy the ring, so the dump does not hold the lock while printing */
+    portENTER_CRITICAL(&ds3_trace_mux);
+    memcpy(records, ds3_trace_ring, sizeof(records));
+    head = ds3_trace_head;
+    portEXIT_CRITICAL(&ds3_trace_mux);
+
+    count = (head < DS3_TRACE_SIZE) ? head : DS3_TRACE_SIZE;
+    for (uint32_t i = head - count; i != head; i++)
+    {
+        uint8_t *p_record = (uint8_t *)&records[i & (DS3_TRACE_SIZE - 1)];
+
+        printf(DS3_TRACE_PREFIX);
+        for (uint32_t j = 0; j < sizeof(ds3_trace_record_t); j++)
+        {
+            printf(" %02x", p_record[j]);
+        }
+        printf("\n");
+    }
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3_trace
+**
+** Description      Record an event into the trace ring. Use the DS3_TRACE
+**                  macro, which compiles to nothing unless DS3_TRACE_ENABLE
+**                  is defined.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_trace(uint8_t event, uint8_t arg0, uint16_t arg1)
+{
+#ifdef DS3_TRACE_ENABLE
+    uint32_t time = (uint32_t)esp_timer_get_time();
+    ds3_trace_record_t *p_record;
+
+    portENTER_CRITICAL_SAFE(&ds3_trace_mux);
+    p_record = &ds3_trace_ring[ds3_trace_head++ & (DS3_TRACE_SIZE - 1)];
+    p_record->time = time;
+    p_record->event = event;
+    p_record->arg0 = arg0;
+    p_record->arg1 = arg1;
+    portEXIT_CRITICAL_SAFE(&ds3_trace_mux);
+#endif
+}
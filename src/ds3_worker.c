@@ -0,0 +1,377 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "include/ds3.h"
+#include "include/ds3_int.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "osi/allocator.h"
+
+#define DS3_TAG "DS3_WORKER"
+
+/* The packets leave a slot for the connection and one for the kick */
+#if DS3_WORKER_QUEUE_SIZE < 3
+#error "DS3_WORKER_QUEUE_SIZE must be at least 3"
+#endif
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+enum ds3_worker_item_type {
+    ds3_worker_item_data,
+    ds3_worker_item_connection,
+    ds3_worker_item_kick,
+};
+
+/* Queue item, the L2CAP buffer itself is handed over, not copied */
+typedef struct {
+    uint8_t type;
+    uint16_t len;
+    void *p_buf;
+    uint8_t *p_data;
+    int64_t time;
+} ds3_worker_item_t;
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+#ifdef DS3_WORKER_ENABLE
+static void ds3_worker_task(void *arg);
+static void ds3_worker_post(ds3_worker_item_t *const p_item);
+static void ds3_worker_link();
+#endif
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+#ifdef DS3_WORKER_ENABLE
+static portMUX_TYPE ds3_worker_mux = portMUX_INITIALIZER_UNLOCKED;
+static QueueHandle_t ds3_worker_queue = NULL;
+static TaskHandle_t ds3_worker_handle = NULL;
+static uint64_t ds3_worker_latency_total_us = 0;
+
+/* Connection changes, counted by the Bluetooth task: the link is up while the
+   count is odd. A single connection item is queued at a time, in a slot the
+   input packets leave free, so no change is ever lost. */
+static atomic_uint ds3_worker_link_changes;
+static atomic_bool ds3_worker_link_queued;
+static unsigned int ds3_worker_link_seen = 0; /* Worker task only */
+
+/* A single kick item is queued at a time, in a second slot kept free */
+static atomic_bool ds3_worker_kick_queued;
+
+#ifdef DS3_MINIMAL
+/* The minimal profile places the queue and the task statically */
+static StaticQueue_t ds3_worker_queue_buffer;
+static uint8_t ds3_worker_queue_storage[DS3_WORKER_QUEUE_SIZE * sizeof(ds3_worker_item_t)];
+static StaticTask_t ds3_worker_task_buffer;
+static StackType_t ds3_worker_stack[DS3_WORKER_STACK_SIZE / sizeof(StackType_t)];
+#endif
+#endif
+static ds3_worker_stats_t ds3_worker_stats;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ds3GetWorkerStats
+**
+** Description      Copies the handoff statistics of the DS3 worker task. All
+**                  zero unless DS3_WORKER_ENABLE is defined.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3GetWorkerStats(ds3_worker_stats_t *const p_stats)
+{
+#ifdef DS3_WORKER_ENABLE
+    portENTER_CRITICAL(&ds3_worker_mux);
+    *p_stats = ds3_worker_stats;
+    if (ds3_worker_stats.count != 0) {
+        p_stats->latency_avg_us = (uint32_t)(ds3_worker_latency_total_us / ds3_worker_stats.count);
+    }
+    portEXIT_CRITICAL(&ds3_worker_mux);
+#else
+    *p_stats = ds3_worker_stats;
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3_worker_init
+**
+** Description      Create the DS3 worker task, pinned to DS3_WORKER_CORE.
+**                  With DS3_MINIMAL its queue and stack are static.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ds3_worker_init()
+{
+    memset(&ds3_worker_stats, 0, sizeof(ds3_worker_stats));
+
+#ifdef DS3_WORKER_ENABLE
+    ds3_worker_latency_total_us = 0;
+    atomic_store(&ds3_worker_link_changes, 0);
+    atomic_store(&ds3_worker_link_queued, false);
+    ds3_worker_link_seen = 0;
+    atomic_store(&ds3_worker_kick_queued, false);
+
+#ifdef DS3_MINIMAL
+    ds3_worker_queue = xQueueCreateStatic(DS3_WORKER_QUEUE_SIZE, sizeof(ds3_worker_item_t),
+                                          ds3_worker_queue_storage, &ds3_worker_queue_buffer);
+#else
+    ds3_worker_queue = xQueueCreate(DS3_WORKER_QUEUE_SIZE, sizeof(ds3_worker_item_t));
+#endif
+    if (ds3_worker_queue == NULL) {
+        ESP_LOGE(DS3_TAG, "%s create queue failed", __func__);
+        return false;
+    }
+
+#ifdef DS3_MINIMAL
+    ds3_worker_handle = xTaskCreateStaticPinnedToCore(ds3_worker_task, "ds3_worker", DS3_WORKER_STACK_SIZE, NULL,
+                                                      DS3_WORKER_PRIORITY, ds3_worker_stack,
+                                                      &ds3_worker_task_buffer, DS3_WORKER_CORE);
+    if (ds3_worker_handle == NULL) {
+#else
+    if (xTaskCreatePinnedToCore(ds3_worker_task, "ds3_worker", DS3_WORKER_STACK_SIZE, NULL,
+                                DS3_WORKER_PRIORITY, &ds3_worker_handle, DS3_WORKER_CORE) != pdPASS) {
+#endif
+        ESP_LOGE(DS3_TAG, "%s create task failed", __func__);
+        vQueueDelete(ds3_worker_queue);
+        ds3_worker_queue = NULL;
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         ds3_worker_deinit
+**
+** Description      Delete the DS3 worker task, releasing the pending buffers
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_worker_deinit()
+{
+#ifdef DS3_WORKER_ENABLE
+    ds3_worker_item_t item;
+
+    if (ds3_worker_handle != NULL) {
+        vTaskDelete(ds3_worker_handle);
+        ds3_worker_handle = NULL;
+    }
+    if (ds3_worker_queue != NULL) {
+        while (xQueueReceive(ds3_worker_queue, &item, 0) == pdTRUE) {
+            if (item.p_buf != NULL) {
+                osi_free(item.p_buf);
+            }
+        }
+        vQueueDelete(ds3_worker_queue);
+        ds3_worker_queue = NULL;
+    }
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3_worker_data
+**
+** Description      Hand an input packet over to the worker task, which takes
+**                  ownership of the L2CAP buffer. Processed in place when
+**                  the worker is disabled. The packet is dropped when the
+**                  worker lags behind, keeping a slot for the connection
+**                  and one for the kick.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_worker_data(void *p_buf, uint8_t p_data[const], uint16_t len)
+{
+#ifdef DS3_WORKER_ENABLE
+    ds3_worker_item_t item = {
+        .type = ds3_worker_item_data,
+        .len = len,
+        .p_buf = p_buf,
+        .p_data = p_data,
+        .time = esp_timer_get_time(),
+    };
+
+    /* Only the Bluetooth task posts the packets and the connection, and a
+       single kick is queued at a time, so the two slots are always left */
+    if ((ds3_worker_queue == NULL) || (uxQueueSpacesAvailable(ds3_worker_queue) <= 2)) {
+        osi_free(p_buf);
+        portENTER_CRITICAL(&ds3_worker_mux);
+        ds3_worker_stats.dropped++;
+        portEXIT_CRITICAL(&ds3_worker_mux);
+        return;
+    }
+    ds3_worker_post(&item);
+#else
+    ds3_receive_data(p_data, len, esp_timer_get_time());
+    osi_free(p_buf);
+#endif
+}
+
+/*******************************************************************************
+**
+** Function         ds3_worker_connection
+**
+** Description      Hand a connection change over to the worker task, so that
+**                  it is ordered with the input packets. Processed in place
+**                  when the worker is disabled. Never dropped: changes made
+**                  while a connection item is queued are picked up with it.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_worker_connection(bool is_connected)
+{
+#ifdef DS3_WORKER_ENABLE
+    ds3_worker_item_t item = {
+        .type = ds3_worker_item_connection,
+        .time = esp_timer_get_time(),
+    };
+    unsigned int changes = atomic_load(&ds3_worker_link_changes);
+
+    if (((changes & 1) != 0) == is_connected) {
+        return;
+    }
+    atomic_store(&ds3_worker_link_changes, changes + 1);
+    if (!atomic_exchange(&ds3_worker_link_queued, true)) {
+        ds3_worker_post(&item);
+    }
+#else
+    ds3HandleConnection(is_connected);
+#endif
+}
+
+
+/*******************************************************************************
+**
+** Function         ds3_worker_kick
+**
+** Description      Schedule ds3_batch_service on the input task: the worker
+**                  task, or the Bluetooth task when the worker is disabled.
+**                  Kicks coalesce until the service runs. Safe to call from
+**                  any task.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ds3_worker_kick()
+{
+#ifdef DS3_WORKER_ENABLE
+    ds3_worker_item_t item = {
+        .type = ds3_worker_item_kick,
+        .time = esp_timer_get_time(),
+    };
+
+    if (!atomic_exchange(&ds3_worker_kick_queued, true)) {
+        ds3_worker_post(&item);
+    }
+#else
+    ds3_bt_kick();
+#endif
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+#ifdef DS3_WORKER_ENABLE
+static void ds3_worker_post(ds3_worker_item_t *const p_item)
+{
+    /* Never block the Bluetooth task */
+    if ((ds3_worker_queue == NULL) || (xQueueSend(ds3_worker_queue, p_item, 0) != pdTRUE)) {
+        if (p_item->p_buf != NULL) {
+            osi_free(p_item->p_buf);
+        }
+        portENTER_CRITICAL(&ds3_worker_mux);
+        ds3_worker_stats.dropped++;
+        portEXIT_CRITICAL(&ds3_worker_mux);
+    }
+}
+
+static void ds3_worker_task(void *arg)
+{
+    ds3_worker_item_t item;
+    uint32_t latency;
+
+    for (;;) {
+        if (xQueueReceive(ds3_worker_queue, &item, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+
+        /* Handoff latency */
+        latency = (uint32_t)(esp_timer_get_time() - item.time);
+        portENTER_CRITICAL(&ds3_worker_mux);
+        if ((ds3_worker_stats.count == 0) || (latency < ds3_worker_stats.latency_min_us)) {
+            ds3_worker_stats.latency_min_us = latency;
+        }
+        if (latency > ds3_worker_stats.latency_max_us) {
+            ds3_worker_stats.latency_max_us = latency;
+        }
+        ds3_worker_latency_total_us += latency;
+        ds3_worker_stats.count++;
+        portEXIT_CRITICAL(&ds3_worker_mux);
+
+        switch (item.type)
+        {
+        case ds3_worker_item_data:
+            ds3_receive_data(item.p_data, item.len, item.time);
+            osi_free(item.p_buf);
+            break;
+        case ds3_worker_item_connection:
+            ds3_worker_link();
+            break;
+        case ds3_worker_item_kick:
+            /* Clear first, a kick from now on queues another item */
+            atomic_store(&ds3_worker_kick_queued, false);
+            ds3_batch_service();
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void ds3_worker_link()
+{
+    unsigned int changes;
+    bool is_connected;
+
+    /* Clear first, a change made from now on queues another item */
+    atomic_store(&ds3_worker_link_queued, false);
+    changes = atomic_load(&ds3_worker_link_changes);
+    is_connected = ((changes & 1) != 0);
+
+    if (changes == ds3_worker_link_seen) {
+        return;
+    }
+    /* An even number of changes is a reconnection, report the disconnection first */
+    if (((changes - ds3_worker_link_seen) & 1) == 0) {
+        ds3HandleConnection(!is_connected);
+    }
+    ds3_worker_link_seen = changes;
+    ds3HandleConnection(is_connected);
+}
+#endif
@@ -1,7 +1,13 @@
 #ifndef DS3_H
 #define DS3_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /* CONFIG */
 /* Flags that can be defined prior to including this file to skip certain parsing functionality */
@@ -11,6 +17,39 @@
 // #define DS3_PARSE_SKIP_ANALOG
 // Skip parsing analog changed events
 // #define DS3_PARSE_SKIP_ANALOG_CHANGED
+// Record connection and output events into the binary trace ring, see ds3DumpTrace
+// #define DS3_TRACE_ENABLE
+// Process the input reports in a dedicated task, see DS3_WORKER_CORE and DS3_WORKER_PRIORITY
+// #define DS3_WORKER_ENABLE
+// Stream the input as binary change records over a UART, see ds3BridgeStart
+// #define DS3_BRIDGE_ENABLE
+// Hold a CPU frequency lock only while processing changing input or sending output, see ds3GetPmStats
+// #define DS3_PM_ENABLE
+// Sample the RSSI for the telemetry, the component then owns the GAP callback, see ds3SetGapCallback
+// #define DS3_TELEMETRY_RSSI_ENABLE
+// Skip the batched delivery, see ds3SetBatchCallback
+// #define DS3_SKIP_BATCH
+// Skip the input recorder, see ds3RecordStart
+// #define DS3_SKIP_RECORD
+// Skip merging a Dualshock and a Navigation controller into one device, see ds3SetMergeMode
+// #define DS3_SKIP_MERGE
+// Skip the runtime input remapping, see ds3SetRemap
+// #define DS3_SKIP_REMAP
+// Minimal RAM profile: skips the optional buffers, shrinks the fixed size tables
+// and places the worker queue and stack statically
+// #define DS3_MINIMAL
+
+#ifdef DS3_MINIMAL
+#define DS3_SKIP_BATCH
+#define DS3_SKIP_RECORD
+#define DS3_SKIP_MERGE
+#define DS3_SKIP_REMAP
+#undef DS3_TELEMETRY_RSSI_ENABLE
+#endif
+
+#ifdef DS3_TELEMETRY_RSSI_ENABLE
+#include "esp_gap_bt_api.h"
+#endif
 
 /********************************************************************************/
 /*                                  T Y P E S                                   */
@@ -153,8 +192,22 @@ typedef struct {
 #ifndef DS3_PARSE_SKIP_SENSOR
     ds3_sensor_t sensor;
 #endif
+    /* Arrival, not part of the report */
+    int64_t time;    /* Arrival time in us, on the esp_timer clock */
+    uint32_t seq;    /* Local sequence number, from 0 at every connection */
+    uint16_t missed; /* Reports estimated lost right before this one, from the expected report period */
 } ds3_input_data_t;
 
+/* Extended input data struct, copies of the reserved and unknown input report
+   bytes not in ds3_input_data_t, undecoded */
+typedef struct {
+    uint8_t reserved0;    /* Before the buttons */
+    uint8_t reserved1;    /* Between the buttons and the sticks */
+    uint8_t reserved2[4]; /* Between the sticks and the analog buttons */
+    uint8_t reserved3[3]; /* Between the analog buttons and the status */
+    uint8_t unknown[9];   /* Between the status and the sensors */
+} ds3_extended_t;
+
 /* Output data struct */
 typedef struct {
     ds3_rumble_t rumble;
@@ -174,12 +227,219 @@ typedef struct {
 } ds3_event_t;
 
 
+/* Batch struct, one column per field, see ds3SetBatchCallback */
+#ifndef DS3_BATCH_MAX
+#define DS3_BATCH_MAX 16
+#endif
+typedef struct {
+    uint16_t count;                         /* Number of reports in the columns */
+    uint32_t time[DS3_BATCH_MAX];           /* Arrival time in us, as ds3_input_data_t, wraps after ~71 minutes */
+    ds3_button_t button[DS3_BATCH_MAX];
+    ds3_button_t button_down[DS3_BATCH_MAX];
+    ds3_button_t button_up[DS3_BATCH_MAX];
+    int8_t lx[DS3_BATCH_MAX];
+    int8_t ly[DS3_BATCH_MAX];
+    int8_t rx[DS3_BATCH_MAX];
+    int8_t ry[DS3_BATCH_MAX];
+#ifndef DS3_PARSE_SKIP_ANALOG
+    ds3_analog_t analog[DS3_BATCH_MAX];
+#endif
+#ifndef DS3_PARSE_SKIP_SENSOR
+    int16_t ax[DS3_BATCH_MAX];
+    int16_t ay[DS3_BATCH_MAX];
+    int16_t az[DS3_BATCH_MAX];
+    int16_t gz[DS3_BATCH_MAX];
+#endif
+} ds3_batch_t;
+
+/* Controller on the link, the Navigation controller sends the Dualshock
+   report with only its own buttons, the left stick and no sensors */
+typedef enum {
+    ds3_controller_dualshock,
+    ds3_controller_navigation,
+} ds3_controller_t;
+
+/* Merged device modes, see ds3SetMergeMode */
+#define DS3_MERGE_LINKS 2
+typedef enum {
+    ds3_merge_none,
+    ds3_merge_ds3_nav, /* Link 0 Dualshock, link 1 Navigation as a second left hand */
+    ds3_merge_nav_nav, /* Link 0 left Navigation, link 1 right Navigation on the right stick and face buttons */
+    ds3_merge_count,
+} ds3_merge_mode_t;
+
+/* Remap entry, see ds3SetRemap */
+#define DS3_REMAP_MAX  24
+#define DS3_REMAP_NONE 0xFF
+enum ds3_remap_kind {
+    ds3_remap_kind_button,
+    ds3_remap_kind_axis,
+};
+typedef struct {
+    uint8_t kind;   /* ds3_remap_kind */
+    uint8_t to;     /* Output button bit, in ds3_button_t order, or axis (lx, ly, rx, ry) */
+    uint8_t from;   /* Input driving the output, DS3_REMAP_NONE to disable a button */
+    uint8_t invert; /* Axes only, negate the input */
+} ds3_remap_t;
+
+/* Connection state */
+typedef enum {
+    ds3_state_idle,      /* Not connected */
+    ds3_state_l2cap_up,  /* L2CAP connected, enabling the reports failed */
+    ds3_state_enabling,  /* Enable report sent, waiting for input reports */
+    ds3_state_streaming, /* Receiving input reports */
+    ds3_state_stalled,   /* Input reports stopped, enable report sent again */
+    ds3_state_count,
+} ds3_state_t;
+
+/* Connection statistics struct */
+typedef struct {
+    ds3_state_t state;                       /* Current state */
+    uint32_t latency_us[ds3_state_count];    /* Time spent in the previous state, at the last entry of each state */
+    uint32_t transitions;                    /* State changes */
+    uint32_t enable_retries;                 /* Enable reports sent again while enabling */
+    uint32_t reconnects;                     /* Disconnections forced by a stalled link */
+} ds3_conn_stats_t;
+
+/* Worker statistics struct */
+typedef struct {
+    uint32_t count;          /* Items handed over to the worker task */
+    uint32_t dropped;        /* Input reports dropped because the worker queue was full */
+    uint32_t latency_min_us; /* Handoff latency, from the L2CAP callback to the worker task */
+    uint32_t latency_max_us;
+    uint32_t latency_avg_us;
+} ds3_worker_stats_t;
+
+/* Bridge groups, see ds3BridgeStart */
+enum ds3_bridge_group {
+    ds3_bridge_group_button = 0x01,
+    ds3_bridge_group_stick  = 0x02,
+    ds3_bridge_group_analog = 0x04,
+    ds3_bridge_group_sensor = 0x08,
+    ds3_bridge_group_status = 0x10,
+};
+
+/* Bridge statistics struct */
+typedef struct {
+    uint32_t reports;        /* Input reports seen while streaming */
+    uint32_t frames;         /* Frames queued */
+    uint32_t bytes;          /* Bytes queued, bytes / reports is the cost per report */
+    uint32_t dropped;        /* Frames dropped because the transmit buffer was full */
+    uint32_t latency_us;     /* Time until the last byte of the last frame is sent */
+    uint32_t latency_max_us;
+} ds3_bridge_stats_t;
+
+/* Control request results, the HANDSHAKE result codes and local ones */
+enum ds3_request_result {
+    ds3_request_result_ok                = 0x00,
+    ds3_request_result_not_ready         = 0x01,
+    ds3_request_result_invalid_report_id = 0x02,
+    ds3_request_result_unsupported       = 0x03,
+    ds3_request_result_invalid_parameter = 0x04,
+    ds3_request_result_unknown           = 0x0E,
+    ds3_request_result_fatal             = 0x0F,
+    ds3_request_result_timeout           = 0x10, /* No response in time, or its response was lost */
+    ds3_request_result_disconnected      = 0x11,
+    ds3_request_result_failed            = 0x12, /* Could not be written to the channel */
+};
+
+/* Control request statistics struct */
+typedef struct {
+    uint32_t requests; /* Requests sent through ds3Request */
+    uint32_t errors;   /* HANDSHAKE responses other than successful, all requests */
+    uint32_t timeouts; /* Requests without a response in time */
+    uint32_t lost;     /* Responses skipped when a later one arrived */
+} ds3_request_stats_t;
+
+/* Suspend statistics struct */
+typedef struct {
+    uint32_t suspends;   /* Calls to ds3Suspend that suspended */
+    uint32_t init_us;    /* Duration of the last ds3Init */
+    uint32_t suspend_us; /* Duration of the last ds3Suspend */
+    uint32_t resume_us;  /* Duration of the last ds3Resume */
+} ds3_suspend_stats_t;
+
+/* Page scan policy struct, see ds3SetScanPolicy. Window and intervals are in
+   0.625 ms slots, the radio listens window / interval of the time, twice
+   that at the fast interval, which scans both page trains interlaced */
+typedef struct {
+    uint16_t window;          /* Page scan window, 0x11 to 0x1000 */
+    uint16_t fast_interval;   /* Interval after ds3Init, a disconnection or ds3Resume */
+    uint16_t slow_interval;   /* Interval at the end of the backoff, up to 0x1000 */
+    uint32_t fast_ms;         /* Time at the fast interval before backing off */
+    uint32_t step_ms;         /* Time at each backoff interval, the interval doubles at each step */
+    bool off_when_connected;  /* Stop page scanning while the controller is connected */
+} ds3_scan_policy_t;
+
+/* Page scan statistics struct, per backoff level, level 0 being the fast interval */
+#define DS3_SCAN_LEVELS 8
+typedef struct {
+    uint16_t interval;   /* Page scan interval of the level */
+    uint32_t connects;   /* Connections accepted at this level */
+    uint32_t connect_ms; /* Total time from the start of page scanning to those connections */
+    uint64_t scan_us;    /* Time page scanning at this level */
+} ds3_scan_level_stats_t;
+
+typedef struct {
+    bool scanning;                 /* Whether the host is page scanning */
+    uint8_t level;                 /* Current backoff level */
+    uint16_t window;               /* Page scan window */
+    uint32_t last_connect_ms;      /* Time from the start of page scanning to the last connection */
+    uint64_t scan_us;              /* Total time page scanning */
+    uint64_t radio_us;             /* Time the radio listened, radio_us / scan_us is the duty cycle */
+    ds3_scan_level_stats_t levels[DS3_SCAN_LEVELS];
+} ds3_scan_stats_t;
+
+/* Power management statistics struct */
+typedef struct {
+    uint32_t acquisitions; /* Times the CPU frequency lock was acquired */
+    uint64_t held_us;      /* Total time the CPU frequency lock was held */
+} ds3_pm_stats_t;
+
+/* Telemetry struct */
+#define DS3_TELEMETRY_JITTER_BUCKETS 8
+typedef struct {
+    uint32_t report_count;          /* Input reports received since connecting */
+    uint16_t report_rate;           /* Input reports per second, over the last second */
+    uint32_t gap_count;             /* Input report intervals above the gap threshold */
+    uint32_t missed_count;          /* Input reports estimated lost, see ds3_input_data_t.missed */
+    uint32_t jitter[DS3_TELEMETRY_JITTER_BUCKETS]; /* Deviation from the report period, 1 ms per bucket */
+    uint32_t congestion_count;      /* Congestion episodes */
+    uint32_t send_count;            /* Output reports written */
+    uint32_t send_congested_count;  /* Output reports queued on a congested channel */
+    uint32_t send_fail_count;       /* Output reports that failed to be written */
+    int8_t rssi_delta;              /* Last sampled RSSI, relative to the golden receive power range */
+    bool rssi_valid;                /* Whether rssi_delta has been sampled, only with DS3_TELEMETRY_RSSI_ENABLE */
+    bool congested;                 /* Whether the channel is currently congested */
+} ds3_telemetry_t;
+
+
 /***************************/
 /*    C A L L B A C K S    */
 /***************************/
 
 typedef void (*ds3_connection_callback_t)(uint8_t is_connected);
 typedef void (*ds3_event_callback_t)(ds3_input_data_t *const p_data, ds3_event_t *const p_event);
+typedef void (*ds3_status_callback_t)(ds3_status_t *const p_status);
+typedef void (*ds3_batch_callback_t)(void *p_ctx, const ds3_batch_t *p_batch);
+typedef void (*ds3_request_callback_t)(void *p_ctx, uint8_t result, const uint8_t *p_data, uint16_t len);
+
+/* Subscriber handlers, each receiving the context given to ds3Subscribe */
+typedef struct {
+    void (*connection)(void *p_ctx, uint8_t is_connected);
+    void (*event)(void *p_ctx, ds3_input_data_t *const p_data, ds3_event_t *const p_event);
+    void (*status)(void *p_ctx, ds3_status_t *const p_status);
+} ds3_handlers_t;
+
+/* Subscriber interest mask */
+enum ds3_interest {
+    ds3_interest_connection = 0x01, /* Connection changes */
+    ds3_interest_status     = 0x02, /* Status changes */
+    ds3_interest_report     = 0x04, /* Every input report */
+    ds3_interest_button     = 0x08, /* Input reports with button changes */
+    ds3_interest_stick      = 0x10, /* Input reports with stick changes */
+    ds3_interest_analog     = 0x20, /* Input reports with analog changes */
+};
 
 
 /********************************************************************************/
@@ -189,15 +449,60 @@ typedef void (*ds3_event_callback_t)(ds3_input_data_t *const p_data, ds3_event_t
 bool ds3IsConnected();
 bool ds3Init();
 bool ds3Deinit();
+bool ds3Suspend();
+bool ds3Resume();
+bool ds3IsSuspended();
+void ds3GetSuspendStats(ds3_suspend_stats_t *const);
+bool ds3SetScanPolicy(const ds3_scan_policy_t *);
+void ds3GetScanPolicy(ds3_scan_policy_t *const);
+void ds3GetScanStats(ds3_scan_stats_t *const);
 void ds3HandleConnection(bool);
-void ds3EnableReport();
-void ds3SendCommand();
+bool ds3EnableReport();
+bool ds3SendCommand();
 void ds3ReceiveData(uint8_t *const);
-void ds3SetLed(uint8_t, bool);
-void ds3SetLeds(bool, bool, bool, bool);
-void ds3SetRumble(uint8_t, uint8_t, uint8_t, uint8_t);
+const uint8_t *ds3GetRawReport(uint16_t *const);
+bool ds3ParseExtended(ds3_extended_t *const);
+bool ds3SetLed(uint8_t, bool);
+bool ds3SetLeds(bool, bool, bool, bool);
+bool ds3SetRumble(uint8_t, uint8_t, uint8_t, uint8_t);
+bool ds3SetRumbleMs(uint8_t, uint32_t, uint8_t, uint32_t);
 void ds3SetConnectionCallback(ds3_connection_callback_t);
 void ds3SetEventCallback(ds3_event_callback_t);
+void ds3SetStatusCallback(ds3_status_callback_t);
+int ds3Subscribe(const ds3_handlers_t *, void *, uint8_t, uint8_t);
+bool ds3Unsubscribe(int);
+void ds3SetBatchCallback(ds3_batch_callback_t, void *, uint16_t, uint32_t);
+void ds3FlushBatch();
+bool ds3RecordStart(FILE *);
+bool ds3RecordStop();
+void ds3SetController(ds3_controller_t);
+bool ds3SetRemap(const ds3_remap_t *, uint8_t, bool);
+bool ds3SetMergeMode(ds3_merge_mode_t, uint8_t);
+bool ds3MergeUpdate(uint8_t, ds3_input_data_t *const, ds3_event_t *const);
+bool ds3MergeDisconnect(uint8_t);
+bool ds3GetMergedInput(ds3_input_data_t *const);
 void ds3SetBluetoothMacAddress(const uint8_t *);
+bool ds3PairingAdd(const uint8_t *);
+bool ds3PairingRemove(const uint8_t *);
+bool ds3PairingClear();
+bool ds3PairingSetHostAddress(const uint8_t *);
+void ds3GetTelemetry(ds3_telemetry_t *const);
+#ifdef DS3_TELEMETRY_RSSI_ENABLE
+void ds3SetGapCallback(esp_bt_gap_cb_t);
+#endif
+void ds3GetConnectionStats(ds3_conn_stats_t *const);
+void ds3GetWorkerStats(ds3_worker_stats_t *const);
+void ds3GetPmStats(ds3_pm_stats_t *const);
+bool ds3Request(uint8_t, const uint8_t *, uint16_t, ds3_request_callback_t, void *);
+bool ds3GetReport(uint8_t, uint8_t, ds3_request_callback_t, void *);
+void ds3GetRequestStats(ds3_request_stats_t *const);
+bool ds3BridgeStart(int, int, uint32_t, uint8_t);
+bool ds3BridgeStop();
+void ds3GetBridgeStats(ds3_bridge_stats_t *const);
+void ds3DumpTrace();
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
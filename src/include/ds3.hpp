@@ -0,0 +1,241 @@
+#ifndef DS3_HPP
+#define DS3_HPP
+
+/* Header-only C++ layer over ds3.h, C++11 or later.
+ *
+ * The handlers are plain classes, whose member functions are bound at
+ * compile time: ds3::Subscription<Handler> registers one trampoline per
+ * member function the handler has, and the trampoline calls it directly.
+ * There is no virtual call or type erasure on the report path, and no
+ * global state, the handler object is the subscription context.
+ *
+ *     struct Robot {
+ *         void onEvent(const ds3_input_data_t &data, const ds3_event_t &event) {
+ *             if (ds3::pressed(event, ds3::button::cross)) { ... }
+ *         }
+ *         void onConnection(bool connected) { ... }
+ *     };
+ *
+ *     ds3::Controller controller;   // ds3Init, ds3Deinit when destroyed
+ *     Robot robot;
+ *     ds3::Subscription<Robot> subscription(robot);
+ */
+
+#include <stdint.h>
+#include <utility>
+#include <type_traits>
+#include "ds3.h"
+
+namespace ds3 {
+
+/* Button masks, in ds3_button_t bit order, see bits() */
+namespace button {
+constexpr uint32_t select   = 1u << 0;
+constexpr uint32_t l3       = 1u << 1;
+constexpr uint32_t r3       = 1u << 2;
+constexpr uint32_t start    = 1u << 3;
+constexpr uint32_t up       = 1u << 4;
+constexpr uint32_t right    = 1u << 5;
+constexpr uint32_t down     = 1u << 6;
+constexpr uint32_t left     = 1u << 7;
+constexpr uint32_t l2       = 1u << 8;
+constexpr uint32_t r2       = 1u << 9;
+constexpr uint32_t l1       = 1u << 10;
+constexpr uint32_t r1       = 1u << 11;
+constexpr uint32_t triangle = 1u << 12;
+constexpr uint32_t circle   = 1u << 13;
+constexpr uint32_t cross    = 1u << 14;
+constexpr uint32_t square   = 1u << 15;
+constexpr uint32_t ps       = 1u << 16;
+
+constexpr uint32_t dpad     = up | right | down | left;
+constexpr uint32_t face     = triangle | circle | cross | square;
+constexpr uint32_t shoulder = l1 | r1 | l2 | r2;
+}
+
+/* Buttons as a mask of ds3::button values, read byte-wise so that a
+   constant mask folds into single byte tests */
+inline uint32_t bits(const ds3_button_t &buttons)
+{
+    static_assert(sizeof(ds3_button_t) == 3, "ds3_button_t is 17 bits in 3 bytes");
+    const uint8_t *p_bytes = reinterpret_cast<const uint8_t *>(&buttons);
+    return p_bytes[0] | (uint32_t)p_bytes[1] << 8 | (uint32_t)p_bytes[2] << 16;
+}
+
+inline bool held(const ds3_input_data_t &data, uint32_t mask)
+{
+    return (bits(data.button) & mask) == mask;
+}
+
+inline bool pressed(const ds3_event_t &event, uint32_t mask)
+{
+    return (bits(event.button_down) & mask) != 0;
+}
+
+inline bool released(const ds3_event_t &event, uint32_t mask)
+{
+    return (bits(event.button_up) & mask) != 0;
+}
+
+
+/* Detection of the handler member functions */
+namespace detail {
+
+template <typename T>
+struct has_on_event {
+    template <typename U>
+    static auto test(int) -> decltype(std::declval<U &>().onEvent(std::declval<const ds3_input_data_t &>(),
+                                                                  std::declval<const ds3_event_t &>()), std::true_type());
+    template <typename>
+    static std::false_type test(...);
+    static constexpr bool value = decltype(test<T>(0))::value;
+};
+
+template <typename T>
+struct has_on_connection {
+    template <typename U>
+    static auto test(int) -> decltype(std::declval<U &>().onConnection(true), std::true_type());
+    template <typename>
+    static std::false_type test(...);
+    static constexpr bool value = decltype(test<T>(0))::value;
+};
+
+template <typename T>
+struct has_on_status {
+    template <typename U>
+    static auto test(int) -> decltype(std::declval<U &>().onStatus(std::declval<const ds3_status_t &>()), std::true_type());
+    template <typename>
+    static std::false_type test(...);
+    static constexpr bool value = decltype(test<T>(0))::value;
+};
+
+/* Trampolines, or nullptr when the handler lacks the member function */
+template <typename T, bool = has_on_event<T>::value>
+struct event_trampoline {
+    static void call(void *p_ctx, ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+    {
+        static_cast<T *>(p_ctx)->onEvent(*p_data, *p_event);
+    }
+    static constexpr decltype(&call) get() { return &call; }
+};
+template <typename T>
+struct event_trampoline<T, false> {
+    static constexpr void (*get())(void *, ds3_input_data_t *const, ds3_event_t *const) { return nullptr; }
+};
+
+template <typename T, bool = has_on_connection<T>::value>
+struct connection_trampoline {
+    static void call(void *p_ctx, uint8_t is_connected)
+    {
+        static_cast<T *>(p_ctx)->onConnection(is_connected != 0);
+    }
+    static constexpr decltype(&call) get() { return &call; }
+};
+template <typename T>
+struct connection_trampoline<T, false> {
+    static constexpr void (*get())(void *, uint8_t) { return nullptr; }
+};
+
+template <typename T, bool = has_on_status<T>::value>
+struct status_trampoline {
+    static void call(void *p_ctx, ds3_status_t *const p_status)
+    {
+        static_cast<T *>(p_ctx)->onStatus(*p_status);
+    }
+    static constexpr decltype(&call) get() { return &call; }
+};
+template <typename T>
+struct status_trampoline<T, false> {
+    static constexpr void (*get())(void *, ds3_status_t *const) { return nullptr; }
+};
+
+}
+
+
+/* Handler table and default interest mask of a handler class */
+template <typename Handler>
+struct Handlers {
+    static constexpr ds3_handlers_t table()
+    {
+        return ds3_handlers_t{
+            detail::connection_trampoline<Handler>::get(),
+            detail::event_trampoline<Handler>::get(),
+            detail::status_trampoline<Handler>::get(),
+        };
+    }
+
+    static constexpr uint8_t mask()
+    {
+        return (detail::has_on_connection<Handler>::value ? ds3_interest_connection : 0)
+             | (detail::has_on_event<Handler>::value ? ds3_interest_report : 0)
+             | (detail::has_on_status<Handler>::value ? ds3_interest_status : 0);
+    }
+};
+
+
+/* Subscription of a handler object, unsubscribed when destroyed. The
+   handler must outlive it. The mask can narrow the reports, e.g. to
+   ds3_interest_button. */
+template <typename Handler>
+class Subscription {
+public:
+    explicit Subscription(Handler &handler, uint8_t mask = Handlers<Handler>::mask(), uint8_t priority = 0)
+    {
+        static_assert(Handlers<Handler>::mask() != 0,
+                      "the handler needs onEvent, onConnection or onStatus");
+        static const ds3_handlers_t handlers = Handlers<Handler>::table();
+        id_ = ds3Subscribe(&handlers, &handler, mask, priority);
+    }
+
+    ~Subscription()
+    {
+        if (id_ >= 0) {
+            ds3Unsubscribe(id_);
+        }
+    }
+
+    Subscription(const Subscription &) = delete;
+    Subscription &operator=(const Subscription &) = delete;
+
+    explicit operator bool() const { return id_ >= 0; }
+    int id() const { return id_; }
+
+private:
+    int id_;
+};
+
+
+/* Initializes the component for its lifetime */
+class Controller {
+public:
+    Controller() : ok_(ds3Init()) {}
+
+    ~Controller()
+    {
+        if (ok_) {
+            ds3Deinit();
+        }
+    }
+
+    Controller(const Controller &) = delete;
+    Controller &operator=(const Controller &) = delete;
+
+    explicit operator bool() const { return ok_; }
+
+    bool connected() const { return ds3IsConnected(); }
+    bool suspend() { return ds3Suspend(); }
+    bool resume() { return ds3Resume(); }
+    bool setLed(uint8_t led, bool value) { return ds3SetLed(led, value); }
+    bool setLeds(bool led1, bool led2, bool led3, bool led4) { return ds3SetLeds(led1, led2, led3, led4); }
+    bool setRumble(uint8_t right_intensity, uint32_t right_ms, uint8_t left_intensity, uint32_t left_ms)
+    {
+        return ds3SetRumbleMs(right_intensity, right_ms, left_intensity, left_ms);
+    }
+
+private:
+    bool ok_;
+};
+
+}
+
+#endif
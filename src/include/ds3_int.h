@@ -2,6 +2,7 @@
 #define DS3_INT_H
 
 #include "sdkconfig.h"
+#include "esp_err.h"
 #include "ds3.h"
 
 /** Check if the project is configured properly */
@@ -21,6 +22,14 @@
 #error "The ESP32-DS3 component requires Classic Bluetooth's L2CAP to be enabled in the project's menuconfig"
 #endif
 
+/** Compile-time log level of the component, see esp_log_level_t */
+#ifndef DS3_LOG_LEVEL
+#define DS3_LOG_LEVEL ESP_LOG_INFO
+#endif
+#ifndef LOG_LOCAL_LEVEL
+#define LOG_LOCAL_LEVEL DS3_LOG_LEVEL
+#endif
+
 /** Check the configured blueooth mode */
 #ifdef CONFIG_BTDM_CONTROLLER_MODE_BTDM
 #define BT_MODE ESP_BT_MODE_BTDM
@@ -35,6 +44,156 @@
 #define DS3_REPORT_BUFFER_SIZE 48
 #define DS3_HID_BUFFER_SIZE    50
 
+/** Number of consecutive reports a new battery level must be seen before it is reported */
+#ifndef DS3_STATUS_BATTERY_HYSTERESIS
+#define DS3_STATUS_BATTERY_HYSTERESIS 50
+#endif
+
+/** Table sizes of the minimal RAM profile, the defaults below apply otherwise */
+#ifdef DS3_MINIMAL
+#ifndef DS3_WORKER_QUEUE_SIZE
+#define DS3_WORKER_QUEUE_SIZE 4
+#endif
+#ifndef DS3_CMD_QUEUE_SIZE
+#define DS3_CMD_QUEUE_SIZE 4
+#endif
+#ifndef DS3_SUBSCRIBER_MAX
+#define DS3_SUBSCRIBER_MAX 2
+#endif
+#ifndef DS3_PAIRING_MAX
+#define DS3_PAIRING_MAX 4
+#endif
+#ifndef DS3_TRACE_SIZE
+#define DS3_TRACE_SIZE 16
+#endif
+#endif
+
+/** Core, priority, stack size and queue length of the worker task. The input
+ *  task is the worker task with DS3_WORKER_ENABLE, the Bluetooth task otherwise */
+#ifndef DS3_WORKER_CORE
+#define DS3_WORKER_CORE 1
+#endif
+#ifndef DS3_WORKER_PRIORITY
+#define DS3_WORKER_PRIORITY 10
+#endif
+#ifndef DS3_WORKER_STACK_SIZE
+#define DS3_WORKER_STACK_SIZE 3072
+#endif
+#ifndef DS3_WORKER_QUEUE_SIZE
+#define DS3_WORKER_QUEUE_SIZE 8
+#endif
+
+/** Number of commands in the output command queue, must be a power of two */
+#ifndef DS3_CMD_QUEUE_SIZE
+#define DS3_CMD_QUEUE_SIZE 16
+#endif
+
+/** Connection state machine tick */
+#ifndef DS3_CONN_TICK_MS
+#define DS3_CONN_TICK_MS 50
+#endif
+/** Time to wait for the first input report before resending the enable report */
+#ifndef DS3_CONN_ENABLE_TIMEOUT_MS
+#define DS3_CONN_ENABLE_TIMEOUT_MS 500
+#endif
+/** Number of times the enable report is resent before disconnecting */
+#ifndef DS3_CONN_ENABLE_RETRIES
+#define DS3_CONN_ENABLE_RETRIES 3
+#endif
+/** Time without input reports after which the stream is stalled */
+#ifndef DS3_CONN_STALL_TIMEOUT_MS
+#define DS3_CONN_STALL_TIMEOUT_MS 250
+#endif
+/** Time a stalled stream gets to recover before disconnecting */
+#ifndef DS3_CONN_RECOVER_TIMEOUT_MS
+#define DS3_CONN_RECOVER_TIMEOUT_MS 1000
+#endif
+
+/** Time unit of the rumble durations in the output report */
+#ifndef DS3_RUMBLE_UNIT_MS
+#define DS3_RUMBLE_UNIT_MS 20
+#endif
+/** Time before a rumble runs out on the controller at which it is refreshed,
+    must exceed the input report interval as refreshes go out with the reports */
+#ifndef DS3_RUMBLE_REFRESH_MARGIN_MS
+#define DS3_RUMBLE_REFRESH_MARGIN_MS 50
+#endif
+
+/** Size of the bridge's UART transmit buffer, holding the frames queued while
+    the previous ones are sent */
+#ifndef DS3_BRIDGE_TX_BUFFER_SIZE
+#define DS3_BRIDGE_TX_BUFFER_SIZE 512
+#endif
+/** Number of input reports between bridge frames carrying all groups */
+#ifndef DS3_BRIDGE_SYNC_REPORTS
+#define DS3_BRIDGE_SYNC_REPORTS 100
+#endif
+
+/** Control requests sent through ds3Request in flight at once */
+#ifndef DS3_REQUEST_WINDOW
+#define DS3_REQUEST_WINDOW 2
+#endif
+/** Control transactions in flight, including the output reports */
+#ifndef DS3_REQUEST_QUEUE_SIZE
+#define DS3_REQUEST_QUEUE_SIZE 8
+#endif
+/** Time a control request waits for its response */
+#ifndef DS3_REQUEST_TIMEOUT_MS
+#define DS3_REQUEST_TIMEOUT_MS 500
+#endif
+
+/** Maximum number of event subscribers */
+#ifndef DS3_SUBSCRIBER_MAX
+#define DS3_SUBSCRIBER_MAX 8
+#endif
+
+/** Size of the recording buffer, written to the file when full */
+#ifndef DS3_RECORD_BUFFER_SIZE
+#define DS3_RECORD_BUFFER_SIZE 512
+#endif
+
+/** Maximum number of controllers in the allow-list */
+#ifndef DS3_PAIRING_MAX
+#define DS3_PAIRING_MAX 16
+#endif
+
+/** Number of records in the trace ring, must be a power of two */
+#ifndef DS3_TRACE_SIZE
+#define DS3_TRACE_SIZE 64
+#endif
+
+/** Page scan policy defaults, see ds3_scan_policy_t. The fast interval
+    scans interlaced, a window on each page train, half of the time; the
+    slow one is the Bluetooth default */
+#ifndef DS3_SCAN_WINDOW
+#define DS3_SCAN_WINDOW 0x0012
+#endif
+#ifndef DS3_SCAN_FAST_INTERVAL
+#define DS3_SCAN_FAST_INTERVAL 0x0048
+#endif
+#ifndef DS3_SCAN_SLOW_INTERVAL
+#define DS3_SCAN_SLOW_INTERVAL 0x0800
+#endif
+#ifndef DS3_SCAN_FAST_MS
+#define DS3_SCAN_FAST_MS 30000
+#endif
+#ifndef DS3_SCAN_STEP_MS
+#define DS3_SCAN_STEP_MS 10000
+#endif
+
+/** Expected interval between input reports */
+#ifndef DS3_TELEMETRY_REPORT_PERIOD_US
+#define DS3_TELEMETRY_REPORT_PERIOD_US 10000
+#endif
+/** Input report interval above which a gap is counted */
+#ifndef DS3_TELEMETRY_GAP_US
+#define DS3_TELEMETRY_GAP_US (DS3_TELEMETRY_REPORT_PERIOD_US * 3 / 2)
+#endif
+/** Interval between RSSI samples */
+#ifndef DS3_TELEMETRY_RSSI_PERIOD_US
+#define DS3_TELEMETRY_RSSI_PERIOD_US 1000000
+#endif
+
 /********************************************************************************/
 /*                         S H A R E D   T Y P E S                              */
 /********************************************************************************/
@@ -69,6 +228,99 @@ typedef struct {
     uint8_t data[DS3_REPORT_BUFFER_SIZE];
 } hid_cmd_t;
 
+/* Trace events, keep in sync with tools/ds3_trace.py */
+enum ds3_trace_event {
+    ds3_trace_event_send           = 0x01, /* arg0: L2CA_DataWrite result, arg1: length */
+    ds3_trace_event_congestion     = 0x02, /* arg0: congested,              arg1: cid */
+    ds3_trace_event_connect_ind    = 0x03, /* arg0: l2cap id,               arg1: psm */
+    ds3_trace_event_config_cfm     = 0x04, /* arg0: result,                 arg1: cid */
+    ds3_trace_event_disconnect_ind = 0x05, /* arg0: ack needed,             arg1: cid */
+    ds3_trace_event_disconnect_cfm = 0x06, /* arg0: result,                 arg1: cid */
+    ds3_trace_event_reject         = 0x07, /* arg0: l2cap id,               arg1: psm */
+    ds3_trace_event_state          = 0x08, /* arg0: new state,              arg1: previous state */
+};
+
+/* Output commands, posted by the public setters and applied on the Bluetooth task */
+enum ds3_cmd_type {
+    ds3_cmd_type_led    = 0x01, /* arg[0]: led number (0 for all), arg[1]: value */
+    ds3_cmd_type_leds   = 0x02, /* arg[0..3]: led1..led4 values */
+    ds3_cmd_type_rumble = 0x03, /* arg[0..3]: right duration, right intensity, left duration, left intensity */
+    ds3_cmd_type_send   = 0x04, /* No arguments, sends the output report */
+    ds3_cmd_type_rumble_ms = 0x05, /* arg[0], arg[1]: right, left intensity, ms[0], ms[1]: right, left duration, see ds3SetRumbleMs */
+    ds3_cmd_type_enable = 0x06, /* No arguments, sends the enable report, see ds3EnableReport */
+    ds3_cmd_type_request = 0x07, /* arg[0]: request slot, see ds3Request */
+};
+
+typedef struct {
+    uint8_t type;
+    uint8_t arg[4];
+    uint32_t ms[2];
+} ds3_cmd_t;
+
+/* Holders of the power management lock */
+enum ds3_pm_holder {
+    ds3_pm_holder_report = 0x01, /* Input is changing */
+    ds3_pm_holder_send   = 0x02, /* Output is being sent */
+};
+
+/* Connection state machine events */
+typedef enum {
+    ds3_conn_event_connected,    /* Both L2CAP channels are configured */
+    ds3_conn_event_disconnected, /* An L2CAP channel is disconnected */
+    ds3_conn_event_report,       /* An input report is received */
+    ds3_conn_event_timeout,      /* The current state timed out */
+} ds3_conn_event_t;
+
+typedef struct {
+    uint32_t time;  /* Timestamp in us, wraps after ~71 minutes */
+    uint8_t event;  /* See ds3_trace_event */
+    uint8_t arg0;
+    uint16_t arg1;
+} ds3_trace_record_t;
+
+typedef struct {
+    ds3_status_t status;     /* Last reported status */
+    uint8_t battery_pending; /* Battery level waiting to be reported */
+    uint8_t battery_count;   /* Consecutive reports of the pending battery level */
+    bool valid;              /* Whether a status has been reported since connecting */
+} ds3_status_monitor_t;
+
+/* Arrival of the previous input report of a link, and its next sequence
+   number, all zero from a new connection */
+typedef struct {
+    int64_t last_us;
+    uint32_t seq;
+} ds3_stamp_t;
+
+
+/********************************************************************************/
+/*                              F U N C T I O N S                               */
+/********************************************************************************/
+
+void ds3_receive_data(uint8_t p_data[const], uint16_t len, int64_t time);
+uint16_t ds3_stamp_report(ds3_stamp_t *const p_stamp, ds3_input_data_t *const p_data, int64_t now);
+void ds3_link_connection(bool is_connected);
+void ds3_service();
+bool ds3_post_command(const ds3_cmd_t *p_cmd);
+
+
+/********************************************************************************/
+/*                     C O M M A N D   F U N C T I O N S                        */
+/********************************************************************************/
+
+bool ds3_cmd_post(const ds3_cmd_t *p_cmd);
+bool ds3_cmd_pop(ds3_cmd_t *const p_cmd);
+
+
+/********************************************************************************/
+/*                  C O N N E C T I O N   F U N C T I O N S                     */
+/********************************************************************************/
+
+bool ds3_conn_init();
+void ds3_conn_deinit();
+void ds3_conn_event(ds3_conn_event_t event);
+void ds3_conn_service(int64_t now);
+
 
 /********************************************************************************/
 /*                           B T   F U N C T I O N S                            */
@@ -76,6 +328,10 @@ typedef struct {
 
 bool ds3_bt_init();
 bool ds3_bt_deinit();
+bool ds3_bt_set_page_scan(uint16_t window, uint16_t interval, bool interlaced);
+void ds3_bt_kick();
+bool ds3_bt_is_task();
+bool ds3_bt_call(bool (*p_call)(void));
 
 
 /********************************************************************************/
@@ -84,7 +340,173 @@ bool ds3_bt_deinit();
 
 bool ds3_l2cap_init_services();
 void ds3_l2cap_deinit_services();
-bool ds3_l2cap_send_data(uint8_t p_data[const], uint16_t len);
+void ds3_l2cap_disconnect();
+bool ds3_l2cap_send_data(const uint8_t p_data[const], uint16_t len);
+
+
+/********************************************************************************/
+/*                        S C A N   F U N C T I O N S                           */
+/********************************************************************************/
+
+bool ds3_scan_init();
+void ds3_scan_deinit();
+bool ds3_scan_enable(bool enable);
+void ds3_scan_service();
+void ds3_scan_paged();
+void ds3_scan_connection(bool is_connected);
+
+
+/********************************************************************************/
+/*                          P M   F U N C T I O N S                             */
+/********************************************************************************/
+
+bool ds3_pm_init();
+void ds3_pm_deinit();
+void ds3_pm_acquire(uint8_t holder);
+void ds3_pm_release(uint8_t holders);
+
+
+/********************************************************************************/
+/*                      W O R K E R   F U N C T I O N S                         */
+/********************************************************************************/
+
+bool ds3_worker_init();
+void ds3_worker_deinit();
+void ds3_worker_data(void *p_buf, uint8_t p_data[const], uint16_t len);
+void ds3_worker_connection(bool is_connected);
+void ds3_worker_kick();
+
+
+/********************************************************************************/
+/*                       B A T C H   F U N C T I O N S                          */
+/********************************************************************************/
+
+#ifndef DS3_SKIP_BATCH
+bool ds3_batch_init();
+void ds3_batch_deinit();
+void ds3_batch_service();
+void ds3_batch_report(ds3_input_data_t *const p_data, ds3_event_t *const p_event);
+#else
+#define ds3_batch_init() (true)
+#define ds3_batch_deinit()
+#define ds3_batch_service()
+#define ds3_batch_report(p_data, p_event)
+#endif
+
+
+/********************************************************************************/
+/*                      B R I D G E   F U N C T I O N S                         */
+/********************************************************************************/
+
+#ifdef DS3_BRIDGE_ENABLE
+void ds3_bridge_report(ds3_input_data_t *const p_data, ds3_event_t *const p_event);
+void ds3_bridge_connection(uint8_t is_connected);
+#else
+#define ds3_bridge_report(p_data, p_event)
+#define ds3_bridge_connection(is_connected)
+#endif
+
+
+/********************************************************************************/
+/*                      E V E N T S   F U N C T I O N S                         */
+/********************************************************************************/
+
+void ds3_events_connection(uint8_t is_connected);
+void ds3_events_report(ds3_input_data_t *const p_data, ds3_event_t *const p_event);
+void ds3_events_status(ds3_status_t *const p_status);
+
+
+/********************************************************************************/
+/*                       M E R G E   F U N C T I O N S                          */
+/********************************************************************************/
+
+#ifndef DS3_SKIP_MERGE
+void ds3_merge_report(ds3_input_data_t *const p_data, ds3_event_t *const p_event);
+void ds3_merge_disconnect();
+#else
+#define ds3_merge_report(p_data, p_event)
+#define ds3_merge_disconnect()
+#endif
+
+
+/********************************************************************************/
+/*                     P A I R I N G   F U N C T I O N S                        */
+/********************************************************************************/
+
+esp_err_t ds3_pairing_nvs_init();
+void ds3_pairing_init();
+bool ds3_pairing_is_allowed(const uint8_t *bd_addr);
+
+
+/********************************************************************************/
+/*                      R E C O R D   F U N C T I O N S                         */
+/********************************************************************************/
+
+#ifndef DS3_SKIP_RECORD
+void ds3_record_report(ds3_input_data_t *const p_data, ds3_event_t *const p_event);
+#else
+#define ds3_record_report(p_data, p_event)
+#endif
+
+
+/********************************************************************************/
+/*                       R E M A P   F U N C T I O N S                          */
+/********************************************************************************/
+
+#ifndef DS3_SKIP_REMAP
+void ds3_remap_init();
+void ds3_remap_apply(ds3_input_data_t *const p_data);
+#else
+#define ds3_remap_init()
+#define ds3_remap_apply(p_data)
+#endif
+
+
+/********************************************************************************/
+/*                     R E Q U E S T   F U N C T I O N S                        */
+/********************************************************************************/
+
+void ds3_request_send(uint8_t slot, bool is_connected);
+bool ds3_request_has_room();
+bool ds3_request_reserve(uint8_t code);
+void ds3_request_sent(uint8_t code, bool success);
+void ds3_request_response(uint8_t p_data[const], uint16_t len);
+void ds3_request_tick(int64_t now);
+void ds3_request_reset();
+
+
+/********************************************************************************/
+/*                      R U M B L E   F U N C T I O N S                         */
+/********************************************************************************/
+
+void ds3_rumble_schedule(uint8_t right_intensity, uint32_t right_ms, uint8_t left_intensity, uint32_t left_ms);
+bool ds3_rumble_update(ds3_rumble_t *const p_rumble);
+void ds3_rumble_cancel();
+
+
+/********************************************************************************/
+/*                       T R A C E   F U N C T I O N S                          */
+/********************************************************************************/
+
+#ifdef DS3_TRACE_ENABLE
+#define DS3_TRACE(event, arg0, arg1) ds3_trace((event), (arg0), (arg1))
+#else
+#define DS3_TRACE(event, arg0, arg1)
+#endif
+
+void ds3_trace(uint8_t event, uint8_t arg0, uint16_t arg1);
+
+
+/********************************************************************************/
+/*                   T E L E M E T R Y   F U N C T I O N S                      */
+/********************************************************************************/
+
+void ds3_telemetry_connect(const uint8_t bd_addr[6]);
+void ds3_telemetry_report(int64_t now);
+void ds3_telemetry_missed(uint16_t count);
+void ds3_telemetry_send(bool success, bool congested);
+void ds3_telemetry_congestion(bool congested);
+void ds3_telemetry_rssi(int8_t rssi_delta);
 
 
 /********************************************************************************/
@@ -92,7 +514,12 @@ bool ds3_l2cap_send_data(uint8_t p_data[const], uint16_t len);
 /********************************************************************************/
 
 void ds3_parse_input(uint8_t p_packet[const], ds3_input_data_t *const p_data);
-void ds3_parse_output(ds3_output_data_t *const p_data, uint8_t p_packet[const]);
+void ds3_parse_nav_input(uint8_t p_packet[const], ds3_input_data_t *const p_data);
+void ds3_parse_extended(uint8_t p_packet[const], ds3_extended_t *const p_ext);
+void ds3_parse_output_init(uint8_t p_packet[const]);
+bool ds3_parse_output(ds3_output_data_t *const p_data, uint8_t p_packet[const]);
 void ds3_parse_event(ds3_input_data_t *const p_prev, ds3_input_data_t *const p_data, ds3_event_t *const p_event);
+bool ds3_parse_event_is_empty(ds3_event_t *const p_event);
+bool ds3_parse_status(ds3_status_monitor_t *const p_monitor, ds3_status_t *const p_status);
 
 #endif
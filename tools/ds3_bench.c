@@ -0,0 +1,391 @@
+/*
+ * Microbenchmark of the per-report input path: ds3_parse_input,
+ * ds3_parse_event and the dispatch of ds3_handle_data_event, the event
+ * callback and ds3_events_report to a subscriber, replayed over a packet trace,
+ * and of the cost ds3_events_report, with one and with DS3_SUBSCRIBER_MAX
+ * subscribers, and ds3_record_report while recording add to it. The output
+ * path is measured too: the bytes of the output report touched per send
+ * when it is patched in place, against rebuilding it on every send.
+ *
+ * On the host it is built once per configuration by tools/ds3_bench.py,
+ * which compiles src/ds3_parser.c, ds3_events.c and ds3_record.c into it. On the target add this file to
+ * the application and build it with the same DS3_PARSE_SKIP_* flags as the
+ * component, it then links against the component and runs from app_main.
+ *
+ * The trace is synthetic (sticks drifting, buttons pressed and released,
+ * sensor noise) unless a file of raw 48 byte input reports is given.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "ds3.h"
+#include "ds3_int.h"
+#define DS3_BENCH_CYCLES() ((uint64_t)esp_cpu_get_cycle_count())
+#define DS3_BENCH_NS()     ((uint64_t)esp_timer_get_time() * 1000)
+#else
+#include <time.h>
+#include "../src/ds3_parser.c"
+#undef DS3_TAG
+#include "../src/ds3_events.c"
+#undef DS3_TAG
+#include "../src/ds3_record.c"
+static uint64_t ds3_bench_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#define DS3_BENCH_NS() ds3_bench_ns()
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define DS3_BENCH_CYCLES() ((uint64_t)__rdtsc())
+#else
+#define DS3_BENCH_CYCLES() ds3_bench_ns()
+#endif
+#endif
+
+#ifndef DS3_BENCH_REPORTS
+#define DS3_BENCH_REPORTS 4096
+#endif
+#ifndef DS3_BENCH_ROUNDS
+#define DS3_BENCH_ROUNDS 16
+#endif
+#ifndef DS3_BENCH_SENDS
+#define DS3_BENCH_SENDS 4096
+#endif
+
+/* Offsets in the input report, see ds3_input_report_t */
+#define DS3_BENCH_BUTTON 1
+#define DS3_BENCH_STICK  5
+#define DS3_BENCH_ANALOG 13
+#define DS3_BENCH_STATUS 28
+#define DS3_BENCH_SENSOR 40
+
+static uint8_t ds3_bench_trace[DS3_BENCH_REPORTS][DS3_REPORT_BUFFER_SIZE];
+static uint32_t ds3_bench_count = 0;
+
+static volatile uint32_t ds3_bench_sink = 0;
+
+/* Output data of each send, see ds3_bench_synthesize_output */
+static ds3_output_data_t ds3_bench_outputs[DS3_BENCH_SENDS];
+
+/* Application callback, called through the pointer ds3SetEventCallback sets */
+static void ds3_bench_callback(ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    ds3_bench_sink += p_data->stick.lx + p_event->stick_changed.lx + p_event->button_down.cross;
+}
+static volatile ds3_event_callback_t ds3_bench_event_cb = ds3_bench_callback;
+
+static uint32_t ds3_bench_rand(uint32_t *p_state)
+{
+    *p_state = *p_state * 1664525u + 1013904223u;
+    return *p_state >> 16;
+}
+
+static void ds3_bench_synthesize()
+{
+    uint32_t seed = 1;
+    uint8_t button = 0;
+
+    for (uint32_t i = 0; i < DS3_BENCH_REPORTS; i++) {
+        uint8_t *p = ds3_bench_trace[i];
+
+        memset(p, 0, DS3_REPORT_BUFFER_SIZE);
+
+        /* A button changes roughly every 30 reports, its analog value follows */
+        if ((ds3_bench_rand(&seed) % 30) == 0) {
+            button ^= 1 << (ds3_bench_rand(&seed) % 8);
+        }
+        p[DS3_BENCH_BUTTON + 1] = button;
+        for (uint8_t b = 0; b < 8; b++) {
+            p[DS3_BENCH_ANALOG + 4 + b] = (button & (1 << b)) ? 0xC0 + (ds3_bench_rand(&seed) & 0x3F) : 0;
+        }
+
+        /* Slow stick sweeps with a little noise */
+        for (uint8_t s = 0; s < 4; s++) {
+            p[DS3_BENCH_STICK + s] = (uint8_t)(128 + ((i * (s + 1)) & 0x7F) - 64 + (ds3_bench_rand(&seed) & 0x3));
+        }
+
+        p[DS3_BENCH_STATUS + 1] = ds3_status_battery_high;
+
+        /* Sensor noise on every report, as the real controller does */
+        for (uint8_t s = 0; s < 4; s++) {
+            uint16_t value = 512 + (ds3_bench_rand(&seed) & 0xF);
+            p[DS3_BENCH_SENSOR + s * 2] = value >> 8;
+            p[DS3_BENCH_SENSOR + s * 2 + 1] = value & 0xFF;
+        }
+    }
+    ds3_bench_count = DS3_BENCH_REPORTS;
+}
+
+/* Sends as an application makes them: the player led set again and again,
+   now and then changed, and rumbles started and stopped */
+static void ds3_bench_synthesize_output()
+{
+    uint32_t seed = 2;
+    ds3_output_data_t data = { .led = { .led1 = 1 } };
+
+    for (uint32_t i = 0; i < DS3_BENCH_SENDS; i++) {
+        uint32_t r = ds3_bench_rand(&seed) % 16;
+
+        if (r == 0) {
+            uint8_t led = 1 << (ds3_bench_rand(&seed) % 4);
+            data.led = (ds3_led_t){ led & 1, (led >> 1) & 1, (led >> 2) & 1, (led >> 3) & 1 };
+        }
+        else if (r == 1) {
+            data.rumble = (ds3_rumble_t){ 0x10, ds3_bench_rand(&seed) & 0xFF, 0x10, ds3_bench_rand(&seed) & 0xFF };
+        }
+        else if (r == 2) {
+            memset(&data.rumble, 0, sizeof(data.rumble));
+        }
+        ds3_bench_outputs[i] = data;
+    }
+}
+
+/* As in ds3.c, a report carrying a rumble is sent even if unchanged */
+static bool ds3_bench_rumble_is_active(const ds3_rumble_t *const p_rumble)
+{
+    return (p_rumble->right_duration && p_rumble->right_intensity)
+        || (p_rumble->left_duration && p_rumble->left_intensity);
+}
+
+static uint32_t ds3_bench_changed(const hid_cmd_t *const p_before, const hid_cmd_t *const p_after)
+{
+    const uint8_t *p_old = (const uint8_t *)p_before;
+    const uint8_t *p_new = (const uint8_t *)p_after;
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < sizeof(hid_cmd_t); i++) {
+        count += (p_old[i] != p_new[i]);
+    }
+    return count;
+}
+
+/* Bytes touched per send, written or compared in the report and copied
+   into the L2CAP buffer, and the ns per send spent building the report.
+   The patched report is ds3SendCommand, the rebuilt one is the report
+   zeroed and filled on every send as before. */
+static void ds3_bench_output(bool patch, double *p_bytes, double *p_ns, double *p_skipped)
+{
+    static hid_cmd_t cmd, before;
+    uint64_t best = UINT64_MAX;
+    uint64_t bytes = 0;
+    uint32_t skipped = 0;
+    bool sent = false;
+
+    /* Count the bytes on one pass */
+    memset(&cmd, 0, sizeof(cmd));
+    ds3_parse_output_init(cmd.data);
+    for (uint32_t i = 0; i < DS3_BENCH_SENDS; i++) {
+        bool changed = true;
+
+        before = cmd;
+        if (patch) {
+            changed = ds3_parse_output(&ds3_bench_outputs[i], cmd.data);
+            bytes += sizeof(ds3_rumble_t) + sizeof(ds3_led_t) + ds3_bench_changed(&before, &cmd);
+        }
+        else {
+            memset(&cmd, 0, sizeof(cmd));
+            ds3_parse_output_init(cmd.data);
+            ds3_parse_output(&ds3_bench_outputs[i], cmd.data);
+            bytes += sizeof(cmd) + ds3_bench_changed(&(hid_cmd_t){ 0 }, &cmd);
+        }
+        if (!changed && sent && !ds3_bench_rumble_is_active(&ds3_bench_outputs[i].rumble)) {
+            skipped++;
+            continue;
+        }
+        bytes += sizeof(cmd);
+        sent = true;
+    }
+
+    /* Then time them */
+    for (uint32_t round = 0; round < DS3_BENCH_ROUNDS; round++) {
+        uint64_t start = DS3_BENCH_NS();
+
+        for (uint32_t i = 0; i < DS3_BENCH_SENDS; i++) {
+            if (!patch) {
+                memset(&cmd, 0, sizeof(cmd));
+                ds3_parse_output_init(cmd.data);
+            }
+            ds3_bench_sink += ds3_parse_output(&ds3_bench_outputs[i], cmd.data);
+        }
+
+        uint64_t elapsed = DS3_BENCH_NS() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    *p_bytes = (double)bytes / DS3_BENCH_SENDS;
+    *p_ns = (double)best / DS3_BENCH_SENDS;
+    *p_skipped = 100.0 * skipped / DS3_BENCH_SENDS;
+}
+
+#ifndef ESP_PLATFORM
+static bool ds3_bench_load(const char *p_path)
+{
+    FILE *p_file = fopen(p_path, "rb");
+
+    if (p_file == NULL) {
+        return false;
+    }
+    ds3_bench_count = fread(ds3_bench_trace, DS3_REPORT_BUFFER_SIZE, DS3_BENCH_REPORTS, p_file);
+    fclose(p_file);
+
+    return (ds3_bench_count > 0);
+}
+#endif
+
+/* Subscriber of the dispatch benchmark */
+static void ds3_bench_subscriber(void *p_ctx, ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    (void)p_ctx;
+    ds3_bench_sink += p_data->stick.lx + p_event->button_down.cross;
+}
+
+#ifndef DS3_SKIP_RECORD
+static void ds3_bench_record(ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    ds3_record_report(p_data, p_event);
+}
+#endif
+
+/* Time a stage adds to parsing each report, in ns per report */
+static double ds3_bench_stage(void (*p_stage)(ds3_input_data_t *const, ds3_event_t *const))
+{
+    static ds3_input_data_t data;
+    static ds3_event_t event;
+    uint64_t best[2] = { UINT64_MAX, UINT64_MAX };
+
+    for (uint32_t round = 0; round < DS3_BENCH_ROUNDS; round++) {
+        for (uint8_t staged = 0; staged < 2; staged++) {
+            memset(&data, 0, sizeof(data));
+            uint64_t start = DS3_BENCH_NS();
+
+            for (uint32_t i = 0; i < ds3_bench_count; i++) {
+                ds3_input_data_t prev = data;
+                ds3_parse_input(ds3_bench_trace[i], &data);
+                ds3_parse_event(&prev, &data, &event);
+                if (staged) {
+                    p_stage(&data, &event);
+                }
+            }
+
+            uint64_t elapsed = DS3_BENCH_NS() - start;
+            if (elapsed < best[staged]) {
+                best[staged] = elapsed;
+            }
+        }
+    }
+
+    return (best[1] > best[0]) ? (double)(best[1] - best[0]) / ds3_bench_count : 0;
+}
+
+/* Dispatch to `count` subscribers: every report for the first, the others
+   interested in the buttons, sticks or analog buttons in turn */
+static double ds3_bench_dispatch_to(uint8_t count)
+{
+    static const uint8_t masks[] = { ds3_interest_button, ds3_interest_stick, ds3_interest_analog };
+    const ds3_handlers_t handlers = { NULL, ds3_bench_subscriber, NULL };
+    int ids[DS3_SUBSCRIBER_MAX];
+    double ns;
+
+    for (uint8_t i = 0; i < count; i++) {
+        ids[i] = ds3Subscribe(&handlers, NULL, (i == 0) ? ds3_interest_report : masks[i % 3], 0);
+    }
+    ns = ds3_bench_stage(ds3_events_report);
+    for (uint8_t i = 0; i < count; i++) {
+        ds3Unsubscribe(ids[i]);
+    }
+
+    return ns;
+}
+
+static void ds3_bench_run()
+{
+    static ds3_input_data_t data;
+    static ds3_event_t event;
+    const ds3_handlers_t handlers = { NULL, ds3_bench_subscriber, NULL };
+    uint64_t best = UINT64_MAX;
+    int id = ds3Subscribe(&handlers, NULL, ds3_interest_report, 0);
+
+    for (uint32_t round = 0; round < DS3_BENCH_ROUNDS; round++) {
+        uint64_t start = DS3_BENCH_CYCLES();
+
+        for (uint32_t i = 0; i < ds3_bench_count; i++) {
+            ds3_input_data_t prev = data;
+            ds3_parse_input(ds3_bench_trace[i], &data);
+            ds3_parse_event(&prev, &data, &event);
+            ds3_bench_event_cb(&data, &event);
+            ds3_events_report(&data, &event);
+        }
+
+        uint64_t elapsed = DS3_BENCH_CYCLES() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+    ds3Unsubscribe(id);
+
+    /* One line per configuration, collected by tools/ds3_bench.py */
+    printf("cycles/report=%.1f state=%u event=%u reports=%u",
+           (double)best / ds3_bench_count,
+           (unsigned)sizeof(ds3_input_data_t), (unsigned)sizeof(ds3_event_t),
+           (unsigned)ds3_bench_count);
+    printf(" dispatch_ns/report=%.1f dispatch_max_ns/report=%.1f subscribers_max=%u",
+           ds3_bench_dispatch_to(1), ds3_bench_dispatch_to(DS3_SUBSCRIBER_MAX), (unsigned)DS3_SUBSCRIBER_MAX);
+    {
+        double bytes, ns, skipped;
+
+        ds3_bench_output(true, &bytes, &ns, &skipped);
+        printf(" output_bytes/send=%.1f output_ns/send=%.1f output_skipped=%.1f", bytes, ns, skipped);
+        ds3_bench_output(false, &bytes, &ns, &skipped);
+        printf(" rebuild_bytes/send=%.1f rebuild_ns/send=%.1f", bytes, ns);
+    }
+#ifndef DS3_SKIP_RECORD
+    {
+        /* The recording goes to /dev/null */
+        FILE *p_file = fopen("/dev/null", "wb");
+        if ((p_file != NULL) && ds3RecordStart(p_file)) {
+            printf(" record_ns/report=%.1f", ds3_bench_stage(ds3_bench_record));
+            ds3RecordStop();
+        }
+        if (p_file != NULL) {
+            fclose(p_file);
+        }
+    }
+#endif
+    printf("\n");
+}
+
+#ifdef ESP_PLATFORM
+void app_main(void)
+{
+    ds3_bench_synthesize();
+    ds3_bench_synthesize_output();
+    ds3_bench_run();
+}
+#else
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        if (!ds3_bench_load(argv[1])) {
+            fprintf(stderr, "cannot read reports from %s\n", argv[1]);
+            return 1;
+        }
+    }
+    else {
+        ds3_bench_synthesize();
+    }
+    ds3_bench_synthesize_output();
+    ds3_bench_run();
+
+    return 0;
+}
+#endif
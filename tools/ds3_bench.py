@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""Compare the per-report cost of the DS3_PARSE_SKIP_* configurations.
+
+Builds tools/ds3_bench.c on the host once per configuration, runs it over
+the same packet trace and prints cycles per report (TSC ticks on x86, ns
+elsewhere), parsing and dispatching to the event callback and a subscriber
+through ds3_events_report, next to the bytes of parser state kept per controller, and the
+ns per report that the subscriber dispatch, to one and to the most
+subscribers, and recording with ds3RecordStart add. The output report
+sends follow, patched in place against rebuilt on every send: the bytes
+of the report written, compared and copied to L2CAP per send, and the ns
+per send building it.
+
+    tools/ds3_bench.py                 # synthetic trace
+    tools/ds3_bench.py reports.bin     # raw 48 byte input reports
+"""
+import argparse
+import os
+import subprocess
+import tempfile
+
+CONFIGS = [
+    ("full", []),
+    ("skip analog changed", ["DS3_PARSE_SKIP_ANALOG_CHANGED"]),
+    ("skip analog", ["DS3_PARSE_SKIP_ANALOG"]),
+    ("skip sensor", ["DS3_PARSE_SKIP_SENSOR"]),
+    ("skip sensor+analog changed", ["DS3_PARSE_SKIP_SENSOR", "DS3_PARSE_SKIP_ANALOG_CHANGED"]),
+    ("skip sensor+analog", ["DS3_PARSE_SKIP_SENSOR", "DS3_PARSE_SKIP_ANALOG"]),
+]
+
+# The host has no ESP-IDF, the parser, the dispatch and the recorder only
+# need these headers and the configuration checks of ds3_int.h to pass. The
+# critical sections spin as on the target.
+SHIMS = {
+    "sdkconfig.h": "#define CONFIG_BT_ENABLED 1\n#define CONFIG_BLUEDROID_ENABLED 1\n"
+                   "#define CONFIG_CLASSIC_BT_ENABLED 1\n#define CONFIG_BT_L2CAP_ENABLED 1\n"
+                   "#define CONFIG_BTDM_CONTROLLER_MODE_BR_EDR_ONLY 1\n",
+    "esp_err.h": "typedef int esp_err_t;\n#define ESP_OK 0\n#define ESP_FAIL -1\n",
+    "esp_log.h": "#define ESP_LOGE(...)\n#define ESP_LOGW(...)\n#define ESP_LOGI(...)\n"
+                 "#define ESP_LOGD(...)\n#define ESP_LOGV(...)\n",
+    "freertos/FreeRTOS.h": "#include <stdint.h>\ntypedef uint32_t TickType_t;\ntypedef int portMUX_TYPE;\n"
+                           "#define portMUX_INITIALIZER_UNLOCKED 0\n"
+                           "#define portENTER_CRITICAL(mux) while (__atomic_exchange_n((mux), 1, __ATOMIC_ACQUIRE)) {}\n"
+                           "#define portEXIT_CRITICAL(mux) __atomic_store_n((mux), 0, __ATOMIC_RELEASE)\n",
+    "freertos/task.h": "typedef void *TaskHandle_t;\n"
+                       "static inline TaskHandle_t xTaskGetCurrentTaskHandle(void) { return (TaskHandle_t)1; }\n"
+                       "static inline void vTaskDelay(TickType_t ticks) { (void)ticks; }\n",
+}
+
+
+def build(cc, cflags, shim_dir, defines, out):
+    here = os.path.dirname(os.path.abspath(__file__))
+    cmd = [cc, *cflags, "-I", shim_dir, "-I", os.path.join(here, "..", "src", "include")]
+    cmd += ["-D" + define for define in defines]
+    cmd += [os.path.join(here, "ds3_bench.c"), "-o", out]
+    subprocess.run(cmd, check=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("trace", nargs="?", help="file of raw input reports")
+    parser.add_argument("--cc", default="cc")
+    parser.add_argument("--cflags", default="-O2", help="compiler flags, e.g. \"-Os -m32\"")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, content in SHIMS.items():
+            os.makedirs(os.path.dirname(os.path.join(tmp, name)), exist_ok=True)
+            with open(os.path.join(tmp, name), "w") as f:
+                f.write("#pragma once\n" + content)
+
+        rows = []
+        for name, defines in CONFIGS:
+            binary = os.path.join(tmp, "ds3_bench")
+            build(args.cc, args.cflags.split(), tmp, defines, binary)
+            output = subprocess.run([binary] + ([args.trace] if args.trace else []),
+                                    check=True, capture_output=True, text=True).stdout
+            fields = dict(field.split("=") for field in output.split())
+            rows.append((name, float(fields["cycles/report"]), int(fields["state"]), int(fields["event"]),
+                         float(fields["dispatch_ns/report"]), float(fields["dispatch_max_ns/report"]),
+                         float(fields.get("record_ns/report", "nan"))))
+            subscribers = int(fields["subscribers_max"])
+            if len(rows) == 1:
+                sends = fields
+
+    base = rows[0][1]
+    print("%-28s %14s %8s %11s %11s %12s %12s %10s" % ("configuration", "cycles/report", "vs full", "state bytes",
+                                                      "event bytes", "dispatch ns", "x%d ns" % subscribers, "record ns"))
+    for name, cycles, state, event, dispatch, dispatch_max, record in rows:
+        print("%-28s %14.1f %7.0f%% %11d %11d %12.1f %12.1f %10.1f" % (name, cycles, 100.0 * cycles / base, state, event,
+                                                                     dispatch, dispatch_max, record))
+
+    print()
+    print("%-28s %14s %12s %10s" % ("output report", "bytes/send", "ns/send", "skipped"))
+    print("%-28s %14.1f %12.1f %9.1f%%" % ("patched in place", float(sends["output_bytes/send"]),
+                                          float(sends["output_ns/send"]), float(sends["output_skipped"])))
+    print("%-28s %14.1f %12.1f %9.1f%%" % ("rebuilt", float(sends["rebuild_bytes/send"]),
+                                          float(sends["rebuild_ns/send"]), 0.0))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+"""Decode the frames streamed by ds3BridgeStart().
+
+Usable as a library (Decoder.feed returns the decoded frames and keeps the
+merged controller state) or from the command line, reading a serial port,
+a pty or a captured file:
+
+    tools/ds3_bridge.py /dev/ttyUSB0 --baud 921600
+    tools/ds3_bridge.py /dev/ttyUSB0 --baud 921600 --stats
+    tools/ds3_bridge.py --loopback     # decode the frames of src/ds3_bridge.c
+
+The frame timestamps are the target's clock, so the latency printed with
+--stats is relative to the fastest frame seen (the clock offset is unknown),
+next to the wire time of the frame at the given baud rate.
+
+--loopback builds the component on the host with tools/ds3_sim.py, streams
+a simulated session over the bridge into the mock UART and decodes the
+captured bytes, so the encoder and this decoder are checked against each
+other.
+"""
+import argparse
+import os
+import re
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+SYNC = 0xA5
+HEADER = 8
+
+TYPE_REPORT = 0x01
+TYPE_CONNECTION = 0x02
+
+# Groups in frame order, with their sizes, keep in sync with src/ds3_bridge.c
+GROUP_BUTTON = 0x01
+GROUP_STICK = 0x02
+GROUP_ANALOG = 0x04
+GROUP_SENSOR = 0x08
+GROUP_STATUS = 0x10
+GROUPS = [(GROUP_BUTTON, 3), (GROUP_STICK, 4), (GROUP_ANALOG, 12), (GROUP_SENSOR, 8), (GROUP_STATUS, 3)]
+
+
+def crc8(data):
+    crc = 0
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+
+def encode(frame_type, seq, time_us, payload):
+    """Build a frame as the target does, for tests and stand-ins."""
+    body = bytes([len(payload) + 6, frame_type, seq & 0xFF]) + struct.pack("<I", time_us & 0xFFFFFFFF) + payload
+    return bytes([SYNC]) + body + bytes([crc8(body)])
+
+
+class Decoder:
+    def __init__(self):
+        self.buffer = bytearray()
+        self.state = {
+            "connected": False,
+            "button": 0,
+            "stick": [0, 0, 0, 0],
+            "analog": [0] * 12,
+            "sensor": [0, 0, 0, 0],
+            "status": [0, 0, 0],
+        }
+        self.frames = 0
+        self.bytes = 0
+        self.crc_errors = 0
+        self.lost = 0
+        self.seq = None
+
+    def feed(self, data):
+        """Decode the complete frames in data, returns (type, seq, time_us) tuples."""
+        self.buffer += data
+        frames = []
+        while True:
+            start = self.buffer.find(SYNC)
+            if start < 0:
+                self.buffer.clear()
+                break
+            del self.buffer[:start]
+            if len(self.buffer) < 2:
+                break
+            size = self.buffer[1] + 3
+            if size < HEADER + 1:
+                del self.buffer[:1]
+                continue
+            if len(self.buffer) < size:
+                break
+            frame = bytes(self.buffer[:size])
+            if crc8(frame[1:-1]) != frame[-1]:
+                # Not a frame start after all, resynchronise on the next sync byte
+                self.crc_errors += 1
+                del self.buffer[:1]
+                continue
+            del self.buffer[:size]
+            frames.append(self._apply(frame))
+        return frames
+
+    def _apply(self, frame):
+        frame_type, seq = frame[2], frame[3]
+        time_us = struct.unpack_from("<I", frame, 4)[0]
+        payload = frame[HEADER:-1]
+
+        if self.seq is not None:
+            self.lost += (seq - self.seq - 1) & 0xFF
+        self.seq = seq
+        self.frames += 1
+        self.bytes += len(frame)
+
+        if frame_type == TYPE_CONNECTION:
+            self.state["connected"] = bool(payload[0])
+        elif frame_type == TYPE_REPORT:
+            mask, pos = payload[0], 1
+            for group, size in GROUPS:
+                if not mask & group:
+                    continue
+                value = payload[pos:pos + size]
+                pos += size
+                if group == GROUP_BUTTON:
+                    self.state["button"] = int.from_bytes(value, "little")
+                elif group == GROUP_STICK:
+                    self.state["stick"] = list(struct.unpack("<4b", value))
+                elif group == GROUP_ANALOG:
+                    self.state["analog"] = list(value)
+                elif group == GROUP_SENSOR:
+                    self.state["sensor"] = list(struct.unpack("<4h", value))
+                elif group == GROUP_STATUS:
+                    self.state["status"] = list(value)
+        return frame_type, seq, time_us
+
+
+def open_port(path, baud):
+    fd = os.open(path, os.O_RDONLY | os.O_NOCTTY)
+    if os.isatty(fd) and baud:
+        import termios
+        import tty
+        tty.setraw(fd)
+        attrs = termios.tcgetattr(fd)
+        speed = getattr(termios, "B%d" % baud)
+        attrs[4] = attrs[5] = speed
+        termios.tcsetattr(fd, termios.TCSANOW, attrs)
+    return fd
+
+
+def loopback(cflags):
+    """Decode the frames the C encoder wrote to the mock UART."""
+    here = os.path.dirname(os.path.abspath(__file__))
+    with tempfile.TemporaryDirectory() as tmp:
+        capture = os.path.join(tmp, "bridge.bin")
+        sim = subprocess.run([sys.executable, os.path.join(here, "ds3_sim.py"), "-D", "DS3_BRIDGE_ENABLE",
+                              "--cflags=" + cflags, "--", "-t", "1", "-u", capture],
+                             stdout=subprocess.PIPE, universal_newlines=True)
+        match = re.search(r"^bridge\s+(\d+) frames, (\d+) bytes", sim.stdout, re.M)
+        if sim.returncode != 0 or not match:
+            sys.stdout.write(sim.stdout)
+            print("loopback FAILED: the simulator did not stream over the bridge")
+            return 1
+        with open(capture, "rb") as f:
+            stream = f.read()
+
+    # Line noise first, then the stream in odd chunks to cross the frame boundaries
+    decoder = Decoder()
+    frames = decoder.feed(b"\x00\xA5\x03")
+    for pos in range(0, len(stream), 7):
+        frames += decoder.feed(stream[pos:pos + 7])
+
+    types = [frame[0] for frame in frames]
+    state = decoder.state
+    ok = (len(frames) == int(match.group(1)) and decoder.bytes == int(match.group(2)) and decoder.lost == 0
+          and decoder.crc_errors == 0 and types[:1] == [TYPE_CONNECTION] and TYPE_REPORT in types
+          and types[-1] == TYPE_CONNECTION and not state["connected"])
+    print("loopback %s: %d/%s frames, %d/%s bytes, %d lost, %d crc errors" %
+          ("ok" if ok else "FAILED", len(frames), match.group(1), decoder.bytes, match.group(2),
+           decoder.lost, decoder.crc_errors))
+    return 0 if ok else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port", nargs="?", help="serial port, pty or captured file")
+    parser.add_argument("--baud", type=int, default=921600)
+    parser.add_argument("--stats", action="store_true", help="print statistics every second instead of the state")
+    parser.add_argument("--loopback", action="store_true", help="decode the frames of the C encoder, built on the host")
+    parser.add_argument("--cflags", default="-O2", help="compiler flags of the --loopback build")
+    args = parser.parse_args()
+
+    if args.loopback:
+        return loopback(args.cflags)
+    if not args.port:
+        parser.error("a port is required")
+
+    fd = open_port(args.port, args.baud)
+    decoder = Decoder()
+    offset = None
+    latency_max = 0.0
+    last = time.monotonic()
+
+    while True:
+        data = os.read(fd, 4096)
+        if not data:
+            break
+        now = time.monotonic()
+        for frame_type, seq, time_us in decoder.feed(data):
+            # Relative latency, against the smallest host minus target time seen
+            delta = now * 1e6 - time_us
+            offset = delta if offset is None else min(offset, delta)
+            latency_max = max(latency_max, delta - offset)
+            if not args.stats:
+                state = decoder.state
+                print("%u %d %06x %s %s %s %s" % (time_us, state["connected"], state["button"], state["stick"],
+                                                 state["analog"], state["sensor"], state["status"]))
+        if args.stats and now - last >= 1.0:
+            frames = max(decoder.frames, 1)
+            print("%d frames, %.1f bytes/frame, %.0f us wire/frame, %d lost, %d crc errors, %.0f us latency max" %
+                  (decoder.frames, decoder.bytes / frames, decoder.bytes / frames * 10e6 / args.baud,
+                   decoder.lost, decoder.crc_errors, latency_max))
+            last = now
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,115 @@
+/*
+ * Host microbenchmark of the C++ wrapper dispatch (src/include/ds3.hpp)
+ * against a plain C subscriber doing the same work.
+ *
+ * Both go through the same ds3_handlers_t function pointer call, as the
+ * component dispatch does, the wrapper only adds its trampoline, which the
+ * compiler folds into the handler member function. The subscriber table is
+ * a stand-in for the one of ds3_events.c.
+ *
+ *     c++ -O2 -std=c++11 -Isrc/include tools/ds3_cpp_bench.cpp -o ds3_cpp_bench
+ *     ./ds3_cpp_bench [reports]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "ds3.hpp"
+
+/* Stand-in of the subscriber table */
+static const ds3_handlers_t *bench_handlers;
+static void *bench_ctx;
+
+extern "C" int ds3Subscribe(const ds3_handlers_t *p_handlers, void *p_ctx, uint8_t, uint8_t)
+{
+    bench_handlers = p_handlers;
+    bench_ctx = p_ctx;
+    return 0;
+}
+
+extern "C" bool ds3Unsubscribe(int)
+{
+    bench_handlers = nullptr;
+    return true;
+}
+
+/* Plain C subscriber */
+struct bench_counts {
+    uint32_t presses;
+    int32_t stick;
+};
+
+static void bench_c_event(void *p_ctx, ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    bench_counts *p_counts = (bench_counts *)p_ctx;
+    if (p_event->button_down.cross) {
+        p_counts->presses++;
+    }
+    p_counts->stick += p_data->stick.lx;
+}
+
+static const ds3_handlers_t bench_c_handlers = { NULL, bench_c_event, NULL };
+
+/* Wrapper subscriber */
+struct BenchHandler {
+    bench_counts counts;
+
+    void onEvent(const ds3_input_data_t &data, const ds3_event_t &event)
+    {
+        if (ds3::pressed(event, ds3::button::cross)) {
+            counts.presses++;
+        }
+        counts.stick += data.stick.lx;
+    }
+};
+
+static_assert(ds3::Handlers<BenchHandler>::mask() == ds3_interest_report, "only onEvent is detected");
+
+/* The dispatch of one report, kept out of line like the component one */
+__attribute__((noinline)) static void bench_dispatch(ds3_input_data_t *p_data, ds3_event_t *p_event)
+{
+    if (bench_handlers && bench_handlers->event) {
+        bench_handlers->event(bench_ctx, p_data, p_event);
+    }
+}
+
+static double bench_run(uint32_t reports, ds3_input_data_t *p_data, ds3_event_t *p_event)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < reports; i++) {
+        p_data->stick.lx = (int8_t)i;
+        p_event->button_down.cross = (i & 0x0F) == 0;
+        bench_dispatch(p_data, p_event);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / reports;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t reports = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 0) : 50000000u;
+    ds3_input_data_t data = {};
+    ds3_event_t event = {};
+
+    bench_counts c_counts = {};
+    ds3Subscribe(&bench_c_handlers, &c_counts, ds3_interest_report, 0);
+    double c_ns = bench_run(reports, &data, &event);
+    ds3Unsubscribe(0);
+
+    BenchHandler handler = {};
+    double cpp_ns;
+    {
+        ds3::Subscription<BenchHandler> subscription(handler);
+        cpp_ns = bench_run(reports, &data, &event);
+    }
+
+    if (c_counts.presses != handler.counts.presses || c_counts.stick != handler.counts.stick) {
+        fprintf(stderr, "mismatch: c %u/%d, c++ %u/%d\n", c_counts.presses, c_counts.stick,
+                handler.counts.presses, handler.counts.stick);
+        return 1;
+    }
+
+    printf("%u reports\n", reports);
+    printf("  c callback    %6.2f ns/report\n", c_ns);
+    printf("  c++ wrapper   %6.2f ns/report (%+.1f%%)\n", cpp_ns, (cpp_ns - c_ns) * 100.0 / c_ns);
+    return 0;
+}
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""Report the RAM footprint of the esp32-ds3 component for one build.
+
+Static usage comes from the symbol sizes of the component objects (nm),
+stack usage from the .su files written by -fstack-usage (see
+CMakeLists.txt), and heap usage from the allocations the component makes,
+sized with the configured values (override them with -D NAME=VALUE when
+the build changes them). The objects are expected from the target
+toolchain; the machine they were built for is printed, with a warning when
+it is not an ESP32 core, as host objects differ in code size and alignment.
+
+    tools/ds3_footprint.py build/ --nm xtensa-esp32-elf-nm
+"""
+import argparse
+import collections
+import glob
+import os
+import subprocess
+
+# Defaults of src/include/ds3_int.h, and of the Bluedroid buffer used per output report
+DEFAULTS = {
+    "DS3_WORKER_STACK_SIZE": 3072,
+    "DS3_WORKER_QUEUE_SIZE": 8,
+    "DS3_WORKER_ITEM_SIZE": 24,
+    "BT_SMALL_BUFFER_SIZE": 660,
+}
+
+
+# ELF e_machine values of the ESP32 cores
+TARGET_MACHINES = {94: "Xtensa", 243: "RISC-V"}
+HOST_MACHINES = {3: "x86", 62: "x86-64", 40: "ARM", 183: "AArch64"}
+
+
+def elf_machine(obj):
+    with open(obj, "rb") as stream:
+        header = stream.read(20)
+    if len(header) < 20 or header[:4] != b"\x7fELF":
+        return None
+    return int.from_bytes(header[18:20], "little" if header[5] == 1 else "big")
+
+
+def objects(build_dir):
+    found = glob.glob(os.path.join(build_dir, "**", "ds3*.c.obj"), recursive=True)
+    found += glob.glob(os.path.join(build_dir, "**", "ds3*.c.o"), recursive=True)
+    return sorted(found)
+
+
+def static_usage(nm, obj):
+    usage = collections.Counter()
+    symbols = set()
+    output = subprocess.run([nm, "-S", "--size-sort", obj], check=True,
+                            capture_output=True, text=True).stdout
+    for line in output.splitlines():
+        parts = line.split()
+        if len(parts) != 4:
+            continue
+        size, kind, name = int(parts[1], 16), parts[2].lower(), parts[3]
+        symbols.add(name)
+        if kind in "bc":
+            usage["bss"] += size
+        elif kind in "dg":
+            usage["data"] += size
+        elif kind == "r":
+            usage["rodata"] += size
+        elif kind == "t":
+            usage["text"] += size
+    return usage, symbols
+
+
+def stack_usage(obj):
+    base = os.path.basename(obj)
+    name = base[:base.index(".c") + 2]
+    candidates = glob.glob(os.path.join(os.path.dirname(obj), name + "*.su"))
+    functions = []
+    for path in candidates:
+        with open(path) as stream:
+            for line in stream:
+                location, size, kind = line.rstrip("\n").split("\t")
+                functions.append((int(size), location.split(":")[-1], kind))
+    return sorted(functions, reverse=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("build_dir")
+    parser.add_argument("--nm", default="xtensa-esp32-elf-nm")
+    parser.add_argument("-D", dest="defines", action="append", default=[], metavar="NAME=VALUE")
+    args = parser.parse_args()
+
+    config = dict(DEFAULTS)
+    for define in args.defines:
+        name, value = define.split("=", 1)
+        config[name] = int(value, 0)
+
+    objs = objects(args.build_dir)
+    if not objs:
+        raise SystemExit("no ds3 objects found in %s" % args.build_dir)
+
+    machine = elf_machine(objs[0])
+    if machine in TARGET_MACHINES:
+        print("target: %s (e_machine %d)" % (TARGET_MACHINES[machine], machine))
+    else:
+        print("target: %s (e_machine %s)" % (HOST_MACHINES.get(machine, "unknown"), machine))
+        print("warning: host objects, not the target: sizes are indicative only, build with the ESP-IDF toolchain")
+
+    total = collections.Counter()
+    symbols = set()
+    print("%-22s %8s %8s %8s %8s %10s" % ("object", "data", "bss", "rodata", "text", "max stack"))
+    for obj in objs:
+        usage, names = static_usage(args.nm, obj)
+        symbols |= names
+        stack = stack_usage(obj)
+        total += usage
+        deepest = "%d %s" % stack[0][:2] if stack else "-"
+        print("%-22s %8d %8d %8d %8d %10s" % (os.path.basename(obj), usage["data"], usage["bss"],
+                                               usage["rodata"], usage["text"], deepest))
+    print("%-22s %8d %8d %8d %8d" % ("total", total["data"], total["bss"], total["rodata"], total["text"]))
+    print("static RAM: %d bytes" % (total["data"] + total["bss"]))
+
+    # Heap allocations made by the component
+    heap = [("output report buffer, per send, freed by L2CAP", config["BT_SMALL_BUFFER_SIZE"])]
+    # With DS3_MINIMAL the worker queue and stack are in the static RAM above
+    if ("ds3_worker_task" in symbols) and ("ds3_worker_stack" not in symbols):
+        heap.append(("worker task stack", config["DS3_WORKER_STACK_SIZE"]))
+        heap.append(("worker queue", config["DS3_WORKER_QUEUE_SIZE"] * config["DS3_WORKER_ITEM_SIZE"]))
+    print("heap:")
+    for name, size in heap:
+        print("  %-50s %6d" % (name, size))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""Decode a recording written by ds3RecordStart()/ds3RecordStop().
+
+Prints one CSV line per input report, or with --stats only the number of
+reports and the compression ratio against the raw ds3_input_data_t size.
+"""
+import argparse
+import sys
+
+MAGIC = b"DS3R"
+VERSION = 1
+
+FLAG_ANALOG = 0x01
+FLAG_SENSOR = 0x02
+
+TAG_BUTTON = 0x01
+TAG_STICK = 0x02
+TAG_ANALOG = 0x04
+TAG_SENSOR = 0x08
+TAG_STATUS = 0x10
+TAG_IDLE = 0x80
+
+# Keep in sync with the ds3_button_t bit order in src/include/ds3.h
+BUTTONS = ["select", "l3", "r3", "start", "up", "right", "down", "left",
+           "l2", "r2", "l1", "r1", "triangle", "circle", "cross", "square", "ps"]
+ANALOG = ["up", "right", "down", "left", "l2", "r2", "l1", "r1",
+          "triangle", "circle", "cross", "square"]
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def done(self):
+        return self.pos >= len(self.data)
+
+    def byte(self):
+        value = self.data[self.pos]
+        self.pos += 1
+        return value
+
+    def bytes(self, count):
+        value = self.data[self.pos:self.pos + count]
+        self.pos += count
+        return value
+
+    def varint(self):
+        value = shift = 0
+        while True:
+            byte = self.byte()
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if byte < 0x80:
+                return value
+
+    def delta(self):
+        value = self.varint()
+        return (value >> 1) ^ -(value & 1)
+
+
+def wrap(value, bits, signed):
+    value &= (1 << bits) - 1
+    if signed and value >= 1 << (bits - 1):
+        value -= 1 << bits
+    return value
+
+
+def decode(data):
+    if data[:4] != MAGIC or data[4] != VERSION:
+        raise ValueError("not a DS3 recording")
+    flags = data[5]
+    reader = Reader(data[6:])
+
+    state = {
+        "button": 0,
+        "stick": [0, 0, 0, 0],
+        "analog": [0] * 12,
+        "sensor": [0, 0, 0, 0],
+        "status": [0, 0, 0],
+    }
+
+    while not reader.done():
+        tag = reader.byte()
+        if tag & TAG_IDLE:
+            for _ in range(reader.varint()):
+                yield state
+            continue
+        if tag & TAG_BUTTON:
+            state["button"] ^= int.from_bytes(reader.bytes(3), "little")
+        if tag & TAG_STICK:
+            state["stick"] = [wrap(v + reader.delta(), 8, True) for v in state["stick"]]
+        if tag & TAG_ANALOG:
+            state["analog"] = [wrap(v + reader.delta(), 8, False) for v in state["analog"]]
+        if tag & TAG_SENSOR:
+            state["sensor"] = [wrap(v + reader.delta(), 16, True) for v in state["sensor"]]
+        if tag & TAG_STATUS:
+            state["status"] = list(reader.bytes(3))
+        yield state
+
+
+
+def raw_size(flags):
+    # Sizes of the ds3_input_data_t members
+    size = 3 + 4 + 3
+    if flags & FLAG_ANALOG:
+        size += 12
+    if flags & FLAG_SENSOR:
+        size += 8
+    return size
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("file")
+    parser.add_argument("--stats", action="store_true", help="only print the compression statistics")
+    args = parser.parse_args()
+
+    with open(args.file, "rb") as stream:
+        data = stream.read()
+    flags = data[5]
+
+    if not args.stats:
+        columns = BUTTONS + ["lx", "ly", "rx", "ry"]
+        if flags & FLAG_ANALOG:
+            columns += ["a_" + name for name in ANALOG]
+        if flags & FLAG_SENSOR:
+            columns += ["ax", "ay", "az", "gz"]
+        columns += ["cable", "battery", "connection"]
+        print(",".join(columns))
+
+    count = 0
+    for state in decode(data):
+        count += 1
+        if args.stats:
+            continue
+        row = [(state["button"] >> bit) & 1 for bit in range(len(BUTTONS))]
+        row += state["stick"]
+        if flags & FLAG_ANALOG:
+            row += state["analog"]
+        if flags & FLAG_SENSOR:
+            row += state["sensor"]
+        row += state["status"]
+        print(",".join(str(value) for value in row))
+
+    raw = count * raw_size(flags)
+    ratio = raw / len(data) if data else 0
+    print("%d reports, %d bytes recorded, %d bytes raw, ratio %.2f" % (count, len(data), raw, ratio),
+          file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
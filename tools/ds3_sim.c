@@ -0,0 +1,738 @@
+/*
+ * Load generator: virtual DS3 controllers played against the component.
+ *
+ * The component sources are built on the host with the mock stack of
+ * ds3_sim_idf.c, so the input path is the real one: the L2CAP callbacks of
+ * ds3_l2cap.c on the mock BT task, the optional worker task, the connection
+ * state machine ticked from the esp_timer task and the subscriber dispatch. Build and
+ * run it with tools/ds3_sim.py.
+ *
+ * Each virtual controller opens HIDC then HIDI, answers the configuration,
+ * waits for the enable report and streams input reports at its rate, with
+ * uniform jitter and random loss over the air, until it disconnects. The
+ * component serves one controller at a time, so the controllers take turns
+ * on the link, --rounds times over for a soak test.
+ *
+ * Every report carries a tag in the unused bytes after the sticks, the
+ * subscriber reads it back from ds3GetRawReport to measure the latency from
+ * the air to the callback. --sweep doubles the report rate until reports
+ * are dropped inside the host, which is the saturation point.
+ *
+ * The mock stack delays each page until it meets a page scan window of the
+ * host, so --gap, which leaves the host idle before every session, shows
+ * the connect latency at each step of the page scan backoff.
+ *
+ * --bridge streams the input over the bridge of ds3BridgeStart and writes
+ * the frames the mock UART receives to a file, tools/ds3_bridge.py decodes
+ * them.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "ds3_sim_idf.h"
+#include "ds3.h"
+
+#define DS3_SIM_CID_HIDC   0x40
+#define DS3_SIM_CID_HIDI   0x41
+#define DS3_SIM_REPORT_LEN 50
+#define DS3_SIM_TAG_OFFSET 11     /* unk2, between the sticks and the analog buttons */
+#define DS3_SIM_RING       65536  /* Send times by tag */
+#define DS3_SIM_SAMPLES    (1u << 24)
+#define DS3_SIM_WAIT_US    3000000  /* Above the longest page scan interval */
+#define DS3_SIM_DS3_RATE   100    /* Reports per second of a DS3 */
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+typedef struct {
+    uint32_t controllers;
+    uint32_t rounds;
+    double rate;           /* Reports per second */
+    uint32_t jitter_us;    /* Uniform, +/- */
+    double loss;           /* Probability of losing a report over the air */
+    double seconds;        /* Streaming time per session */
+    uint16_t queue_size;   /* BT task queue */
+    bool sweep;
+    double sweep_max;
+    bool suspend;          /* The host suspends at the end of the sessions */
+    double gap;            /* Idle time before each session, in seconds */
+    uint32_t backoff_ms;   /* Page scan fast time and backoff step, 0 for the defaults */
+    const char *p_bridge;  /* File receiving the bridge frames, NULL for no bridge */
+} ds3_sim_config_t;
+
+typedef struct {
+    double rate;
+    uint32_t sessions;
+    uint32_t failed;          /* Sessions that never reached streaming */
+    uint64_t sent;            /* Reports the controllers sent */
+    uint64_t lost_air;        /* Lost over the air, on purpose */
+    uint64_t lost_host;       /* Dropped by the BT task or the worker queue */
+    uint64_t delivered;       /* Reports seen by the subscriber */
+    uint64_t missed_reported; /* The component estimate of the lost reports */
+    uint64_t outputs;         /* Output reports received by the controllers */
+    double connect_ms_total;
+    double connect_ms_max;
+    uint32_t suspends;
+    uint32_t suspend_refused; /* Connections refused while suspended */
+    uint64_t resume_us_total;
+    uint32_t resume_us_max;
+    uint32_t full_cycle_us;   /* ds3Deinit and ds3Init */
+    uint32_t scan_connected;  /* Sessions streaming while the host was still page scanning */
+    double wall_s;
+    uint64_t cpu_us;
+    uint32_t *p_latency;      /* us, one per delivered report */
+    uint32_t latency_count;
+} ds3_sim_result_t;
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static const ds3_sim_config_t ds3_sim_defaults = {
+    .controllers = 1,
+    .rounds = 1,
+    .rate = 100,
+    .jitter_us = 1000,
+    .loss = 0,
+    .seconds = 2,
+    .queue_size = 32,
+    .sweep = false,
+    .sweep_max = 2000000,
+    .suspend = false,
+    .gap = 0,
+    .backoff_ms = 0,
+};
+
+/* Controller side, written by the L2CAP hooks */
+static atomic_bool ds3_sim_hidc_configured;
+static atomic_bool ds3_sim_enabled;
+static atomic_bool ds3_sim_refused;
+static atomic_uint_fast64_t ds3_sim_outputs;
+
+/* Host side, written by the subscriber */
+static atomic_bool ds3_sim_connected;
+static int64_t ds3_sim_connected_us;
+static int64_t ds3_sim_sent_us[DS3_SIM_RING];
+static ds3_sim_result_t *ds3_sim_current = NULL;
+static atomic_uint_fast64_t ds3_sim_delivered;
+static atomic_uint_fast64_t ds3_sim_missed;
+
+static uint64_t ds3_sim_rng = 0x9E3779B97F4A7C15ull;
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+static uint32_t ds3_sim_random()
+{
+    /* xorshift64*, reproducible between runs */
+    ds3_sim_rng ^= ds3_sim_rng >> 12;
+    ds3_sim_rng ^= ds3_sim_rng << 25;
+    ds3_sim_rng ^= ds3_sim_rng >> 27;
+    return (uint32_t)((ds3_sim_rng * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+static double ds3_sim_uniform()
+{
+    return ds3_sim_random() / 4294967296.0;
+}
+
+static void ds3_sim_sleep_until(int64_t time_us)
+{
+    int64_t delta = time_us - esp_timer_get_time();
+    struct timespec ts;
+
+    if (delta <= 0) {
+        return;
+    }
+    ts.tv_sec = delta / 1000000;
+    ts.tv_nsec = (delta % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
+static bool ds3_sim_wait(atomic_bool *p_flag, bool value)
+{
+    int64_t deadline = esp_timer_get_time() + DS3_SIM_WAIT_US;
+
+    while (atomic_load(p_flag) != value) {
+        /* A refused channel never completes */
+        if (atomic_load(&ds3_sim_refused) || (esp_timer_get_time() > deadline)) {
+            return false;
+        }
+        ds3_sim_sleep_until(esp_timer_get_time() + 200);
+    }
+    return true;
+}
+
+static void ds3_sim_post(uint8_t type, uint16_t cid, uint16_t psm, uint16_t result, const uint8_t *bd_addr)
+{
+    ds3_sim_bt_event_t event = { .type = type, .id = (uint8_t)cid, .cid = cid, .psm = psm, .result = result };
+
+    if (bd_addr != NULL) {
+        memcpy(event.bd_addr, bd_addr, sizeof(event.bd_addr));
+    }
+    ds3_sim_bt_post(&event);
+}
+
+static void ds3_sim_post_data(uint16_t cid, const uint8_t *p_data, uint16_t len)
+{
+    ds3_sim_bt_event_t event = { .type = ds3_sim_bt_data_ind, .cid = cid };
+
+    event.p_buf = ds3_sim_bt_buffer(p_data, len);
+    if (event.p_buf != NULL) {
+        ds3_sim_bt_post(&event);
+    }
+}
+
+/* A plausible input report, the sticks drift and a button toggles now and then */
+static void ds3_sim_report(uint8_t p_report[DS3_SIM_REPORT_LEN], uint32_t tag, uint32_t n)
+{
+    memset(p_report, 0, DS3_SIM_REPORT_LEN);
+    p_report[0] = 0xA1;
+    p_report[1] = 0x01;
+    p_report[4] = ((n / 50) & 1) ? 0x40 : 0x00;     /* cross */
+    p_report[7] = (uint8_t)(0x80 + (int8_t)(n & 0x1F));
+    p_report[8] = 0x80;
+    p_report[9] = (uint8_t)(0x80 - (int8_t)(n & 0x0F));
+    p_report[10] = 0x80;
+    memcpy(&p_report[DS3_SIM_TAG_OFFSET], &tag, sizeof(tag));
+    p_report[30] = 0x03;                            /* cable: unplugged */
+    p_report[31] = 0x05;                            /* battery: high */
+    p_report[32] = 0x16;                            /* connection: bluetooth, rumble off */
+    for (int i = 42; i < DS3_SIM_REPORT_LEN; i += 2) {
+        p_report[i] = (uint8_t)(ds3_sim_random() & 0x03); /* sensors at rest, with noise */
+        p_report[i + 1] = 0x02;
+    }
+}
+
+static int ds3_sim_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t ds3_sim_percentile(const ds3_sim_result_t *p_result, double p)
+{
+    if (p_result->latency_count == 0) {
+        return 0;
+    }
+    return p_result->p_latency[(uint32_t)(p * (p_result->latency_count - 1))];
+}
+
+
+/********************************************************************************/
+/*                         S U B S C R I B E R                                  */
+/********************************************************************************/
+
+static void ds3_sim_connection_cb(void *p_ctx, uint8_t is_connected)
+{
+    (void)p_ctx;
+    if (is_connected) {
+        ds3_sim_connected_us = esp_timer_get_time();
+    }
+    atomic_store(&ds3_sim_connected, is_connected != 0);
+}
+
+static void ds3_sim_event_cb(void *p_ctx, ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    ds3_sim_result_t *p_result = ds3_sim_current;
+    const uint8_t *p_raw = ds3GetRawReport(NULL);
+    uint32_t tag;
+
+    (void)p_ctx;
+    (void)p_event;
+    if ((p_result == NULL) || (p_raw == NULL)) {
+        return;
+    }
+    memcpy(&tag, &p_raw[DS3_SIM_TAG_OFFSET], sizeof(tag));
+    if (p_result->latency_count < DS3_SIM_SAMPLES) {
+        p_result->p_latency[p_result->latency_count++] =
+            (uint32_t)(esp_timer_get_time() - ds3_sim_sent_us[tag % DS3_SIM_RING]);
+    }
+    atomic_fetch_add(&ds3_sim_missed, p_data->missed);
+    atomic_fetch_add(&ds3_sim_delivered, 1);
+}
+
+static const ds3_handlers_t ds3_sim_handlers = {
+    ds3_sim_connection_cb,
+    ds3_sim_event_cb,
+    NULL,
+};
+
+
+/********************************************************************************/
+/*                  C O N T R O L L E R    S I D E    H O O K S                 */
+/********************************************************************************/
+
+void ds3_sim_on_connect_rsp(const uint8_t *bd_addr, uint8_t id, uint16_t cid, uint16_t result)
+{
+    (void)bd_addr; (void)id; (void)cid;
+    if ((result != L2CAP_CONN_OK) && (result != L2CAP_CONN_PENDING)) {
+        atomic_store(&ds3_sim_refused, true);
+    }
+}
+
+void ds3_sim_on_config_req(uint16_t cid)
+{
+    /* The controller configures its side and accepts the host side */
+    ds3_sim_post(ds3_sim_bt_config_ind, cid, 0, L2CAP_CFG_OK, NULL);
+    ds3_sim_post(ds3_sim_bt_config_cfm, cid, 0, L2CAP_CFG_OK, NULL);
+    if (cid == DS3_SIM_CID_HIDC) {
+        atomic_store(&ds3_sim_hidc_configured, true);
+    }
+}
+
+uint8_t ds3_sim_on_data_write(uint16_t cid, const uint8_t *p_data, uint16_t len)
+{
+    static const uint8_t handshake_ok[] = { 0x00 };
+    uint8_t reply[DS3_SIM_REPORT_LEN] = { 0xA3, 0x00 };
+
+    if ((cid != DS3_SIM_CID_HIDC) || (len < 2)) {
+        return L2CAP_DW_FAILED;
+    }
+
+    switch (p_data[0] & 0xF0) {
+    case 0x50: /* SET_REPORT */
+        if (p_data[0] == 0x53 && p_data[1] == 0xF4) {
+            atomic_store(&ds3_sim_enabled, true);
+        }
+        else {
+            atomic_fetch_add(&ds3_sim_outputs, 1);
+        }
+        ds3_sim_post_data(DS3_SIM_CID_HIDC, handshake_ok, sizeof(handshake_ok));
+        break;
+    case 0x40: /* GET_REPORT, answered with a blank report of the same id */
+        reply[0] = 0xA0 | (p_data[0] & 0x03);
+        reply[1] = p_data[1];
+        ds3_sim_post_data(DS3_SIM_CID_HIDC, reply, sizeof(reply));
+        break;
+    default:
+        ds3_sim_post_data(DS3_SIM_CID_HIDC, handshake_ok, sizeof(handshake_ok));
+        break;
+    }
+    return L2CAP_DW_SUCCESS;
+}
+
+void ds3_sim_on_disconnect_req(uint16_t cid)
+{
+    ds3_sim_post(ds3_sim_bt_disconnect_cfm, cid, 0, L2CAP_CONN_OK, NULL);
+}
+
+
+/********************************************************************************/
+/*                            S E S S I O N S                                   */
+/********************************************************************************/
+
+/* The host suspends, which disconnects the controller; its reconnection
+   must be refused until the host resumes */
+static void ds3_sim_suspend(uint32_t controller, ds3_sim_result_t *p_result)
+{
+    const uint8_t bd_addr[6] = { 0x00, 0x19, 0xC1, 0x5A, (uint8_t)(controller >> 8), (uint8_t)controller };
+    int64_t start;
+    uint32_t resume_us;
+
+    if (!ds3Suspend() || !ds3IsSuspended()) {
+        p_result->failed++;
+        return;
+    }
+    p_result->suspends++;
+    ds3_sim_wait(&ds3_sim_connected, false);
+    ds3_sim_sleep_until(esp_timer_get_time() + 5000);
+
+    atomic_store(&ds3_sim_refused, false);
+    atomic_store(&ds3_sim_hidc_configured, false);
+    ds3_sim_post(ds3_sim_bt_connect_ind, DS3_SIM_CID_HIDC, BT_PSM_HIDC, 0, bd_addr);
+    if (!ds3_sim_wait(&ds3_sim_refused, true) || atomic_load(&ds3_sim_hidc_configured)) {
+        p_result->failed++;
+    }
+    else {
+        p_result->suspend_refused++;
+    }
+
+    start = esp_timer_get_time();
+    if (!ds3Resume()) {
+        p_result->failed++;
+        return;
+    }
+    resume_us = (uint32_t)(esp_timer_get_time() - start);
+    p_result->resume_us_total += resume_us;
+    if (resume_us > p_result->resume_us_max) {
+        p_result->resume_us_max = resume_us;
+    }
+}
+
+/* One controller: connect, stream for the configured time, disconnect */
+static void ds3_sim_session(const ds3_sim_config_t *p_config, uint32_t controller, ds3_sim_result_t *p_result)
+{
+    const uint8_t bd_addr[6] = { 0x00, 0x19, 0xC1, 0x5A, (uint8_t)(controller >> 8), (uint8_t)controller };
+    const double period_us = 1000000.0 / p_config->rate;
+    uint8_t report[DS3_SIM_REPORT_LEN];
+    ds3_sim_bt_stats_t bt_before, bt_after;
+    ds3_worker_stats_t worker_before, worker_after;
+    int64_t start, base, end, due;
+    double connect_ms;
+    uint32_t jitter_us;
+    uint32_t n;
+    static uint32_t tag = 0;
+
+    atomic_store(&ds3_sim_hidc_configured, false);
+    atomic_store(&ds3_sim_enabled, false);
+    atomic_store(&ds3_sim_refused, false);
+    p_result->sessions++;
+
+    /* The controller stays off while the host backs off */
+    ds3_sim_sleep_until(esp_timer_get_time() + (int64_t)(p_config->gap * 1000000));
+
+    /* Open HIDC, then HIDI once HIDC is configured, as the DS3 does */
+    start = esp_timer_get_time();
+    ds3_sim_post(ds3_sim_bt_connect_ind, DS3_SIM_CID_HIDC, BT_PSM_HIDC, 0, bd_addr);
+    if (!ds3_sim_wait(&ds3_sim_hidc_configured, true)) {
+        p_result->failed++;
+        return;
+    }
+    ds3_sim_post(ds3_sim_bt_connect_ind, DS3_SIM_CID_HIDI, BT_PSM_HIDI, 0, bd_addr);
+    if (!ds3_sim_wait(&ds3_sim_enabled, true)) {
+        p_result->failed++;
+        goto disconnect;
+    }
+
+    ds3_sim_bt_stats(&bt_before);
+    ds3GetWorkerStats(&worker_before);
+    if (bt_before.connectable) {
+        p_result->scan_connected++;
+    }
+
+    /* The first report completes the connection */
+    ds3_sim_report(report, tag, 0);
+    ds3_sim_sent_us[tag++ % DS3_SIM_RING] = esp_timer_get_time();
+    p_result->sent++;
+    ds3_sim_post_data(DS3_SIM_CID_HIDI, report, sizeof(report));
+    if (!ds3_sim_wait(&ds3_sim_connected, true)) {
+        p_result->failed++;
+        goto disconnect;
+    }
+    connect_ms = (ds3_sim_connected_us - start) / 1000.0;
+    p_result->connect_ms_total += connect_ms;
+    if (connect_ms > p_result->connect_ms_max) {
+        p_result->connect_ms_max = connect_ms;
+    }
+
+    /* Stream, at the rate with jitter and loss. The jitter moves each report
+       around its nominal time, capped at half the period to keep them in order */
+    jitter_us = ((double)p_config->jitter_us < period_us / 2) ? p_config->jitter_us : (uint32_t)(period_us / 2);
+    base = esp_timer_get_time();
+    end = base + (int64_t)(p_config->seconds * 1000000);
+    for (n = 1; ; n++) {
+        due = base + (int64_t)(n * period_us);
+        if (due >= end) {
+            break;
+        }
+        if (jitter_us != 0) {
+            due += (int64_t)(ds3_sim_random() % (2 * jitter_us + 1)) - jitter_us;
+        }
+        ds3_sim_sleep_until(due);
+        if (ds3_sim_uniform() < p_config->loss) {
+            p_result->lost_air++;
+            continue;
+        }
+        ds3_sim_report(report, tag, n);
+        ds3_sim_sent_us[tag++ % DS3_SIM_RING] = esp_timer_get_time();
+        p_result->sent++;
+        ds3_sim_post_data(DS3_SIM_CID_HIDI, report, sizeof(report));
+    }
+
+    /* Let the host drain before reading its counters */
+    ds3_sim_sleep_until(esp_timer_get_time() + 20000);
+    ds3_sim_bt_stats(&bt_after);
+    ds3GetWorkerStats(&worker_after);
+    p_result->lost_host += (bt_after.dropped - bt_before.dropped) + (worker_after.dropped - worker_before.dropped);
+
+disconnect:
+    if (p_config->suspend) {
+        ds3_sim_suspend(controller, p_result);
+        return;
+    }
+    /* The controller closes HIDI, then HIDC */
+    ds3_sim_post(ds3_sim_bt_disconnect_ind, DS3_SIM_CID_HIDI, 0, true, NULL);
+    ds3_sim_post(ds3_sim_bt_disconnect_ind, DS3_SIM_CID_HIDC, 0, true, NULL);
+    ds3_sim_wait(&ds3_sim_connected, false);
+    /* The disconnection is ordered behind the reports, wait for the worker as well */
+    ds3_sim_sleep_until(esp_timer_get_time() + 5000);
+}
+
+static bool ds3_sim_run(const ds3_sim_config_t *p_config, double rate, ds3_sim_result_t *p_result)
+{
+    ds3_sim_config_t config = *p_config;
+    uint64_t cpu_start;
+    int64_t wall_start;
+
+    memset(p_result, 0, sizeof(*p_result));
+    p_result->rate = rate;
+    p_result->p_latency = malloc(DS3_SIM_SAMPLES * sizeof(uint32_t));
+    if (p_result->p_latency == NULL) {
+        return false;
+    }
+    config.rate = rate;
+    atomic_store(&ds3_sim_delivered, 0);
+    atomic_store(&ds3_sim_missed, 0);
+    atomic_store(&ds3_sim_outputs, 0);
+    ds3_sim_current = p_result;
+
+    cpu_start = ds3_sim_cpu_us();
+    wall_start = esp_timer_get_time();
+    for (uint32_t round = 0; round < config.rounds; round++) {
+        for (uint32_t controller = 0; controller < config.controllers; controller++) {
+            ds3_sim_session(&config, controller, p_result);
+        }
+    }
+    p_result->wall_s = (esp_timer_get_time() - wall_start) / 1e6;
+    p_result->cpu_us = ds3_sim_cpu_us() - cpu_start;
+
+    ds3_sim_current = NULL;
+    p_result->delivered = atomic_load(&ds3_sim_delivered);
+    p_result->missed_reported = atomic_load(&ds3_sim_missed);
+    p_result->outputs = atomic_load(&ds3_sim_outputs);
+    qsort(p_result->p_latency, p_result->latency_count, sizeof(uint32_t), ds3_sim_compare);
+    return true;
+}
+
+/* Page scan time, radio duty cycle and connect latency per backoff level */
+static void ds3_sim_print_scan(const ds3_sim_result_t *p_result)
+{
+    ds3_scan_stats_t stats;
+    ds3_sim_bt_stats_t bt;
+
+    ds3GetScanStats(&stats);
+    ds3_sim_bt_stats(&bt);
+
+    printf("page scan        %.2f s, duty %.2f%%, window %.2f ms, %s now; %u pages waited %.1f ms avg\n",
+           stats.scan_us / 1e6, stats.scan_us ? 100.0 * stats.radio_us / stats.scan_us : 0, stats.window * 0.625,
+           stats.scanning ? "scanning" : "off", bt.pages, bt.pages ? bt.page_wait_us / 1e3 / bt.pages : 0);
+    for (uint8_t level = 0; level < DS3_SCAN_LEVELS; level++) {
+        const ds3_scan_level_stats_t *p_level = &stats.levels[level];
+        if ((p_level->scan_us == 0) && (p_level->connects == 0)) {
+            continue;
+        }
+        uint32_t window = stats.window;
+        /* Level 0 scans interlaced, a window on each page train */
+        if (level == 0) {
+            window = (2U * window < p_level->interval) ? 2U * window : p_level->interval;
+        }
+        printf("  level %u        interval %7.2f ms, duty %6.2f%%, %8.2f s, %3u connects %8.1f ms avg\n", level,
+               p_level->interval * 0.625, 100.0 * window / p_level->interval, p_level->scan_us / 1e6,
+               p_level->connects, p_level->connects ? (double)p_level->connect_ms / p_level->connects : 0);
+    }
+    if (p_result->scan_connected != 0) {
+        printf("warning          %u sessions streamed while page scanning\n", p_result->scan_connected);
+    }
+}
+
+static void ds3_sim_print(const ds3_sim_config_t *p_config, const ds3_sim_result_t *p_result)
+{
+    /* The first report of every session completes the connection and is not dispatched */
+    uint64_t expected = p_result->sent - (p_result->sessions - p_result->failed);
+    ds3_sim_bt_stats_t bt;
+
+    ds3_sim_bt_stats(&bt);
+
+    printf("controllers      %u x %u rounds, %.0f reports/s, jitter +/-%u us, loss %.1f%%\n",
+           p_config->controllers, p_config->rounds, p_result->rate, p_config->jitter_us, p_config->loss * 100);
+    printf("sessions         %u, %u failed, connect %.2f ms avg %.2f ms max\n", p_result->sessions, p_result->failed,
+           p_result->sessions > p_result->failed ? p_result->connect_ms_total / (p_result->sessions - p_result->failed) : 0,
+           p_result->connect_ms_max);
+    printf("reports          %llu sent, %llu delivered, %llu lost in the air, %llu dropped by the host\n",
+           (unsigned long long)p_result->sent, (unsigned long long)p_result->delivered,
+           (unsigned long long)p_result->lost_air, (unsigned long long)p_result->lost_host);
+    printf("missed           %llu estimated by the component (%llu lost in the air)\n",
+           (unsigned long long)p_result->missed_reported, (unsigned long long)p_result->lost_air);
+    printf("throughput       %.0f reports/s delivered, %llu output reports\n",
+           p_result->delivered / p_result->wall_s, (unsigned long long)p_result->outputs);
+    printf("cpu              %.2f us/report (BT and component tasks)\n",
+           p_result->delivered ? (double)p_result->cpu_us / p_result->delivered : 0);
+    printf("latency us       p50 %u  p90 %u  p99 %u  p99.9 %u  max %u\n", ds3_sim_percentile(p_result, 0.5),
+           ds3_sim_percentile(p_result, 0.9), ds3_sim_percentile(p_result, 0.99), ds3_sim_percentile(p_result, 0.999),
+           ds3_sim_percentile(p_result, 1.0));
+    printf("stack            BT queue peak %u/%u, %u buffers outstanding\n", bt.peak_depth, p_config->queue_size, bt.buffers);
+    if (p_config->suspend) {
+        ds3_suspend_stats_t stats;
+        ds3GetSuspendStats(&stats);
+        printf("suspend          %u cycles, %u reconnections refused, resume %.1f us avg %u us max\n",
+               p_result->suspends, p_result->suspend_refused,
+               p_result->suspends ? (double)p_result->resume_us_total / p_result->suspends : 0, p_result->resume_us_max);
+        printf("                 full ds3Deinit and ds3Init %u us; last ds3Init %u us, ds3Resume %u us\n",
+               p_result->full_cycle_us, stats.init_us, stats.resume_us);
+    }
+    ds3_sim_print_scan(p_result);
+    if (p_result->delivered != expected - p_result->lost_host) {
+        printf("warning          %llu reports unaccounted for\n",
+               (unsigned long long)(expected - p_result->lost_host - p_result->delivered));
+    }
+}
+
+/* Doubles the rate until the host drops reports or cannot keep the pace */
+static void ds3_sim_sweep(const ds3_sim_config_t *p_config)
+{
+    ds3_sim_result_t result;
+    double saturation = 0;
+
+    printf("%12s %12s %10s %8s %10s %8s %8s %8s\n", "rate", "delivered/s", "dropped", "drop%", "cpu us", "p50 us", "p99 us",
+           "max us");
+    for (double rate = p_config->rate; rate <= p_config->sweep_max; rate *= 2) {
+        if (!ds3_sim_run(p_config, rate, &result)) {
+            break;
+        }
+        double throughput = result.delivered / result.wall_s;
+        double drop = result.sent ? 100.0 * result.lost_host / result.sent : 0;
+        printf("%12.0f %12.0f %10llu %7.2f%% %10.2f %8u %8u %8u\n", rate, throughput, (unsigned long long)result.lost_host,
+               drop, result.delivered ? (double)result.cpu_us / result.delivered : 0, ds3_sim_percentile(&result, 0.5),
+               ds3_sim_percentile(&result, 0.99), ds3_sim_percentile(&result, 1.0));
+        free(result.p_latency);
+        /* Saturated: the host drops reports, or the sessions fail */
+        if ((drop > 0.1) || (result.failed != 0)) {
+            break;
+        }
+        saturation = rate;
+    }
+    if (saturation > 0) {
+        printf("saturation above %.0f reports/s, %.0fx the %u reports/s of a DS3\n", saturation,
+               saturation / DS3_SIM_DS3_RATE, DS3_SIM_DS3_RATE);
+    }
+    else {
+        printf("saturated at the first rate\n");
+    }
+}
+
+static void ds3_sim_usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n N      virtual controllers, taking turns (%u)\n"
+            "  -c N      rounds over the controllers (%u)\n"
+            "  -r HZ     reports per second (%.0f), the start rate of --sweep\n"
+            "  -j US     jitter, +/-, at most half the period (%u)\n"
+            "  -l PCT    loss over the air, percent (%.0f)\n"
+            "  -t S      streaming time per session (%.0f)\n"
+            "  -q N      BT task queue size (%u)\n"
+            "  -s        sweep the rate up to the saturation\n"
+            "  -m HZ     highest rate of --sweep (%.0f)\n"
+            "  -p        suspend and resume the host instead of disconnecting the controllers\n"
+            "  -g S      idle time before each session, the host page scan backs off meanwhile (%.0f)\n"
+            "  -b MS     page scan fast time and backoff step, 0 for the component defaults (%u)\n"
+            "  -u FILE   stream the input over the bridge into FILE, needs DS3_BRIDGE_ENABLE\n"
+            "  -v        log the component, repeat for more\n",
+            name, ds3_sim_defaults.controllers, ds3_sim_defaults.rounds, ds3_sim_defaults.rate, ds3_sim_defaults.jitter_us,
+            ds3_sim_defaults.loss * 100, ds3_sim_defaults.seconds, ds3_sim_defaults.queue_size, ds3_sim_defaults.sweep_max,
+            ds3_sim_defaults.gap, ds3_sim_defaults.backoff_ms);
+}
+
+
+/********************************************************************************/
+/*                                 M A I N                                      */
+/********************************************************************************/
+
+int main(int argc, char **argv)
+{
+    ds3_sim_config_t config = ds3_sim_defaults;
+    ds3_sim_result_t result;
+    ds3_sim_bt_stats_t bt;
+    int status = 0;
+    int opt;
+
+    ds3_sim_log_level = 0;
+    while ((opt = getopt(argc, argv, "n:c:r:j:l:t:q:sm:pg:b:u:vh")) != -1) {
+        switch (opt) {
+        case 'n': config.controllers = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'c': config.rounds = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'r': config.rate = strtod(optarg, NULL); break;
+        case 'j': config.jitter_us = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'l': config.loss = strtod(optarg, NULL) / 100; break;
+        case 't': config.seconds = strtod(optarg, NULL); break;
+        case 'q': config.queue_size = (uint16_t)strtoul(optarg, NULL, 0); break;
+        case 's': config.sweep = true; break;
+        case 'm': config.sweep_max = strtod(optarg, NULL); break;
+        case 'p': config.suspend = true; break;
+        case 'g': config.gap = strtod(optarg, NULL); break;
+        case 'b': config.backoff_ms = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'u': config.p_bridge = optarg; break;
+        case 'v': ds3_sim_log_level++; break;
+        default:
+            ds3_sim_usage(argv[0]);
+            return 2;
+        }
+    }
+    if ((config.controllers == 0) || (config.rounds == 0) || (config.rate <= 0) || (config.queue_size == 0)) {
+        ds3_sim_usage(argv[0]);
+        return 2;
+    }
+
+    if (!ds3_sim_bt_start(config.queue_size) || !ds3Init() || (ds3Subscribe(&ds3_sim_handlers, NULL,
+        ds3_interest_connection | ds3_interest_report, 0) < 0)) {
+        fprintf(stderr, "initialization failed\n");
+        return 1;
+    }
+    if (config.backoff_ms != 0) {
+        ds3_scan_policy_t policy;
+        ds3GetScanPolicy(&policy);
+        policy.fast_ms = config.backoff_ms;
+        policy.step_ms = config.backoff_ms;
+        if (!ds3SetScanPolicy(&policy)) {
+            fprintf(stderr, "invalid page scan policy\n");
+            return 1;
+        }
+    }
+
+    if (config.p_bridge != NULL) {
+        ds3_sim_uart_capture(config.p_bridge);
+        if (!ds3BridgeStart(1, 17, 921600, ds3_bridge_group_button | ds3_bridge_group_stick |
+            ds3_bridge_group_analog | ds3_bridge_group_sensor | ds3_bridge_group_status)) {
+            fprintf(stderr, "bridge start failed\n");
+            return 1;
+        }
+    }
+
+    if (config.sweep) {
+        ds3_sim_sweep(&config);
+    }
+    else if (ds3_sim_run(&config, config.rate, &result)) {
+        if (config.suspend) {
+            /* Every cycle refused the reconnection, on the stack started once,
+               registering the services from the BT task only */
+            ds3_sim_bt_stats(&bt);
+            if ((result.failed != 0) || (result.suspends != result.sessions) ||
+                (result.suspend_refused != result.suspends) || (bt.inits != 1) || (bt.off_task != 0)) {
+                fprintf(stderr, "suspend check failed: %u failed, %u/%u suspended, %u refused, %u stack inits, "
+                        "%u calls off the BT task\n", result.failed, result.suspends, result.sessions,
+                        result.suspend_refused, bt.inits, bt.off_task);
+                status = 1;
+            }
+            /* Against the full teardown and rebuild that suspending replaces */
+            int64_t start = esp_timer_get_time();
+            ds3Deinit();
+            ds3Init();
+            result.full_cycle_us = (uint32_t)(esp_timer_get_time() - start);
+        }
+        ds3_sim_print(&config, &result);
+        free(result.p_latency);
+    }
+
+    if (config.p_bridge != NULL) {
+        ds3_bridge_stats_t stats;
+        ds3BridgeStop();
+        ds3GetBridgeStats(&stats);
+        printf("bridge           %u frames, %u bytes, %u dropped, %u reports\n", stats.frames, stats.bytes,
+               stats.dropped, stats.reports);
+    }
+
+    ds3Deinit();
+    ds3_sim_bt_stop();
+    return status;
+}
@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+"""Build and run the load generator of tools/ds3_sim.c on the host.
+
+The component sources are compiled against the mock stack of
+tools/ds3_sim_idf.c, with the component flags given by -D. The remaining
+arguments go to the simulator, see --help of the binary (-- -h). --test
+builds and runs the tests of tools/ds3_test.c instead, the remaining
+arguments select tests by name, and the exit status is non-zero on a
+failure.
+
+    tools/ds3_sim.py                                # one controller, 100 reports/s
+    tools/ds3_sim.py -- -n 4 -c 25 -t 1 -l 2        # soak: 100 sessions, 2% loss
+    tools/ds3_sim.py -D DS3_WORKER_ENABLE -- -s     # saturation sweep, with the worker
+    tools/ds3_sim.py --test                         # all the tests
+    tools/ds3_sim.py --test -D DS3_WORKER_ENABLE -- conn
+"""
+import argparse
+import glob
+import os
+import subprocess
+import sys
+import tempfile
+
+# IDF headers included by the component, all served by ds3_sim_idf.h
+HEADERS = [
+    "sdkconfig.h", "esp_log.h", "esp_err.h", "esp_timer.h", "esp_pm.h", "esp_mac.h",
+    "esp_bt.h", "esp_bt_main.h", "esp_bt_device.h", "esp_gap_bt_api.h",
+    "nvs.h", "nvs_flash.h", "driver/uart.h", "osi/allocator.h",
+    "freertos/FreeRTOS.h", "freertos/task.h", "freertos/queue.h", "freertos/semphr.h",
+    "stack/bt_types.h", "stack/btm_api.h", "stack/l2c_api.h", "stack/btu.h", "osi/thread.h",
+]
+
+# Shorter connection timeouts, to keep the tests quick, and a recording
+# buffer small enough to be written every few reports
+TEST_DEFINES = ["DS3_CONN_ENABLE_TIMEOUT_MS=100", "DS3_CONN_RECOVER_TIMEOUT_MS=200", "DS3_RECORD_BUFFER_SIZE=128"]
+
+
+def build(cc, cflags, defines, shim_dir, out, main="ds3_sim.c"):
+    here = os.path.dirname(os.path.abspath(__file__))
+    src = os.path.join(here, "..", "src")
+    cmd = [cc, "-std=gnu11", *cflags, "-pthread", "-D_GNU_SOURCE", "-I", shim_dir, "-I", here, "-I", os.path.join(src, "include")]
+    cmd += ["-D" + define for define in defines]
+    cmd += sorted(glob.glob(os.path.join(src, "*.c")))
+    cmd += [os.path.join(here, "ds3_sim_idf.c"), os.path.join(here, main), "-o", out]
+    subprocess.run(cmd, check=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-D", dest="defines", action="append", default=[], help="component flag, e.g. DS3_WORKER_ENABLE")
+    parser.add_argument("--cc", default="cc")
+    parser.add_argument("--cflags", default="-O2", help="compiler flags, e.g. \"-O2 -fsanitize=thread\"")
+    parser.add_argument("--test", action="store_true", help="build and run tools/ds3_test.c")
+    parser.add_argument("args", nargs=argparse.REMAINDER, help="simulator arguments or test names, after --")
+    args = parser.parse_args()
+    sim_args = args.args[1:] if args.args[:1] == ["--"] else args.args
+
+    with tempfile.TemporaryDirectory() as tmp:
+        for header in HEADERS:
+            path = os.path.join(tmp, header)
+            os.makedirs(os.path.dirname(path), exist_ok=True)
+            with open(path, "w") as f:
+                f.write("#include \"ds3_sim_idf.h\"\n")
+
+        binary = os.path.join(tmp, "ds3_sim")
+        if args.test:
+            build(args.cc, args.cflags.split(), TEST_DEFINES + args.defines, tmp, binary, "ds3_test.c")
+        else:
+            build(args.cc, args.cflags.split(), args.defines, tmp, binary)
+        return subprocess.run([binary] + sim_args).returncode
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,1181 @@
+/*
+ * Host mock of the ESP-IDF, FreeRTOS and Bluedroid API, see ds3_sim_idf.h.
+ */
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "ds3_sim_idf.h"
+
+#define DS3_SIM_TASK_MAX  4
+#define DS3_SIM_TIMER_MAX 8
+#define DS3_SIM_NVS_MAX   16
+#define DS3_SIM_NVS_BLOB  512
+#define DS3_SIM_CID_MAX   8
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+struct ds3_sim_queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    uint8_t *p_items;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    bool is_static;       /* Control and storage given by the caller */
+};
+_Static_assert(sizeof(struct ds3_sim_queue) <= sizeof(StaticQueue_t), "StaticQueue_t too small");
+
+struct ds3_sim_task {
+    pthread_t thread;
+    TaskFunction_t fn;
+    void *arg;
+    bool used;
+};
+
+struct ds3_sim_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    uint64_t period_us;
+    int64_t next_us;
+    bool active;
+    bool used;
+};
+
+typedef struct {
+    char name[16];
+    char key[16];
+    uint8_t data[DS3_SIM_NVS_BLOB];
+    size_t len;
+    bool used;
+} ds3_sim_nvs_entry_t;
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+int ds3_sim_log_level = 1;
+
+static struct ds3_sim_task ds3_sim_tasks[DS3_SIM_TASK_MAX];
+/* Handle of the current thread, the threads not created as tasks get their own */
+static __thread struct ds3_sim_task *ds3_sim_task_current = NULL;
+static __thread struct ds3_sim_task ds3_sim_task_thread;
+
+static pthread_mutex_t ds3_sim_timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ds3_sim_timer_cond = PTHREAD_COND_INITIALIZER;
+static struct ds3_sim_timer ds3_sim_timers[DS3_SIM_TIMER_MAX];
+static pthread_t ds3_sim_timer_thread;
+static bool ds3_sim_timer_started = false;
+
+static ds3_sim_nvs_entry_t ds3_sim_nvs[DS3_SIM_NVS_MAX];
+static char ds3_sim_nvs_names[DS3_SIM_NVS_MAX][16];
+static atomic_bool ds3_sim_nvs_failing;
+
+static atomic_uint ds3_sim_static_objects;
+
+static atomic_int ds3_sim_pm_held;
+static atomic_uint ds3_sim_pm_acquires;
+static atomic_uint ds3_sim_pm_unbalanced;
+
+static const char *ds3_sim_uart_path = NULL;
+static FILE *ds3_sim_uart_file = NULL;
+static atomic_bool ds3_sim_uart_installed;
+static atomic_uint ds3_sim_uart_writes;
+static atomic_uint ds3_sim_uart_closed_writes;
+
+static atomic_uint ds3_sim_buffers;
+static atomic_bool ds3_sim_connectable;
+
+/* Page scan, the window opens every interval from the time it was set */
+static pthread_mutex_t ds3_sim_scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint16_t ds3_sim_scan_window = BTM_DEFAULT_CONN_WINDOW;
+static uint16_t ds3_sim_scan_interval = BTM_DEFAULT_CONN_INTERVAL;
+static bool ds3_sim_scan_interlaced = false;
+static int64_t ds3_sim_scan_phase_us = 0;
+
+static tL2CAP_APPL_INFO *ds3_sim_l2cap_hidc = NULL;
+static tL2CAP_APPL_INFO *ds3_sim_l2cap_hidi = NULL;
+static uint16_t ds3_sim_cid_psm[DS3_SIM_CID_MAX];
+
+static pthread_mutex_t ds3_sim_bt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ds3_sim_bt_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ds3_sim_bt_space = PTHREAD_COND_INITIALIZER;
+static pthread_t ds3_sim_bt_thread;
+static ds3_sim_bt_event_t *ds3_sim_bt_queue = NULL;
+static uint16_t ds3_sim_bt_size = 0;
+static uint16_t ds3_sim_bt_head = 0;
+static uint16_t ds3_sim_bt_count = 0;
+static bool ds3_sim_bt_running = false;
+static ds3_sim_bt_stats_t ds3_sim_bt_counters;
+
+
+/********************************************************************************/
+/*                        E S P    E R R    A N D    L O G                      */
+/********************************************************************************/
+
+const char *esp_err_to_name(esp_err_t err)
+{
+    switch (err) {
+    case ESP_OK:                return "ESP_OK";
+    case ESP_FAIL:              return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:        return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:   return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_NVS_NOT_FOUND: return "ESP_ERR_NVS_NOT_FOUND";
+    default:                    return "ESP_ERR";
+    }
+}
+
+void ds3_sim_log(int level, const char *tag, const char *fmt, ...)
+{
+    va_list args;
+
+    if (level > ds3_sim_log_level) {
+        return;
+    }
+    va_start(args, fmt);
+    fprintf(stderr, "%c %s: ", "?EWI"[level], tag);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+
+/********************************************************************************/
+/*                              F R E E R T O S                                 */
+/********************************************************************************/
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct ds3_sim_queue *p_queue = calloc(1, sizeof(*p_queue));
+
+    if (p_queue == NULL) {
+        return NULL;
+    }
+    /* Semaphores have empty items */
+    p_queue->p_items = calloc(length, item_size ? item_size : 1);
+    if (p_queue->p_items == NULL) {
+        free(p_queue);
+        return NULL;
+    }
+    pthread_mutex_init(&p_queue->mutex, NULL);
+    pthread_cond_init(&p_queue->not_empty, NULL);
+    p_queue->length = length;
+    p_queue->item_size = item_size;
+    return p_queue;
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t *p_storage,
+                                 StaticQueue_t *p_buffer)
+{
+    struct ds3_sim_queue *p_queue = (struct ds3_sim_queue *)p_buffer;
+
+    if ((p_buffer == NULL) || ((p_storage == NULL) && (item_size != 0))) {
+        return NULL;
+    }
+    memset(p_queue, 0, sizeof(*p_queue));
+    pthread_mutex_init(&p_queue->mutex, NULL);
+    pthread_cond_init(&p_queue->not_empty, NULL);
+    p_queue->p_items = p_storage;
+    p_queue->length = length;
+    p_queue->item_size = item_size;
+    p_queue->is_static = true;
+    atomic_fetch_add(&ds3_sim_static_objects, 1);
+    return p_queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *p_item, TickType_t ticks)
+{
+    (void)ticks;
+
+    /* The component only sends without blocking */
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->count == queue->length) {
+        pthread_mutex_unlock(&queue->mutex);
+        return pdFALSE;
+    }
+    if (queue->item_size != 0) {
+        memcpy(&queue->p_items[((queue->head + queue->count) % queue->length) * queue->item_size], p_item, queue->item_size);
+    }
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+    return pdTRUE;
+}
+
+static void ds3_sim_unlock(void *p_mutex)
+{
+    pthread_mutex_unlock(p_mutex);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *p_item, TickType_t ticks)
+{
+    struct timespec deadline;
+    volatile int ret = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ticks / 1000;
+    deadline.tv_nsec += (long)(ticks % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    /* A task is only deleted while it waits on its queue */
+    pthread_cleanup_push(ds3_sim_unlock, &queue->mutex);
+    while ((queue->count == 0) && (ticks != 0) && (ret != ETIMEDOUT)) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        if (ticks == portMAX_DELAY) {
+            pthread_cond_wait(&queue->not_empty, &queue->mutex);
+        }
+        else {
+            ret = pthread_cond_timedwait(&queue->not_empty, &queue->mutex, &deadline);
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    }
+    pthread_cleanup_pop(0);
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->mutex);
+        return pdFALSE;
+    }
+    if (queue->item_size != 0) {
+        memcpy(p_item, &queue->p_items[queue->head * queue->item_size], queue->item_size);
+    }
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_mutex_unlock(&queue->mutex);
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+    UBaseType_t spaces;
+
+    pthread_mutex_lock(&queue->mutex);
+    spaces = queue->length - queue->count;
+    pthread_mutex_unlock(&queue->mutex);
+    return spaces;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    SemaphoreHandle_t sem = xQueueCreate(1, 0);
+
+    /* A mutex starts available */
+    if (sem != NULL) {
+        xSemaphoreGive(sem);
+    }
+    return sem;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->not_empty);
+    if (!queue->is_static) {
+        free(queue->p_items);
+        free(queue);
+    }
+}
+
+static void *ds3_sim_task_main(void *arg)
+{
+    struct ds3_sim_task *p_task = arg;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    ds3_sim_task_current = p_task;
+    p_task->fn(p_task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *p_handle, BaseType_t core)
+{
+    (void)name; (void)stack; (void)priority; (void)core;
+
+    for (int i = 0; i < DS3_SIM_TASK_MAX; i++) {
+        struct ds3_sim_task *p_task = &ds3_sim_tasks[i];
+        if (!p_task->used) {
+            p_task->fn = fn;
+            p_task->arg = arg;
+            if (pthread_create(&p_task->thread, NULL, ds3_sim_task_main, p_task) != 0) {
+                return pdFALSE;
+            }
+            p_task->used = true;
+            if (p_handle != NULL) {
+                *p_handle = p_task;
+            }
+            return pdPASS;
+        }
+    }
+    return pdFALSE;
+}
+
+unsigned int ds3_sim_static_created(void)
+{
+    return atomic_load(&ds3_sim_static_objects);
+}
+
+/* The mock task runs on a pthread, the stack given is only checked */
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                           UBaseType_t priority, StackType_t *p_stack, StaticTask_t *p_buffer,
+                                           BaseType_t core)
+{
+    TaskHandle_t handle = NULL;
+
+    if ((p_stack == NULL) || (p_buffer == NULL)) {
+        return NULL;
+    }
+    if (xTaskCreatePinnedToCore(fn, name, stack, arg, priority, &handle, core) != pdPASS) {
+        return NULL;
+    }
+    atomic_fetch_add(&ds3_sim_static_objects, 1);
+    return handle;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if ((task == NULL) || pthread_equal(task->thread, pthread_self())) {
+        task = NULL;
+        for (int i = 0; i < DS3_SIM_TASK_MAX; i++) {
+            if (ds3_sim_tasks[i].used && pthread_equal(ds3_sim_tasks[i].thread, pthread_self())) {
+                ds3_sim_tasks[i].used = false;
+            }
+        }
+        pthread_detach(pthread_self());
+        pthread_exit(NULL);
+    }
+    pthread_cancel(task->thread);
+    pthread_join(task->thread, NULL);
+    task->used = false;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return (ds3_sim_task_current != NULL) ? ds3_sim_task_current : &ds3_sim_task_thread;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec delay = { .tv_sec = ticks / 1000, .tv_nsec = (long)(ticks % 1000) * 1000000 };
+
+    nanosleep(&delay, NULL);
+}
+
+
+/********************************************************************************/
+/*                    E S P    T I M E R ,   P M ,   U A R T                    */
+/********************************************************************************/
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* The esp_timer task, callbacks run one at a time outside of the lock */
+static void *ds3_sim_timer_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&ds3_sim_timer_mutex);
+    for (;;) {
+        struct ds3_sim_timer *p_next = NULL;
+        int64_t now = esp_timer_get_time();
+
+        for (int i = 0; i < DS3_SIM_TIMER_MAX; i++) {
+            struct ds3_sim_timer *p_timer = &ds3_sim_timers[i];
+            if (p_timer->used && p_timer->active && ((p_next == NULL) || (p_timer->next_us < p_next->next_us))) {
+                p_next = p_timer;
+            }
+        }
+
+        if (p_next == NULL) {
+            pthread_cond_wait(&ds3_sim_timer_cond, &ds3_sim_timer_mutex);
+        }
+        else if (p_next->next_us > now) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            int64_t ns = deadline.tv_nsec + (p_next->next_us - now) * 1000;
+            deadline.tv_sec += ns / 1000000000;
+            deadline.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&ds3_sim_timer_cond, &ds3_sim_timer_mutex, &deadline);
+        }
+        else {
+            esp_timer_cb_t callback = p_next->callback;
+            void *cb_arg = p_next->arg;
+            /* Skip the periods missed, as skip_unhandled_events */
+            if (p_next->period_us == 0) {
+                p_next->active = false;
+            }
+            while (p_next->active && (p_next->next_us <= now)) {
+                p_next->next_us += p_next->period_us;
+            }
+            pthread_mutex_unlock(&ds3_sim_timer_mutex);
+            callback(cb_arg);
+            pthread_mutex_lock(&ds3_sim_timer_mutex);
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *p_args, esp_timer_handle_t *p_handle)
+{
+    esp_err_t ret = ESP_ERR_NO_MEM;
+
+    pthread_mutex_lock(&ds3_sim_timer_mutex);
+    if (!ds3_sim_timer_started) {
+        if (pthread_create(&ds3_sim_timer_thread, NULL, ds3_sim_timer_main, NULL) != 0) {
+            pthread_mutex_unlock(&ds3_sim_timer_mutex);
+            return ESP_FAIL;
+        }
+        ds3_sim_timer_started = true;
+    }
+    for (int i = 0; i < DS3_SIM_TIMER_MAX; i++) {
+        struct ds3_sim_timer *p_timer = &ds3_sim_timers[i];
+        if (!p_timer->used) {
+            memset(p_timer, 0, sizeof(*p_timer));
+            p_timer->callback = p_args->callback;
+            p_timer->arg = p_args->arg;
+            p_timer->used = true;
+            *p_handle = p_timer;
+            ret = ESP_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ds3_sim_timer_mutex);
+    return ret;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    pthread_mutex_lock(&ds3_sim_timer_mutex);
+    if (timer->active) {
+        pthread_mutex_unlock(&ds3_sim_timer_mutex);
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->period_us = 0;
+    timer->next_us = esp_timer_get_time() + (int64_t)timeout_us;
+    timer->active = true;
+    pthread_cond_signal(&ds3_sim_timer_cond);
+    pthread_mutex_unlock(&ds3_sim_timer_mutex);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    pthread_mutex_lock(&ds3_sim_timer_mutex);
+    if (timer->active) {
+        pthread_mutex_unlock(&ds3_sim_timer_mutex);
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->period_us = period_us;
+    timer->next_us = esp_timer_get_time() + (int64_t)period_us;
+    timer->active = true;
+    pthread_cond_signal(&ds3_sim_timer_cond);
+    pthread_mutex_unlock(&ds3_sim_timer_mutex);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    esp_err_t ret;
+
+    pthread_mutex_lock(&ds3_sim_timer_mutex);
+    ret = timer->active ? ESP_OK : ESP_ERR_INVALID_STATE;
+    timer->active = false;
+    pthread_mutex_unlock(&ds3_sim_timer_mutex);
+    return ret;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    pthread_mutex_lock(&ds3_sim_timer_mutex);
+    timer->active = false;
+    timer->used = false;
+    pthread_mutex_unlock(&ds3_sim_timer_mutex);
+    return ESP_OK;
+}
+
+struct ds3_sim_pm_lock {
+    int count;
+};
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t type, int arg, const char *name, esp_pm_lock_handle_t *p_handle)
+{
+    (void)type; (void)arg; (void)name;
+    *p_handle = calloc(1, sizeof(struct ds3_sim_pm_lock));
+    return (*p_handle != NULL) ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t lock)
+{
+    __atomic_add_fetch(&lock->count, 1, __ATOMIC_RELAXED);
+    atomic_fetch_add(&ds3_sim_pm_held, 1);
+    atomic_fetch_add(&ds3_sim_pm_acquires, 1);
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t lock)
+{
+    if (__atomic_sub_fetch(&lock->count, 1, __ATOMIC_RELAXED) < 0) {
+        __atomic_add_fetch(&lock->count, 1, __ATOMIC_RELAXED);
+        atomic_fetch_add(&ds3_sim_pm_unbalanced, 1);
+        return ESP_ERR_INVALID_STATE;
+    }
+    atomic_fetch_sub(&ds3_sim_pm_held, 1);
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_delete(esp_pm_lock_handle_t lock)
+{
+    free(lock);
+    return ESP_OK;
+}
+
+void ds3_sim_pm_stats(ds3_sim_pm_stats_t *p_stats)
+{
+    p_stats->held = atomic_load(&ds3_sim_pm_held);
+    p_stats->acquires = atomic_load(&ds3_sim_pm_acquires);
+    p_stats->unbalanced = atomic_load(&ds3_sim_pm_unbalanced);
+}
+
+esp_err_t uart_driver_install(int uart_num, int rx_size, int tx_size, int queue_size, void *p_queue, int flags)
+{
+    (void)uart_num; (void)rx_size; (void)tx_size; (void)queue_size; (void)p_queue; (void)flags;
+    if (ds3_sim_uart_path != NULL) {
+        ds3_sim_uart_file = fopen(ds3_sim_uart_path, "wb");
+        if (ds3_sim_uart_file == NULL) {
+            return ESP_FAIL;
+        }
+    }
+    atomic_store(&ds3_sim_uart_installed, true);
+    return ESP_OK;
+}
+
+esp_err_t uart_driver_delete(int uart_num)
+{
+    (void)uart_num;
+    atomic_store(&ds3_sim_uart_installed, false);
+    if (ds3_sim_uart_file != NULL) {
+        fclose(ds3_sim_uart_file);
+        ds3_sim_uart_file = NULL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t uart_param_config(int uart_num, const uart_config_t *p_config)
+{
+    (void)uart_num; (void)p_config;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(int uart_num, int tx, int rx, int rts, int cts)
+{
+    (void)uart_num; (void)tx; (void)rx; (void)rts; (void)cts;
+    return ESP_OK;
+}
+
+int uart_write_bytes(int uart_num, const void *p_src, size_t size)
+{
+    struct timespec copy = { .tv_nsec = 100000 };
+
+    (void)uart_num;
+    atomic_fetch_add(&ds3_sim_uart_writes, 1);
+    if (!atomic_load(&ds3_sim_uart_installed)) {
+        atomic_fetch_add(&ds3_sim_uart_closed_writes, 1);
+        return -1;
+    }
+    if (ds3_sim_uart_file != NULL) {
+        fwrite(p_src, 1, size, ds3_sim_uart_file);
+    }
+    /* The copy into the driver ring, long enough for a concurrent
+       uart_driver_delete to show */
+    nanosleep(&copy, NULL);
+    if (!atomic_load(&ds3_sim_uart_installed)) {
+        atomic_fetch_add(&ds3_sim_uart_closed_writes, 1);
+    }
+    return (int)size;
+}
+
+esp_err_t uart_wait_tx_done(int uart_num, TickType_t ticks)
+{
+    (void)uart_num; (void)ticks;
+    return ESP_OK;
+}
+
+void ds3_sim_uart_capture(const char *p_path)
+{
+    ds3_sim_uart_path = p_path;
+}
+
+void ds3_sim_uart_stats(ds3_sim_uart_stats_t *p_stats)
+{
+    p_stats->writes = atomic_load(&ds3_sim_uart_writes);
+    p_stats->closed_writes = atomic_load(&ds3_sim_uart_closed_writes);
+}
+
+
+/********************************************************************************/
+/*                                  N V S                                       */
+/********************************************************************************/
+
+esp_err_t nvs_flash_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+    memset(ds3_sim_nvs, 0, sizeof(ds3_sim_nvs));
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *p_handle)
+{
+    (void)mode;
+
+    for (int i = 0; i < DS3_SIM_NVS_MAX; i++) {
+        if ((ds3_sim_nvs_names[i][0] == '\0') || (strncmp(ds3_sim_nvs_names[i], name, 15) == 0)) {
+            strncpy(ds3_sim_nvs_names[i], name, 15);
+            *p_handle = (nvs_handle_t)i;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+    (void)handle;
+}
+
+static ds3_sim_nvs_entry_t *ds3_sim_nvs_find(nvs_handle_t handle, const char *key, bool create)
+{
+    ds3_sim_nvs_entry_t *p_free = NULL;
+
+    for (int i = 0; i < DS3_SIM_NVS_MAX; i++) {
+        ds3_sim_nvs_entry_t *p_entry = &ds3_sim_nvs[i];
+        if (!p_entry->used) {
+            p_free = (p_free != NULL) ? p_free : p_entry;
+        }
+        else if ((strcmp(p_entry->name, ds3_sim_nvs_names[handle]) == 0) && (strncmp(p_entry->key, key, 15) == 0)) {
+            return p_entry;
+        }
+    }
+    if (create && (p_free != NULL)) {
+        strncpy(p_free->name, ds3_sim_nvs_names[handle], 15);
+        strncpy(p_free->key, key, 15);
+        p_free->used = true;
+        return p_free;
+    }
+    return NULL;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *p_value, size_t *p_len)
+{
+    ds3_sim_nvs_entry_t *p_entry = ds3_sim_nvs_find(handle, key, false);
+
+    if (p_entry == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (p_value != NULL) {
+        if (*p_len < p_entry->len) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        memcpy(p_value, p_entry->data, p_entry->len);
+    }
+    *p_len = p_entry->len;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *p_value, size_t len)
+{
+    ds3_sim_nvs_entry_t *p_entry;
+
+    if (atomic_load(&ds3_sim_nvs_failing)) {
+        return ESP_FAIL;
+    }
+    if (len > DS3_SIM_NVS_BLOB) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    p_entry = ds3_sim_nvs_find(handle, key, true);
+    if (p_entry == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(p_entry->data, p_value, len);
+    p_entry->len = len;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    ds3_sim_nvs_entry_t *p_entry = ds3_sim_nvs_find(handle, key, false);
+
+    if (atomic_load(&ds3_sim_nvs_failing)) {
+        return ESP_FAIL;
+    }
+    if (p_entry == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    p_entry->used = false;
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    (void)handle;
+    return ESP_OK;
+}
+
+void ds3_sim_nvs_fail(bool fail)
+{
+    atomic_store(&ds3_sim_nvs_failing, fail);
+}
+
+
+/********************************************************************************/
+/*                    E S P    B T    A N D    B L U E D R O I D                */
+/********************************************************************************/
+
+esp_err_t esp_bt_mem_release(esp_bt_mode_t mode) { (void)mode; return ESP_OK; }
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t *p_cfg) { (void)p_cfg; return ESP_OK; }
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode) { (void)mode; return ESP_OK; }
+esp_err_t esp_bt_controller_disable(void) { return ESP_OK; }
+esp_err_t esp_bt_controller_deinit(void) { return ESP_OK; }
+esp_err_t esp_bluedroid_init(void)
+{
+    pthread_mutex_lock(&ds3_sim_bt_mutex);
+    ds3_sim_bt_counters.inits++;
+    pthread_mutex_unlock(&ds3_sim_bt_mutex);
+    return ESP_OK;
+}
+esp_err_t esp_bluedroid_enable(void) { return ESP_OK; }
+esp_err_t esp_bluedroid_disable(void) { return ESP_OK; }
+esp_err_t esp_bluedroid_deinit(void) { return ESP_OK; }
+esp_err_t esp_bt_dev_set_device_name(const char *name) { (void)name; return ESP_OK; }
+esp_err_t esp_base_mac_addr_set(const uint8_t *p_mac) { (void)p_mac; return ESP_OK; }
+esp_err_t esp_bt_gap_read_rssi_delta(esp_bd_addr_t remote_addr) { (void)remote_addr; return ESP_OK; }
+esp_err_t esp_bt_gap_register_callback(esp_bt_gap_cb_t callback) { (void)callback; return ESP_OK; }
+
+esp_err_t esp_bt_gap_set_scan_mode(esp_bt_connection_mode_t c_mode, esp_bt_discovery_mode_t d_mode)
+{
+    (void)d_mode;
+    /* BTA applies the default window and interval */
+    BTM_SetConnectability(c_mode == ESP_BT_CONNECTABLE ? BTM_CONNECTABLE : BTM_NON_CONNECTABLE,
+                          BTM_DEFAULT_CONN_WINDOW, BTM_DEFAULT_CONN_INTERVAL);
+    return ESP_OK;
+}
+
+void *osi_malloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (p != NULL) {
+        atomic_fetch_add(&ds3_sim_buffers, 1);
+    }
+    return p;
+}
+
+void osi_free(void *p)
+{
+    if (p != NULL) {
+        atomic_fetch_sub(&ds3_sim_buffers, 1);
+        free(p);
+    }
+}
+
+
+/********************************************************************************/
+/*                                 L 2 C A P                                    */
+/********************************************************************************/
+
+/* Bluedroid keeps its state unlocked, only the BT task may call it */
+static void ds3_sim_bt_check_task(void)
+{
+    if (!ds3_sim_bt_is_current()) {
+        pthread_mutex_lock(&ds3_sim_bt_mutex);
+        ds3_sim_bt_counters.off_task++;
+        pthread_mutex_unlock(&ds3_sim_bt_mutex);
+    }
+}
+
+uint16_t L2CA_Register(uint16_t psm, tL2CAP_APPL_INFO *p_cb_info)
+{
+    ds3_sim_bt_check_task();
+    if (psm == BT_PSM_HIDC) {
+        ds3_sim_l2cap_hidc = p_cb_info;
+    }
+    else if (psm == BT_PSM_HIDI) {
+        ds3_sim_l2cap_hidi = p_cb_info;
+    }
+    else {
+        return 0;
+    }
+    return psm;
+}
+
+void L2CA_Deregister(uint16_t psm)
+{
+    ds3_sim_bt_check_task();
+    if (psm == BT_PSM_HIDC) {
+        ds3_sim_l2cap_hidc = NULL;
+    }
+    else if (psm == BT_PSM_HIDI) {
+        ds3_sim_l2cap_hidi = NULL;
+    }
+}
+
+bool L2CA_ConnectRsp(BD_ADDR bd_addr, uint8_t id, uint16_t cid, uint16_t result, uint16_t status)
+{
+    (void)status;
+    ds3_sim_on_connect_rsp(bd_addr, id, cid, result);
+    return true;
+}
+
+bool L2CA_ConfigReq(uint16_t cid, tL2CAP_CFG_INFO *p_cfg)
+{
+    (void)p_cfg;
+    ds3_sim_on_config_req(cid);
+    return true;
+}
+
+bool L2CA_ConfigRsp(uint16_t cid, tL2CAP_CFG_INFO *p_cfg)
+{
+    (void)cid; (void)p_cfg;
+    return true;
+}
+
+bool L2CA_DisconnectReq(uint16_t cid)
+{
+    ds3_sim_on_disconnect_req(cid);
+    return true;
+}
+
+bool L2CA_DisconnectRsp(uint16_t cid)
+{
+    (void)cid;
+    return true;
+}
+
+uint8_t L2CA_DataWrite(uint16_t cid, BT_HDR *p_buf)
+{
+    /* L2CAP owns the buffer, whatever the result */
+    uint8_t result = ds3_sim_on_data_write(cid, &p_buf->data[p_buf->offset], p_buf->len);
+
+    osi_free(p_buf);
+    return result;
+}
+
+bool BTM_SetSecurityLevel(bool is_originator, const char *name, uint8_t service_id, uint16_t sec_level,
+                          uint16_t psm, uint32_t mx_proto_id, uint32_t mx_chan_id)
+{
+    (void)is_originator; (void)name; (void)service_id; (void)sec_level; (void)psm; (void)mx_proto_id; (void)mx_chan_id;
+    ds3_sim_bt_check_task();
+    return true;
+}
+
+tBTM_STATUS BTM_SetPageScanType(uint16_t scan_type)
+{
+    ds3_sim_bt_check_task();
+    if (scan_type > BTM_SCAN_TYPE_INTERLACED) {
+        return BTM_ILLEGAL_VALUE;
+    }
+    pthread_mutex_lock(&ds3_sim_scan_mutex);
+    ds3_sim_scan_interlaced = scan_type == BTM_SCAN_TYPE_INTERLACED;
+    pthread_mutex_unlock(&ds3_sim_scan_mutex);
+    return BTM_SUCCESS;
+}
+
+/* The ranges checked by Bluedroid */
+tBTM_STATUS BTM_SetConnectability(uint16_t page_mode, uint16_t window, uint16_t interval)
+{
+    ds3_sim_bt_check_task();
+    if (page_mode == BTM_CONNECTABLE) {
+        if ((window < 0x0011) || (window > 0x1000) || (interval < 0x0012) || (interval > 0x1000) || (window > interval)) {
+            return BTM_ILLEGAL_VALUE;
+        }
+        pthread_mutex_lock(&ds3_sim_scan_mutex);
+        ds3_sim_scan_window = window;
+        ds3_sim_scan_interval = interval;
+        ds3_sim_scan_phase_us = esp_timer_get_time();
+        pthread_mutex_unlock(&ds3_sim_scan_mutex);
+    }
+    atomic_store(&ds3_sim_connectable, page_mode == BTM_CONNECTABLE);
+    return BTM_SUCCESS;
+}
+
+
+/********************************************************************************/
+/*                         S I M U L A T O R    S I D E                         */
+/********************************************************************************/
+
+static tL2CAP_APPL_INFO *ds3_sim_bt_appl(uint16_t cid)
+{
+    uint16_t psm = ds3_sim_cid_psm[cid % DS3_SIM_CID_MAX];
+
+    return (psm == BT_PSM_HIDC) ? ds3_sim_l2cap_hidc : (psm == BT_PSM_HIDI) ? ds3_sim_l2cap_hidi : NULL;
+}
+
+/* Time until the page of a controller paging now meets a scan window, an
+   interlaced scan listens twice per interval */
+static int64_t ds3_sim_bt_page_wait(void)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t window_us, interval_us, position_us;
+
+    pthread_mutex_lock(&ds3_sim_scan_mutex);
+    window_us = (int64_t)ds3_sim_scan_window * 625;
+    interval_us = (int64_t)ds3_sim_scan_interval * 625;
+    if (ds3_sim_scan_interlaced) {
+        window_us = (2 * window_us < interval_us) ? 2 * window_us : interval_us;
+    }
+    position_us = (now - ds3_sim_scan_phase_us) % interval_us;
+    pthread_mutex_unlock(&ds3_sim_scan_mutex);
+
+    return (position_us < window_us) ? 0 : interval_us - position_us;
+}
+
+static void ds3_sim_bt_dispatch(ds3_sim_bt_event_t *p_event)
+{
+    tL2CAP_CFG_INFO cfg = { .result = p_event->result, .mtu_present = true, .mtu = 672 };
+    tL2CAP_APPL_INFO *p_appl;
+
+    if (p_event->type == ds3_sim_bt_connect_ind) {
+        ds3_sim_cid_psm[p_event->cid % DS3_SIM_CID_MAX] = p_event->psm;
+    }
+    p_appl = ds3_sim_bt_appl(p_event->cid);
+
+    switch (p_event->type) {
+    case ds3_sim_bt_connect_ind:
+        /* HIDC is opened right after the page, HIDI rides on the same link */
+        if ((p_event->psm == BT_PSM_HIDC) && atomic_load(&ds3_sim_connectable)) {
+            int64_t wait_us = ds3_sim_bt_page_wait();
+            struct timespec ts = { .tv_sec = wait_us / 1000000, .tv_nsec = (wait_us % 1000000) * 1000 };
+            nanosleep(&ts, NULL);
+            pthread_mutex_lock(&ds3_sim_bt_mutex);
+            ds3_sim_bt_counters.pages++;
+            ds3_sim_bt_counters.page_wait_us += (uint64_t)wait_us;
+            pthread_mutex_unlock(&ds3_sim_bt_mutex);
+        }
+        if (!atomic_load(&ds3_sim_connectable)) {
+            /* Not page scanning, the page times out */
+            ds3_sim_on_connect_rsp(p_event->bd_addr, p_event->id, p_event->cid, L2CAP_CONN_TIMEOUT);
+        }
+        else if (p_appl == NULL) {
+            /* No service on this PSM, refused by the stack itself */
+            ds3_sim_on_connect_rsp(p_event->bd_addr, p_event->id, p_event->cid, L2CAP_CONN_NO_PSM);
+        }
+        else {
+            p_appl->pL2CA_ConnectInd_Cb(p_event->bd_addr, p_event->cid, p_event->psm, p_event->id);
+        }
+        break;
+    case ds3_sim_bt_config_ind:
+        if (p_appl != NULL) {
+            p_appl->pL2CA_ConfigInd_Cb(p_event->cid, &cfg);
+        }
+        break;
+    case ds3_sim_bt_config_cfm:
+        if (p_appl != NULL) {
+            p_appl->pL2CA_ConfigCfm_Cb(p_event->cid, &cfg);
+        }
+        break;
+    case ds3_sim_bt_data_ind:
+        if (p_appl != NULL) {
+            p_appl->pL2CA_DataInd_Cb(p_event->cid, p_event->p_buf);
+        }
+        else {
+            osi_free(p_event->p_buf);
+        }
+        break;
+    case ds3_sim_bt_disconnect_ind:
+        if (p_appl != NULL) {
+            p_appl->pL2CA_DisconnectInd_Cb(p_event->cid, p_event->result != 0);
+        }
+        break;
+    case ds3_sim_bt_disconnect_cfm:
+        if (p_appl != NULL) {
+            p_appl->pL2CA_DisconnectCfm_Cb(p_event->cid, p_event->result);
+        }
+        break;
+    case ds3_sim_bt_congestion:
+        if (p_appl != NULL) {
+            p_appl->pL2CA_CongestionStatus_Cb(p_event->cid, p_event->result != 0);
+        }
+        break;
+    case ds3_sim_bt_call: {
+        /* btu_general_alarm_process */
+        TIMER_LIST_ENT *p_tle = p_event->p_arg;
+        if (p_tle->event == BTU_TTYPE_USER_FUNC) {
+            (*(tUSER_TIMEOUT_FUNC *)p_tle->param)(p_tle);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void *ds3_sim_bt_main(void *arg)
+{
+    ds3_sim_bt_event_t event;
+
+    (void)arg;
+    pthread_mutex_lock(&ds3_sim_bt_mutex);
+    for (;;) {
+        while (ds3_sim_bt_running && (ds3_sim_bt_count == 0)) {
+            pthread_cond_wait(&ds3_sim_bt_cond, &ds3_sim_bt_mutex);
+        }
+        if (ds3_sim_bt_count == 0) {
+            break;
+        }
+        event = ds3_sim_bt_queue[ds3_sim_bt_head];
+        ds3_sim_bt_head = (ds3_sim_bt_head + 1) % ds3_sim_bt_size;
+        ds3_sim_bt_count--;
+        pthread_cond_broadcast(&ds3_sim_bt_space);
+        pthread_mutex_unlock(&ds3_sim_bt_mutex);
+        ds3_sim_bt_dispatch(&event);
+        pthread_mutex_lock(&ds3_sim_bt_mutex);
+    }
+    pthread_mutex_unlock(&ds3_sim_bt_mutex);
+    return NULL;
+}
+
+bool ds3_sim_bt_start(uint16_t queue_size)
+{
+    ds3_sim_bt_queue = calloc(queue_size, sizeof(ds3_sim_bt_event_t));
+    if (ds3_sim_bt_queue == NULL) {
+        return false;
+    }
+    ds3_sim_bt_size = queue_size;
+    ds3_sim_bt_head = 0;
+    ds3_sim_bt_count = 0;
+    memset(&ds3_sim_bt_counters, 0, sizeof(ds3_sim_bt_counters));
+    ds3_sim_bt_running = true;
+    if (pthread_create(&ds3_sim_bt_thread, NULL, ds3_sim_bt_main, NULL) != 0) {
+        free(ds3_sim_bt_queue);
+        return false;
+    }
+    return true;
+}
+
+void ds3_sim_bt_stop(void)
+{
+    pthread_mutex_lock(&ds3_sim_bt_mutex);
+    ds3_sim_bt_running = false;
+    pthread_cond_signal(&ds3_sim_bt_cond);
+    pthread_cond_broadcast(&ds3_sim_bt_space);
+    pthread_mutex_unlock(&ds3_sim_bt_mutex);
+    pthread_join(ds3_sim_bt_thread, NULL);
+    free(ds3_sim_bt_queue);
+    ds3_sim_bt_queue = NULL;
+}
+
+bool ds3_sim_bt_post(const ds3_sim_bt_event_t *p_event)
+{
+    pthread_mutex_lock(&ds3_sim_bt_mutex);
+    if (!ds3_sim_bt_running || (ds3_sim_bt_count == ds3_sim_bt_size)) {
+        ds3_sim_bt_counters.dropped++;
+        pthread_mutex_unlock(&ds3_sim_bt_mutex);
+        osi_free(p_event->p_buf);
+        return false;
+    }
+    ds3_sim_bt_queue[(ds3_sim_bt_head + ds3_sim_bt_count) % ds3_sim_bt_size] = *p_event;
+    ds3_sim_bt_count++;
+    ds3_sim_bt_counters.posted++;
+    if (ds3_sim_bt_count > ds3_sim_bt_counters.peak_depth) {
+        ds3_sim_bt_counters.peak_depth = ds3_sim_bt_count;
+    }
+    pthread_cond_signal(&ds3_sim_bt_cond);
+    pthread_mutex_unlock(&ds3_sim_bt_mutex);
+    return true;
+}
+
+/* Posts from the stack itself wait for space, unlike the air events */
+bool btu_task_post(uint32_t sig, void *param, uint32_t timeout)
+{
+    ds3_sim_bt_event_t event = { .type = ds3_sim_bt_call, .p_arg = param };
+
+    if (sig != SIG_BTU_GENERAL_ALARM) {
+        return false;
+    }
+    pthread_mutex_lock(&ds3_sim_bt_mutex);
+    while (ds3_sim_bt_running && (ds3_sim_bt_count == ds3_sim_bt_size) && (timeout != 0)) {
+        pthread_cond_wait(&ds3_sim_bt_space, &ds3_sim_bt_mutex);
+    }
+    if (!ds3_sim_bt_running || (ds3_sim_bt_count == ds3_sim_bt_size)) {
+        pthread_mutex_unlock(&ds3_sim_bt_mutex);
+        return false;
+    }
+    ds3_sim_bt_queue[(ds3_sim_bt_head + ds3_sim_bt_count) % ds3_sim_bt_size] = event;
+    ds3_sim_bt_count++;
+    ds3_sim_bt_counters.calls++;
+    pthread_cond_signal(&ds3_sim_bt_cond);
+    pthread_mutex_unlock(&ds3_sim_bt_mutex);
+    return true;
+}
+
+bool ds3_sim_bt_is_current(void)
+{
+    return pthread_equal(pthread_self(), ds3_sim_bt_thread);
+}
+
+BT_HDR *ds3_sim_bt_buffer(const uint8_t *p_data, uint16_t len)
+{
+    BT_HDR *p_buf = osi_malloc(sizeof(BT_HDR) + L2CAP_MIN_OFFSET + len);
+
+    if (p_buf != NULL) {
+        memset(p_buf, 0, sizeof(BT_HDR));
+        p_buf->len = len;
+        p_buf->offset = L2CAP_MIN_OFFSET;
+        memcpy(&p_buf->data[p_buf->offset], p_data, len);
+    }
+    return p_buf;
+}
+
+void ds3_sim_bt_stats(ds3_sim_bt_stats_t *p_stats)
+{
+    pthread_mutex_lock(&ds3_sim_bt_mutex);
+    *p_stats = ds3_sim_bt_counters;
+    pthread_mutex_unlock(&ds3_sim_bt_mutex);
+    p_stats->buffers = atomic_load(&ds3_sim_buffers);
+    p_stats->connectable = atomic_load(&ds3_sim_connectable);
+    pthread_mutex_lock(&ds3_sim_scan_mutex);
+    p_stats->interlaced = ds3_sim_scan_interlaced;
+    p_stats->window = ds3_sim_scan_window;
+    p_stats->interval = ds3_sim_scan_interval;
+    pthread_mutex_unlock(&ds3_sim_scan_mutex);
+}
+
+static uint64_t ds3_sim_thread_cpu_us(pthread_t thread)
+{
+    struct timespec ts;
+    clockid_t clock;
+
+    if ((pthread_getcpuclockid(thread, &clock) != 0) || (clock_gettime(clock, &ts) != 0)) {
+        return 0;
+    }
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t ds3_sim_cpu_us(void)
+{
+    uint64_t total = ds3_sim_thread_cpu_us(ds3_sim_bt_thread);
+
+    for (int i = 0; i < DS3_SIM_TASK_MAX; i++) {
+        if (ds3_sim_tasks[i].used) {
+            total += ds3_sim_thread_cpu_us(ds3_sim_tasks[i].thread);
+        }
+    }
+    return total;
+}
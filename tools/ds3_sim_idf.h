@@ -0,0 +1,415 @@
+/*
+ * Host mock of the ESP-IDF, FreeRTOS and Bluedroid API used by the
+ * component, for tools/ds3_sim.c. tools/ds3_sim.py generates the IDF header
+ * names (esp_bt.h, stack/l2c_api.h, freertos/queue.h...) as one line shims
+ * including this file.
+ *
+ * Tasks, queues and the esp_timer task are pthreads, critical sections are
+ * recursive mutexes, NVS is in memory. The Bluedroid side is a "BT task"
+ * thread calling the registered L2CAP callbacks, fed by ds3_sim_bt_post; the
+ * L2CA_* calls of the component are forwarded to the ds3_sim_on_* hooks the
+ * simulator implements.
+ */
+#ifndef DS3_SIM_IDF_H
+#define DS3_SIM_IDF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/* sdkconfig.h */
+#define CONFIG_BT_ENABLED 1
+#define CONFIG_BLUEDROID_ENABLED 1
+#define CONFIG_CLASSIC_BT_ENABLED 1
+#define CONFIG_BT_L2CAP_ENABLED 1
+#define CONFIG_BTDM_CONTROLLER_MODE_BR_EDR_ONLY 1
+
+
+/********************************************************************************/
+/*                        E S P    E R R    A N D    L O G                      */
+/********************************************************************************/
+
+typedef int esp_err_t;
+#define ESP_OK                        0
+#define ESP_FAIL                      -1
+#define ESP_ERR_NO_MEM                0x101
+#define ESP_ERR_INVALID_ARG           0x102
+#define ESP_ERR_INVALID_STATE         0x103
+#define ESP_ERR_NOT_FOUND             0x105
+#define ESP_ERR_NOT_SUPPORTED         0x106
+#define ESP_ERR_NVS_NOT_FOUND         0x1102
+#define ESP_ERR_NVS_NO_FREE_PAGES     0x110d
+#define ESP_ERR_NVS_NEW_VERSION_FOUND 0x1110
+#define ESP_ERROR_CHECK(x)            ((void)(x))
+
+const char *esp_err_to_name(esp_err_t err);
+
+/* 0 silent, 1 errors, 2 warnings, 3 info */
+extern int ds3_sim_log_level;
+void ds3_sim_log(int level, const char *tag, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#define ESP_LOGE(tag, ...) ds3_sim_log(1, tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) ds3_sim_log(2, tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) ds3_sim_log(3, tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) ((void)(tag))
+#define ESP_LOGV(tag, ...) ((void)(tag))
+
+
+/********************************************************************************/
+/*                              F R E E R T O S                                 */
+/********************************************************************************/
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+
+#define pdTRUE            1
+#define pdFALSE           0
+#define pdPASS            1
+#define portMAX_DELAY     0xFFFFFFFFu
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define tskNO_AFFINITY    0x7FFFFFFF
+
+typedef struct {
+    pthread_mutex_t mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP }
+#define portENTER_CRITICAL(p_mux)      pthread_mutex_lock(&(p_mux)->mutex)
+#define portEXIT_CRITICAL(p_mux)       pthread_mutex_unlock(&(p_mux)->mutex)
+#define portENTER_CRITICAL_SAFE(p_mux) portENTER_CRITICAL(p_mux)
+#define portEXIT_CRITICAL_SAFE(p_mux)  portEXIT_CRITICAL(p_mux)
+
+typedef struct ds3_sim_queue *QueueHandle_t;
+typedef struct ds3_sim_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *arg);
+
+/* Large enough for a mock queue, checked in ds3_sim_idf.c */
+typedef struct { void *p_reserved[16]; } StaticQueue_t;
+typedef struct { void *p_reserved[4]; } StaticTask_t;
+typedef uint8_t StackType_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t *p_storage,
+                                 StaticQueue_t *p_buffer);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *p_item, TickType_t ticks);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *p_item, TickType_t ticks);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue);
+void vQueueDelete(QueueHandle_t queue);
+
+/* Semaphores are queues of empty items, as in FreeRTOS */
+typedef QueueHandle_t SemaphoreHandle_t;
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+#define xSemaphoreCreateBinary()       xQueueCreate(1, 0)
+#define xSemaphoreTake(sem, ticks)     xQueueReceive((sem), NULL, (ticks))
+#define xSemaphoreGive(sem)            xQueueSend((sem), NULL, 0)
+#define vSemaphoreDelete(sem)          vQueueDelete(sem)
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *p_handle, BaseType_t core);
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                           UBaseType_t priority, StackType_t *p_stack, StaticTask_t *p_buffer,
+                                           BaseType_t core);
+void vTaskDelete(TaskHandle_t task);
+/* Queues and tasks created from static buffers */
+unsigned int ds3_sim_static_created(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+void vTaskDelay(TickType_t ticks);
+
+
+/********************************************************************************/
+/*                    E S P    T I M E R ,   P M ,   U A R T                    */
+/********************************************************************************/
+
+typedef struct ds3_sim_timer *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *arg);
+typedef enum { ESP_TIMER_TASK } esp_timer_dispatch_t;
+typedef struct {
+    esp_timer_cb_t callback;
+    void *arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char *name;
+    bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+int64_t esp_timer_get_time(void);
+esp_err_t esp_timer_create(const esp_timer_create_args_t *p_args, esp_timer_handle_t *p_handle);
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us);
+esp_err_t esp_timer_stop(esp_timer_handle_t timer);
+esp_err_t esp_timer_delete(esp_timer_handle_t timer);
+
+typedef struct ds3_sim_pm_lock *esp_pm_lock_handle_t;
+typedef enum { ESP_PM_CPU_FREQ_MAX, ESP_PM_APB_FREQ_MAX, ESP_PM_NO_LIGHT_SLEEP } esp_pm_lock_type_t;
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t type, int arg, const char *name, esp_pm_lock_handle_t *p_handle);
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t lock);
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t lock);
+esp_err_t esp_pm_lock_delete(esp_pm_lock_handle_t lock);
+typedef struct {
+    int32_t held;            /* Acquisitions not released yet, over every lock */
+    uint32_t acquires;       /* esp_pm_lock_acquire calls */
+    uint32_t unbalanced;     /* Releases of a lock that was not held */
+} ds3_sim_pm_stats_t;
+void ds3_sim_pm_stats(ds3_sim_pm_stats_t *p_stats);
+
+#define UART_FIFO_LEN      128
+#define UART_PIN_NO_CHANGE (-1)
+typedef enum { UART_DATA_8_BITS = 3 } uart_word_length_t;
+typedef enum { UART_PARITY_DISABLE } uart_parity_t;
+typedef enum { UART_STOP_BITS_1 = 1 } uart_stop_bits_t;
+typedef enum { UART_HW_FLOWCTRL_DISABLE } uart_hw_flowcontrol_t;
+typedef enum { UART_SCLK_DEFAULT } uart_sclk_t;
+typedef struct {
+    int baud_rate;
+    uart_word_length_t data_bits;
+    uart_parity_t parity;
+    uart_stop_bits_t stop_bits;
+    uart_hw_flowcontrol_t flow_ctrl;
+    uint8_t rx_flow_ctrl_thresh;
+    uart_sclk_t source_clk;
+} uart_config_t;
+esp_err_t uart_driver_install(int uart_num, int rx_size, int tx_size, int queue_size, void *p_queue, int flags);
+esp_err_t uart_driver_delete(int uart_num);
+esp_err_t uart_param_config(int uart_num, const uart_config_t *p_config);
+esp_err_t uart_set_pin(int uart_num, int tx, int rx, int rts, int cts);
+int uart_write_bytes(int uart_num, const void *p_src, size_t size);
+esp_err_t uart_wait_tx_done(int uart_num, TickType_t ticks);
+/* Append the bytes written to the UART to a file from the next driver install,
+   NULL to discard them */
+void ds3_sim_uart_capture(const char *p_path);
+typedef struct {
+    uint32_t writes;         /* uart_write_bytes calls */
+    uint32_t closed_writes;  /* Of them, made without a driver installed */
+} ds3_sim_uart_stats_t;
+void ds3_sim_uart_stats(ds3_sim_uart_stats_t *p_stats);
+
+
+/********************************************************************************/
+/*                                  N V S                                       */
+/********************************************************************************/
+
+typedef uint32_t nvs_handle_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode_t;
+
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *p_handle);
+void nvs_close(nvs_handle_t handle);
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *p_value, size_t *p_len);
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *p_value, size_t len);
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key);
+esp_err_t nvs_commit(nvs_handle_t handle);
+/* Fail the writes until cleared, as a worn out or full flash would */
+void ds3_sim_nvs_fail(bool fail);
+
+
+/********************************************************************************/
+/*                    E S P    B T    A N D    B L U E D R O I D                */
+/********************************************************************************/
+
+typedef enum { ESP_BT_MODE_IDLE, ESP_BT_MODE_BLE, ESP_BT_MODE_CLASSIC_BT, ESP_BT_MODE_BTDM } esp_bt_mode_t;
+typedef struct { int unused; } esp_bt_controller_config_t;
+#define BT_CONTROLLER_INIT_CONFIG_DEFAULT() { 0 }
+
+esp_err_t esp_bt_mem_release(esp_bt_mode_t mode);
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t *p_cfg);
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode);
+esp_err_t esp_bt_controller_disable(void);
+esp_err_t esp_bt_controller_deinit(void);
+esp_err_t esp_bluedroid_init(void);
+esp_err_t esp_bluedroid_enable(void);
+esp_err_t esp_bluedroid_disable(void);
+esp_err_t esp_bluedroid_deinit(void);
+esp_err_t esp_bt_dev_set_device_name(const char *name);
+esp_err_t esp_base_mac_addr_set(const uint8_t *p_mac);
+
+typedef uint8_t esp_bd_addr_t[6];
+typedef enum { ESP_BT_NON_CONNECTABLE, ESP_BT_CONNECTABLE } esp_bt_connection_mode_t;
+typedef enum { ESP_BT_NON_DISCOVERABLE, ESP_BT_LIMITED_DISCOVERABLE, ESP_BT_GENERAL_DISCOVERABLE } esp_bt_discovery_mode_t;
+typedef enum { ESP_BT_GAP_READ_RSSI_DELTA_EVT = 5 } esp_bt_gap_cb_event_t;
+typedef enum { ESP_BT_STATUS_SUCCESS } esp_bt_status_t;
+typedef union {
+    struct {
+        esp_bd_addr_t bda;
+        esp_bt_status_t stat;
+        int8_t rssi_delta;
+    } read_rssi_delta;
+} esp_bt_gap_cb_param_t;
+typedef void (*esp_bt_gap_cb_t)(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *p_param);
+
+esp_err_t esp_bt_gap_set_scan_mode(esp_bt_connection_mode_t c_mode, esp_bt_discovery_mode_t d_mode);
+esp_err_t esp_bt_gap_read_rssi_delta(esp_bd_addr_t remote_addr);
+esp_err_t esp_bt_gap_register_callback(esp_bt_gap_cb_t callback);
+
+void *osi_malloc(size_t size);
+void osi_free(void *p);
+
+
+/********************************************************************************/
+/*                                 L 2 C A P                                    */
+/********************************************************************************/
+
+typedef uint8_t BD_ADDR[6];
+typedef struct {
+    uint16_t event;
+    uint16_t len;
+    uint16_t offset;
+    uint16_t layer_specific;
+    uint8_t data[];
+} BT_HDR;
+
+#define BT_SMALL_BUFFER_SIZE        660
+#define BT_PSM_HIDC                 0x0011
+#define BT_PSM_HIDI                 0x0013
+#define BTM_SEC_SERVICE_FIRST_EMPTY 51
+
+#define L2CAP_MIN_OFFSET            13
+#define L2CAP_DW_FAILED             0
+#define L2CAP_DW_SUCCESS            1
+#define L2CAP_DW_CONGESTED          2
+#define L2CAP_CONN_OK               0
+#define L2CAP_CONN_PENDING          1
+#define L2CAP_CONN_NO_PSM           2
+#define L2CAP_CONN_SECURITY_BLOCK   3
+#define L2CAP_CONN_NO_RESOURCES     4
+#define L2CAP_CONN_TIMEOUT          0xEEEE
+#define L2CAP_CFG_OK                0
+
+typedef uint8_t tBTM_STATUS;
+#define BTM_SUCCESS                 0
+#define BTM_CMD_STARTED             1
+#define BTM_ILLEGAL_VALUE           5
+#define BTM_NON_CONNECTABLE         0
+#define BTM_CONNECTABLE             1
+#define BTM_SCAN_TYPE_STANDARD      0
+#define BTM_SCAN_TYPE_INTERLACED    1
+#define BTM_DEFAULT_CONN_WINDOW     0x0012
+#define BTM_DEFAULT_CONN_INTERVAL   0x0800
+
+typedef struct {
+    uint16_t result;
+    bool mtu_present;
+    uint16_t mtu;
+} tL2CAP_CFG_INFO;
+
+typedef void (tL2CA_CONNECT_IND_CB)(BD_ADDR bd_addr, uint16_t cid, uint16_t psm, uint8_t id);
+typedef void (tL2CA_CONNECT_CFM_CB)(uint16_t cid, uint16_t result);
+typedef void (tL2CA_CONNECT_PND_CB)(uint16_t cid);
+typedef void (tL2CA_CONFIG_IND_CB)(uint16_t cid, tL2CAP_CFG_INFO *p_cfg);
+typedef void (tL2CA_CONFIG_CFM_CB)(uint16_t cid, tL2CAP_CFG_INFO *p_cfg);
+typedef void (tL2CA_DISCONNECT_IND_CB)(uint16_t cid, bool ack_needed);
+typedef void (tL2CA_DISCONNECT_CFM_CB)(uint16_t cid, uint16_t result);
+typedef void (tL2CA_QOS_VIOLATION_IND_CB)(BD_ADDR bd_addr);
+typedef void (tL2CA_DATA_IND_CB)(uint16_t cid, BT_HDR *p_buf);
+typedef void (tL2CA_CONGESTION_STATUS_CB)(uint16_t cid, bool congested);
+typedef void (tL2CA_TX_COMPLETE_CB)(uint16_t cid, uint16_t sdu_count);
+
+typedef struct {
+    tL2CA_CONNECT_IND_CB *pL2CA_ConnectInd_Cb;
+    tL2CA_CONNECT_CFM_CB *pL2CA_ConnectCfm_Cb;
+    tL2CA_CONNECT_PND_CB *pL2CA_ConnectPnd_Cb;
+    tL2CA_CONFIG_IND_CB *pL2CA_ConfigInd_Cb;
+    tL2CA_CONFIG_CFM_CB *pL2CA_ConfigCfm_Cb;
+    tL2CA_DISCONNECT_IND_CB *pL2CA_DisconnectInd_Cb;
+    tL2CA_DISCONNECT_CFM_CB *pL2CA_DisconnectCfm_Cb;
+    tL2CA_QOS_VIOLATION_IND_CB *pL2CA_QoSViolationInd_Cb;
+    tL2CA_DATA_IND_CB *pL2CA_DataInd_Cb;
+    tL2CA_CONGESTION_STATUS_CB *pL2CA_CongestionStatus_Cb;
+    tL2CA_TX_COMPLETE_CB *pL2CA_TxComplete_Cb;
+} tL2CAP_APPL_INFO;
+
+uint16_t L2CA_Register(uint16_t psm, tL2CAP_APPL_INFO *p_cb_info);
+void L2CA_Deregister(uint16_t psm);
+bool L2CA_ConnectRsp(BD_ADDR bd_addr, uint8_t id, uint16_t cid, uint16_t result, uint16_t status);
+bool L2CA_ConfigReq(uint16_t cid, tL2CAP_CFG_INFO *p_cfg);
+bool L2CA_ConfigRsp(uint16_t cid, tL2CAP_CFG_INFO *p_cfg);
+bool L2CA_DisconnectReq(uint16_t cid);
+bool L2CA_DisconnectRsp(uint16_t cid);
+uint8_t L2CA_DataWrite(uint16_t cid, BT_HDR *p_buf);
+bool BTM_SetSecurityLevel(bool is_originator, const char *name, uint8_t service_id, uint16_t sec_level,
+                          uint16_t psm, uint32_t mx_proto_id, uint32_t mx_chan_id);
+tBTM_STATUS BTM_SetPageScanType(uint16_t scan_type);
+tBTM_STATUS BTM_SetConnectability(uint16_t page_mode, uint16_t window, uint16_t interval);
+
+/* stack/btu.h and osi/thread.h, user function timers posted to the BT task */
+typedef void *TIMER_PARAM_TYPE;
+typedef struct _tle {
+    struct _tle *p_next;
+    struct _tle *p_prev;
+    int32_t ticks;
+    TIMER_PARAM_TYPE param;
+    uint16_t event;
+    uint8_t in_use;
+} TIMER_LIST_ENT;
+typedef void (tUSER_TIMEOUT_FUNC)(TIMER_LIST_ENT *p_tle);
+
+#define BTU_TTYPE_USER_FUNC    16
+#define SIG_BTU_GENERAL_ALARM  4
+#define OSI_THREAD_MAX_TIMEOUT 0xFFFFFFFFu
+
+bool btu_task_post(uint32_t sig, void *param, uint32_t timeout);
+
+
+/********************************************************************************/
+/*                         S I M U L A T O R    S I D E                         */
+/********************************************************************************/
+
+/* L2CAP events delivered on the BT task, from the remote device */
+typedef enum {
+    ds3_sim_bt_connect_ind,
+    ds3_sim_bt_config_ind,
+    ds3_sim_bt_config_cfm,
+    ds3_sim_bt_data_ind,
+    ds3_sim_bt_disconnect_ind,
+    ds3_sim_bt_disconnect_cfm,
+    ds3_sim_bt_congestion,
+    ds3_sim_bt_call,          /* btu_task_post from the component, never dropped */
+} ds3_sim_bt_type_t;
+
+typedef struct {
+    uint8_t type;     /* See ds3_sim_bt_type_t */
+    uint8_t id;
+    uint16_t cid;
+    uint16_t psm;
+    uint16_t result;  /* Result, ack_needed or congested */
+    BD_ADDR bd_addr;
+    BT_HDR *p_buf;    /* data_ind, owned by the receiver */
+    void *p_arg;      /* call */
+} ds3_sim_bt_event_t;
+
+/* Stack counters */
+typedef struct {
+    uint32_t posted;
+    uint32_t dropped;  /* BT task queue full, lost over the air */
+    uint32_t buffers;  /* osi buffers currently allocated */
+    uint32_t peak_depth;
+    uint32_t calls;    /* btu_task_post calls run on the BT task */
+    uint32_t off_task; /* L2CAP registrations and BTM calls made outside of the BT task */
+    uint32_t inits;    /* esp_bluedroid_init calls, stack restarts */
+    bool connectable;  /* Page scanning, set by BTM_SetConnectability or esp_bt_gap_set_scan_mode */
+    bool interlaced;   /* Page scan type */
+    uint16_t window;   /* Page scan window and interval, in 0.625 ms slots */
+    uint16_t interval;
+    uint32_t pages;    /* HIDC connections paged, and the time they waited for a scan window */
+    uint64_t page_wait_us;
+} ds3_sim_bt_stats_t;
+
+bool ds3_sim_bt_start(uint16_t queue_size);
+void ds3_sim_bt_stop(void);
+bool ds3_sim_bt_post(const ds3_sim_bt_event_t *p_event);
+BT_HDR *ds3_sim_bt_buffer(const uint8_t *p_data, uint16_t len);
+void ds3_sim_bt_stats(ds3_sim_bt_stats_t *p_stats);
+/* Whether the caller runs on the BT task */
+bool ds3_sim_bt_is_current(void);
+/* CPU time of the BT task and of the tasks created by the component, in us */
+uint64_t ds3_sim_cpu_us(void);
+
+/* Hooks of the L2CA_* calls made by the component, implemented by the simulator */
+void ds3_sim_on_connect_rsp(const uint8_t *bd_addr, uint8_t id, uint16_t cid, uint16_t result);
+void ds3_sim_on_config_req(uint16_t cid);
+uint8_t ds3_sim_on_data_write(uint16_t cid, const uint8_t *p_data, uint16_t len);
+void ds3_sim_on_disconnect_req(uint16_t cid);
+
+#endif
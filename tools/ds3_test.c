@@ -0,0 +1,1792 @@
+/*
+ * Host tests of the component, against the mock stack of ds3_sim_idf.c.
+ *
+ * Each test drives the component through the mock BT task like a DS3
+ * controller would, or calls the internal functions of ds3_int.h directly,
+ * and checks the outcome. The controller side hooks below answer the
+ * configuration and the control requests, and count the L2CAP calls the
+ * component makes outside of the BT task, which must stay at zero. Build and
+ * run it with tools/ds3_sim.py --test, which exits non-zero on a failure.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include "ds3_sim_idf.h"
+#include "ds3.h"
+#include "ds3_int.h"
+
+#define DS3_TEST_CID_HIDC   0x40
+#define DS3_TEST_CID_HIDI   0x41
+#define DS3_TEST_REPORT_LEN 50
+#define DS3_TEST_STICK_LX   7     /* HIDP header and report id, then the stick at 5 in ds3_input_report_t */
+#define DS3_TEST_BATTERY    31    /* The battery at 29 in ds3_input_report_t */
+#define DS3_TEST_RECORD_MAX 4096
+
+#define DS3_TEST_CHECK(cond) ds3_test_check((cond), #cond, __FILE__, __LINE__)
+
+/* Polls the condition until it holds or the time is up, evaluates to it */
+#define DS3_TEST_WAIT(cond, ms) ({                                          \
+    int64_t ds3_test_deadline = esp_timer_get_time() + (int64_t)(ms) * 1000; \
+    while (!(cond) && (esp_timer_get_time() < ds3_test_deadline)) {        \
+        ds3_test_sleep_us(500);                                             \
+    }                                                                       \
+    (cond);                                                                 \
+})
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} ds3_test_t;
+
+/* Response held back by the controller side */
+typedef struct {
+    uint8_t data[4];
+    uint16_t len;
+} ds3_test_response_t;
+
+/* Outcome of a control request, written by its callback on the BT task */
+typedef struct {
+    atomic_bool done;
+    atomic_uint result;
+    atomic_uint data;    /* First payload byte, the report id */
+} ds3_test_request_t;
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static const uint8_t ds3_test_bd_addr[6] = { 0x00, 0x19, 0xC1, 0x5A, 0x00, 0x01 };
+
+static uint32_t ds3_test_failures = 0;
+
+/* Controller side, written by the L2CAP hooks */
+static atomic_bool ds3_test_hidc_configured;
+static atomic_uint ds3_test_enables;        /* Enable reports received */
+static atomic_uint ds3_test_disconnects;    /* Disconnect requests received */
+static atomic_uint ds3_test_fail_writes;    /* Writes to fail before accepting again */
+static atomic_uint ds3_test_outputs;        /* Output reports received */
+static atomic_uint ds3_test_rumble;         /* Rumble bytes of the last output report */
+static atomic_uint ds3_test_off_task;       /* L2CAP calls made outside of the BT task */
+static atomic_uint ds3_test_refused;        /* Connections refused or timed out */
+static atomic_bool ds3_test_unconfirmed;    /* Leaves the disconnect requests unconfirmed */
+static atomic_bool ds3_test_defer;          /* Holds the control responses back */
+static ds3_test_response_t ds3_test_deferred[32];
+static atomic_uint ds3_test_deferred_count;
+
+/* Host side, written by the subscriber on the input task */
+static char ds3_test_connections[32];       /* Connection changes, as '1' and '0' */
+static atomic_uint ds3_test_connection_count;
+static atomic_uint ds3_test_reports;
+static atomic_uint ds3_test_seq;            /* Stamp of the last input report */
+static atomic_uint ds3_test_missed;
+static atomic_uint ds3_test_time;     /* Arrival time of the last report, as the batch keeps it */
+static atomic_bool ds3_test_hold;           /* Holds the input task in the report handler */
+static atomic_bool ds3_test_held;
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+static void ds3_test_check(bool ok, const char *expr, const char *file, int line)
+{
+    if (!ok) {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expr);
+        ds3_test_failures++;
+    }
+}
+
+static void ds3_test_sleep_us(int64_t us)
+{
+    struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+
+    nanosleep(&ts, NULL);
+}
+
+static void ds3_test_post(uint8_t type, uint16_t cid, uint16_t psm, uint16_t result)
+{
+    ds3_sim_bt_event_t event = { .type = type, .id = (uint8_t)cid, .cid = cid, .psm = psm, .result = result };
+
+    memcpy(event.bd_addr, ds3_test_bd_addr, sizeof(event.bd_addr));
+    ds3_sim_bt_post(&event);
+}
+
+static void ds3_test_post_data(uint16_t cid, const uint8_t *p_data, uint16_t len)
+{
+    ds3_sim_bt_event_t event = { .type = ds3_sim_bt_data_ind, .cid = cid };
+
+    event.p_buf = ds3_sim_bt_buffer(p_data, len);
+    if (event.p_buf != NULL) {
+        ds3_sim_bt_post(&event);
+    }
+}
+
+static void ds3_test_report()
+{
+    uint8_t report[DS3_TEST_REPORT_LEN] = { 0xA1, 0x01 };
+
+    ds3_test_post_data(DS3_TEST_CID_HIDI, report, sizeof(report));
+}
+
+/* An input report with the given left stick byte */
+static void ds3_test_report_stick(uint8_t lx)
+{
+    uint8_t report[DS3_TEST_REPORT_LEN] = { 0xA1, 0x01 };
+
+    report[DS3_TEST_STICK_LX] = lx;
+    ds3_test_post_data(DS3_TEST_CID_HIDI, report, sizeof(report));
+}
+
+/* An input report with the given battery byte */
+static void ds3_test_report_battery(uint8_t battery)
+{
+    uint8_t report[DS3_TEST_REPORT_LEN] = { 0xA1, 0x01 };
+
+    report[DS3_TEST_BATTERY] = battery;
+    ds3_test_post_data(DS3_TEST_CID_HIDI, report, sizeof(report));
+}
+
+static ds3_state_t ds3_test_state()
+{
+    ds3_conn_stats_t stats;
+
+    ds3GetConnectionStats(&stats);
+    return stats.state;
+}
+
+/* Opens HIDC then HIDI, as the DS3 does, and waits for the enable report */
+static bool ds3_test_connect()
+{
+    atomic_store(&ds3_test_hidc_configured, false);
+    ds3_test_post(ds3_sim_bt_connect_ind, DS3_TEST_CID_HIDC, BT_PSM_HIDC, 0);
+    if (!DS3_TEST_WAIT(atomic_load(&ds3_test_hidc_configured), 3000)) {
+        return false;
+    }
+    ds3_test_post(ds3_sim_bt_connect_ind, DS3_TEST_CID_HIDI, BT_PSM_HIDI, 0);
+    return DS3_TEST_WAIT(ds3_test_state() != ds3_state_idle, 1000);
+}
+
+/* The controller closes HIDI, then HIDC */
+static void ds3_test_disconnect()
+{
+    ds3_test_post(ds3_sim_bt_disconnect_ind, DS3_TEST_CID_HIDI, 0, true);
+    ds3_test_post(ds3_sim_bt_disconnect_ind, DS3_TEST_CID_HIDC, 0, true);
+    DS3_TEST_WAIT(ds3_test_state() == ds3_state_idle, 1000);
+}
+
+
+/********************************************************************************/
+/*                  C O N T R O L L E R    S I D E    H O O K S                 */
+/********************************************************************************/
+
+void ds3_sim_on_connect_rsp(const uint8_t *bd_addr, uint8_t id, uint16_t cid, uint16_t result)
+{
+    (void)bd_addr; (void)id; (void)cid;
+    if (!ds3_sim_bt_is_current()) {
+        atomic_fetch_add(&ds3_test_off_task, 1);
+    }
+    if (result != L2CAP_CONN_OK) {
+        atomic_fetch_add(&ds3_test_refused, 1);
+    }
+}
+
+void ds3_sim_on_config_req(uint16_t cid)
+{
+    if (!ds3_sim_bt_is_current()) {
+        atomic_fetch_add(&ds3_test_off_task, 1);
+    }
+    ds3_test_post(ds3_sim_bt_config_ind, cid, 0, L2CAP_CFG_OK);
+    ds3_test_post(ds3_sim_bt_config_cfm, cid, 0, L2CAP_CFG_OK);
+    if (cid == DS3_TEST_CID_HIDC) {
+        atomic_store(&ds3_test_hidc_configured, true);
+    }
+}
+
+/* Answers a control packet like the DS3, a GET_REPORT with the report id */
+static void ds3_test_respond(const uint8_t *p_data)
+{
+    ds3_test_response_t response = { .data = { 0x00 }, .len = 1 };
+    unsigned int count;
+
+    if ((p_data[0] & 0xF0) == hid_cmd_code_get_report) {
+        response = (ds3_test_response_t){ .data = { hid_cmd_code_data | (p_data[0] & 0x03), p_data[1], 0x5A }, .len = 3 };
+    }
+    if (!atomic_load(&ds3_test_defer)) {
+        ds3_test_post_data(DS3_TEST_CID_HIDC, response.data, response.len);
+        return;
+    }
+    count = atomic_load(&ds3_test_deferred_count);
+    if (count < sizeof(ds3_test_deferred) / sizeof(ds3_test_deferred[0])) {
+        ds3_test_deferred[count] = response;
+        atomic_store(&ds3_test_deferred_count, count + 1);
+    }
+}
+
+/* Sends the responses held back, in order */
+static void ds3_test_release()
+{
+    unsigned int count = atomic_load(&ds3_test_deferred_count);
+
+    for (unsigned int i = 0; i < count; i++) {
+        ds3_test_post_data(DS3_TEST_CID_HIDC, ds3_test_deferred[i].data, ds3_test_deferred[i].len);
+    }
+    atomic_store(&ds3_test_deferred_count, 0);
+    atomic_store(&ds3_test_defer, false);
+}
+
+uint8_t ds3_sim_on_data_write(uint16_t cid, const uint8_t *p_data, uint16_t len)
+{
+    unsigned int fail = atomic_load(&ds3_test_fail_writes);
+
+    if (!ds3_sim_bt_is_current()) {
+        atomic_fetch_add(&ds3_test_off_task, 1);
+    }
+    if ((cid != DS3_TEST_CID_HIDC) || (len < 2)) {
+        return L2CAP_DW_FAILED;
+    }
+    if ((fail != 0) && atomic_compare_exchange_strong(&ds3_test_fail_writes, &fail, fail - 1)) {
+        return L2CAP_DW_FAILED;
+    }
+    if ((p_data[0] == 0x53) && (p_data[1] == 0xF4)) {
+        atomic_fetch_add(&ds3_test_enables, 1);
+    }
+    if ((p_data[0] == 0x52) && (p_data[1] == 0x01) && (len >= 7)) {
+        atomic_store(&ds3_test_rumble, (uint32_t)p_data[3] << 24 | (uint32_t)p_data[4] << 16 | p_data[5] << 8 | p_data[6]);
+        atomic_fetch_add(&ds3_test_outputs, 1);
+    }
+    ds3_test_respond(p_data);
+    return L2CAP_DW_SUCCESS;
+}
+
+void ds3_sim_on_disconnect_req(uint16_t cid)
+{
+    if (!ds3_sim_bt_is_current()) {
+        atomic_fetch_add(&ds3_test_off_task, 1);
+    }
+    atomic_fetch_add(&ds3_test_disconnects, 1);
+    if (!atomic_load(&ds3_test_unconfirmed)) {
+        ds3_test_post(ds3_sim_bt_disconnect_cfm, cid, 0, L2CAP_CONN_OK);
+    }
+}
+
+
+/********************************************************************************/
+/*                         S U B S C R I B E R                                  */
+/********************************************************************************/
+
+static void ds3_test_connection_cb(void *p_ctx, uint8_t is_connected)
+{
+    unsigned int count = atomic_load(&ds3_test_connection_count);
+
+    (void)p_ctx;
+    if (count < sizeof(ds3_test_connections) - 1) {
+        ds3_test_connections[count] = is_connected ? '1' : '0';
+        atomic_store(&ds3_test_connection_count, count + 1);
+    }
+}
+
+static void ds3_test_event_cb(void *p_ctx, ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    (void)p_ctx; (void)p_event;
+    atomic_store(&ds3_test_seq, p_data->seq);
+    atomic_store(&ds3_test_missed, p_data->missed);
+    atomic_store(&ds3_test_time, (uint32_t)p_data->time);
+    atomic_fetch_add(&ds3_test_reports, 1);
+    while (atomic_load(&ds3_test_hold)) {
+        atomic_store(&ds3_test_held, true);
+        ds3_test_sleep_us(500);
+    }
+    atomic_store(&ds3_test_held, false);
+}
+
+static const ds3_handlers_t ds3_test_handlers = {
+    ds3_test_connection_cb,
+    ds3_test_event_cb,
+    NULL,
+};
+
+static void ds3_test_request_cb(void *p_ctx, uint8_t result, const uint8_t *p_data, uint16_t len)
+{
+    ds3_test_request_t *p_request = p_ctx;
+
+    if (!ds3_sim_bt_is_current()) {
+        atomic_fetch_add(&ds3_test_off_task, 1);
+    }
+    atomic_store(&p_request->result, result);
+    atomic_store(&p_request->data, (len > 0) ? p_data[0] : 0x100);
+    atomic_store(&p_request->done, true);
+}
+
+static void ds3_test_connections_reset()
+{
+    memset(ds3_test_connections, 0, sizeof(ds3_test_connections));
+    atomic_store(&ds3_test_connection_count, 0);
+}
+
+/* The connection changes seen by the subscriber, once they settled */
+static const char *ds3_test_connections_log(unsigned int count)
+{
+    DS3_TEST_WAIT(atomic_load(&ds3_test_connection_count) >= count, 1000);
+    return ds3_test_connections;
+}
+
+
+/********************************************************************************/
+/*                                 T E S T S                                    */
+/********************************************************************************/
+
+/* Every row of the connection state machine transition table */
+static void ds3_test_conn()
+{
+    const uint32_t retry_ms = (DS3_CONN_ENABLE_RETRIES + 2) * DS3_CONN_ENABLE_TIMEOUT_MS + 500;
+    ds3_sim_bt_stats_t bt;
+    ds3_conn_stats_t stats, start;
+    unsigned int enables;
+
+    ds3GetConnectionStats(&start);
+    atomic_store(&ds3_test_enables, 0);
+    atomic_store(&ds3_test_disconnects, 0);
+
+    /* idle -> enabling, then enabling times out into retries and a reconnection */
+    DS3_TEST_CHECK(ds3_test_connect());
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_enables) == 1, 500));
+    DS3_TEST_CHECK(ds3_test_state() == ds3_state_enabling);
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_disconnects) == 2, retry_ms));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_idle, 500));
+    ds3GetConnectionStats(&stats);
+    DS3_TEST_CHECK(atomic_load(&ds3_test_enables) == 1 + DS3_CONN_ENABLE_RETRIES);
+    DS3_TEST_CHECK(stats.enable_retries - start.enable_retries == DS3_CONN_ENABLE_RETRIES);
+    DS3_TEST_CHECK(stats.reconnects - start.reconnects == 1);
+
+    /* enabling -> streaming -> stalled -> streaming -> stalled -> idle */
+    DS3_TEST_CHECK(ds3_test_connect());
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_enabling, 500));
+    enables = atomic_load(&ds3_test_enables);
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_streaming, 500));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_stalled, DS3_CONN_STALL_TIMEOUT_MS + 500));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_enables) == enables + 1, 500));
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_streaming, 500));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_stalled, DS3_CONN_STALL_TIMEOUT_MS + 500));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_idle, DS3_CONN_RECOVER_TIMEOUT_MS + 500));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_disconnects) == 4, 500));
+    ds3GetConnectionStats(&stats);
+    DS3_TEST_CHECK(stats.reconnects - start.reconnects == 2);
+
+    /* stalled -> idle without the disconnect confirmations, the link is
+       dropped all the same and the next connection is taken */
+    atomic_store(&ds3_test_unconfirmed, true);
+    ds3_test_connections_reset();
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_streaming, 500));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_idle,
+                                 DS3_CONN_STALL_TIMEOUT_MS + DS3_CONN_RECOVER_TIMEOUT_MS + 500));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_disconnects) == 6, 500));
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(2), "10") == 0);
+    atomic_store(&ds3_test_unconfirmed, false);
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_streaming, 500));
+    ds3_test_disconnect();
+
+    /* A failed enable report waits in l2cap_up, then a tick sends it again */
+    atomic_store(&ds3_test_fail_writes, 1);
+    enables = atomic_load(&ds3_test_enables);
+    DS3_TEST_CHECK(ds3_test_connect());
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_enabling, 1000));
+    DS3_TEST_CHECK(atomic_load(&ds3_test_fail_writes) == 0);
+    DS3_TEST_CHECK(atomic_load(&ds3_test_enables) == enables + 1);
+    ds3GetConnectionStats(&stats);
+    DS3_TEST_CHECK(stats.latency_us[ds3_state_enabling] >= DS3_CONN_TICK_MS * 1000 / 2);
+
+    /* Disconnecting from every state leads back to idle */
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(ds3_test_state() == ds3_state_idle);
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_streaming, 500));
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(ds3_test_state() == ds3_state_idle);
+
+    /* The ticks reach the state machine through the BT task only */
+    ds3_sim_bt_stats(&bt);
+    DS3_TEST_CHECK(bt.calls > 0);
+    DS3_TEST_CHECK(atomic_load(&ds3_test_off_task) == 0);
+}
+
+/* The output reports go out from the BT task, whichever task sets them */
+static void ds3_test_output()
+{
+    unsigned int outputs = atomic_load(&ds3_test_outputs);
+    unsigned int enables;
+
+    /* Set while disconnected, sent once connected */
+    DS3_TEST_CHECK(ds3SetLeds(true, false, false, true));
+    ds3_test_sleep_us(20000);
+    DS3_TEST_CHECK(atomic_load(&ds3_test_outputs) == outputs);
+    DS3_TEST_CHECK(ds3_test_connect());
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_outputs) == outputs + 1, 500));
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_streaming, 500));
+
+    /* Sent right away, without waiting for an input report */
+    DS3_TEST_CHECK(ds3SetLed(2, true));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_outputs) == outputs + 2, 500));
+    enables = atomic_load(&ds3_test_enables);
+    DS3_TEST_CHECK(ds3EnableReport());
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_enables) == enables + 1, 500));
+
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(atomic_load(&ds3_test_off_task) == 0);
+}
+
+/* The rumble schedule starts on the BT task and ends with the connection */
+static void ds3_test_rumble_ms()
+{
+    unsigned int outputs;
+    uint32_t rumble;
+
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_streaming, 500));
+    ds3_test_sleep_us(20000);
+
+    /* Right motor only, for longer than one report holds */
+    outputs = atomic_load(&ds3_test_outputs);
+    DS3_TEST_CHECK(ds3SetRumbleMs(0x40, 10000, 0, 0));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_outputs) == outputs + 1, 500));
+    rumble = atomic_load(&ds3_test_rumble);
+    DS3_TEST_CHECK((rumble >> 24) == 0xFE);
+    DS3_TEST_CHECK(((rumble >> 16) & 0xFF) == 0x40);
+    DS3_TEST_CHECK((rumble & 0xFFFF) == 0);
+
+    /* A new connection does not resume what is left of it */
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(ds3_test_connect());
+    outputs = atomic_load(&ds3_test_outputs);
+    DS3_TEST_CHECK(ds3SetLed(3, true));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_outputs) == outputs + 1, 500));
+    DS3_TEST_CHECK(atomic_load(&ds3_test_rumble) == 0);
+
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(atomic_load(&ds3_test_off_task) == 0);
+}
+
+/* Control requests are matched with their responses in the order of the
+   wire, output reports in between included, and none is ever dropped */
+static void ds3_test_request()
+{
+    static ds3_test_request_t requests[3];
+    const unsigned int room = DS3_REQUEST_QUEUE_SIZE - DS3_REQUEST_WINDOW;
+    ds3_request_stats_t before, after;
+    unsigned int outputs;
+    bool led = false;
+
+    memset(requests, 0, sizeof(requests));
+    ds3GetRequestStats(&before);
+
+    /* Posted while disconnected, failed on the BT task */
+    DS3_TEST_CHECK(ds3GetReport(hid_cmd_code_type_feature, 0xF2, ds3_test_request_cb, &requests[0]));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&requests[0].done), 500));
+    DS3_TEST_CHECK(atomic_load(&requests[0].result) == ds3_request_result_disconnected);
+
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_streaming, 500));
+    ds3_test_sleep_us(20000);
+
+    /* Hold the responses, the window takes two requests */
+    memset(requests, 0, sizeof(requests));
+    atomic_store(&ds3_test_defer, true);
+    DS3_TEST_CHECK(ds3GetReport(hid_cmd_code_type_feature, 0xF2, ds3_test_request_cb, &requests[0]));
+    DS3_TEST_CHECK(ds3GetReport(hid_cmd_code_type_feature, 0xF5, ds3_test_request_cb, &requests[1]));
+    DS3_TEST_CHECK(!ds3GetReport(hid_cmd_code_type_feature, 0xEF, ds3_test_request_cb, &requests[2]));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_deferred_count) == 2, 500));
+
+    /* Outputs fill the rest of the FIFO, then wait instead of evicting */
+    outputs = atomic_load(&ds3_test_outputs);
+    for (unsigned int i = 0; i < room + 1; i++) {
+        led = !led;
+        DS3_TEST_CHECK(ds3SetLed(1, led));
+        DS3_TEST_WAIT(atomic_load(&ds3_test_outputs) == outputs + i + 1, 20);
+        /* Keep streaming, the reports also give the waiting output a chance */
+        ds3_test_report();
+    }
+    DS3_TEST_CHECK(atomic_load(&ds3_test_outputs) == outputs + room);
+    DS3_TEST_CHECK(atomic_load(&ds3_test_deferred_count) == 2 + room);
+    DS3_TEST_CHECK(ds3_test_state() == ds3_state_streaming);
+
+    /* Each request gets its own report, the waiting output goes out */
+    ds3_test_release();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&requests[1].done), 500));
+    DS3_TEST_CHECK(atomic_load(&requests[0].result) == ds3_request_result_ok);
+    DS3_TEST_CHECK(atomic_load(&requests[0].data) == 0xF2);
+    DS3_TEST_CHECK(atomic_load(&requests[1].result) == ds3_request_result_ok);
+    DS3_TEST_CHECK(atomic_load(&requests[1].data) == 0xF5);
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_outputs) == outputs + room + 1, 500));
+
+    /* A request between two outputs still gets its report */
+    DS3_TEST_CHECK(ds3SetLed(1, !led));
+    DS3_TEST_CHECK(ds3GetReport(hid_cmd_code_type_feature, 0xEF, ds3_test_request_cb, &requests[2]));
+    DS3_TEST_CHECK(ds3SetLed(1, led));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&requests[2].done), 500));
+    DS3_TEST_CHECK(atomic_load(&requests[2].data) == 0xEF);
+
+    ds3GetRequestStats(&after);
+    DS3_TEST_CHECK(after.requests - before.requests == 3);
+    DS3_TEST_CHECK(after.lost == before.lost);
+    DS3_TEST_CHECK(after.timeouts == before.timeouts);
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(atomic_load(&ds3_test_off_task) == 0);
+}
+
+/* Suspending drops the connection and refuses new ones, on the running stack */
+static void ds3_test_suspend()
+{
+    ds3_sim_bt_stats_t bt;
+    unsigned int refused;
+
+    ds3_test_connections_reset();
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_streaming, 500));
+
+    DS3_TEST_CHECK(ds3Suspend());
+    DS3_TEST_CHECK(ds3IsSuspended());
+    DS3_TEST_CHECK(ds3_test_state() == ds3_state_idle);
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(2), "10") == 0);
+    DS3_TEST_CHECK(ds3Suspend());
+
+    refused = atomic_load(&ds3_test_refused);
+    atomic_store(&ds3_test_hidc_configured, false);
+    ds3_test_post(ds3_sim_bt_connect_ind, DS3_TEST_CID_HIDC, BT_PSM_HIDC, 0);
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_refused) == refused + 1, 500));
+    DS3_TEST_CHECK(!atomic_load(&ds3_test_hidc_configured));
+
+    DS3_TEST_CHECK(ds3Resume());
+    DS3_TEST_CHECK(!ds3IsSuspended());
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(3), "101") == 0);
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(4), "1010") == 0);
+
+    ds3_sim_bt_stats(&bt);
+    DS3_TEST_CHECK(bt.inits == 1);
+    DS3_TEST_CHECK(bt.off_task == 0);
+    DS3_TEST_CHECK(atomic_load(&ds3_test_off_task) == 0);
+}
+
+/* The page scan changes of other tasks are applied by the BT task */
+static void ds3_test_scan()
+{
+    ds3_scan_policy_t policy, saved;
+    ds3_scan_stats_t start, stats;
+    ds3_sim_bt_stats_t bt;
+    uint64_t radio_us;
+
+    ds3GetScanPolicy(&saved);
+    policy = saved;
+    policy.fast_interval = 0x0040;
+    policy.slow_interval = 0x0100;
+    policy.fast_ms = 60;
+    policy.step_ms = 60;
+    /* The totals carry on, the level statistics restart with the policy */
+    ds3GetScanStats(&start);
+    DS3_TEST_CHECK(ds3SetScanPolicy(&policy));
+
+    /* Fast and interlaced, then backing off from the esp_timer task */
+    DS3_TEST_CHECK(DS3_TEST_WAIT((ds3_sim_bt_stats(&bt), bt.interval == 0x0040), 500));
+    DS3_TEST_CHECK(bt.connectable && bt.interlaced && (bt.window == policy.window));
+    DS3_TEST_CHECK(DS3_TEST_WAIT((ds3_sim_bt_stats(&bt), bt.interval == 0x0080), 500));
+    DS3_TEST_CHECK(!bt.interlaced);
+    DS3_TEST_CHECK(DS3_TEST_WAIT((ds3_sim_bt_stats(&bt), bt.interval == 0x0100), 500));
+
+    /* The interlaced level listens twice the window, the others once */
+    ds3GetScanStats(&stats);
+    radio_us = stats.levels[0].scan_us * 2 * policy.window / 0x0040 + stats.levels[1].scan_us * policy.window / 0x0080
+             + stats.levels[2].scan_us * policy.window / 0x0100;
+    DS3_TEST_CHECK(stats.levels[0].scan_us > 0);
+    DS3_TEST_CHECK(llabs((long long)(stats.radio_us - start.radio_us - radio_us)) < 1000);
+
+    /* Off while connected, fast again on the disconnection */
+    DS3_TEST_CHECK(ds3_test_connect());
+    DS3_TEST_CHECK(DS3_TEST_WAIT((ds3_sim_bt_stats(&bt), !bt.connectable), 500));
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(DS3_TEST_WAIT((ds3_sim_bt_stats(&bt), bt.connectable && (bt.interval == 0x0040)), 500));
+
+    DS3_TEST_CHECK(ds3SetScanPolicy(&saved));
+    DS3_TEST_CHECK(DS3_TEST_WAIT((ds3_sim_bt_stats(&bt), bt.interval == saved.fast_interval), 500));
+    DS3_TEST_CHECK(bt.off_task == 0);
+}
+
+/* The connection changes reach the input task in order, even when the
+   worker lags behind and drops input reports */
+static void ds3_test_worker()
+{
+#ifdef DS3_WORKER_ENABLE
+    ds3_worker_stats_t before, after;
+
+#ifdef DS3_MINIMAL
+    /* The minimal profile creates the worker queue and task statically */
+    DS3_TEST_CHECK(ds3_sim_static_created() == 2);
+#endif
+    ds3_test_connections_reset();
+    ds3GetWorkerStats(&before);
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(1), "1") == 0);
+
+    /* Hold the worker, flood its queue, then reconnect behind it */
+    atomic_store(&ds3_test_hold, true);
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_held), 500));
+    for (int i = 0; i < 2 * DS3_WORKER_QUEUE_SIZE; i++) {
+        ds3_test_report();
+    }
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(ds3_test_connect());
+    atomic_store(&ds3_test_hold, false);
+
+    /* The reconnection is seen as a disconnection, then a new connection */
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(2), "10") == 0);
+    ds3_test_report();
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(3), "101") == 0);
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(4), "1010") == 0);
+    ds3GetWorkerStats(&after);
+    DS3_TEST_CHECK(after.dropped > before.dropped);
+#endif
+}
+
+/* Second subscriber, after the test handlers */
+static void ds3_test_counted_cb(void *p_ctx, ds3_input_data_t *const p_data, ds3_event_t *const p_event)
+{
+    (void)p_data; (void)p_event;
+    atomic_fetch_add((atomic_uint *)p_ctx, 1);
+}
+
+static const ds3_handlers_t ds3_test_counted_handlers = { NULL, ds3_test_counted_cb, NULL };
+
+typedef struct {
+    int id;
+    atomic_int result;
+    atomic_bool done;
+} ds3_test_subscription_t;
+
+static void *ds3_test_unsubscribe(void *p_arg)
+{
+    ds3_test_subscription_t *p_sub = p_arg;
+
+    atomic_store(&p_sub->result, ds3Unsubscribe(p_sub->id));
+    atomic_store(&p_sub->done, true);
+    return NULL;
+}
+
+static void *ds3_test_subscribe(void *p_arg)
+{
+    ds3_test_subscription_t *p_sub = p_arg;
+
+    atomic_store(&p_sub->result, ds3Subscribe(&ds3_test_counted_handlers, &ds3_test_reports, ds3_interest_report, 0));
+    atomic_store(&p_sub->done, true);
+    return NULL;
+}
+
+/* Subscribing and unsubscribing from another task wait for the dispatch in
+   progress, and the ids stay unique */
+static void ds3_test_subscribe_async()
+{
+    ds3_test_subscription_t sub = { 0 };
+    atomic_uint calls = 0;
+    pthread_t thread;
+    int kept, id;
+
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    sub.id = ds3Subscribe(&ds3_test_counted_handlers, &calls, ds3_interest_report, 0);
+    DS3_TEST_CHECK(sub.id > 0);
+
+    /* Held in the test handlers, before the counted one */
+    atomic_store(&ds3_test_hold, true);
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_held), 500));
+    pthread_create(&thread, NULL, ds3_test_unsubscribe, &sub);
+    ds3_test_sleep_us(20000);
+    DS3_TEST_CHECK(!atomic_load(&sub.done));
+    atomic_store(&ds3_test_hold, false);
+    pthread_join(thread, NULL);
+    DS3_TEST_CHECK(atomic_load(&sub.result) == 1);
+    DS3_TEST_CHECK(atomic_load(&calls) == 0);
+
+    /* Subscribing moves the entries, it waits as well */
+    atomic_store(&ds3_test_hold, true);
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_held), 500));
+    sub = (ds3_test_subscription_t){ 0 };
+    pthread_create(&thread, NULL, ds3_test_subscribe, &sub);
+    ds3_test_sleep_us(20000);
+    DS3_TEST_CHECK(!atomic_load(&sub.done));
+    atomic_store(&ds3_test_hold, false);
+    pthread_join(thread, NULL);
+    DS3_TEST_CHECK(atomic_load(&sub.result) > 0);
+    DS3_TEST_CHECK(ds3Unsubscribe(atomic_load(&sub.result)));
+    ds3_test_connections_reset();
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(1), "0") == 0);
+
+#if DS3_SUBSCRIBER_MAX >= 3
+    /* Past 255 subscriptions, a new id never matches a kept one. Takes three
+       slots: the test handlers, the kept one and the new one */
+    kept = ds3Subscribe(&ds3_test_counted_handlers, &calls, ds3_interest_report, 0);
+    DS3_TEST_CHECK(kept > 0);
+    for (int i = 0; i < 600; i++) {
+        id = ds3Subscribe(&ds3_test_counted_handlers, &calls, ds3_interest_report, 0);
+        if ((id <= 0) || (id == kept)) {
+            DS3_TEST_CHECK((id > 0) && (id != kept));
+            break;
+        }
+        ds3Unsubscribe(id);
+    }
+    DS3_TEST_CHECK(ds3Unsubscribe(kept));
+    DS3_TEST_CHECK(!ds3Unsubscribe(kept));
+#else
+    (void)kept; (void)id;
+#endif
+}
+
+#ifndef DS3_SKIP_BATCH
+/* Batches delivered to ds3_test_batch_cb */
+typedef struct {
+    atomic_uint batches;
+    atomic_uint reports;
+    atomic_uint last;       /* Reports in the last batch */
+    atomic_uint empty;      /* Batches without a report, or above DS3_BATCH_MAX */
+    atomic_uint last_time;  /* Time of the last report in the last batch */
+} ds3_test_batches_t;
+
+static void ds3_test_batch_cb(void *p_ctx, const ds3_batch_t *p_batch)
+{
+    ds3_test_batches_t *p_batches = p_ctx;
+
+    if ((p_batch->count == 0) || (p_batch->count > DS3_BATCH_MAX)) {
+        atomic_fetch_add(&p_batches->empty, 1);
+    }
+    else {
+        atomic_store(&p_batches->last_time, p_batch->time[p_batch->count - 1]);
+    }
+    atomic_store(&p_batches->last, p_batch->count);
+    atomic_fetch_add(&p_batches->reports, p_batch->count);
+    atomic_fetch_add(&p_batches->batches, 1);
+}
+
+static void *ds3_test_batch_settings(void *p_arg)
+{
+    for (int i = 0; i < 200; i++) {
+        ds3SetBatchCallback(ds3_test_batch_cb, p_arg, (uint16_t)(1 + (i % DS3_BATCH_MAX)), (i % 2) ? 5 : 0);
+        ds3_test_sleep_us(100);
+    }
+    return NULL;
+}
+#endif
+
+/* A batch is flushed by age once the reports stop, and the settings can be
+   changed from another task while reporting */
+static void ds3_test_batch()
+{
+#ifndef DS3_SKIP_BATCH
+    ds3_test_batches_t batches = { 0 };
+    pthread_t thread;
+    int64_t start;
+
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    ds3SetBatchCallback(ds3_test_batch_cb, &batches, DS3_BATCH_MAX, 20);
+
+    /* Fewer reports than a batch, then nothing */
+    start = esp_timer_get_time();
+    for (int i = 0; i < 3; i++) {
+        ds3_test_report();
+    }
+    /* Well before the stall timeout, which would bring another report */
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&batches.batches) == 1, 200));
+    DS3_TEST_CHECK(esp_timer_get_time() - start >= 20000);
+    DS3_TEST_CHECK(atomic_load(&batches.last) == 3);
+    /* Stamped on arrival, as the reports themselves */
+    DS3_TEST_CHECK(atomic_load(&batches.last_time) == atomic_load(&ds3_test_time));
+    ds3_test_sleep_us(40000);
+    DS3_TEST_CHECK(atomic_load(&batches.batches) == 1);
+
+    /* Full batches are flushed on count, without waiting for the age. Paced
+       for the worker queue. */
+    for (int i = 0; i < DS3_BATCH_MAX; i++) {
+        ds3_test_report();
+        ds3_test_sleep_us(300);
+    }
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&batches.batches) == 2, 15));
+    DS3_TEST_CHECK(atomic_load(&batches.last) == DS3_BATCH_MAX);
+
+    /* Settings changed from another task */
+    pthread_create(&thread, NULL, ds3_test_batch_settings, &batches);
+    for (int i = 0; i < 400; i++) {
+        ds3_test_report();
+        ds3_test_sleep_us(50);
+    }
+    pthread_join(thread, NULL);
+    ds3_test_sleep_us(20000);
+    DS3_TEST_CHECK(atomic_load(&batches.batches) > 2);
+    DS3_TEST_CHECK(atomic_load(&batches.empty) == 0);
+    ds3SetBatchCallback(NULL, NULL, 0, 0);
+    ds3_test_connections_reset();
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(1), "0") == 0);
+#endif
+}
+
+/* The padding bits of the buttons are never merged, and the buttons of a
+   link are released when its controller disconnects */
+static void ds3_test_merge()
+{
+#ifndef DS3_SKIP_MERGE
+    ds3_input_data_t data = { 0 };
+    ds3_input_data_t merged;
+    ds3_event_t event = { 0 };
+    uint32_t bits = 0;
+
+    DS3_TEST_CHECK(ds3SetMergeMode(ds3_merge_ds3_nav, 0));
+    memset(&data.button, 0xFF, sizeof(data.button));
+    memset(&event.button_down, 0xFF, sizeof(event.button_down));
+
+    DS3_TEST_CHECK(ds3MergeUpdate(1, &data, &event));
+    DS3_TEST_CHECK(ds3GetMergedInput(&merged));
+    memcpy(&bits, &merged.button, sizeof(merged.button));
+    DS3_TEST_CHECK(bits == 0x1FFFF);
+    DS3_TEST_CHECK(!ds3MergeDisconnect(0));
+    DS3_TEST_CHECK(ds3MergeDisconnect(1));
+    DS3_TEST_CHECK(ds3GetMergedInput(&merged));
+    memcpy(&bits, &merged.button, sizeof(merged.button));
+    DS3_TEST_CHECK(bits == 0);
+
+    /* This component's link */
+    ds3_merge_report(&data, &event);
+    ds3_merge_disconnect();
+    DS3_TEST_CHECK(ds3GetMergedInput(&merged));
+    memcpy(&bits, &merged.button, sizeof(merged.button));
+    DS3_TEST_CHECK(bits == 0);
+    DS3_TEST_CHECK(ds3SetMergeMode(ds3_merge_none, 0));
+#endif
+}
+
+#ifndef DS3_WORKER_ENABLE
+/* Fake clock of ds3_test_feed, the arrival time of the next report */
+static int64_t ds3_test_clock_us;
+
+static bool ds3_test_feed()
+{
+    uint8_t report[DS3_TEST_REPORT_LEN] = { 0xA1, 0x01 };
+
+    ds3_receive_data(report, sizeof(report), ds3_test_clock_us);
+    return true;
+}
+
+static bool ds3_test_unlink()
+{
+    ds3HandleConnection(false);
+    return true;
+}
+
+/* Feeds a report on the BT task, `us` after the previous one */
+static void ds3_test_feed_after(int64_t us)
+{
+    ds3_test_clock_us += us;
+    ds3_bt_call(ds3_test_feed);
+}
+#endif
+
+/* The missed reports are rounded to the report period and clamped, and the
+   sequence restarts with a new connection, on the link and on a merged one */
+static void ds3_test_stamp()
+{
+#ifndef DS3_WORKER_ENABLE
+    const int64_t period = DS3_TELEMETRY_REPORT_PERIOD_US;
+    ds3_telemetry_t before, after;
+#endif
+#ifndef DS3_SKIP_MERGE
+    ds3_input_data_t data = { 0 };
+    ds3_input_data_t merged;
+    ds3_event_t event = { 0 };
+#endif
+
+#ifndef DS3_WORKER_ENABLE
+    /* Fed on the BT task, which is the input task without the worker. The
+       first report is the connection. */
+    ds3_test_connections_reset();
+    ds3_test_clock_us = 1000000000;
+    ds3_test_feed_after(0);
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(1), "1") == 0);
+
+    ds3_test_feed_after(period);
+    DS3_TEST_CHECK((atomic_load(&ds3_test_seq) == 1) && (atomic_load(&ds3_test_missed) == 0));
+    ds3_test_feed_after(period + period / 2 - 1);
+    DS3_TEST_CHECK((atomic_load(&ds3_test_seq) == 2) && (atomic_load(&ds3_test_missed) == 0));
+    ds3_test_feed_after(period + period / 2);
+    DS3_TEST_CHECK((atomic_load(&ds3_test_seq) == 3) && (atomic_load(&ds3_test_missed) == 1));
+    ds3_test_feed_after(3 * period + period / 2 - 1);
+    DS3_TEST_CHECK(atomic_load(&ds3_test_missed) == 2);
+    ds3_test_feed_after((int64_t)(UINT16_MAX + 1) * period);
+    DS3_TEST_CHECK(atomic_load(&ds3_test_missed) == UINT16_MAX);
+    ds3_test_feed_after((int64_t)(UINT16_MAX + 100) * period);
+    DS3_TEST_CHECK(atomic_load(&ds3_test_missed) == UINT16_MAX);
+
+    /* A gap across a reconnection is not a loss */
+    ds3GetTelemetry(&before);
+    ds3_bt_call(ds3_test_unlink);
+    ds3_test_feed_after(50 * period);
+    ds3_test_feed_after(period);
+    ds3GetTelemetry(&after);
+    DS3_TEST_CHECK((atomic_load(&ds3_test_seq) == 1) && (atomic_load(&ds3_test_missed) == 0));
+    DS3_TEST_CHECK(after.missed_count == before.missed_count);
+    ds3_bt_call(ds3_test_unlink);
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(4), "1010") == 0);
+#endif
+
+#ifndef DS3_SKIP_MERGE
+    /* A merged link keeps its own sequence */
+    DS3_TEST_CHECK(ds3SetMergeMode(ds3_merge_ds3_nav, 0));
+    for (uint32_t i = 0; i < 3; i++) {
+        DS3_TEST_CHECK(ds3MergeUpdate(1, &data, &event) && (data.seq == i));
+        /* The merged device carries the stamp of the report applied */
+        DS3_TEST_CHECK(ds3GetMergedInput(&merged));
+        DS3_TEST_CHECK((merged.time == data.time) && (merged.seq == i) && (merged.missed == data.missed));
+    }
+    DS3_TEST_CHECK(ds3MergeDisconnect(1));
+    DS3_TEST_CHECK(ds3MergeUpdate(1, &data, &event) && (data.seq == 0) && (data.missed == 0));
+    DS3_TEST_CHECK(ds3SetMergeMode(ds3_merge_none, 0));
+#endif
+}
+
+/* Status changes delivered to ds3_test_status_cb */
+typedef struct {
+    atomic_uint changes;
+    atomic_uint battery;    /* Battery of the last change */
+} ds3_test_statuses_t;
+
+static void ds3_test_status_cb(void *p_ctx, ds3_status_t *const p_status)
+{
+    ds3_test_statuses_t *p_statuses = p_ctx;
+
+    atomic_store(&p_statuses->battery, p_status->battery);
+    atomic_fetch_add(&p_statuses->changes, 1);
+}
+
+static const ds3_handlers_t ds3_test_status_handlers = { NULL, NULL, ds3_test_status_cb };
+
+/* Battery reports, each waited for as the worker queue is short */
+static bool ds3_test_battery_run(uint8_t battery, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int reports = atomic_load(&ds3_test_reports);
+
+        ds3_test_report_battery(battery);
+        if (!DS3_TEST_WAIT(atomic_load(&ds3_test_reports) != reports, 1000)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* A battery level flickering around a threshold is not reported, it is once
+   stable for DS3_STATUS_BATTERY_HYSTERESIS reports */
+static void ds3_test_status()
+{
+    ds3_test_statuses_t statuses = { 0 };
+    int id;
+
+    id = ds3Subscribe(&ds3_test_status_handlers, &statuses, ds3_interest_status, 0);
+    DS3_TEST_CHECK(id >= 0);
+    DS3_TEST_CHECK(ds3_test_connect());
+
+    /* The first status is the connection one, reported as is */
+    ds3_test_report_battery(ds3_status_battery_high);
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&statuses.changes) == 1, 1000));
+    DS3_TEST_CHECK(atomic_load(&statuses.battery) == ds3_status_battery_high);
+
+    /* Runs one report short of the hysteresis, back to the level each time.
+       Every report is waited for, so every status has been parsed. */
+    for (int i = 0; i < 4; i++) {
+        DS3_TEST_CHECK(ds3_test_battery_run(ds3_status_battery_low, DS3_STATUS_BATTERY_HYSTERESIS - 1));
+        DS3_TEST_CHECK(ds3_test_battery_run(ds3_status_battery_high, 1));
+    }
+    /* Alternating readings */
+    for (int i = 0; i < DS3_STATUS_BATTERY_HYSTERESIS; i++) {
+        DS3_TEST_CHECK(ds3_test_battery_run((i % 2) ? ds3_status_battery_high : ds3_status_battery_low, 1));
+    }
+    DS3_TEST_CHECK(ds3_test_battery_run(ds3_status_battery_high, 1));
+    DS3_TEST_CHECK(atomic_load(&statuses.changes) == 1);
+
+    /* Crossing the hysteresis reports the new level once */
+    DS3_TEST_CHECK(ds3_test_battery_run(ds3_status_battery_low, DS3_STATUS_BATTERY_HYSTERESIS));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&statuses.changes) == 2, 1000));
+    DS3_TEST_CHECK(atomic_load(&statuses.battery) == ds3_status_battery_low);
+    DS3_TEST_CHECK(ds3_test_battery_run(ds3_status_battery_low, 10));
+    DS3_TEST_CHECK(ds3_test_battery_run(ds3_status_battery_high, 1));
+    DS3_TEST_CHECK(atomic_load(&statuses.changes) == 2);
+
+    DS3_TEST_CHECK(ds3Unsubscribe(id));
+    ds3_test_connections_reset();
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(1), "0") == 0);
+}
+
+/* Runs on the BT task once the events posted before are handled */
+static bool ds3_test_idle()
+{
+    return true;
+}
+
+/* The telemetry counts the reports, the reports estimated lost, the output
+   writes and their failures, and the congestion episodes of the connection */
+static void ds3_test_telemetry()
+{
+    ds3_telemetry_t before, after;
+    unsigned int outputs;
+    unsigned int reports;
+
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_streaming, 500));
+
+    /* Reports, each waited for as the worker queue is short */
+    ds3GetTelemetry(&before);
+    for (int i = 0; i < 10; i++) {
+        reports = atomic_load(&ds3_test_reports);
+        ds3_test_report();
+        DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_reports) == reports + 1, 500));
+    }
+    ds3GetTelemetry(&after);
+    DS3_TEST_CHECK(after.report_count - before.report_count == 10);
+    DS3_TEST_CHECK(after.missed_count == before.missed_count);
+
+#ifndef DS3_WORKER_ENABLE
+    /* Fed on the BT task, from a clock past the last report */
+    ds3_test_clock_us = esp_timer_get_time();
+    ds3_test_feed_after(DS3_TELEMETRY_REPORT_PERIOD_US);
+    ds3GetTelemetry(&before);
+    ds3_test_feed_after(DS3_TELEMETRY_REPORT_PERIOD_US);
+    ds3_test_feed_after(4 * DS3_TELEMETRY_REPORT_PERIOD_US);
+    ds3_test_feed_after(DS3_TELEMETRY_REPORT_PERIOD_US);
+    ds3GetTelemetry(&after);
+    DS3_TEST_CHECK(after.report_count - before.report_count == 3);
+    DS3_TEST_CHECK(after.missed_count - before.missed_count == 3);
+    DS3_TEST_CHECK(after.gap_count - before.gap_count == 1);
+#endif
+
+    /* Output writes, and a failed one, each changing the leds left by the
+       previous tests so that none is skipped */
+    DS3_TEST_CHECK(ds3SetLeds(false, false, false, false));
+    DS3_TEST_CHECK(ds3_bt_call(ds3_test_idle));
+    ds3GetTelemetry(&before);
+    outputs = atomic_load(&ds3_test_outputs);
+    DS3_TEST_CHECK(ds3SetLed(1, true));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_outputs) == outputs + 1, 500));
+    atomic_store(&ds3_test_fail_writes, 1);
+    DS3_TEST_CHECK(ds3SetLed(2, true));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_fail_writes) == 0, 500));
+    DS3_TEST_CHECK(ds3SetLed(3, true));
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_outputs) == outputs + 2, 500));
+    ds3GetTelemetry(&after);
+    DS3_TEST_CHECK(after.send_count - before.send_count == 3);
+    DS3_TEST_CHECK(after.send_fail_count - before.send_fail_count == 1);
+    DS3_TEST_CHECK(after.send_congested_count == before.send_congested_count);
+
+    /* A congestion episode is counted once, however often it is signalled */
+    ds3GetTelemetry(&before);
+    ds3_test_post(ds3_sim_bt_congestion, DS3_TEST_CID_HIDC, 0, true);
+    ds3_test_post(ds3_sim_bt_congestion, DS3_TEST_CID_HIDC, 0, true);
+    ds3_test_post(ds3_sim_bt_congestion, DS3_TEST_CID_HIDC, 0, false);
+    DS3_TEST_CHECK(ds3_bt_call(ds3_test_idle));
+    ds3GetTelemetry(&after);
+    DS3_TEST_CHECK(after.congestion_count - before.congestion_count == 1);
+    DS3_TEST_CHECK(!after.congested);
+
+    ds3_test_connections_reset();
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(1), "0") == 0);
+}
+
+static const uint8_t ds3_test_other_addr[6] = { 0x00, 0x19, 0xC1, 0x5A, 0x00, 0x02 };
+
+static void *ds3_test_pairing_churn(void *p_arg)
+{
+    for (int i = 0; i < 200; i++) {
+        ds3PairingAdd(ds3_test_other_addr);
+        ds3PairingRemove(ds3_test_other_addr);
+    }
+    atomic_store((atomic_bool *)p_arg, true);
+    return NULL;
+}
+
+/* A change the NVS refuses is not put in use, and the allow-list in use is
+   never seen half built while another task changes it */
+static void ds3_test_pairing()
+{
+    atomic_bool done = false;
+    uint32_t denied = 0;
+    pthread_t thread;
+
+    DS3_TEST_CHECK(ds3PairingAdd(ds3_test_bd_addr));
+    DS3_TEST_CHECK(!ds3_pairing_is_allowed(ds3_test_other_addr));
+
+    ds3_sim_nvs_fail(true);
+    DS3_TEST_CHECK(!ds3PairingAdd(ds3_test_other_addr));
+    DS3_TEST_CHECK(!ds3_pairing_is_allowed(ds3_test_other_addr));
+    DS3_TEST_CHECK(!ds3PairingRemove(ds3_test_bd_addr));
+    DS3_TEST_CHECK(!ds3PairingClear());
+    DS3_TEST_CHECK(ds3_pairing_is_allowed(ds3_test_bd_addr));
+    DS3_TEST_CHECK(!ds3_pairing_is_allowed(ds3_test_other_addr));
+    ds3_sim_nvs_fail(false);
+
+    /* What is in use is what was saved */
+    ds3_pairing_init();
+    DS3_TEST_CHECK(ds3_pairing_is_allowed(ds3_test_bd_addr));
+    DS3_TEST_CHECK(!ds3_pairing_is_allowed(ds3_test_other_addr));
+
+    pthread_create(&thread, NULL, ds3_test_pairing_churn, &done);
+    while (!atomic_load(&done)) {
+        denied += !ds3_pairing_is_allowed(ds3_test_bd_addr);
+    }
+    pthread_join(thread, NULL);
+    DS3_TEST_CHECK(denied == 0);
+    DS3_TEST_CHECK(!ds3_pairing_is_allowed(ds3_test_other_addr));
+
+    DS3_TEST_CHECK(ds3PairingClear());
+    DS3_TEST_CHECK(ds3_pairing_is_allowed(ds3_test_other_addr));
+}
+
+#define DS3_TEST_CMD_PRODUCERS 4
+#define DS3_TEST_CMD_COUNT     20000 /* Commands per producer */
+
+/* Outcome of the command queue stress, checked by the consumer */
+static int64_t ds3_test_cmd_deadline_us; /* A broken queue fails instead of hanging */
+static atomic_uint ds3_test_cmd_out_of_order;
+static atomic_uint ds3_test_cmd_popped;
+
+static void *ds3_test_cmd_produce(void *p_arg)
+{
+    ds3_cmd_t cmd = { .type = ds3_cmd_type_leds, .ms = { (uint32_t)(uintptr_t)p_arg, 0 } };
+
+    for (uint32_t i = 0; i < DS3_TEST_CMD_COUNT; i++) {
+        cmd.ms[1] = i;
+        /* A full queue is retried, never overwritten */
+        while (!ds3_cmd_post(&cmd)) {
+            if (esp_timer_get_time() >= ds3_test_cmd_deadline_us) {
+                return NULL;
+            }
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/* Drains the queue on the BT task, its only consumer */
+static bool ds3_test_cmd_consume()
+{
+    uint32_t next[DS3_TEST_CMD_PRODUCERS] = { 0 };
+    uint32_t popped = 0;
+    ds3_cmd_t cmd;
+
+    while ((popped < DS3_TEST_CMD_PRODUCERS * DS3_TEST_CMD_COUNT) && (esp_timer_get_time() < ds3_test_cmd_deadline_us)) {
+        if (!ds3_cmd_pop(&cmd)) {
+            sched_yield();
+            continue;
+        }
+        /* Each producer's commands come out whole and in order */
+        if ((cmd.ms[0] >= DS3_TEST_CMD_PRODUCERS) || (cmd.ms[1] != next[cmd.ms[0]])) {
+            atomic_fetch_add(&ds3_test_cmd_out_of_order, 1);
+        }
+        else {
+            next[cmd.ms[0]]++;
+        }
+        popped++;
+    }
+    atomic_store(&ds3_test_cmd_popped, popped);
+    return !ds3_cmd_pop(&cmd);
+}
+
+/* Holds the BT task until released, or for at most 500 ms */
+static atomic_bool ds3_test_bt_held;
+static atomic_bool ds3_test_bt_release;
+
+static bool ds3_test_bt_hold()
+{
+    int64_t deadline = esp_timer_get_time() + 500000;
+
+    atomic_store(&ds3_test_bt_held, true);
+    while (!atomic_load(&ds3_test_bt_release) && (esp_timer_get_time() < deadline)) {
+        ds3_test_sleep_us(500);
+    }
+    atomic_store(&ds3_test_bt_held, false);
+    return true;
+}
+
+static void *ds3_test_bt_hold_thread(void *p_arg)
+{
+    (void)p_arg;
+    ds3_bt_call(ds3_test_bt_hold);
+    return NULL;
+}
+
+/* Producers on several threads and the BT task consuming: no command is
+   lost, duplicated or reordered per producer. A setter never waits for room
+   in the BT task queue */
+static void ds3_test_cmd()
+{
+    pthread_t threads[DS3_TEST_CMD_PRODUCERS];
+    ds3_sim_bt_stats_t bt;
+    unsigned int outputs;
+    uint32_t dropped;
+    int64_t start;
+
+    ds3_test_cmd_deadline_us = esp_timer_get_time() + 10000000;
+    atomic_store(&ds3_test_cmd_out_of_order, 0);
+    for (uintptr_t i = 0; i < DS3_TEST_CMD_PRODUCERS; i++) {
+        pthread_create(&threads[i], NULL, ds3_test_cmd_produce, (void *)i);
+    }
+    DS3_TEST_CHECK(ds3_bt_call(ds3_test_cmd_consume));
+    for (int i = 0; i < DS3_TEST_CMD_PRODUCERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    DS3_TEST_CHECK(atomic_load(&ds3_test_cmd_popped) == DS3_TEST_CMD_PRODUCERS * DS3_TEST_CMD_COUNT);
+    DS3_TEST_CHECK(atomic_load(&ds3_test_cmd_out_of_order) == 0);
+
+    /* Hold the BT task and fill its queue with input reports */
+    ds3_test_connections_reset();
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_streaming, 500));
+    atomic_store(&ds3_test_bt_release, false);
+    pthread_create(&threads[0], NULL, ds3_test_bt_hold_thread, NULL);
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_bt_held), 500));
+    ds3_sim_bt_stats(&bt);
+    dropped = bt.dropped;
+    for (int i = 0; (i < 256) && (bt.dropped == dropped); i++) {
+        ds3_test_report_stick((uint8_t)i);
+        ds3_sim_bt_stats(&bt);
+    }
+    DS3_TEST_CHECK(bt.dropped > dropped);
+
+    /* The setter returns at once, the reports run the service once released */
+    outputs = atomic_load(&ds3_test_outputs);
+    start = esp_timer_get_time();
+    DS3_TEST_CHECK(ds3SetRumble(0xFE, 0x33, 0, 0));
+    DS3_TEST_CHECK(esp_timer_get_time() - start < 100000);
+    DS3_TEST_CHECK(atomic_load(&ds3_test_bt_held));
+    atomic_store(&ds3_test_bt_release, true);
+    pthread_join(threads[0], NULL);
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_outputs) > outputs, 500));
+    DS3_TEST_CHECK(((atomic_load(&ds3_test_rumble) >> 16) & 0xFF) == 0x33);
+    DS3_TEST_CHECK(ds3SetRumble(0, 0, 0, 0));
+
+    ds3_test_connections_reset();
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(1), "0") == 0);
+}
+
+/* The CPU frequency lock is held while the input changes, and released once
+   the input is idle or the controller disconnects */
+static void ds3_test_pm()
+{
+    ds3_pm_stats_t start, stats;
+    ds3_sim_pm_stats_t pm;
+    unsigned int reports;
+
+    ds3GetPmStats(&start);
+    ds3_test_connections_reset();
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    DS3_TEST_CHECK(DS3_TEST_WAIT(ds3_test_state() == ds3_state_streaming, 500));
+
+    reports = atomic_load(&ds3_test_reports);
+    ds3_test_report_stick(0x20);
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_reports) == reports + 1, 500));
+#ifdef DS3_PM_ENABLE
+    ds3_sim_pm_stats(&pm);
+    DS3_TEST_CHECK(pm.held == 1);
+
+    /* The same input again is idle */
+    ds3_test_report_stick(0x20);
+    DS3_TEST_CHECK(DS3_TEST_WAIT((ds3_sim_pm_stats(&pm), pm.held == 0), 500));
+    ds3GetPmStats(&stats);
+    DS3_TEST_CHECK(stats.acquisitions > start.acquisitions);
+    DS3_TEST_CHECK(stats.held_us > start.held_us);
+
+    /* Changing input holds it again, until the disconnection */
+    reports = atomic_load(&ds3_test_reports);
+    ds3_test_report_stick(0x40);
+    DS3_TEST_CHECK(DS3_TEST_WAIT(atomic_load(&ds3_test_reports) == reports + 1, 500));
+    ds3_sim_pm_stats(&pm);
+    DS3_TEST_CHECK(pm.held == 1);
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(DS3_TEST_WAIT((ds3_sim_pm_stats(&pm), pm.held == 0), 500));
+    DS3_TEST_CHECK(pm.unbalanced == 0);
+#else
+    /* Without power management neither the lock nor the accounting is used */
+    ds3_test_disconnect();
+    ds3_sim_pm_stats(&pm);
+    ds3GetPmStats(&stats);
+    DS3_TEST_CHECK(pm.acquires == 0);
+    DS3_TEST_CHECK((stats.acquisitions == 0) && (stats.held_us == 0));
+#endif
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(2), "10") == 0);
+}
+
+/* The remap tables: swapped buttons, a disabled one, remapped and inverted
+   axes, analog values following their buttons, and the NVS round trip */
+static void ds3_test_remap()
+{
+#ifndef DS3_SKIP_REMAP
+    /* Bits in ds3_button_t order: select 0, start 3, l1 10, cross 14, square 15 */
+    const ds3_remap_t map[] = {
+        { ds3_remap_kind_button, 14, 15, false },
+        { ds3_remap_kind_button, 15, 14, false },
+        { ds3_remap_kind_button, 3, DS3_REMAP_NONE, false },
+        { ds3_remap_kind_button, 10, 0, false },
+        { ds3_remap_kind_axis, 0, 2, false },
+        { ds3_remap_kind_axis, 1, 1, true },
+        { ds3_remap_kind_axis, 3, 3, true },
+    };
+    const uint8_t count = sizeof(map) / sizeof(map[0]);
+    const ds3_remap_t invalid[] = {
+        { ds3_remap_kind_button, 17, 0, false },
+        { ds3_remap_kind_button, 0, 17, false },
+        { ds3_remap_kind_axis, 4, 0, false },
+        { 2, 0, 0, false },
+    };
+    ds3_input_data_t input = { 0 };
+    ds3_input_data_t data;
+
+    input.button.cross = 1;
+    input.button.start = 1;
+    input.button.select = 1;
+    input.stick = (ds3_stick_t){ 10, 20, 30, INT8_MIN };
+#ifndef DS3_PARSE_SKIP_ANALOG
+    input.analog.cross = 0xC0;
+    input.analog.square = 0x11;
+    input.analog.l1 = 0x55;
+#endif
+
+    for (uint8_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        DS3_TEST_CHECK(!ds3SetRemap(&invalid[i], 1, false));
+    }
+    DS3_TEST_CHECK(!ds3SetRemap(NULL, 1, false));
+
+    DS3_TEST_CHECK(ds3SetRemap(map, count, false));
+    data = input;
+    ds3_remap_apply(&data);
+    DS3_TEST_CHECK(data.button.square && !data.button.cross);
+    DS3_TEST_CHECK(!data.button.start && data.button.select && data.button.l1);
+    DS3_TEST_CHECK((data.stick.lx == 30) && (data.stick.ly == -20) && (data.stick.rx == 30) && (data.stick.ry == INT8_MAX));
+#ifndef DS3_PARSE_SKIP_ANALOG
+    /* Swapped with their buttons, and 0 from a button without one */
+    DS3_TEST_CHECK((data.analog.square == 0xC0) && (data.analog.cross == 0x11) && (data.analog.l1 == 0));
+#endif
+
+    /* Stored, then applied again as at ds3Init */
+    DS3_TEST_CHECK(ds3SetRemap(map, count, true));
+    DS3_TEST_CHECK(ds3SetRemap(NULL, 0, false));
+    data = input;
+    ds3_remap_apply(&data);
+    DS3_TEST_CHECK(memcmp(&data, &input, sizeof(data)) == 0);
+    ds3_remap_init();
+    data = input;
+    ds3_remap_apply(&data);
+    DS3_TEST_CHECK(data.button.square && !data.button.start && (data.stick.ry == INT8_MAX));
+
+    /* A refused write fails, and the identity stored clears the mapping */
+    ds3_sim_nvs_fail(true);
+    DS3_TEST_CHECK(!ds3SetRemap(map, count, true));
+    ds3_sim_nvs_fail(false);
+    DS3_TEST_CHECK(ds3SetRemap(NULL, 0, true));
+    ds3_remap_init();
+    data = input;
+    ds3_remap_apply(&data);
+    DS3_TEST_CHECK(memcmp(&data, &input, sizeof(data)) == 0);
+#endif
+}
+
+#ifndef DS3_SKIP_RECORD
+/* Reference decoder of the recording format, as tools/ds3_record.py, returns
+   the number of reports or -1 when the recording is malformed */
+static uint32_t ds3_test_varint(const uint8_t *p_rec, size_t len, size_t *p_pos)
+{
+    uint32_t value = 0;
+
+    for (uint8_t shift = 0; (*p_pos < len) && (shift < 32); shift += 7) {
+        uint8_t byte = p_rec[(*p_pos)++];
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if (byte < 0x80) {
+            return value;
+        }
+    }
+    *p_pos = len + 1;
+    return 0;
+}
+
+static int32_t ds3_test_delta(const uint8_t *p_rec, size_t len, size_t *p_pos)
+{
+    uint32_t value = ds3_test_varint(p_rec, len, p_pos);
+
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static int ds3_test_record_decode(const uint8_t *p_rec, size_t len, ds3_input_data_t *p_out, int max)
+{
+    ds3_input_data_t state;
+    size_t pos = 6;
+    int count = 0;
+
+    if ((len < 6) || (memcmp(p_rec, "DS3R", 4) != 0) || (p_rec[4] != 1)) {
+        return -1;
+    }
+    memset(&state, 0, sizeof(state));
+
+    while (pos < len) {
+        uint8_t tag = p_rec[pos++];
+        uint32_t repeat = 1;
+
+        if (tag & 0x80) {
+            repeat = ds3_test_varint(p_rec, len, &pos);
+        }
+        else {
+            if (tag & 0x01) {
+                uint8_t *p_button = (uint8_t *)&state.button;
+                for (uint8_t i = 0; (i < 3) && (pos < len); i++) {
+                    p_button[i] ^= p_rec[pos++];
+                }
+            }
+            if (tag & 0x02) {
+                int8_t *p_stick = (int8_t *)&state.stick;
+                for (uint8_t i = 0; i < sizeof(ds3_stick_t); i++) {
+                    p_stick[i] = (int8_t)(p_stick[i] + ds3_test_delta(p_rec, len, &pos));
+                }
+            }
+#ifndef DS3_PARSE_SKIP_ANALOG
+            if (tag & 0x04) {
+                uint8_t *p_analog = (uint8_t *)&state.analog;
+                for (uint8_t i = 0; i < sizeof(ds3_analog_t); i++) {
+                    p_analog[i] = (uint8_t)(p_analog[i] + ds3_test_delta(p_rec, len, &pos));
+                }
+            }
+#endif
+#ifndef DS3_PARSE_SKIP_SENSOR
+            if (tag & 0x08) {
+                state.sensor.ax = (int16_t)(state.sensor.ax + ds3_test_delta(p_rec, len, &pos));
+                state.sensor.ay = (int16_t)(state.sensor.ay + ds3_test_delta(p_rec, len, &pos));
+                state.sensor.az = (int16_t)(state.sensor.az + ds3_test_delta(p_rec, len, &pos));
+                state.sensor.gz = (int16_t)(state.sensor.gz + ds3_test_delta(p_rec, len, &pos));
+            }
+#endif
+            if ((tag & 0x10) && (pos + sizeof(ds3_status_t) <= len)) {
+                memcpy(&state.status, &p_rec[pos], sizeof(ds3_status_t));
+                pos += sizeof(ds3_status_t);
+            }
+        }
+        if (pos > len) {
+            return -1;
+        }
+        for (uint32_t i = 0; (i < repeat) && (count < max); i++) {
+            p_out[count++] = state;
+        }
+    }
+
+    return count;
+}
+
+/* Stream sink slow enough for a stop to land while the input task writes,
+   or holding the writer until released */
+typedef struct {
+    char *p_data;
+    size_t len;
+    atomic_bool hold;
+    atomic_bool held;
+} ds3_test_sink_t;
+
+static ssize_t ds3_test_slow_write(void *p_cookie, const char *p_buf, size_t size)
+{
+    ds3_test_sink_t *p_sink = p_cookie;
+    char *p_data = realloc(p_sink->p_data, p_sink->len + size);
+
+    if (p_data == NULL) {
+        return -1;
+    }
+    ds3_test_sleep_us(1000);
+    while (atomic_load(&p_sink->hold)) {
+        atomic_store(&p_sink->held, true);
+        ds3_test_sleep_us(200);
+    }
+    memcpy(&p_data[p_sink->len], p_buf, size);
+    p_sink->p_data = p_data;
+    p_sink->len += size;
+    return (ssize_t)size;
+}
+
+static void *ds3_test_record_stop(void *p_ok)
+{
+    *(bool *)p_ok = ds3RecordStop();
+    return NULL;
+}
+
+static bool ds3_test_same_input(const ds3_input_data_t *p_a, const ds3_input_data_t *p_b)
+{
+    return (memcmp(&p_a->button, &p_b->button, 3) == 0)
+        && (memcmp(&p_a->stick, &p_b->stick, sizeof(ds3_stick_t)) == 0)
+#ifndef DS3_PARSE_SKIP_ANALOG
+        && (memcmp(&p_a->analog, &p_b->analog, sizeof(ds3_analog_t)) == 0)
+#endif
+#ifndef DS3_PARSE_SKIP_SENSOR
+        && (memcmp(&p_a->sensor, &p_b->sensor, sizeof(ds3_sensor_t)) == 0)
+#endif
+        && (memcmp(&p_a->status, &p_b->status, sizeof(ds3_status_t)) == 0);
+}
+#endif
+
+/* Recorded reports decode to the input data, and stopping waits for the
+   report the input task is encoding */
+static void ds3_test_record()
+{
+#ifndef DS3_SKIP_RECORD
+    static ds3_input_data_t sent[DS3_TEST_RECORD_MAX];
+    static ds3_input_data_t decoded[DS3_TEST_RECORD_MAX];
+    ds3_input_data_t prev, data;
+    ds3_event_t event;
+    uint32_t seed = 7;
+    char *p_rec = NULL;
+    size_t len = 0;
+    FILE *p_file;
+    int count;
+
+    /* Round trip of random inputs, full scale deltas and long idle runs,
+       encoded directly while no controller is connected */
+    p_file = open_memstream(&p_rec, &len);
+    DS3_TEST_CHECK(ds3RecordStart(p_file));
+    DS3_TEST_CHECK(!ds3RecordStart(p_file));
+    memset(&data, 0, sizeof(data));
+    for (int i = 0; i < DS3_TEST_RECORD_MAX; i++) {
+        uint8_t *p_bytes = (uint8_t *)&data;
+        prev = data;
+        seed = seed * 1664525u + 1013904223u;
+        if (((i / 256) % 4 != 3) && ((seed >> 28) < 12)) {
+            /* Change a few random bytes of the fields, the buttons included */
+            for (int j = (int)(seed >> 26) & 3; j >= 0; j--) {
+                seed = seed * 1664525u + 1013904223u;
+                p_bytes[(seed >> 16) % offsetof(ds3_input_data_t, time)] = (uint8_t)(seed >> 8);
+            }
+        }
+        ((uint8_t *)&data.button)[2] &= 0x01;
+        ds3_parse_event(&prev, &data, &event);
+        ds3_record_report(&data, &event);
+        sent[i] = data;
+    }
+    DS3_TEST_CHECK(ds3RecordStop());
+    DS3_TEST_CHECK(!ds3RecordStop());
+    fclose(p_file);
+
+    count = ds3_test_record_decode((uint8_t *)p_rec, len, decoded, DS3_TEST_RECORD_MAX);
+    DS3_TEST_CHECK(count == DS3_TEST_RECORD_MAX);
+    for (int i = 0; i < count; i++) {
+        if (!ds3_test_same_input(&sent[i], &decoded[i])) {
+            fprintf(stderr, "report %d decodes differently\n", i);
+            DS3_TEST_CHECK(false);
+            break;
+        }
+    }
+    free(p_rec);
+
+    /* Stop while the input task is held in a write: the stop waits for it,
+       and the recording holds every report once */
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    {
+        ds3_test_sink_t sink = { .p_data = NULL, .len = 0 };
+        unsigned int reports;
+        pthread_t stopper;
+        bool ok = false;
+        int sent = 0;
+
+        ds3_test_sleep_us(20000);
+        reports = atomic_load(&ds3_test_reports);
+        atomic_store(&sink.hold, true);
+        p_file = fopencookie(&sink, "w", (cookie_io_functions_t){ .write = ds3_test_slow_write });
+        setvbuf(p_file, NULL, _IONBF, 0);
+        DS3_TEST_CHECK(ds3RecordStart(p_file));
+        while (!atomic_load(&sink.held) && (sent < 64)) {
+            sent++;
+            ds3_test_report_stick((uint8_t)sent);
+            DS3_TEST_WAIT(atomic_load(&sink.held) || (atomic_load(&ds3_test_reports) == reports + sent), 500);
+        }
+        DS3_TEST_CHECK(atomic_load(&sink.held));
+
+        pthread_create(&stopper, NULL, ds3_test_record_stop, &ok);
+        ds3_test_sleep_us(20000);
+        atomic_store(&sink.hold, false);
+        pthread_join(stopper, NULL);
+        DS3_TEST_CHECK(ok);
+        fclose(p_file);
+
+        count = ds3_test_record_decode((uint8_t *)sink.p_data, sink.len, decoded, DS3_TEST_RECORD_MAX);
+        DS3_TEST_CHECK(count == sent);
+        DS3_TEST_CHECK((count > 0) && (decoded[count - 1].stick.lx == (int8_t)(sent - 128)));
+        free(sink.p_data);
+    }
+
+    /* Start and stop while the input task records a stick sweep from -127 to
+       -64, every recording holds increasing reports: a lagging worker drops
+       some, and it may start with the end of the previous sweep still
+       queued, but a block written twice runs past the end of the sweep. */
+    for (int cycle = 0; cycle < 10; cycle++) {
+        ds3_test_sink_t sink = { .p_data = NULL, .len = 0 };
+        bool restarted = false;
+
+        p_file = fopencookie(&sink, "w", (cookie_io_functions_t){ .write = ds3_test_slow_write });
+        setvbuf(p_file, NULL, _IONBF, 0);
+        DS3_TEST_CHECK(ds3RecordStart(p_file));
+        for (int i = 1; i <= 64; i++) {
+            ds3_test_report_stick((uint8_t)i);
+            /* Paced below the BT queue, a write takes 1 ms every few reports */
+            if ((i % 8) == 0) {
+                ds3_test_sleep_us(1500);
+            }
+        }
+        ds3_test_sleep_us(100 * (cycle % 4));
+        DS3_TEST_CHECK(ds3RecordStop());
+        fclose(p_file);
+
+        count = ds3_test_record_decode((uint8_t *)sink.p_data, sink.len, decoded, DS3_TEST_RECORD_MAX);
+        DS3_TEST_CHECK(count >= 0);
+        for (int i = 1; i < count; i++) {
+            int8_t lx = decoded[i].stick.lx;
+            bool next = (lx > decoded[i - 1].stick.lx);
+
+            if (!next && !restarted && (lx == -127)) {
+                restarted = next = true;
+            }
+            if (!next || (lx > -64)) {
+                fprintf(stderr, "cycle %d report %d: lx %d after %d\n", cycle, i, lx, decoded[i - 1].stick.lx);
+                DS3_TEST_CHECK(false);
+                break;
+            }
+        }
+        free(sink.p_data);
+    }
+
+    /* Past the reports the worker is still recording */
+    ds3_test_connections_reset();
+    ds3_test_disconnect();
+    DS3_TEST_CHECK(strcmp(ds3_test_connections_log(1), "0") == 0);
+#endif
+}
+
+/* Stopping the bridge waits for the frame the input task is writing, the
+   UART driver is never deleted under it */
+static void ds3_test_bridge()
+{
+#ifdef DS3_BRIDGE_ENABLE
+    ds3_sim_uart_stats_t uart;
+    ds3_bridge_stats_t stats;
+
+    DS3_TEST_CHECK(ds3_test_connect());
+    ds3_test_report();
+    for (int i = 0; i < 50; i++) {
+        /* The sensors are framed with every report */
+        DS3_TEST_CHECK(ds3BridgeStart(1, 17, 921600, ds3_bridge_group_sensor));
+        for (int j = 0; j < 4; j++) {
+            ds3_test_report();
+        }
+        ds3_test_sleep_us(100 * (i % 4));
+        DS3_TEST_CHECK(ds3BridgeStop());
+    }
+    DS3_TEST_CHECK(!ds3BridgeStop());
+    ds3GetBridgeStats(&stats);
+    DS3_TEST_CHECK(stats.frames <= stats.reports);
+    ds3_test_disconnect();
+
+    ds3_sim_uart_stats(&uart);
+    DS3_TEST_CHECK(uart.writes > 0);
+    DS3_TEST_CHECK(uart.closed_writes == 0);
+#endif
+}
+
+static const ds3_test_t ds3_tests[] = {
+    { "batch", ds3_test_batch },
+    { "bridge", ds3_test_bridge },
+    { "cmd", ds3_test_cmd },
+    { "conn", ds3_test_conn },
+    { "merge", ds3_test_merge },
+    { "output", ds3_test_output },
+    { "pairing", ds3_test_pairing },
+    { "pm", ds3_test_pm },
+    { "record", ds3_test_record },
+    { "remap", ds3_test_remap },
+    { "request", ds3_test_request },
+    { "rumble", ds3_test_rumble_ms },
+    { "scan", ds3_test_scan },
+    { "stamp", ds3_test_stamp },
+    { "status", ds3_test_status },
+    { "subscribe", ds3_test_subscribe_async },
+    { "suspend", ds3_test_suspend },
+    { "telemetry", ds3_test_telemetry },
+    { "worker", ds3_test_worker },
+};
+
+
+/********************************************************************************/
+/*                                 M A I N                                      */
+/********************************************************************************/
+
+int main(int argc, char **argv)
+{
+    uint32_t failed = 0;
+
+    ds3_sim_log_level = getenv("DS3_TEST_LOG") ? 5 : 0;
+    if (!ds3_sim_bt_start(64) || !ds3Init() ||
+        (ds3Subscribe(&ds3_test_handlers, NULL, ds3_interest_connection | ds3_interest_report, 0) < 0)) {
+        fprintf(stderr, "initialization failed\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(ds3_tests) / sizeof(ds3_tests[0]); i++) {
+        uint32_t before = ds3_test_failures;
+
+        /* Run the tests named on the command line, or all of them */
+        if (argc > 1) {
+            bool selected = false;
+            for (int arg = 1; arg < argc; arg++) {
+                selected |= (strcmp(argv[arg], ds3_tests[i].name) == 0);
+            }
+            if (!selected) {
+                continue;
+            }
+        }
+        ds3_tests[i].run();
+        printf("%-16s %s\n", ds3_tests[i].name, (ds3_test_failures == before) ? "ok" : "FAILED");
+        failed += (ds3_test_failures != before);
+    }
+
+    ds3Deinit();
+    ds3_sim_bt_stop();
+    return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+"""Decode the trace ring printed by ds3DumpTrace().
+
+Reads a serial log on stdin (or from the given file) and prints one line per
+trace record. Records are 8 bytes, little endian:
+    uint32 time (us), uint8 event, uint8 arg0, uint16 arg1
+"""
+import re
+import struct
+import sys
+
+PREFIX = re.compile(r"DS3TRACE:((?: [0-9a-fA-F]{2}){8})")
+
+# Keep in sync with enum ds3_trace_event in src/include/ds3_int.h
+EVENTS = {
+    0x01: ("send", "result", "len"),
+    0x02: ("congestion", "congested", "cid"),
+    0x03: ("connect_ind", "id", "psm"),
+    0x04: ("config_cfm", "result", "cid"),
+    0x05: ("disconnect_ind", "ack_needed", "cid"),
+    0x06: ("disconnect_cfm", "result", "cid"),
+    0x07: ("reject", "id", "psm"),
+    0x08: ("state", "state", "prev"),
+}
+
+# L2CA_DataWrite results
+SEND_RESULTS = {0: "failed", 1: "success", 2: "congested"}
+
+
+def decode(lines):
+    prev = None
+    for line in lines:
+        match = PREFIX.search(line)
+        if not match:
+            continue
+        time, event, arg0, arg1 = struct.unpack("<IBBH", bytes.fromhex(match.group(1)))
+        delta = 0 if prev is None else (time - prev) & 0xFFFFFFFF
+        prev = time
+        name, name0, name1 = EVENTS.get(event, ("0x%02x" % event, "arg0", "arg1"))
+        if event == 0x01:
+            arg0 = SEND_RESULTS.get(arg0, arg0)
+        yield "%10u us (+%8u) %-15s %s=%s %s=0x%04x" % (time, delta, name, name0, arg0, name1, arg1)
+
+
+def main():
+    stream = open(sys.argv[1]) if len(sys.argv) > 1 else sys.stdin
+    for record in decode(stream):
+        print(record)
+
+
+if __name__ == "__main__":
+    main()